@@ -0,0 +1,347 @@
+#include "admit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <event2/event.h>
+
+#include "metrics.h"
+#include "verbose.h"
+
+/* The quickest answer in every this many is what upstream can do */
+#define ADMIT_WINDOW 128
+
+/* Slow is over twice the quickest, and then some for the jitter */
+#define ADMIT_SLACK_USEC 10000
+
+/* What's left of the limit after a slow one */
+#define ADMIT_BACKOFF 0.9
+
+struct admit {
+	struct admit_options opts;
+
+	/* Both letting the next ones in and turning the old ones away */
+	struct event *timer;
+
+	double limit;
+	int inflight;
+
+	struct admit_ticket *head;
+	struct admit_ticket *tail;
+	int queued;
+
+	/* In usecs. baseline is the quickest of the last full window. */
+	long baseline;
+	long window_min;
+	int window_n;
+	double average;
+
+	/* Those let in before this were already backed off for */
+	struct timeval backed_off;
+
+	struct metric *limit_gauge;
+	struct metric *inflight_gauge;
+	struct metric *queued_gauge;
+	struct metric *shed_full;
+	struct metric *shed_timeout;
+};
+
+static void update_gauges(struct admit *admit)
+{
+	metric_set(admit->limit_gauge, (long)admit->limit);
+	metric_set(admit->inflight_gauge, admit->inflight);
+	metric_set(admit->queued_gauge, admit->queued);
+}
+
+static int room(struct admit *admit)
+{
+	return admit->inflight < (int)admit->limit;
+}
+
+/* Right away if there's someone to let in, or when the first in line
+ * has waited long enough.
+ */
+static void rearm(struct admit *admit)
+{
+	struct timeval now, tv;
+
+	update_gauges(admit);
+
+	if (admit->head == NULL) {
+		evtimer_del(admit->timer);
+		return;
+	}
+
+	evutil_timerclear(&tv);
+	if (!room(admit)) {
+		gettimeofday(&now, NULL);
+		if (evutil_timercmp(&admit->head->expires, &now, >)) {
+			evutil_timersub(&admit->head->expires, &now, &tv);
+		}
+	}
+	evtimer_add(admit->timer, &tv);
+}
+
+static struct admit_ticket *dequeue(struct admit *admit)
+{
+	struct admit_ticket *ticket = admit->head;
+
+	if ((admit->head = ticket->next) == NULL) {
+		admit->tail = NULL;
+	}
+	ticket->next = NULL;
+	ticket->state = ADMIT_OUT;
+	admit->queued--;
+
+	return ticket;
+}
+
+static void next_in_line(evutil_socket_t fd, short events, void *arg)
+{
+	struct admit *admit = arg;
+	struct admit_ticket *ticket;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	/* Whoever's called back may come and go as they please */
+	while (admit->head != NULL) {
+		if (room(admit)) {
+			ticket = dequeue(admit);
+			ticket->state = ADMIT_IN;
+			ticket->since = now;
+			admit->inflight++;
+			ticket->cb(0, ticket->arg);
+		} else if (!evutil_timercmp(&admit->head->expires, &now, >)) {
+			ticket = dequeue(admit);
+			metric_add(admit->shed_timeout, 1);
+			ticket->cb(ETIMEDOUT, ticket->arg);
+		} else {
+			break;
+		}
+	}
+
+	rearm(admit);
+}
+
+int admit_init(struct admit **admitp, struct event_base *base,
+	       const struct admit_options *opts)
+{
+	struct admit *admit;
+
+	if (opts->min_limit < 1 || opts->max_limit < opts->min_limit) {
+		return EINVAL;
+	}
+
+	if ((admit = malloc(sizeof(*admit))) == NULL) {
+		return errno;
+	}
+	memset(admit, 0, sizeof(*admit));
+
+	admit->opts = *opts;
+	admit->limit = opts->initial_limit;
+	if (admit->limit < opts->min_limit) {
+		admit->limit = opts->min_limit;
+	} else if (admit->limit > opts->max_limit) {
+		admit->limit = opts->max_limit;
+	}
+
+	if ((admit->timer = evtimer_new(base, next_in_line, admit)) == NULL) {
+		free(admit);
+		return ENOMEM;
+	}
+
+	admit->limit_gauge = metric_gauge("yt_history_admit_limit",
+					  "Requests let at upstream at once, at most",
+					  NULL);
+	admit->inflight_gauge = metric_gauge("yt_history_admit_inflight",
+					     "Requests at upstream",
+					     NULL);
+	admit->queued_gauge = metric_gauge("yt_history_admit_queued",
+					   "Requests waiting for their turn at upstream",
+					   NULL);
+	admit->shed_full = metric_counter("yt_history_admit_shed_total",
+					  "Requests turned away without asking upstream",
+					  "reason=\"full\"");
+	admit->shed_timeout = metric_counter("yt_history_admit_shed_total",
+					     "Requests turned away without asking upstream",
+					     "reason=\"timeout\"");
+	update_gauges(admit);
+
+	*admitp = admit;
+	return 0;
+}
+
+void admit_destroy(struct admit *admit)
+{
+	if (admit != NULL) {
+		event_free(admit->timer);
+		free(admit);
+	}
+}
+
+int admit_enter(struct admit *admit, struct admit_ticket *ticket,
+		admit_cb cb, void *arg)
+{
+	struct timeval tv;
+
+	if (ticket->state != ADMIT_OUT) {
+		return EALREADY;
+	}
+
+	gettimeofday(&ticket->since, NULL);
+
+	/* Nobody jumps the queue */
+	if (admit->head == NULL && room(admit)) {
+		ticket->state = ADMIT_IN;
+		admit->inflight++;
+		update_gauges(admit);
+		return 0;
+	}
+
+	if (cb == NULL) {
+		return EBUSY;
+	}
+
+	if (admit->queued >= admit->opts.max_queue) {
+		metric_add(admit->shed_full, 1);
+		return EBUSY;
+	}
+
+	tv.tv_sec = admit->opts.queue_timeout / 1000;
+	tv.tv_usec = (admit->opts.queue_timeout % 1000) * 1000;
+	evutil_timeradd(&ticket->since, &tv, &ticket->expires);
+
+	ticket->state = ADMIT_QUEUED;
+	ticket->cb = cb;
+	ticket->arg = arg;
+	ticket->next = NULL;
+	if (admit->tail != NULL) {
+		admit->tail->next = ticket;
+	} else {
+		admit->head = ticket;
+	}
+	admit->tail = ticket;
+	admit->queued++;
+
+	rearm(admit);
+
+	return EINPROGRESS;
+}
+
+static void back_off(struct admit *admit, struct admit_ticket *ticket,
+		     const struct timeval *now)
+{
+	/* It went out before we last backed off, and that's what it's
+	 * telling us about
+	 */
+	if (!evutil_timercmp(&ticket->since, &admit->backed_off, >)) {
+		return;
+	}
+
+	admit->limit *= ADMIT_BACKOFF;
+	if (admit->limit < admit->opts.min_limit) {
+		admit->limit = admit->opts.min_limit;
+	}
+	admit->backed_off = *now;
+
+	verbose(VERBOSE, "%s(): limit %d, inflight %d, queued %d\n",
+		__func__, (int)admit->limit, admit->inflight, admit->queued);
+}
+
+/* inflight is still counting the one that's just come back */
+static void learn(struct admit *admit, struct admit_ticket *ticket,
+		  enum admit_outcome outcome)
+{
+	struct timeval now, elapsed;
+	long usec, quickest;
+
+	if (outcome == ADMIT_DROPPED) {
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+
+	if (outcome == ADMIT_FAILED) {
+		back_off(admit, ticket, &now);
+		return;
+	}
+
+	evutil_timersub(&now, &ticket->since, &elapsed);
+	usec = elapsed.tv_sec * 1000000L + elapsed.tv_usec;
+
+	admit->average = admit->average == 0 ? usec :
+		admit->average * 7 / 8 + usec / 8.0;
+
+	if (admit->window_n == 0 || usec < admit->window_min) {
+		admit->window_min = usec;
+	}
+	if (++admit->window_n == ADMIT_WINDOW) {
+		admit->baseline = admit->window_min;
+		admit->window_n = 0;
+	}
+
+	quickest = admit->window_min;
+	if (admit->baseline != 0 && admit->baseline < quickest) {
+		quickest = admit->baseline;
+	}
+
+	if (usec > 2 * quickest + ADMIT_SLACK_USEC) {
+		back_off(admit, ticket, &now);
+	} else if (admit->inflight * 2 >= (int)admit->limit) {
+		/* Only if we've been using it, or it's no news */
+		admit->limit += 1 / admit->limit;
+		if (admit->limit > admit->opts.max_limit) {
+			admit->limit = admit->opts.max_limit;
+		}
+	}
+}
+
+void admit_leave(struct admit *admit, struct admit_ticket *ticket,
+		 enum admit_outcome outcome)
+{
+	struct admit_ticket *p, *prev;
+
+	switch (ticket->state) {
+	case ADMIT_QUEUED:
+		for (prev = NULL, p = admit->head; p != ticket; prev = p, p = p->next) {
+			;
+		}
+		if (prev != NULL) {
+			prev->next = ticket->next;
+		} else {
+			admit->head = ticket->next;
+		}
+		if (admit->tail == ticket) {
+			admit->tail = prev;
+		}
+		ticket->next = NULL;
+		admit->queued--;
+		break;
+	case ADMIT_IN:
+		learn(admit, ticket, outcome);
+		admit->inflight--;
+		break;
+	case ADMIT_OUT:
+		return;
+	}
+
+	ticket->state = ADMIT_OUT;
+	rearm(admit);
+}
+
+int admit_retry_after(struct admit *admit)
+{
+	double secs;
+
+	/* Everyone ahead, and then this one, a limit's worth at a time */
+	secs = (admit->queued + 1) * admit->average / admit->limit / 1000000;
+
+	return secs < 1 ? 1 : (int)secs + (secs > (int)secs);
+}
+
+int admit_limit(struct admit *admit)
+{
+	return (int)admit->limit;
+}
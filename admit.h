@@ -0,0 +1,90 @@
+#ifndef ADMIT_H__INCLUDED
+#define ADMIT_H__INCLUDED
+
+/*
+ * How many requests we let at upstream at once.
+ *
+ * The limit adapts, AIMD style: it creeps up by about one for every
+ * limit's worth of requests that come back in good time while it's
+ * all in use, and is cut by a fraction when one comes back slow or
+ * failed, at most once per round trip. Slow is a good deal slower than
+ * the quickest we've seen lately, which is what upstream looks like
+ * when it isn't queueing us.
+ *
+ * Requests over the limit wait their turn in a queue, for a while.
+ * When the queue is full, or the wait is up, they're turned away, so
+ * that under overload some fail fast instead of all getting slow.
+ */
+
+#include <sys/time.h>
+
+#include <event2/event.h>
+
+struct admit;
+
+struct admit_options {
+	/* Concurrency to start from, and the bounds it stays in */
+	int initial_limit;
+	int min_limit;
+	int max_limit;
+
+	/* Requests waiting at most, and milliseconds each may wait */
+	int max_queue;
+	int queue_timeout;
+};
+
+int admit_init(struct admit **admitp, struct event_base *base,
+	       const struct admit_options *opts);
+
+/* Nobody may be waiting any more */
+void admit_destroy(struct admit *admit);
+
+/*
+ * Called with 0 when it's the waiter's turn, or with ETIMEDOUT if it
+ * waited too long and is out of the queue.
+ */
+typedef void (*admit_cb)(int err, void *arg);
+
+/* Lives in the caller's memory, the fields are admit.c's */
+struct admit_ticket {
+	struct admit_ticket *next;
+	enum { ADMIT_OUT, ADMIT_QUEUED, ADMIT_IN } state;
+	struct timeval since;
+	struct timeval expires;
+	admit_cb cb;
+	void *arg;
+};
+
+/*
+ * 0 if the request may go right away, and cb isn't called.
+ * EINPROGRESS if it's queued, and cb will be. EBUSY if it's turned
+ * away, as it is without a cb if it can't go right away.
+ *
+ * The ticket must be zeroed the first time round.
+ */
+int admit_enter(struct admit *admit, struct admit_ticket *ticket,
+		admit_cb cb, void *arg);
+
+enum admit_outcome {
+	/* Upstream answered. How long it took counts. */
+	ADMIT_DONE,
+	/* Upstream was overloaded, timed out or otherwise failed */
+	ADMIT_FAILED,
+	/* Nothing learned, like when the browser went away */
+	ADMIT_DROPPED,
+};
+
+/*
+ * Out of the queue, or out of upstream, making room for the next in
+ * line. Does nothing for a ticket that's neither. cb isn't called.
+ */
+void admit_leave(struct admit *admit, struct admit_ticket *ticket,
+		 enum admit_outcome outcome);
+
+/* Seconds a client that's turned away might want to wait */
+int admit_retry_after(struct admit *admit);
+
+/* The current limit */
+int admit_limit(struct admit *admit);
+
+#endif
@@ -0,0 +1,226 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "verbose.h"
+
+#define ARENA_ALIGN (2 * sizeof(void *))
+
+struct slab_obj {
+	struct slab_obj *next;
+};
+
+struct slab {
+	size_t obj_size;
+
+	struct slab_obj *idle;
+	int nidle;
+	int max_idle;
+};
+
+int slab_init(struct slab **slabp, size_t obj_size, int max_idle)
+{
+	struct slab *slab;
+
+	if ((slab = malloc(sizeof(*slab))) == NULL) {
+		return errno;
+	}
+	memset(slab, 0, sizeof(*slab));
+
+	/* Idle objects double as free list links */
+	slab->obj_size = obj_size < sizeof(struct slab_obj)
+		? sizeof(struct slab_obj)
+		: obj_size;
+	slab->max_idle = max_idle;
+
+	*slabp = slab;
+	return 0;
+}
+
+void slab_destroy(struct slab *slab)
+{
+	struct slab_obj *obj;
+
+	if (slab != NULL) {
+		while ((obj = slab->idle) != NULL) {
+			slab->idle = obj->next;
+			free(obj);
+		}
+		free(slab);
+	}
+}
+
+void *slab_alloc(struct slab *slab)
+{
+	struct slab_obj *obj;
+
+	if ((obj = slab->idle) != NULL) {
+		slab->idle = obj->next;
+		slab->nidle--;
+	} else {
+		obj = malloc(slab->obj_size);
+		verbose(FIREHOSE, "%s(): slab %p grew by %zd bytes (%p)\n",
+			__func__, slab, slab->obj_size, obj);
+	}
+
+	return obj;
+}
+
+void slab_free(struct slab *slab, void *ptr)
+{
+	struct slab_obj *obj = ptr;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	if (slab->nidle < slab->max_idle) {
+		obj->next = slab->idle;
+		slab->idle = obj;
+		slab->nidle++;
+	} else {
+		free(obj);
+	}
+}
+
+size_t slab_obj_size(struct slab *slab)
+{
+	return slab->obj_size;
+}
+
+
+/*
+ * An arena lives at the head of the first chunk it hands out
+ * allocations from. Further chunks come from the same slab and are
+ * chained after it. Allocations that don't fit in a chunk at all get
+ * malloc()ed on their own and chained just the same, flagged so we
+ * know not to give them to the slab.
+ */
+struct arena_chunk {
+	struct arena_chunk *next;
+	int oversized;
+};
+
+struct arena {
+	struct slab *chunks;
+	struct arena_chunk *extra;
+
+	char *pos;
+	char *end;
+};
+
+static size_t align_up(size_t sz)
+{
+	return (sz + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+struct arena *arena_new(struct slab *chunks)
+{
+	struct arena *arena;
+
+	if ((arena = slab_alloc(chunks)) == NULL) {
+		return NULL;
+	}
+
+	arena->chunks = chunks;
+	arena->extra = NULL;
+	arena->pos = (char *)arena + align_up(sizeof(*arena));
+	arena->end = (char *)arena + slab_obj_size(chunks);
+
+	return arena;
+}
+
+void arena_free(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	if (arena == NULL) {
+		return;
+	}
+
+	while ((chunk = arena->extra) != NULL) {
+		arena->extra = chunk->next;
+		if (chunk->oversized) {
+			free(chunk);
+		} else {
+			slab_free(arena->chunks, chunk);
+		}
+	}
+
+	slab_free(arena->chunks, arena);
+}
+
+static void *alloc_oversized(struct arena *arena, size_t sz)
+{
+	struct arena_chunk *chunk;
+	size_t hdr = align_up(sizeof(*chunk));
+
+	if ((chunk = malloc(hdr + sz)) == NULL) {
+		return NULL;
+	}
+
+	verbose(FIREHOSE, "%s(): %zd bytes won't fit in a chunk\n",
+		__func__, sz);
+
+	chunk->oversized = 1;
+	chunk->next = arena->extra;
+	arena->extra = chunk;
+
+	return (char *)chunk + hdr;
+}
+
+static int grow(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	if ((chunk = slab_alloc(arena->chunks)) == NULL) {
+		return ENOMEM;
+	}
+
+	chunk->oversized = 0;
+	chunk->next = arena->extra;
+	arena->extra = chunk;
+
+	arena->pos = (char *)chunk + align_up(sizeof(*chunk));
+	arena->end = (char *)chunk + slab_obj_size(arena->chunks);
+
+	return 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t sz)
+{
+	void *ptr;
+
+	sz = align_up(sz);
+
+	if (arena->end - arena->pos < sz) {
+		if (sz > slab_obj_size(arena->chunks) - align_up(sizeof(struct arena_chunk))) {
+			return alloc_oversized(arena, sz);
+		}
+		if (grow(arena) != 0) {
+			return NULL;
+		}
+	}
+
+	ptr = arena->pos;
+	arena->pos += sz;
+
+	return ptr;
+}
+
+void *arena_memdup(struct arena *arena, const void *src, size_t sz)
+{
+	void *ptr;
+
+	if ((ptr = arena_alloc(arena, sz)) != NULL) {
+		memcpy(ptr, src, sz);
+	}
+	return ptr;
+}
+
+char *arena_strdup(struct arena *arena, const char *s)
+{
+	return arena_memdup(arena, s, strlen(s) + 1);
+}
@@ -0,0 +1,35 @@
+#ifndef ARENA_H__INCLUDED
+#define ARENA_H__INCLUDED
+
+/*
+ * Request-scoped memory.
+ *
+ * A slab hands out fixed-size objects and keeps released ones on a
+ * free list for the next taker. An arena carves arbitrary allocations
+ * out of slab-sized chunks and hands all of them back in one go, so a
+ * request that lives inside an arena is torn down with a single
+ * arena_free().
+ */
+
+#include <stddef.h>
+
+struct slab;
+struct arena;
+
+int slab_init(struct slab **slabp, size_t obj_size, int max_idle);
+void slab_destroy(struct slab *slab);
+
+void *slab_alloc(struct slab *slab);
+void slab_free(struct slab *slab, void *obj);
+
+size_t slab_obj_size(struct slab *slab);
+
+
+struct arena *arena_new(struct slab *chunks);
+void arena_free(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t sz);
+void *arena_memdup(struct arena *arena, const void *src, size_t sz);
+char *arena_strdup(struct arena *arena, const char *s);
+
+#endif
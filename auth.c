@@ -4,7 +4,9 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
+#include <event2/event.h>
 #include <event2/http.h>
 #include <event2/buffer.h>
 
@@ -15,15 +17,62 @@
 #include "https.h"
 #include "token.h"
 #include "store.h"
+#include "arena.h"
+#include "metrics.h"
+#include "trace.h"
 #include "verbose.h"
 
+/* Tokens are refreshed this long before they'd expire, in seconds, or
+ * halfway through if they're shorter lived than twice that.
+ */
+#define REFRESH_MARGIN (5 * 60)
+
+/* A token this close to expiring is refreshed before it's used */
+#define EXPIRY_SLACK 30
+
 struct auth_engine {
 	char auth_url[2048];
 	char client_id[512];
 	char client_secret[512];
 	int local_port;
 
+	struct event_base *base;
 	struct https_engine *https;
+	const struct https_endpoint *accounts;
+	struct https_deadline token_deadline;
+
+	/* In flight, one per session at most */
+	struct refresh *refreshing;
+
+	/* Waiting for their turn */
+	struct scheduled *scheduled;
+
+	struct metric *refreshed;
+	struct metric *refresh_failed;
+
+	auth_login_cb login_cb;
+	void *login_arg;
+};
+
+/* A token refresh on its way, and whoever's waiting for it */
+struct refresh {
+	struct refresh *next;
+	struct auth_engine *auth;
+	struct session *session;
+	struct arena *arena;
+	struct request_ctx *upstream;
+	enum https_priority priority;
+	struct evbuffer *token_buf;
+	struct auth_waiter *waiters;
+};
+
+/* A session whose token is due for a refresh when ev fires */
+struct scheduled {
+	struct scheduled *next;
+	struct scheduled **prevp;
+	struct auth_engine *auth;
+	struct session *session;
+	struct event *ev;
 };
 
 
@@ -43,11 +92,19 @@ static void auth_dispatch(struct auth_engine *auth, struct evhttp_request *req)
 
 struct token_request_ctx {
 
+	struct arena *arena;
+	struct auth_engine *auth;
+
 	struct evhttp_request *original_request;
+	struct evhttp_connection *original_conn;
 	struct session *session;
 
+	struct request_ctx *upstream;
+
 	struct evbuffer *token_buf;
-	struct evbuffer *request_body;
+
+	unsigned int trace;
+	struct timeval started;
 };
 
 static void token_response_read_cb(struct evbuffer *buf, void *arg)
@@ -65,6 +122,10 @@ static void dump_contents(enum verbosity_level level, struct evbuffer *buf, char
 	int n;
 	int blen;
 
+	if (!verbose_enabled(level)) {
+		return;
+	}
+
 	blen = evbuffer_get_length(buf);
 
 	verbose(level, "%s: %zd/%d bytes\n", prefix,
@@ -77,33 +138,330 @@ static void dump_contents(enum verbosity_level level, struct evbuffer *buf, char
 	}
 }
 
-static void done_auth(char *err_msg, void *arg)
+/* 0 for a token that didn't say */
+static time_t expires_at(struct session *session)
+{
+	const char *value;
+
+	value = session_get_value(session, "expires_at");
+	return value != NULL ? strtoll(value, NULL, 10) : 0;
+}
+
+static int has_refresh_token(struct session *session)
+{
+	const char *value;
+
+	value = session_get_value(session, "refresh_token");
+	return value != NULL && *value != '\0';
+}
+
+/* Refresh tokens only come with the first one. Later ones keep it. */
+static void keep_token(struct session *session, struct access_token *token)
+{
+	char buf[32];
+
+	session_set_value(session, "access_token", token->access_token);
+	if (token->refresh_token != NULL) {
+		session_set_value(session, "refresh_token", token->refresh_token);
+	}
+	if (token->expires_in > 0) {
+		snprintf(buf, sizeof(buf), "%lld",
+			 (long long)time(NULL) + token->expires_in);
+		session_set_value(session, "expires_at", buf);
+	}
+}
+
+static void unschedule(struct scheduled *sched)
+{
+	if ((*sched->prevp = sched->next) != NULL) {
+		sched->next->prevp = sched->prevp;
+	}
+	event_free(sched->ev);
+	session_release(sched->session);
+	free(sched);
+}
+
+static struct refresh *start_refresh(struct auth_engine *auth, struct session *session,
+				     enum https_priority priority);
+
+static void refresh_due(evutil_socket_t fd, short what, void *arg)
+{
+	struct scheduled *sched = arg;
+	struct session *session = sched->session;
+
+	/* Gone from the store, or refreshed by someone else meanwhile */
+	if (session_is_stored(session) &&
+	    expires_at(session) - REFRESH_MARGIN <= time(NULL) + EXPIRY_SLACK) {
+		start_refresh(sched->auth, session, HTTPS_BACKGROUND);
+	}
+
+	unschedule(sched);
+}
+
+/* For a while before the token it just got expires */
+static void schedule_refresh(struct auth_engine *auth, struct session *session,
+			     int expires_in)
+{
+	struct scheduled *sched;
+	struct timeval tv;
+
+	if (expires_in <= 0 || !has_refresh_token(session)) {
+		return;
+	}
+
+	if ((sched = calloc(1, sizeof(*sched))) == NULL ||
+	    session_hold(session) != 0) {
+		free(sched);
+		return;
+	}
+	if ((sched->ev = evtimer_new(auth->base, refresh_due, sched)) == NULL) {
+		session_release(session);
+		free(sched);
+		return;
+	}
+	sched->auth = auth;
+	sched->session = session;
+
+	if ((sched->next = auth->scheduled) != NULL) {
+		sched->next->prevp = &sched->next;
+	}
+	sched->prevp = &auth->scheduled;
+	auth->scheduled = sched;
+
+	tv.tv_sec = expires_in > 2 * REFRESH_MARGIN
+		? expires_in - REFRESH_MARGIN
+		: expires_in / 2;
+	tv.tv_usec = 0;
+	evtimer_add(sched->ev, &tv);
+
+	verbose(VERBOSE, "%s(): refreshing in %lds\n", __func__, (long)tv.tv_sec);
+}
+
+static void unlink_refresh(struct refresh *refresh)
+{
+	struct refresh **rp;
+
+	for (rp = &refresh->auth->refreshing; *rp != NULL; rp = &(*rp)->next) {
+		if (*rp == refresh) {
+			*rp = refresh->next;
+			break;
+		}
+	}
+}
+
+static void free_refresh(struct refresh *refresh)
+{
+	unlink_refresh(refresh);
+
+	session_release(refresh->session);
+	if (refresh->token_buf != NULL) {
+		evbuffer_free(refresh->token_buf);
+	}
+	arena_free(refresh->arena);
+}
+
+static void refresh_read_cb(struct evbuffer *buf, void *arg)
+{
+	struct refresh *refresh = arg;
+
+	evbuffer_add_buffer(refresh->token_buf, buf);
+}
+
+static void done_refresh(int err_status, char *err_msg, void *arg)
+{
+	struct refresh *refresh = arg;
+	struct auth_engine *auth = refresh->auth;
+	struct access_token *token;
+	struct auth_waiter *waiter;
+	int err;
+
+	dump_contents(VERBOSE, refresh->token_buf, "Token buffer after refresh");
+
+	if (err_msg != NULL) {
+		verbose(ERROR, "%s(): %s\n", __func__, err_msg);
+		err = EACCES;
+	} else if ((err = token_parse_json(&token, refresh->token_buf)) == 0) {
+		keep_token(refresh->session, token);
+		schedule_refresh(auth, refresh->session, token->expires_in);
+		token_free(token);
+	}
+
+	metric_add(err == 0 ? auth->refreshed : auth->refresh_failed, 1);
+
+	/* Off the list first, so the waiters can start another */
+	unlink_refresh(refresh);
+	while ((waiter = refresh->waiters) != NULL) {
+		refresh->waiters = waiter->next;
+		waiter->refresh = NULL;
+		waiter->cb(err, waiter->arg);
+	}
+
+	free(err_msg);
+	free_refresh(refresh);
+}
+
+static struct https_cb_ops refresh_cb_ops = {
+	.read = refresh_read_cb,
+	.done = done_refresh,
+};
+
+/* The one already on its way, if there is one, and at priority at
+ * least. NULL if out of luck.
+ */
+static struct refresh *start_refresh(struct auth_engine *auth, struct session *session,
+				     enum https_priority priority)
+{
+	struct request_ctx *upstream;
+	struct refresh *refresh;
+	struct evbuffer *body;
+	struct arena *arena;
+	char *encoded;
+
+	for (refresh = auth->refreshing; refresh != NULL; refresh = refresh->next) {
+		if (refresh->session == session) {
+			verbose(VERBOSE, "%s(): joining the one in flight\n", __func__);
+			if (refresh->upstream != NULL && priority < refresh->priority) {
+				https_request_set_priority(refresh->upstream, priority,
+							   session);
+				refresh->priority = priority;
+			}
+			return refresh;
+		}
+	}
+
+	if (!has_refresh_token(session) || session_hold(session) != 0) {
+		return NULL;
+	}
+
+	if ((arena = https_arena_new(auth->https)) == NULL ||
+	    (refresh = arena_alloc(arena, sizeof(*refresh))) == NULL) {
+		arena_free(arena);
+		session_release(session);
+		return NULL;
+	}
+	memset(refresh, 0, sizeof(*refresh));
+	refresh->auth = auth;
+	refresh->session = session;
+	refresh->arena = arena;
+	refresh->next = auth->refreshing;
+	auth->refreshing = refresh;
+
+	body = NULL;
+	encoded = evhttp_encode_uri(session_get_value(session, "refresh_token"));
+	upstream = https_request_new(auth->https,
+				     auth->accounts->host, auth->accounts->port,
+				     "POST", "/o/oauth2/token");
+	if (encoded == NULL || upstream == NULL ||
+	    (body = evbuffer_new()) == NULL ||
+	    (refresh->token_buf = evbuffer_new()) == NULL) {
+		if (upstream != NULL) {
+			https_request_free(upstream);
+		}
+		if (body != NULL) {
+			evbuffer_free(body);
+		}
+		free(encoded);
+		free_refresh(refresh);
+		return NULL;
+	}
+
+	evbuffer_add_printf(body,
+			    "client_id=%s&client_secret=%s"
+			    "&refresh_token=%s"
+			    "&grant_type=refresh_token",
+			    auth->client_id, auth->client_secret, encoded);
+	free(encoded);
+
+	https_request_set_body(upstream, body);
+	https_request_set_priority(upstream, priority, session);
+	refresh->priority = priority;
+
+	verbose(VERBOSE, "%s(): refreshing an access token\n", __func__);
+
+	https_request_send(upstream, &auth->token_deadline,
+			   &refresh_cb_ops, refresh, &refresh->upstream);
+
+	return refresh;
+}
+
+int auth_ensure_token(struct auth_engine *auth, struct session *session,
+		      struct auth_waiter *waiter, auth_token_cb cb, void *arg)
+{
+	struct refresh *refresh;
+	time_t at;
+
+	if (session_get_value(session, "access_token") == NULL) {
+		return ENOENT;
+	}
+
+	at = expires_at(session);
+	if (at == 0 || at > time(NULL) + EXPIRY_SLACK) {
+		return 0;
+	}
+
+	if ((refresh = start_refresh(auth, session, HTTPS_INTERACTIVE)) == NULL) {
+		return ENOENT;
+	}
+
+	waiter->cb = cb;
+	waiter->arg = arg;
+	waiter->refresh = refresh;
+	waiter->next = refresh->waiters;
+	refresh->waiters = waiter;
+
+	return EINPROGRESS;
+}
+
+void auth_waiter_cancel(struct auth_waiter *waiter)
+{
+	struct auth_waiter **wp;
+
+	if (waiter->refresh == NULL) {
+		return;
+	}
+
+	for (wp = &waiter->refresh->waiters; *wp != waiter; wp = &(*wp)->next) {
+		;
+	}
+	*wp = waiter->next;
+	waiter->refresh = NULL;
+}
+
+static void done_auth(int err_status, char *err_msg, void *arg)
 {
 	struct token_request_ctx *ctx = arg;
 	struct access_token *token;
 
-	if (verbose_adjust_level(0) >= VERBOSE) {
-		dump_contents(VERBOSE, ctx->token_buf, "Token buffer after request");
+	dump_contents(VERBOSE, ctx->token_buf, "Token buffer after request");
+
+	if (ctx->original_conn != NULL) {
+		evhttp_connection_set_closecb(ctx->original_conn, NULL, NULL);
 	}
 
+	reply_server_timing(ctx->original_request, ctx->trace, &ctx->started);
+
 	if (err_msg != NULL) {
-		evhttp_send_error(ctx->original_request, HTTP_INTERNAL, err_msg);
+		evhttp_send_error(ctx->original_request, err_status, err_msg);
 	} else {
 		if (token_parse_json(&token, ctx->token_buf) != 0) {
 			evhttp_send_error(ctx->original_request,
 					  HTTP_INTERNAL, "Invalid token json");
 		} else {
-			session_set_value(ctx->session, "access_token", token->access_token);
+			keep_token(ctx->session, token);
+			schedule_refresh(ctx->auth, ctx->session, token->expires_in);
 			token_free(token);
+			if (ctx->auth->login_cb != NULL) {
+				ctx->auth->login_cb(ctx->session, ctx->auth->login_arg);
+			}
 			/* Authentication was splendid. Let's hit the list. */
 			reply_redirect(ctx->original_request, "/list");
 		}
 	}
 
 	free(err_msg);
+	session_release(ctx->session);
 	evbuffer_free(ctx->token_buf);
-	evbuffer_free(ctx->request_body);
-	free(ctx);
+	arena_free(ctx->arena);
 }
 
 static struct https_cb_ops token_cb_ops = {
@@ -112,32 +470,75 @@ static struct https_cb_ops token_cb_ops = {
 };
 
 
+static void browser_gone(struct evhttp_connection *conn, void *arg)
+{
+	struct token_request_ctx *ctx = arg;
+
+	verbose(VERBOSE, "%s(): giving up on the token exchange\n", __func__);
+
+	if (ctx->upstream != NULL) {
+		https_request_cancel(ctx->upstream);
+	}
+
+	session_release(ctx->session);
+	evbuffer_free(ctx->token_buf);
+	arena_free(ctx->arena);
+}
+
 static void request_token(struct auth_engine *auth, struct session *session,
 			  struct evhttp_request *req, const char *code)
 {
 	struct token_request_ctx *ctx;
+	struct request_ctx *upstream;
+	struct evbuffer *body;
+	struct arena *arena;
+
+	/* The browser may not be around any more by the time the
+	 * token comes in, the session has to be.
+	 */
+	if (session_hold(session) != 0) {
+		evhttp_send_error(req, HTTP_INTERNAL, "Session went away");
+		return;
+	}
 
-	if ((ctx = malloc(sizeof(*ctx))) == NULL) {
+	if ((arena = https_arena_new(auth->https)) == NULL ||
+	    (ctx = arena_alloc(arena, sizeof(*ctx))) == NULL) {
+		arena_free(arena);
+		session_release(session);
 		evhttp_send_error(req, HTTP_INTERNAL, "Failed to allocate memory");
 		return;
 	}
+	ctx->arena = arena;
+	ctx->auth = auth;
 	ctx->original_request = req;
 	ctx->session = session;
-
-	if ((ctx->request_body = evbuffer_new()) == NULL) {
+	ctx->upstream = NULL;
+	ctx->trace = trace_begin();
+	gettimeofday(&ctx->started, NULL);
+
+	upstream = https_request_new(auth->https,
+				     auth->accounts->host, auth->accounts->port,
+				     "POST", "/o/oauth2/token");
+	if (upstream == NULL) {
 		evhttp_send_error(req, HTTP_INTERNAL, "Failed to allocate memory");
-		free(ctx);
+		session_release(session);
+		arena_free(arena);
 		return;
 	}
 
-	if ((ctx->token_buf = evbuffer_new()) == NULL) {
+	if ((body = evbuffer_new()) == NULL ||
+	    (ctx->token_buf = evbuffer_new()) == NULL) {
 		evhttp_send_error(req, HTTP_INTERNAL, "Failed to allocate memory");
-		evbuffer_free(ctx->request_body);
-		free(ctx);
+		if (body != NULL) {
+			evbuffer_free(body);
+		}
+		https_request_free(upstream);
+		session_release(session);
+		arena_free(arena);
 		return;
 	}
 
-	evbuffer_add_printf(ctx->request_body,
+	evbuffer_add_printf(body,
 			    "code=%s"
 			    "&client_id=%s&client_secret=%s"
 			    "&redirect_uri=http://localhost:%d"
@@ -145,12 +546,19 @@ static void request_token(struct auth_engine *auth, struct session *session,
 			    code, auth->client_id, auth->client_secret,
 			    auth->local_port);
 
-	https_request(auth->https,
-		      "accounts.google.com", 443,
-		      "POST", "/o/oauth2/token",
-		      (char *)NULL,
-		      ctx->request_body,
-		      &token_cb_ops, ctx);
+	/* It's the request's now */
+	https_request_set_body(upstream, body);
+	https_request_set_trace(upstream, ctx->trace);
+	https_request_set_priority(upstream, HTTPS_INTERACTIVE, session);
+
+	if ((ctx->original_conn = evhttp_request_get_connection(req)) != NULL) {
+		evhttp_connection_set_closecb(ctx->original_conn, browser_gone, ctx);
+	}
+
+	https_request_send(upstream,
+			   &auth->token_deadline,
+			   &token_cb_ops, ctx,
+			   &ctx->upstream);
 }
 
 
@@ -196,7 +604,9 @@ void auth_handle(struct auth_engine *auth, struct session *session, struct evhtt
 }
 
 
-int auth_init(struct auth_engine **authp, struct https_engine *https, int local_port)
+int auth_init(struct auth_engine **authp, struct event_base *base,
+	      struct https_engine *https, const struct https_endpoint *accounts,
+	      int local_port)
 {
 	struct auth_engine *auth;
 	int err;
@@ -220,29 +630,71 @@ int auth_init(struct auth_engine **authp, struct https_engine *https, int local_
 		return err;
 	}
 
+	/* The scope is a name, it stays the same wherever the feeds
+	 * come from.
+	 */
 	n = snprintf(auth->auth_url, sizeof(auth->auth_url),
-		     "https://accounts.google.com/o/oauth2/auth"
+		     "https://%s:%d/o/oauth2/auth"
 		     "?client_id=%s"
 		     "&redirect_uri=http://localhost:%d"
 		     "&response_type=code"
 		     "&scope=https://gdata.youtube.com"
 		     "&approval_prompt=auto"
-		     "&access_type=online"
+		     "&access_type=offline"
 		     "&state=auth",
+		     accounts->host, accounts->port,
 		     auth->client_id, local_port);
 
-	if (n == sizeof(auth->auth_url)) {
+	if (n >= sizeof(auth->auth_url)) {
 		free(auth);
 		return EINVAL;
 	}
 
+	auth->base = base;
 	auth->https = https;
+	auth->accounts = accounts;
+
+	auth->refreshed = metric_counter("yt_history_token_refreshes_total",
+					 "Access tokens refreshed, by how it went",
+					 "result=\"ok\"");
+	auth->refresh_failed = metric_counter("yt_history_token_refreshes_total",
+					      "Access tokens refreshed, by how it went",
+					      "result=\"failed\"");
+
+	if ((err = https_deadline_init(&auth->token_deadline, "token")) != 0) {
+		free(auth);
+		return err;
+	}
 
 	*authp = auth;
 	return 0;
 }
 
+void auth_on_login(struct auth_engine *auth, auth_login_cb cb, void *arg)
+{
+	auth->login_cb = cb;
+	auth->login_arg = arg;
+}
+
 void auth_destroy(struct auth_engine *auth)
 {
+	struct refresh *refresh;
+
+	if (auth == NULL) {
+		return;
+	}
+
+	while (auth->scheduled != NULL) {
+		unschedule(auth->scheduled);
+	}
+
+	/* Nobody's waiting for these any more */
+	while ((refresh = auth->refreshing) != NULL) {
+		if (refresh->upstream != NULL) {
+			https_request_cancel(refresh->upstream);
+		}
+		free_refresh(refresh);
+	}
+
 	free(auth);
 }
@@ -1,16 +1,59 @@
 #ifndef AUTH_H__INCLUDED
 #define AUTH_H__INCLUDED
 
+#include <event2/event.h>
 #include <event2/http.h>
 #include "store.h"
 #include "https.h"
 
 struct auth_engine;
 
-int auth_init(struct auth_engine **authp, struct https_engine *https, int local_port);
+/* accounts is where the browser logs in and tokens come from. It has
+ * to stay around.
+ */
+int auth_init(struct auth_engine **authp, struct event_base *base,
+	      struct https_engine *https, const struct https_endpoint *accounts,
+	      int local_port);
 
 void auth_destroy(struct auth_engine *auth);
 
 void auth_handle(struct auth_engine *auth, struct session *session, struct evhttp_request *req, struct evhttp_uri *uri);
 
+/* Called for every session that's just got its token, before the
+ * browser is sent on to /list.
+ */
+typedef void (*auth_login_cb)(struct session *session, void *arg);
+
+void auth_on_login(struct auth_engine *auth, auth_login_cb cb, void *arg);
+
+/*
+ * Someone waiting for a session's access token to be refreshed. Lives
+ * in the waiter's own memory, the fields are auth.c's.
+ */
+typedef void (*auth_token_cb)(int err, void *arg);
+
+struct auth_waiter {
+	struct auth_waiter *next;
+	struct refresh *refresh;
+	auth_token_cb cb;
+	void *arg;
+};
+
+/*
+ * Makes sure the session's access token is good for a while yet.
+ * Tokens are normally refreshed on a timer before they get this far,
+ * this is for the ones that weren't, like those restored after a
+ * restart.
+ *
+ * 0 if the token is good as it is, and cb won't be called.
+ * EINPROGRESS if it's being refreshed, and cb gets called when that's
+ * done, with 0 or an errno. ENOENT if there's nothing to refresh it
+ * with, and the user has to log in again.
+ */
+int auth_ensure_token(struct auth_engine *auth, struct session *session,
+		      struct auth_waiter *waiter, auth_token_cb cb, void *arg);
+
+/* cb won't be called. The refresh itself goes on. */
+void auth_waiter_cancel(struct auth_waiter *waiter);
+
 #endif
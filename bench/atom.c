@@ -0,0 +1,75 @@
+#include "atom.h"
+
+#include <string.h>
+
+static const char *HEAD =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+	"<feed xmlns=\"http://www.w3.org/2005/Atom\""
+	" xmlns:media=\"http://search.yahoo.com/mrss/\""
+	" xmlns:yt=\"http://gdata.youtube.com/schemas/2007\">\n"
+	"  <link rel=\"previous\" type=\"application/atom+xml\""
+	" href=\"https://gdata.youtube.com/feeds/api/users/default/watch_history"
+	"?alt=atom&amp;start-index=%d&amp;max-results=%d&amp;v=2\"/>\n"
+	"  <link rel=\"next\" type=\"application/atom+xml\""
+	" href=\"https://gdata.youtube.com/feeds/api/users/default/watch_history"
+	"?alt=atom&amp;start-index=%d&amp;max-results=%d&amp;v=2\"/>\n";
+
+/* Printable, with the odd one XML wants escaped */
+static void filler(struct evbuffer *out, int len, int seed, int amp_every)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJ0123456789-";
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (amp_every && i % amp_every == amp_every - 1) {
+			evbuffer_add(out, "&amp;", 5);
+		} else {
+			evbuffer_add(out, &chars[(seed + i * 7) % (sizeof(chars) - 1)], 1);
+		}
+	}
+}
+
+size_t atom_generate(struct evbuffer *out, const struct atom_params *params)
+{
+	size_t before;
+	int start, i;
+
+	before = evbuffer_get_length(out);
+
+	start = params->start_index > 0 ? params->start_index : 1;
+	evbuffer_add_printf(out, HEAD,
+			    start > params->entries ? start - params->entries : 1,
+			    params->entries,
+			    start + params->entries, params->entries);
+
+	for (i = 0; i < params->entries; i++) {
+		evbuffer_add_printf(out,
+				    "  <entry>\n"
+				    "    <published>2012-12-%02dT19:26:52.000Z</published>\n"
+				    "    <updated>2012-12-%02dT19:26:52.000Z</updated>\n"
+				    "    <title>",
+				    i % 28 + 1, i % 28 + 1);
+		filler(out, params->title_len, i, 0);
+		evbuffer_add_printf(out,
+				    "</title>\n"
+				    "    <content type=\"application/x-shockwave-flash\""
+				    " src=\"https://www.youtube.com/v/vid%07d?version=3\"/>\n"
+				    "    <media:group>\n"
+				    "      <media:credit role=\"uploader\" scheme=\"urn:youtube\""
+				    " yt:display=\"uploader%d\">uploader%d</media:credit>\n"
+				    "      <media:player url=\"https://www.youtube.com/watch?v=vid%07d",
+				    i, i % 100, i % 100, i);
+		filler(out, params->url_len, i, 8);
+		evbuffer_add_printf(out,
+				    "\"/>\n"
+				    "      <media:thumbnail url=\"http://i.ytimg.com/vi/vid%07d/default.jpg\""
+				    " height=\"90\" width=\"120\"/>\n"
+				    "    </media:group>\n"
+				    "  </entry>\n",
+				    i);
+	}
+
+	evbuffer_add_printf(out, "</feed>\n");
+
+	return evbuffer_get_length(out) - before;
+}
@@ -0,0 +1,31 @@
+#ifndef ATOM_H__INCLUDED
+#define ATOM_H__INCLUDED
+
+/*
+ * Made-up watch history feeds, shaped like the real thing as far as
+ * feed.c is concerned, in whatever size is wanted.
+ */
+
+#include <stddef.h>
+#include <event2/buffer.h>
+
+struct atom_params {
+	int entries;
+
+	/* Rough lengths of each entry's title and player url. Every
+	 * eighth character of a url is an &, for feed_escape_amp() to
+	 * chew on.
+	 */
+	int title_len;
+	int url_len;
+
+	/* Where the page starts, for the previous and next links. Zero
+	 * for the first page.
+	 */
+	int start_index;
+};
+
+/* Appended to out. Returns how many bytes that was. */
+size_t atom_generate(struct evbuffer *out, const struct atom_params *params);
+
+#endif
@@ -0,0 +1,111 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+
+/* Runs per case, whatever the time says */
+#define BENCH_MIN_RUNS 5
+#define BENCH_MAX_RUNS 1000000
+
+double bench_seconds = 1.0;
+
+uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_start(struct bench *b, const char *name, const char *fmt, ...)
+{
+	va_list ap;
+
+	b->name = name;
+	va_start(ap, fmt);
+	vsnprintf(b->params, sizeof(b->params), fmt, ap);
+	va_end(ap);
+
+	b->samples = NULL;
+	b->n = b->cap = 0;
+	b->busy = b->bytes = b->items = b->wall = 0;
+	b->started = bench_now();
+}
+
+void bench_sample(struct bench *b, uint64_t ns, size_t bytes, size_t items)
+{
+	uint64_t *samples;
+	int cap;
+
+	if (b->n == b->cap) {
+		cap = b->cap ? b->cap * 2 : 1024;
+		if ((samples = realloc(b->samples, cap * sizeof(*samples))) == NULL) {
+			return;
+		}
+		b->samples = samples;
+		b->cap = cap;
+	}
+
+	b->samples[b->n++] = ns;
+	b->busy += ns;
+	b->bytes += bytes;
+	b->items += items;
+}
+
+int bench_more(struct bench *b)
+{
+	if (b->n < BENCH_MIN_RUNS) {
+		return 1;
+	}
+
+	return b->n < BENCH_MAX_RUNS &&
+		bench_now() - b->started < bench_seconds * 1e9;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank, in microseconds. p is in tenths of a percent. */
+static double percentile(struct bench *b, int p)
+{
+	long i;
+
+	i = ((long)b->n * p + 999) / 1000 - 1;
+	return b->samples[i < 0 ? 0 : i] / 1e3;
+}
+
+void bench_report(struct bench *b)
+{
+	double secs;
+
+	if (b->n == 0) {
+		fprintf(stderr, "%s %s: no samples\n", b->name, b->params);
+		return;
+	}
+
+	qsort(b->samples, b->n, sizeof(*b->samples), cmp_u64);
+	secs = (b->wall ? b->wall : b->busy) / 1e9;
+
+	printf("{\"bench\":\"%s\",\"case\":\"%s\",\"iterations\":%d",
+	       b->name, b->params, b->n);
+	if (b->bytes) {
+		printf(",\"mb_s\":%.2f", b->bytes / secs / 1e6);
+	}
+	if (b->items) {
+		printf(",\"items_s\":%.1f", b->items / secs);
+	}
+	printf(",\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f"
+	       ",\"max_us\":%.2f}\n",
+	       percentile(b, 500), percentile(b, 900), percentile(b, 990),
+	       percentile(b, 999), b->samples[b->n - 1] / 1e3);
+	fflush(stdout);
+
+	free(b->samples);
+	b->samples = NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef BENCH_H__INCLUDED
+#define BENCH_H__INCLUDED
+
+/*
+ * Timing a case over and over, and reporting how it went as one line
+ * of JSON on stdout, for keeping around and comparing against the
+ * next release's:
+ *
+ *   {"bench":"feed","case":"entries=100 title=64","iterations":812,
+ *    "mb_s":41.2,"items_s":18790.3,"p50_us":...,"p90_us":...,
+ *    "p99_us":...,"p999_us":...,"max_us":...}
+ *
+ * Throughput is bytes and items over the time spent in the timed
+ * parts only, or over wall if that's set, for samples that were taken
+ * side by side. Either is left out if the case doesn't count it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct bench {
+	const char *name;
+	char params[128];
+
+	uint64_t *samples;
+	int n;
+	int cap;
+
+	uint64_t busy;
+	uint64_t bytes;
+	uint64_t items;
+	uint64_t started;
+	uint64_t wall;
+};
+
+/* Seconds each case gets, at least. Set from the command line. */
+extern double bench_seconds;
+
+/* Monotonic nanoseconds */
+uint64_t bench_now(void);
+
+void bench_start(struct bench *b, const char *name, const char *fmt, ...)
+	__attribute__((format(printf,3,4)));
+
+/* One timed run, that took ns and got through bytes and items */
+void bench_sample(struct bench *b, uint64_t ns, size_t bytes, size_t items);
+
+/* Whether the case should be run again */
+int bench_more(struct bench *b);
+
+/* Prints the line and frees the samples */
+void bench_report(struct bench *b);
+
+/* The benchmarks, each running its cases in turn */
+void bench_feed(void);
+void bench_escape(void);
+void bench_https(void);
+void bench_store(void);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * feed_escape_amp() on player urls with more and fewer &'s in them.
+ */
+
+#include "bench.h"
+#include "feed.h"
+
+#include <string.h>
+
+/* Calls per sample, the single ones are too quick to time */
+#define ESCAPE_BATCH 1000
+
+static void run(int len, int amp_every)
+{
+	char from[128], to[128];
+	struct bench b;
+	uint64_t t0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		from[i] = amp_every && i % amp_every == amp_every - 1 ? '&' : 'a' + i % 26;
+	}
+	from[len] = '\0';
+
+	bench_start(&b, "escape", "len=%d amp_every=%d", len, amp_every);
+
+	while (bench_more(&b)) {
+		t0 = bench_now();
+		for (i = 0; i < ESCAPE_BATCH; i++) {
+			feed_escape_amp(to, sizeof(to), from);
+			__asm__ volatile("" : : "r"(to) : "memory");
+		}
+		bench_sample(&b, bench_now() - t0, ESCAPE_BATCH * len, ESCAPE_BATCH);
+	}
+
+	bench_report(&b);
+}
+
+void bench_escape(void)
+{
+	/* All short enough not to be truncated */
+	run(32, 0);
+	run(96, 0);
+	run(64, 8);
+	run(40, 2);
+}
@@ -0,0 +1,82 @@
+/*
+ * feed_consume() and feed_final() on made-up feeds, from feed_init()
+ * to the last byte of html, fed to it the way reads off the wire
+ * would.
+ */
+
+#include "bench.h"
+#include "atom.h"
+#include "feed.h"
+
+#include <stdlib.h>
+
+#include <event2/buffer.h>
+
+static const struct {
+	struct atom_params atom;
+	size_t read_size;
+} cases[] = {
+	{ { 10, 32, 32 }, 16384 },
+	{ { 100, 32, 32 }, 16384 },
+	{ { 1000, 32, 32 }, 16384 },
+	{ { 100, 256, 32 }, 16384 },
+	{ { 100, 32, 32 }, 512 },
+	{ { 100, 32, 32 }, 1460 },
+	{ { 100, 32, 32 }, 0 },
+};
+
+static void run(const struct atom_params *atom, size_t read_size)
+{
+	struct evbuffer *in, *sink;
+	struct feed *feed;
+	struct bench b;
+	unsigned char *xml;
+	size_t len, off, n;
+	uint64_t t0, t;
+
+	in = evbuffer_new();
+	sink = evbuffer_new();
+	len = atom_generate(in, atom);
+	xml = malloc(len);
+	evbuffer_remove(in, xml, len);
+
+	bench_start(&b, "feed", "entries=%d title=%d url=%d read=%zu",
+		    atom->entries, atom->title_len, atom->url_len, read_size);
+
+	while (bench_more(&b)) {
+		t = 0;
+		t0 = bench_now();
+		feed_init(&feed, sink, NULL);
+		for (off = 0; off < len; off += n) {
+			n = read_size && len - off > read_size ? read_size : len - off;
+
+			/* Filling the buffer is the network's part */
+			t += bench_now() - t0;
+			evbuffer_add(in, xml + off, n);
+			t0 = bench_now();
+
+			feed_consume(feed, in);
+		}
+		feed_final(feed);
+		feed_destroy(feed);
+		t += bench_now() - t0;
+
+		bench_sample(&b, t, len, atom->entries);
+		evbuffer_drain(sink, evbuffer_get_length(sink));
+	}
+
+	bench_report(&b);
+
+	free(xml);
+	evbuffer_free(sink);
+	evbuffer_free(in);
+}
+
+void bench_feed(void)
+{
+	int i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		run(&cases[i].atom, cases[i].read_size);
+	}
+}
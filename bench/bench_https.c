@@ -0,0 +1,574 @@
+/*
+ * Responses through https.c, over each of conn_stash's transports:
+ * from a server on a thread of its own over loopback, with TLS and
+ * without, and from one on the client's own event loop over
+ * bufferevent pairs. The server writes each response in pieces, one
+ * SSL_write(), write() or bufferevent_write() at a time, so the parser
+ * sees it arrive split the same way. Over pairs it's split exactly
+ * that way every time, and no time goes to the kernel. Times are from
+ * sending the request to done(), connection and all, so compare the
+ * cases with each other rather than with the other benchmarks.
+ */
+
+#include "bench.h"
+#include "atom.h"
+#include "cert.h"
+#include "https.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#define BENCH_HOST "bench.invalid"
+#define BENCH_PORT 443
+
+struct split {
+	const char *name;
+
+	/* Status line and headers go out a byte at a time */
+	int bytewise_head;
+
+	/* Then the rest in pieces this big. Zero for all at once. */
+	size_t piece;
+};
+
+static const struct split splits[] = {
+	{ "whole", 0, 0 },
+	{ "mss", 0, 1448 },
+	{ "small", 0, 61 },
+	{ "bytewise_head", 1, 0 },
+};
+
+struct response {
+	char *data;
+	size_t len;
+	size_t head_len;
+	size_t body_len;
+	const struct split *split;
+};
+
+struct pair_conn;
+
+struct server {
+	/* NULL for plain TCP */
+	SSL_CTX *ssl_ctx;
+	int fd;
+	int port;
+	pthread_t thread;
+
+	/* Connections still being served */
+	atomic_int nconns;
+	struct pair_conn *pairs;
+
+	_Atomic(struct response *) response;
+};
+
+struct conn {
+	struct server *server;
+	SSL *ssl;
+	int fd;
+};
+
+/* A connection to the in-process server, over a pair */
+struct pair_conn {
+	struct pair_conn *next;
+	struct bufferevent *bev;
+	struct event *respond;
+	struct server *server;
+};
+
+struct client {
+	struct event_base *base;
+	struct https_engine *https;
+	const char *transport;
+	struct bench b;
+	uint64_t sent;
+	size_t body;
+	int warmup;
+	int failed;
+};
+
+/* One of ssl, fd and bev, whichever the transport has */
+static int write_piece(SSL *ssl, int fd, struct bufferevent *bev,
+		       const char *data, size_t n)
+{
+	ssize_t done;
+
+	if (ssl != NULL) {
+		return SSL_write(ssl, data, n) > 0 ? 0 : -1;
+	}
+
+	if (bev != NULL) {
+		return bufferevent_write(bev, data, n);
+	}
+
+	for (; n > 0; data += done, n -= done) {
+		if ((done = write(fd, data, n)) <= 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int write_all(SSL *ssl, int fd, struct bufferevent *bev,
+		     const char *data, size_t len, size_t piece)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = piece && piece < len ? piece : len;
+		if (write_piece(ssl, fd, bev, data, n) != 0) {
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int respond(SSL *ssl, int fd, struct bufferevent *bev,
+		   const struct response *resp)
+{
+	const struct split *split = resp->split;
+	size_t off;
+
+	off = 0;
+	if (split->bytewise_head) {
+		if (write_all(ssl, fd, bev, resp->data, resp->head_len, 1) != 0) {
+			return -1;
+		}
+		off = resp->head_len;
+	}
+
+	return write_all(ssl, fd, bev, resp->data + off, resp->len - off,
+			 split->piece);
+}
+
+/* Reads requests and answers them until the client's gone */
+static void *serve_conn(void *arg)
+{
+	struct conn *conn = arg;
+	char buf[4096];
+	size_t len;
+	int n;
+
+	if (conn->ssl != NULL && SSL_accept(conn->ssl) != 1) {
+		goto out;
+	}
+
+	len = 0;
+	for (;;) {
+		n = conn->ssl != NULL
+			? SSL_read(conn->ssl, buf + len, sizeof(buf) - 1 - len)
+			: read(conn->fd, buf + len, sizeof(buf) - 1 - len);
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+		buf[len] = '\0';
+
+		/* GETs, nothing after the headers */
+		if (strstr(buf, "\r\n\r\n") == NULL) {
+			if (len == sizeof(buf) - 1) {
+				break;
+			}
+			continue;
+		}
+		len = 0;
+
+		if (respond(conn->ssl, conn->fd, NULL,
+			    atomic_load(&conn->server->response)) != 0) {
+			break;
+		}
+	}
+
+ out:
+	SSL_free(conn->ssl);
+	close(conn->fd);
+	atomic_fetch_sub(&conn->server->nconns, 1);
+	free(conn);
+	return NULL;
+}
+
+static void *serve(void *arg)
+{
+	struct server *server = arg;
+	struct conn *conn;
+	pthread_t thread;
+	int fd, one = 1;
+
+	while ((fd = accept(server->fd, NULL, NULL)) >= 0) {
+		if ((conn = malloc(sizeof(*conn))) == NULL) {
+			close(fd);
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn->server = server;
+		conn->fd = fd;
+		conn->ssl = NULL;
+		if (server->ssl_ctx != NULL) {
+			conn->ssl = SSL_new(server->ssl_ctx);
+			SSL_set_fd(conn->ssl, fd);
+		}
+
+		atomic_fetch_add(&server->nconns, 1);
+		if (pthread_create(&thread, NULL, serve_conn, conn) != 0) {
+			atomic_fetch_sub(&server->nconns, 1);
+			SSL_free(conn->ssl);
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	return NULL;
+}
+
+static int server_start(struct server *server, int tls)
+{
+	struct sockaddr_in sin;
+	socklen_t sinlen;
+
+	memset(server, 0, sizeof(*server));
+
+	if (tls && (server->ssl_ctx = cert_server_ctx(BENCH_HOST)) == NULL) {
+		return EINVAL;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sinlen = sizeof(sin);
+
+	if ((server->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    bind(server->fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+	    listen(server->fd, 8) != 0 ||
+	    getsockname(server->fd, (struct sockaddr *)&sin, &sinlen) != 0) {
+		if (server->fd >= 0) {
+			close(server->fd);
+		}
+		SSL_CTX_free(server->ssl_ctx);
+		return errno;
+	}
+	server->port = ntohs(sin.sin_port);
+
+	pthread_create(&server->thread, NULL, serve, server);
+	return 0;
+}
+
+/* After the client's closed its connections */
+static void server_stop(struct server *server)
+{
+	shutdown(server->fd, SHUT_RDWR);
+	pthread_join(server->thread, NULL);
+	close(server->fd);
+
+	while (atomic_load(&server->nconns) > 0) {
+		usleep(1000);
+	}
+
+	SSL_CTX_free(server->ssl_ctx);
+}
+
+/* Not from pair_read(), the client's still busy sending */
+static void pair_respond(evutil_socket_t fd, short what, void *arg)
+{
+	struct pair_conn *conn = arg;
+
+	respond(NULL, -1, conn->bev, atomic_load(&conn->server->response));
+}
+
+static void pair_read(struct bufferevent *bev, void *arg)
+{
+	struct pair_conn *conn = arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	struct evbuffer_ptr end;
+
+	/* GETs, nothing after the headers */
+	while ((end = evbuffer_search(in, "\r\n\r\n", 4, NULL)).pos != -1) {
+		evbuffer_drain(in, end.pos + 4);
+		event_active(conn->respond, EV_TIMEOUT, 0);
+	}
+}
+
+static void pair_free(struct pair_conn *conn)
+{
+	struct pair_conn **connp;
+
+	for (connp = &conn->server->pairs; *connp != conn; connp = &(*connp)->next)
+		;
+	*connp = conn->next;
+
+	event_free(conn->respond);
+	bufferevent_free(conn->bev);
+	free(conn);
+}
+
+static void pair_event(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		pair_free(arg);
+	}
+}
+
+static void pair_accept(struct bufferevent *bev, const char *host, int port,
+			void *arg)
+{
+	struct server *server = arg;
+	struct pair_conn *conn;
+
+	if ((conn = calloc(1, sizeof(*conn))) == NULL) {
+		bufferevent_free(bev);
+		return;
+	}
+	conn->bev = bev;
+	conn->server = server;
+	conn->respond = event_new(bufferevent_get_base(bev), -1, 0,
+				  pair_respond, conn);
+
+	conn->next = server->pairs;
+	server->pairs = conn;
+
+	bufferevent_setcb(bev, pair_read, NULL, pair_event, conn);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+static void make_response(struct response *resp, struct evbuffer *body,
+			  int chunked, size_t chunk_size)
+{
+	struct evbuffer *out;
+	unsigned char *p;
+	size_t len, n;
+
+	out = evbuffer_new();
+	len = evbuffer_get_length(body);
+	p = evbuffer_pullup(body, -1);
+
+	evbuffer_add_printf(out, "HTTP/1.1 200 OK\r\n"
+			    "Content-Type: application/atom+xml; charset=UTF-8\r\n"
+			    "Cache-Control: private, max-age=0, must-revalidate, no-transform\r\n"
+			    "X-Content-Type-Options: nosniff\r\n");
+	if (chunked) {
+		evbuffer_add_printf(out, "Transfer-Encoding: chunked\r\n\r\n");
+	} else {
+		evbuffer_add_printf(out, "Content-Length: %zu\r\n\r\n", len);
+	}
+	resp->head_len = evbuffer_get_length(out);
+
+	if (chunked) {
+		for (; len > 0; p += n, len -= n) {
+			n = len < chunk_size ? len : chunk_size;
+			evbuffer_add_printf(out, "%zx\r\n", n);
+			evbuffer_add(out, p, n);
+			evbuffer_add(out, "\r\n", 2);
+		}
+		evbuffer_add(out, "0\r\n\r\n", 5);
+	} else {
+		evbuffer_add(out, p, len);
+	}
+
+	resp->body_len = evbuffer_get_length(body);
+	resp->len = evbuffer_get_length(out);
+	resp->data = malloc(resp->len);
+	evbuffer_remove(out, resp->data, resp->len);
+	evbuffer_free(out);
+}
+
+static void send_request(struct client *client);
+
+static void cb_body(struct evbuffer *buf, void *arg)
+{
+	struct client *client = arg;
+
+	client->body += evbuffer_get_length(buf);
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+}
+
+static void cb_done(int err_status, char *err_msg, void *arg)
+{
+	struct client *client = arg;
+
+	if (err_msg != NULL) {
+		fprintf(stderr, "%s(): %d %s\n", __func__, err_status, err_msg);
+		free(err_msg);
+		client->failed = 1;
+		event_base_loopbreak(client->base);
+		return;
+	}
+
+	if (client->warmup) {
+		event_base_loopbreak(client->base);
+		return;
+	}
+
+	bench_sample(&client->b, bench_now() - client->sent, client->body, 1);
+
+	if (bench_more(&client->b)) {
+		send_request(client);
+	} else {
+		event_base_loopbreak(client->base);
+	}
+}
+
+static struct https_cb_ops cb_ops = {
+	.read = cb_body,
+	.done = cb_done,
+};
+
+static void send_request(struct client *client)
+{
+	static const struct https_deadline unlimited;
+
+	client->body = 0;
+	client->sent = bench_now();
+	https_request(client->https, BENCH_HOST, BENCH_PORT, "GET",
+		      "/feeds/api/users/default/watch_history?v=2", NULL, NULL,
+		      &unlimited, &cb_ops, client, NULL);
+}
+
+static void run(struct client *client, struct server *server, struct evbuffer *body,
+		int entries, int chunked, size_t chunk_size, const struct split *split)
+{
+	struct response resp;
+
+	make_response(&resp, body, chunked, chunk_size);
+	resp.split = split;
+	atomic_store(&server->response, &resp);
+
+	/* Timed ones start on a connection that's already there */
+	client->warmup = 1;
+	client->failed = 0;
+	send_request(client);
+	event_base_dispatch(client->base);
+	client->warmup = 0;
+
+	if (chunked) {
+		bench_start(&client->b, "https",
+			    "transport=%s entries=%d body=%zu chunked=%zu split=%s",
+			    client->transport, entries, resp.body_len, chunk_size,
+			    split->name);
+	} else {
+		bench_start(&client->b, "https",
+			    "transport=%s entries=%d body=%zu length split=%s",
+			    client->transport, entries, resp.body_len, split->name);
+	}
+	if (!client->failed) {
+		send_request(client);
+		event_base_dispatch(client->base);
+	}
+
+	if (!client->failed) {
+		bench_report(&client->b);
+	} else {
+		free(client->b.samples);
+	}
+
+	free(resp.data);
+}
+
+static const struct {
+	const char *name;
+	const struct conn_transport *transport;
+	int tls;
+} transports[] = {
+	{ "tls", &conn_transport_tls, 1 },
+	{ "tcp", &conn_transport_tcp, 0 },
+	{ "pair", &conn_transport_pair, 0 },
+};
+
+static void run_transport(int t)
+{
+	struct https_connect_to connect_to[] = {
+		{ BENCH_HOST, BENCH_PORT, "127.0.0.1", 0 },
+		{ NULL },
+	};
+	/* The hedge timer is in whole milliseconds, and over loopback
+	 * the p95 it goes by is zero, so every request would be hedged on
+	 * a fresh connection. Pipelined ones aren't, and one at a time
+	 * they go out just the same.
+	 */
+	struct https_options opts = {
+		.connect_to = connect_to,
+		.pipeline_depth = 2,
+		.transport = transports[t].transport,
+	};
+	struct atom_params atom = { 0, 32, 32 };
+	static const int sizes[] = { 1, 100 };
+	struct server server;
+	struct client client;
+	struct evbuffer *body;
+	int pair, i, j;
+
+	pair = transports[t].transport == &conn_transport_pair;
+	if (pair) {
+		memset(&server, 0, sizeof(server));
+		opts.pair_accept = pair_accept;
+		opts.pair_arg = &server;
+	} else if (server_start(&server, transports[t].tls) != 0) {
+		fprintf(stderr, "%s(): can't start the server\n", __func__);
+		return;
+	}
+	connect_to[0].to_port = server.port;
+
+	memset(&client, 0, sizeof(client));
+	client.transport = transports[t].name;
+	client.base = event_base_new();
+	if (https_engine_init(&client.https, client.base, &opts) != 0) {
+		fprintf(stderr, "%s(): https_engine_init() failed\n", __func__);
+		event_base_free(client.base);
+		if (!pair) {
+			server_stop(&server);
+		}
+		return;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		body = evbuffer_new();
+		atom.entries = sizes[i];
+		atom_generate(body, &atom);
+
+		for (j = 0; j < sizeof(splits) / sizeof(splits[0]); j++) {
+			run(&client, &server, body, sizes[i], 0, 0, &splits[j]);
+			run(&client, &server, body, sizes[i], 1, 8192, &splits[j]);
+		}
+		run(&client, &server, body, sizes[i], 1, 256, &splits[0]);
+
+		evbuffer_free(body);
+	}
+
+	https_engine_destroy(client.https);
+	if (pair) {
+		while (server.pairs != NULL) {
+			pair_free(server.pairs);
+		}
+	} else {
+		server_stop(&server);
+	}
+	event_base_free(client.base);
+}
+
+void bench_https(void)
+{
+	int t;
+
+	for (t = 0; t < sizeof(transports) / sizeof(transports[0]); t++) {
+		run_transport(t);
+	}
+}
@@ -0,0 +1,109 @@
+/*
+ * Session lookups, gets and sets with a good many sessions in the
+ * store, one thread at it. test/stress_store has the threads.
+ */
+
+#include "bench.h"
+#include "store.h"
+#include "rcu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <event2/http.h>
+
+/* Operations per sample, with a quiescent state in between like a
+ * pass through the event loop would have.
+ */
+#define STORE_BATCH 1000
+
+/* New sessions last, they only add to the ones looked up */
+enum { OP_ENSURE, OP_GET, OP_SET, OP_ENSURE_NEW };
+
+static const char *op_names[] = { "ensure", "get", "set", "ensure_new" };
+
+static void run(int nsessions)
+{
+	struct store_options opts = { .nel = nsessions };
+	struct evhttp_request **reqs;
+	struct session **sessions;
+	struct evhttp_request *req;
+	struct session *session;
+	struct store *store;
+	struct bench b;
+	char value[64];
+	uint64_t t0;
+	unsigned int k;
+	int op, i, j;
+
+	if (store_init(&store, NULL, &opts) != 0) {
+		fprintf(stderr, "%s(): store_init() failed\n", __func__);
+		return;
+	}
+
+	/* Requests carrying the cookies of every session there is */
+	reqs = calloc(nsessions, sizeof(*reqs));
+	sessions = calloc(nsessions, sizeof(*sessions));
+	for (i = 0; i < nsessions; i++) {
+		req = evhttp_request_new(NULL, NULL);
+		session_ensure(store, &sessions[i], req);
+		snprintf(value, sizeof(value), "token-%d", i);
+		session_set_value(sessions[i], "access_token", value);
+
+		reqs[i] = evhttp_request_new(NULL, NULL);
+		evhttp_add_header(evhttp_request_get_input_headers(reqs[i]), "Cookie",
+				  evhttp_find_header(evhttp_request_get_output_headers(req),
+						     "Set-Cookie"));
+		evhttp_request_free(req);
+	}
+	rcu_quiescent_state();
+
+	for (op = OP_ENSURE; op <= OP_ENSURE_NEW; op++) {
+		bench_start(&b, "store", "op=%s sessions=%d batch=%d",
+			    op_names[op], nsessions, STORE_BATCH);
+		k = 0;
+		while (bench_more(&b)) {
+			t0 = bench_now();
+			for (j = 0; j < STORE_BATCH; j++) {
+				i = (k++ * 7919u) % nsessions;
+				switch (op) {
+				case OP_ENSURE:
+					session_ensure(store, &sessions[i], reqs[i]);
+					break;
+				case OP_GET:
+					session_get_value(sessions[i], "access_token");
+					break;
+				case OP_SET:
+					snprintf(value, sizeof(value), "token-%d-%d", i, k);
+					session_set_value(sessions[i], "access_token", value);
+					break;
+				case OP_ENSURE_NEW:
+					/* The request's making counts too */
+					req = evhttp_request_new(NULL, NULL);
+					session_ensure(store, &session, req);
+					evhttp_request_free(req);
+					break;
+				}
+			}
+			rcu_quiescent_state();
+			bench_sample(&b, bench_now() - t0, 0, STORE_BATCH);
+		}
+		bench_report(&b);
+	}
+
+	for (i = 0; i < nsessions; i++) {
+		evhttp_request_free(reqs[i]);
+	}
+	free(reqs);
+	free(sessions);
+	store_destroy(store);
+	rcu_quiescent_state();
+}
+
+void bench_store(void)
+{
+	rcu_register_thread();
+	run(1000);
+	run(100000);
+	rcu_unregister_thread();
+}
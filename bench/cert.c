@@ -0,0 +1,63 @@
+#include "cert.h"
+
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+
+static EVP_PKEY *new_key(void)
+{
+	EVP_PKEY_CTX *pctx;
+	EVP_PKEY *pkey;
+
+	pkey = NULL;
+	if ((pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) == NULL) {
+		return NULL;
+	}
+	if (EVP_PKEY_keygen_init(pctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pctx, NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(pctx, &pkey) <= 0) {
+		pkey = NULL;
+	}
+	EVP_PKEY_CTX_free(pctx);
+
+	return pkey;
+}
+
+SSL_CTX *cert_server_ctx(const char *cn)
+{
+	EVP_PKEY *pkey;
+	X509 *x509;
+	SSL_CTX *ctx;
+
+	if ((pkey = new_key()) == NULL) {
+		return NULL;
+	}
+
+	ctx = NULL;
+	if ((x509 = X509_new()) == NULL) {
+		goto out;
+	}
+	ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x509), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x509), 24 * 60 * 60);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(x509), "CN", MBSTRING_ASC,
+				   (const unsigned char *)cn, -1, -1, 0);
+	X509_set_issuer_name(x509, X509_get_subject_name(x509));
+	X509_set_pubkey(x509, pkey);
+	if (X509_sign(x509, pkey, EVP_sha256()) == 0) {
+		goto out;
+	}
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx != NULL &&
+	    (SSL_CTX_use_certificate(ctx, x509) != 1 ||
+	     SSL_CTX_use_PrivateKey(ctx, pkey) != 1)) {
+		SSL_CTX_free(ctx);
+		ctx = NULL;
+	}
+
+ out:
+	X509_free(x509);
+	EVP_PKEY_free(pkey);
+	return ctx;
+}
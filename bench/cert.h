@@ -0,0 +1,16 @@
+#ifndef CERT_H__INCLUDED
+#define CERT_H__INCLUDED
+
+/*
+ * Stand-ins for Google need a certificate. We don't check them, so
+ * any will do, and one made up on the spot saves keeping one around.
+ */
+
+#include <openssl/ssl.h>
+
+/* A server context with a fresh self-signed certificate for cn, good
+ * for a day. NULL if that didn't work out.
+ */
+SSL_CTX *cert_server_ctx(const char *cn);
+
+#endif
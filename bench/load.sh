@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# yt_history against mock_upstream, with loadgen at it, all on this
+# machine. Arguments go to loadgen. MOCK_ARGS and YT_ARGS go to the
+# other two:
+#
+#   MOCK_ARGS="-l 50 -j 20 -f 2" ./load.sh -c 64 -t 30
+#
+# Run from bench/, after make.
+
+MOCK_PORT=${MOCK_PORT:-18443}
+YT_PORT=${YT_PORT:-18080}
+
+home=$(mktemp -d)
+trap 'kill $mock $yt 2>/dev/null; wait 2>/dev/null; rm -rf "$home"' EXIT INT TERM
+
+# yt_history wants these, the mock doesn't care what they are
+mkdir "$home/.yt_history"
+echo load > "$home/.yt_history/client_id"
+echo load > "$home/.yt_history/client_secret"
+
+./mock_upstream -p $MOCK_PORT $MOCK_ARGS > /dev/null &
+mock=$!
+
+HOME=$home ../yt_history -p $YT_PORT \
+	-G localhost:$MOCK_PORT -A localhost:$MOCK_PORT $YT_ARGS > /dev/null &
+yt=$!
+
+# Both are up once they've bound their ports
+sleep 1
+
+./loadgen -p $YT_PORT "$@"
@@ -0,0 +1,272 @@
+/*
+ * Drives /list on a running yt_history with a number of sessions at
+ * once, each logging in first and then asking for the list again as
+ * soon as it has it:
+ *
+ *   ./loadgen [-c sessions] [-t seconds] [-p port] [-q query]
+ *
+ * Logging in is done the way a browser coming back from Google would,
+ * so yt_history has to be pointed at something that'll take any code,
+ * like mock_upstream. One line of JSON at the end, like the other
+ * benchmarks, with /list latencies and requests per second over the
+ * whole run. Anything but a 200 from /list is counted as an error, on
+ * stderr.
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+
+/* Tries at logging in, with failures injected upstream */
+#define LOGIN_ATTEMPTS 10
+
+enum { STEP_COOKIE, STEP_LOGIN, STEP_LIST };
+
+struct loadgen {
+	struct event_base *base;
+	const char *query;
+	int nusers;
+	int port;
+
+	int logging_in;
+	int running;
+	int stopping;
+	uint64_t started;
+
+	struct bench b;
+	unsigned long errors;
+};
+
+struct user {
+	struct loadgen *lg;
+	struct evhttp_connection *conn;
+	int id;
+	int step;
+	int attempts;
+	char cookie[128];
+	uint64_t sent;
+};
+
+static void send_step(struct user *user);
+
+static void start_lists(struct loadgen *lg, struct user *users)
+{
+	int i;
+
+	lg->started = bench_now();
+	lg->running = lg->nusers;
+	for (i = 0; i < lg->nusers; i++) {
+		send_step(&users[i]);
+	}
+}
+
+static void user_done(struct user *user)
+{
+	struct loadgen *lg = user->lg;
+
+	if (--lg->running == 0) {
+		lg->b.wall = bench_now() - lg->started;
+		event_base_loopbreak(lg->base);
+	}
+}
+
+static void cb_response(struct evhttp_request *req, void *arg)
+{
+	struct user *user = arg;
+	struct loadgen *lg = user->lg;
+	const char *cookie;
+	int code;
+	size_t n;
+
+	code = req != NULL ? evhttp_request_get_response_code(req) : 0;
+
+	switch (user->step) {
+	case STEP_COOKIE:
+		cookie = req != NULL ?
+			evhttp_find_header(evhttp_request_get_input_headers(req),
+					   "Set-Cookie") : NULL;
+		if (cookie == NULL) {
+			fprintf(stderr, "loadgen: session %d got no cookie (%d)\n",
+				user->id, code);
+			event_base_loopbreak(lg->base);
+			return;
+		}
+		n = strcspn(cookie, ";");
+		snprintf(user->cookie, sizeof(user->cookie), "%.*s", (int)n, cookie);
+		user->step = STEP_LOGIN;
+		send_step(user);
+		break;
+
+	case STEP_LOGIN:
+		if (code != HTTP_MOVETEMP) {
+			if (++user->attempts < LOGIN_ATTEMPTS) {
+				send_step(user);
+				return;
+			}
+			fprintf(stderr, "loadgen: session %d couldn't log in (%d)\n",
+				user->id, code);
+			event_base_loopbreak(lg->base);
+			return;
+		}
+		user->step = STEP_LIST;
+		if (--lg->logging_in == 0) {
+			start_lists(lg, user - user->id);
+		}
+		break;
+
+	case STEP_LIST:
+		if (code == HTTP_OK) {
+			bench_sample(&lg->b, bench_now() - user->sent, 0, 1);
+		} else {
+			lg->errors++;
+		}
+		if (lg->stopping) {
+			user_done(user);
+		} else {
+			send_step(user);
+		}
+		break;
+	}
+}
+
+static void send_step(struct user *user)
+{
+	struct evhttp_request *req;
+	struct evkeyvalq *headers;
+	char path[512];
+
+	req = evhttp_request_new(cb_response, user);
+	headers = evhttp_request_get_output_headers(req);
+	evhttp_add_header(headers, "Host", "localhost");
+	if (user->cookie[0] != '\0') {
+		evhttp_add_header(headers, "Cookie", user->cookie);
+	}
+
+	switch (user->step) {
+	case STEP_COOKIE:
+		snprintf(path, sizeof(path), "/");
+		break;
+	case STEP_LOGIN:
+		snprintf(path, sizeof(path), "/?state=auth&code=loadgen-%d", user->id);
+		break;
+	default:
+		snprintf(path, sizeof(path), "/list%s%s",
+			 user->lg->query ? "?" : "",
+			 user->lg->query ? user->lg->query : "");
+		break;
+	}
+
+	user->sent = bench_now();
+	if (evhttp_make_request(user->conn, req, EVHTTP_REQ_GET, path) != 0) {
+		fprintf(stderr, "loadgen: can't send %s\n", path);
+		event_base_loopbreak(user->lg->base);
+	}
+}
+
+static void stop(evutil_socket_t fd, short what, void *arg)
+{
+	struct loadgen *lg = arg;
+
+	lg->stopping = 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct loadgen lg;
+	struct user *users;
+	struct timeval tv;
+	struct event *timer;
+	double seconds;
+	int opt, i;
+
+	memset(&lg, 0, sizeof(lg));
+	lg.nusers = 16;
+	lg.port = 8080;
+	seconds = 10;
+
+	while ((opt = getopt(argc, argv, "c:p:q:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			lg.nusers = atoi(optarg);
+			break;
+		case 'p':
+			lg.port = atoi(optarg);
+			break;
+		case 'q':
+			lg.query = optarg;
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c sessions] [-t seconds] [-p port]"
+				" [-q query]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (lg.nusers <= 0) {
+		fprintf(stderr, "loadgen: no sessions, no load\n");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	lg.base = event_base_new();
+	users = calloc(lg.nusers, sizeof(*users));
+
+	for (i = 0; i < lg.nusers; i++) {
+		users[i].lg = &lg;
+		users[i].id = i;
+		users[i].conn = evhttp_connection_base_new(lg.base, NULL,
+							   "127.0.0.1", lg.port);
+	}
+
+	/* Everybody logs in first, and the clock starts after */
+	lg.logging_in = lg.nusers;
+	for (i = 0; i < lg.nusers; i++) {
+		send_step(&users[i]);
+	}
+
+	bench_start(&lg.b, "load", "sessions=%d path=/list%s%s", lg.nusers,
+		    lg.query ? "?" : "", lg.query ? lg.query : "");
+
+	tv.tv_sec = (long)seconds;
+	tv.tv_usec = (long)((seconds - tv.tv_sec) * 1e6);
+	timer = evtimer_new(lg.base, stop, &lg);
+
+	/* The timer's started once the first list goes out */
+	while (lg.logging_in > 0 && event_base_loop(lg.base, EVLOOP_ONCE) == 0) {
+		if (event_base_got_break(lg.base)) {
+			return 1;
+		}
+	}
+	evtimer_add(timer, &tv);
+	event_base_dispatch(lg.base);
+
+	if (lg.running > 0) {
+		/* Broken off */
+		return 1;
+	}
+
+	if (lg.errors > 0) {
+		fprintf(stderr, "loadgen: %lu errors\n", lg.errors);
+	}
+	bench_report(&lg.b);
+
+	event_free(timer);
+	for (i = 0; i < lg.nusers; i++) {
+		evhttp_connection_free(users[i].conn);
+	}
+	free(users);
+	event_base_free(lg.base);
+
+	return 0;
+}
@@ -0,0 +1,342 @@
+/*
+ * A stand-in for gdata.youtube.com and accounts.google.com, for
+ * running yt_history and the load generator against without going
+ * anywhere near Google:
+ *
+ *   ./mock_upstream [-p port] [-l latency_ms] [-j jitter_ms]
+ *                   [-f fail_pct] [-r reset_pct] [-x expires_in] [-v]
+ *
+ *   ./yt_history -G localhost:8443 -A localhost:8443
+ *
+ * It logs anybody in, hands out tokens for any code or refresh token,
+ * and serves made-up watch history pages for any access token. Each
+ * answer waits latency_ms, give or take jitter_ms. fail_pct percent
+ * of them are a 503, and reset_pct percent never come, the connection
+ * is just closed.
+ */
+
+#include "atom.h"
+#include "cert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "verbose.h"
+
+/* A page has no more entries than this, whatever's asked */
+#define MAX_ENTRIES 50
+
+struct mock {
+	struct event_base *base;
+	struct evhttp *http;
+	SSL_CTX *ssl_ctx;
+
+	int latency;
+	int jitter;
+	int fail_pct;
+	int reset_pct;
+	int expires_in;
+
+	unsigned long tokens;
+	unsigned int seed;
+};
+
+/* An answer that's waiting its turn */
+struct reply {
+	struct evhttp_request *req;
+	int code;
+	const char *reason;
+	struct evbuffer *body;
+};
+
+static struct bufferevent *ssl_bev(struct event_base *base, void *arg)
+{
+	struct mock *mock = arg;
+
+	return bufferevent_openssl_socket_new(base, -1, SSL_new(mock->ssl_ctx),
+					      BUFFEREVENT_SSL_ACCEPTING,
+					      BEV_OPT_CLOSE_ON_FREE);
+}
+
+static void send_reply(evutil_socket_t fd, short what, void *arg)
+{
+	struct reply *reply = arg;
+
+	evhttp_send_reply(reply->req, reply->code, reply->reason, reply->body);
+	evbuffer_free(reply->body);
+	free(reply);
+}
+
+static void reply_later(struct mock *mock, struct reply *reply)
+{
+	struct timeval tv;
+	int ms;
+
+	ms = mock->latency;
+	if (mock->jitter > 0) {
+		ms += rand_r(&mock->seed) % (2 * mock->jitter + 1) - mock->jitter;
+	}
+
+	if (ms <= 0) {
+		send_reply(-1, EV_TIMEOUT, reply);
+		return;
+	}
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	if (event_base_once(mock->base, -1, EV_TIMEOUT, send_reply, reply, &tv) != 0) {
+		send_reply(-1, EV_TIMEOUT, reply);
+	}
+}
+
+/* The browser's sent right back, logged in */
+static void handle_login(struct mock *mock, struct evhttp_request *req,
+			 struct reply *reply, struct evkeyvalq *params)
+{
+	const char *redirect_uri, *state;
+	char location[1024];
+
+	if ((redirect_uri = evhttp_find_header(params, "redirect_uri")) == NULL) {
+		reply->code = HTTP_BADREQUEST;
+		reply->reason = "No redirect_uri";
+		return;
+	}
+	state = evhttp_find_header(params, "state");
+
+	snprintf(location, sizeof(location), "%s/?code=mock-%lu&state=%s",
+		 redirect_uri, ++mock->tokens, state ? state : "");
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Location", location);
+	reply->code = HTTP_MOVETEMP;
+	reply->reason = "Found";
+}
+
+/* First ones come with a refresh token, refreshed ones don't */
+static void handle_token(struct mock *mock, struct evhttp_request *req,
+			 struct reply *reply)
+{
+	struct evbuffer *in;
+	struct evkeyvalq form;
+	const char *grant;
+	char *body;
+	size_t len;
+
+	in = evhttp_request_get_input_buffer(req);
+	len = evbuffer_get_length(in);
+	if ((body = malloc(len + 1)) == NULL) {
+		reply->code = HTTP_INTERNAL;
+		reply->reason = "Out of memory";
+		return;
+	}
+	evbuffer_remove(in, body, len);
+	body[len] = '\0';
+
+	memset(&form, 0, sizeof(form));
+	evhttp_parse_query_str(body, &form);
+	grant = evhttp_find_header(&form, "grant_type");
+
+	mock->tokens++;
+	if (grant != NULL && strcmp(grant, "refresh_token") == 0) {
+		evbuffer_add_printf(reply->body,
+				    "{\"access_token\":\"mock-access-%lu\","
+				    "\"expires_in\":%d,\"token_type\":\"Bearer\"}",
+				    mock->tokens, mock->expires_in);
+	} else {
+		evbuffer_add_printf(reply->body,
+				    "{\"access_token\":\"mock-access-%lu\","
+				    "\"expires_in\":%d,\"token_type\":\"Bearer\","
+				    "\"refresh_token\":\"mock-refresh-%lu\"}",
+				    mock->tokens, mock->expires_in, mock->tokens);
+	}
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Content-Type", "application/json");
+
+	evhttp_clear_headers(&form);
+	free(body);
+}
+
+static void handle_history(struct mock *mock, struct evhttp_request *req,
+			   struct reply *reply, struct evkeyvalq *params)
+{
+	struct atom_params atom = { 25, 40, 24 };
+	const char *auth, *val;
+
+	auth = evhttp_find_header(evhttp_request_get_input_headers(req),
+				  "Authorization");
+	if (auth == NULL || strncmp(auth, "Bearer ", 7) != 0) {
+		reply->code = 401;
+		reply->reason = "Unauthorized";
+		return;
+	}
+
+	if ((val = evhttp_find_header(params, "max-results")) != NULL) {
+		atom.entries = atoi(val);
+	}
+	if (atom.entries < 0 || atom.entries > MAX_ENTRIES) {
+		atom.entries = MAX_ENTRIES;
+	}
+	if ((val = evhttp_find_header(params, "start-index")) != NULL) {
+		atom.start_index = atoi(val);
+	}
+
+	atom_generate(reply->body, &atom);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Content-Type", "application/atom+xml; charset=UTF-8");
+}
+
+static void handle_request(struct evhttp_request *req, void *arg)
+{
+	struct mock *mock = arg;
+	const struct evhttp_uri *uri;
+	struct evkeyvalq params;
+	struct reply *reply;
+	const char *path;
+
+	uri = evhttp_request_get_evhttp_uri(req);
+	path = evhttp_uri_get_path(uri);
+
+	verbose(NORMAL, "%s(): %s\n", __func__, evhttp_request_get_uri(req));
+
+	if (mock->reset_pct > 0 && rand_r(&mock->seed) % 100 < mock->reset_pct) {
+		evhttp_connection_free(evhttp_request_get_connection(req));
+		return;
+	}
+
+	if ((reply = malloc(sizeof(*reply))) == NULL ||
+	    (reply->body = evbuffer_new()) == NULL) {
+		free(reply);
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+	reply->req = req;
+	reply->code = HTTP_OK;
+	reply->reason = "OK";
+
+	memset(&params, 0, sizeof(params));
+	evhttp_parse_query_str(evhttp_uri_get_query(uri), &params);
+
+	if (mock->fail_pct > 0 && rand_r(&mock->seed) % 100 < mock->fail_pct) {
+		reply->code = HTTP_SERVUNAVAIL;
+		reply->reason = "Service Unavailable";
+	} else if (strcmp(path, "/o/oauth2/auth") == 0) {
+		handle_login(mock, req, reply, &params);
+	} else if (strcmp(path, "/o/oauth2/token") == 0) {
+		handle_token(mock, req, reply);
+	} else if (strcmp(path, "/feeds/api/users/default/watch_history") == 0) {
+		handle_history(mock, req, reply, &params);
+	} else {
+		reply->code = HTTP_NOTFOUND;
+		reply->reason = "Not Found";
+	}
+
+	evhttp_clear_headers(&params);
+	reply_later(mock, reply);
+}
+
+static void interrupted(evutil_socket_t fd, short events, void *base)
+{
+	event_base_loopexit(base, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	struct mock mock;
+	struct evhttp_bound_socket *sock;
+	struct event *interrupt;
+	int opt, port, one = 1;
+
+	memset(&mock, 0, sizeof(mock));
+	mock.expires_in = 3600;
+	mock.seed = getpid();
+	port = 8443;
+
+	while ((opt = getopt(argc, argv, "f:j:l:p:r:vx:")) != -1) {
+		switch (opt) {
+		case 'f':
+			mock.fail_pct = atoi(optarg);
+			break;
+		case 'j':
+			mock.jitter = atoi(optarg);
+			break;
+		case 'l':
+			mock.latency = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			mock.reset_pct = atoi(optarg);
+			break;
+		case 'v':
+			verbose_adjust_level(+1);
+			break;
+		case 'x':
+			mock.expires_in = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-l latency_ms] [-j jitter_ms]"
+				" [-f fail_pct] [-r reset_pct] [-x expires_in] [-v]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	/* Only the odd warning, unless asked for more */
+	verbose_adjust_level(-1);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((mock.ssl_ctx = cert_server_ctx("localhost")) == NULL) {
+		fprintf(stderr, "Can't make a certificate\n");
+		return 1;
+	}
+
+	if ((mock.base = event_base_new()) == NULL ||
+	    (mock.http = evhttp_new(mock.base)) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	evhttp_set_bevcb(mock.http, ssl_bev, &mock);
+	evhttp_set_gencb(mock.http, handle_request, &mock);
+	evhttp_set_allowed_methods(mock.http, EVHTTP_REQ_GET | EVHTTP_REQ_POST);
+
+	if ((sock = evhttp_bind_socket_with_handle(mock.http, "127.0.0.1", port)) == NULL) {
+		perror("evhttp_bind_socket()");
+		return 1;
+	}
+
+	/* Linux hands it down to the accepted ones. Headers and body go
+	 * out as TLS records of their own, and Nagle would hold the body
+	 * back for the client's delayed ACK.
+	 */
+	setsockopt(evhttp_bound_socket_get_fd(sock), IPPROTO_TCP, TCP_NODELAY,
+		   &one, sizeof(one));
+
+	interrupt = evsignal_new(mock.base, SIGINT, interrupted, mock.base);
+	evsignal_add(interrupt, NULL);
+
+	printf("https://localhost:%d/\n", port);
+	fflush(stdout);
+
+	event_base_dispatch(mock.base);
+
+	event_free(interrupt);
+	evhttp_free(mock.http);
+	event_base_free(mock.base);
+	SSL_CTX_free(mock.ssl_ctx);
+
+	return 0;
+}
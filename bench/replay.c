@@ -0,0 +1,150 @@
+/*
+ * Plays captures back through the https client's response parser and
+ * on into the feed parser, the way /list would have them, and times
+ * them. Captures come from yt_history -R, see https_replay().
+ *
+ *   ./replay [-r] [-t seconds] [-v] file.cap ...
+ *
+ * With -r each one takes as long as it did the first time, which
+ * makes for few samples, but shows what the pieces the network hands
+ * us look like from the inside. Without, they go as fast as they can.
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+
+#include "verbose.h"
+#include "https.h"
+#include "feed.h"
+
+struct replay_ctx {
+	struct event_base *base;
+	struct feed *feed;
+	size_t bytes;
+	int failed;
+};
+
+static void replay_read(struct evbuffer *buf, void *arg)
+{
+	struct replay_ctx *ctx = arg;
+
+	ctx->bytes += evbuffer_get_length(buf);
+	feed_consume(ctx->feed, buf);
+}
+
+static void replay_done(int err_status, char *err_msg, void *arg)
+{
+	struct replay_ctx *ctx = arg;
+
+	if (err_msg != NULL) {
+		fprintf(stderr, "%d %s\n", err_status, err_msg);
+		free(err_msg);
+		ctx->failed = 1;
+	}
+
+	feed_final(ctx->feed);
+	event_base_loopbreak(ctx->base);
+}
+
+static struct https_cb_ops replay_cb_ops = {
+	.read = replay_read,
+	.done = replay_done,
+};
+
+static int run(struct https_engine *https, struct event_base *base,
+	       char *path, int realtime)
+{
+	struct replay_ctx ctx;
+	struct evbuffer *sink;
+	struct bench b;
+	uint64_t t0;
+	int err;
+
+	sink = evbuffer_new();
+	ctx.failed = err = 0;
+
+	bench_start(&b, "replay", "file=%s realtime=%d",
+		    basename(path), realtime);
+
+	while (bench_more(&b)) {
+		memset(&ctx, 0, sizeof(ctx));
+		ctx.base = base;
+
+		t0 = bench_now();
+		feed_init(&ctx.feed, sink, NULL);
+		if ((err = https_replay(https, path, realtime,
+					&replay_cb_ops, &ctx)) != 0) {
+			fprintf(stderr, "%s: %s\n", path, strerror(err));
+			feed_destroy(ctx.feed);
+			break;
+		}
+		event_base_dispatch(base);
+		feed_destroy(ctx.feed);
+
+		if (ctx.failed) {
+			break;
+		}
+
+		bench_sample(&b, bench_now() - t0, ctx.bytes, 0);
+		evbuffer_drain(sink, evbuffer_get_length(sink));
+	}
+
+	bench_report(&b);
+	evbuffer_free(sink);
+
+	return err != 0 || ctx.failed;
+}
+
+int main(int argc, char **argv)
+{
+	struct https_options opts;
+	struct https_engine *https;
+	struct event_base *base;
+	int opt, realtime, i, failed;
+
+	verbose_adjust_level(-1);
+
+	realtime = 0;
+	while ((opt = getopt(argc, argv, "rt:v")) != -1) {
+		switch (opt) {
+		case 'r':
+			realtime = 1;
+			break;
+		case 't':
+			bench_seconds = atof(optarg);
+			break;
+		case 'v':
+			verbose_adjust_level(+1);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r] [-t seconds] [-v] file.cap ...\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	base = event_base_new();
+	memset(&opts, 0, sizeof(opts));
+	if (https_engine_init(&https, base, &opts) != 0) {
+		fprintf(stderr, "https_engine_init() failed\n");
+		return 1;
+	}
+
+	failed = 0;
+	for (i = optind; i < argc; i++) {
+		failed |= run(https, base, argv[i], realtime);
+	}
+
+	https_engine_destroy(https);
+	event_base_free(base);
+
+	return failed;
+}
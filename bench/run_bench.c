@@ -0,0 +1,75 @@
+/*
+ * Runs the benchmarks, or the ones named.
+ *
+ *   ./run_bench [-t seconds] [-v] [feed|escape|https|store] ...
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "verbose.h"
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} benches[] = {
+	{ "feed", bench_feed },
+	{ "escape", bench_escape },
+	{ "https", bench_https },
+	{ "store", bench_store },
+};
+
+#define NBENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static int wanted(int argc, char **argv, const char *name)
+{
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], name) == 0) {
+			return 1;
+		}
+	}
+
+	return argc == 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, i;
+
+	/* Only the errors. Everything logged goes to stdout, in among
+	 * the results.
+	 */
+	verbose_adjust_level(-1);
+
+	/* The https one's server writing to connections we've closed */
+	signal(SIGPIPE, SIG_IGN);
+
+	while ((opt = getopt(argc, argv, "t:v")) != -1) {
+		switch (opt) {
+		case 't':
+			bench_seconds = atof(optarg);
+			break;
+		case 'v':
+			verbose_adjust_level(+1);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-v] [name] ...\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < NBENCHES; i++) {
+		if (wanted(argc - optind, argv + optind, benches[i].name)) {
+			benches[i].run();
+		}
+	}
+
+	return 0;
+}
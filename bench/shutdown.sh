@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# yt_history interrupted with /list requests waiting on a slow
+# mock_upstream, and the browsers that asked still connected. It has
+# to come down cleanly. Exits non-zero if it doesn't. A build with
+# -fsanitize=address catches more than a crash:
+#
+#   ./shutdown.sh
+#
+# Run from bench/, after make.
+
+MOCK_PORT=${MOCK_PORT:-18443}
+YT_PORT=${YT_PORT:-18080}
+
+# Long enough for the interrupt to land while the lists are out
+LATENCY=${LATENCY:-3000}
+
+home=$(mktemp -d)
+trap 'kill $mock $yt $lg 2>/dev/null; wait 2>/dev/null; rm -rf "$home"' EXIT INT TERM
+
+mkdir "$home/.yt_history"
+echo shutdown > "$home/.yt_history/client_id"
+echo shutdown > "$home/.yt_history/client_secret"
+
+./mock_upstream -p $MOCK_PORT -l $LATENCY > /dev/null &
+mock=$!
+
+HOME=$home ../yt_history -v -p $YT_PORT \
+	-G localhost:$MOCK_PORT -A localhost:$MOCK_PORT > "$home/yt.log" 2>&1 &
+yt=$!
+
+sleep 1
+
+./loadgen -p $YT_PORT -c 4 -t 60 > /dev/null 2>&1 &
+lg=$!
+
+# Until the first /list has gone upstream
+tries=0
+until grep -q "^list_handle()" "$home/yt.log"; do
+	tries=$((tries + 1))
+	if [ $tries -gt 200 ]; then
+		echo "shutdown: no /list made it to yt_history" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+kill -INT $yt
+wait $yt
+status=$?
+yt=
+
+if [ $status -ne 0 ] || ! grep -q "^Interrupted" "$home/yt.log"; then
+	echo "shutdown: yt_history exited with $status" >&2
+	grep -A30 "ERROR: AddressSanitizer" "$home/yt.log" >&2 ||
+		tail -20 "$home/yt.log" >&2
+	exit 1
+fi
+
+echo "shutdown: ok"
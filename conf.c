@@ -5,7 +5,7 @@
 #include <errno.h>
 #include <string.h>
 
-static char *full_name(const char *tail, char *buf, int sz)
+char *conf_path(const char *tail, char *buf, int sz)
 {
 	/* Might want to check for overruns, though it will fail
 	 * at fopen() later.
@@ -19,7 +19,7 @@ int conf_read(const char *fname, char *buf, int sz)
 {
 	char fnbuf[512];
 
-	FILE *f = fopen(full_name(fname, fnbuf, sizeof(fnbuf)), "r");
+	FILE *f = fopen(conf_path(fname, fnbuf, sizeof(fnbuf)), "r");
 	if (f == NULL) {
 		return errno;
 	}
@@ -3,4 +3,7 @@
 
 int conf_read(const char *fname, char *buf, int sz);
 
+/* Where fname is under $HOME/.yt_history */
+char *conf_path(const char *fname, char *buf, int sz);
+
 #endif
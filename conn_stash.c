@@ -1,39 +1,191 @@
 #include "conn_stash.h"
 
 #include <event2/bufferevent_ssl.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/util.h>
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 
 #include <openssl/ssl.h>
+#include <openssl/err.h>
 
 #include "verbose.h"
+#include "metrics.h"
+#include "trace.h"
 
 struct conn_slot {
 
 	struct conn_slot *next;
-	const char *host;
+	char *host;
 	int port;
 
-	enum { FREE, IN_USE } status;
+	enum { FREE, IN_USE, WARMING } status;
 
-	SSL *ssl;
+	/* Whatever the transport keeps a connection in */
+	void *conn;
+
+	/* Handshake in progress, for WARMING slots */
+	struct bufferevent *warming;
+	struct conn_stash *stash;
+
+	/* When it was last handed back to us */
+	struct timeval idle_since;
+};
+
+
+/* A host we keep a few handshaken connections ready for */
+struct warm_target {
+	struct warm_target *next;
+	char *host;
+	int port;
+	int min_idle;
+};
+
+/* Where to really connect to when asked for host:port */
+struct connect_to {
+	struct connect_to *next;
+	char *host;
+	int port;
+	char *to_host;
+	int to_port;
 };
 
+/* Wait this long before trying again after a warm-up failed */
+#define WARM_RETRY_SECS 5
 
+/*
+ * How connections are made. A connection outlives the bufferevents
+ * it's handed out in: wrap() makes one for a connection, connecting
+ * or already up, and unwrap() gets rid of it again, leaving the
+ * connection be. Those that aren't reused are close()d.
+ */
+struct conn_transport {
+	const char *name;
+
+	/* To addr:port, on behalf of host, offering h2 as well if
+	 * asked to. NULL if it can't be done.
+	 */
+	void *(*open)(struct conn_stash *stash, const char *host,
+		      const char *addr, int port, int h2);
+	struct bufferevent *(*wrap)(struct conn_stash *stash, void *conn,
+				    int connecting);
+	void (*unwrap)(struct bufferevent *bev);
+	int (*owns)(void *conn, struct bufferevent *bev);
+	int (*alive)(void *conn);
+	void (*close)(void *conn);
+
+	/* What was agreed on to speak over it, NULL until it's up */
+	const char *(*protocol)(struct bufferevent *bev);
+
+	/* Once it's up. May be NULL. */
+	void (*connected)(struct conn_stash *stash, struct bufferevent *bev);
+};
 
 struct conn_stash {
 	struct event_base *event_base;
+	const struct conn_transport *transport;
 	SSL_CTX *ssl_ctx;
 
+	/* The other end of pair connections */
+	conn_pair_accept_cb pair_accept;
+	void *pair_arg;
+
 	struct conn_slot *conns;
 
 	int no_keepalive;
+
+	/* Idle connections older than this are closed by the reaper */
+	struct timeval idle_timeout;
+	struct event *reaper;
+
+	struct warm_target *warm;
+	struct event *top_up;
+
+	struct connect_to *connect_to;
+
+	/* Whether to ask OpenSSL for kernel TLS, and whether we've
+	 * said yet that we didn't get it.
+	 */
+	int ktls;
+	int ktls_missed;
+
+	/* Whether to offer h2 on connections that are handed out */
+	int h2;
+
+	struct metric *handshakes;
+	struct metric *ktls_send;
+	struct metric *ktls_recv;
+	struct metric *bytes_in;
+	struct metric *bytes_out;
+	struct metric *idle;
+	struct metric *in_use;
+	struct metric *warming;
 };
 
+static void reap_idle(evutil_socket_t fd, short what, void *arg);
+static void top_up(evutil_socket_t fd, short what, void *arg);
+
+static const unsigned char alpn_http11[] = "\x08http/1.1";
+static const unsigned char alpn_h2[] = "\x02h2\x08http/1.1";
+
+/* Cheaper than keeping the gauges up to date as slots change hands */
+static void count_conns(void *arg)
+{
+	struct conn_stash *stash = arg;
+	struct conn_slot *slot;
+	long n[3] = { 0, 0, 0 };
+
+	for (slot = stash->conns; slot; slot = slot->next) {
+		n[slot->status]++;
+	}
+
+	metric_set(stash->idle, n[FREE]);
+	metric_set(stash->in_use, n[IN_USE]);
+	metric_set(stash->warming, n[WARMING]);
+}
+
+static void init_metrics(struct conn_stash *stash)
+{
+	static const char *conns_help = "Upstream connections, by state";
+
+	stash->handshakes = metric_counter("yt_history_tls_handshakes_total",
+					   "TLS handshakes started with upstreams",
+					   NULL);
+	stash->ktls_send = metric_counter("yt_history_ktls_conns_total",
+					  "Upstream connections with TLS offloaded to the kernel",
+					  "direction=\"send\"");
+	stash->ktls_recv = metric_counter("yt_history_ktls_conns_total",
+					  "Upstream connections with TLS offloaded to the kernel",
+					  "direction=\"recv\"");
+	stash->bytes_in = metric_counter("yt_history_upstream_bytes_total",
+					 "Bytes exchanged with upstreams",
+					 "direction=\"in\"");
+	stash->bytes_out = metric_counter("yt_history_upstream_bytes_total",
+					  "Bytes exchanged with upstreams",
+					  "direction=\"out\"");
+	stash->idle = metric_gauge("yt_history_upstream_conns",
+				   conns_help, "state=\"idle\"");
+	stash->in_use = metric_gauge("yt_history_upstream_conns",
+				     conns_help, "state=\"in_use\"");
+	stash->warming = metric_gauge("yt_history_upstream_conns",
+				      conns_help, "state=\"warming\"");
+}
+
 int conn_stash_init(struct conn_stash **stashp, struct event_base *event_base,
-		    int no_keepalive)
+		    const struct conn_transport *transport,
+		    int no_keepalive, int idle_timeout)
 {
 
 	struct conn_stash *stash;
@@ -56,37 +208,221 @@ int conn_stash_init(struct conn_stash **stashp, struct event_base *event_base,
 		return ENOMEM;
 	}
 
+	/* HTTP/1.1 unless a connection says otherwise, see tls_open().
+	 * Out loud, so the server doesn't have to guess.
+	 */
+	if (SSL_CTX_set_alpn_protos(stash->ssl_ctx, alpn_http11,
+				    sizeof(alpn_http11) - 1) != 0) {
+		SSL_CTX_free(stash->ssl_ctx);
+		free(stash);
+		return ENOMEM;
+	}
+
+	stash->reaper = evtimer_new(event_base, reap_idle, stash);
+	stash->top_up = evtimer_new(event_base, top_up, stash);
+	if (stash->reaper == NULL || stash->top_up == NULL) {
+		if (stash->reaper != NULL) {
+			event_free(stash->reaper);
+		}
+		SSL_CTX_free(stash->ssl_ctx);
+		free(stash);
+		return ENOMEM;
+	}
+
 	stash->event_base = event_base;
+	stash->transport = transport != NULL ? transport : &conn_transport_tls;
 	stash->no_keepalive = no_keepalive;
+	stash->idle_timeout.tv_sec = idle_timeout;
+
+	init_metrics(stash);
+	if (metrics_collect(count_conns, stash) != 0) {
+		verbose(ERROR, "%s(): connections won't be counted\n", __func__);
+	}
 
 	*stashp = stash;
 	return 0;
 }
 
-static void kill_conn(SSL *ssl)
+static void free_slot(struct conn_slot *slot)
 {
-	(void)BIO_set_close(SSL_get_wbio(ssl), 1);
-	SSL_free(ssl);
+	free(slot->host);
+	free(slot);
+}
+
+static void count_in(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+		     void *arg)
+{
+	struct conn_stash *stash = arg;
+
+	metric_add(stash->bytes_in, info->n_added);
+}
+
+/* Drained into the transport, that is */
+static void count_out(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+		      void *arg)
+{
+	struct conn_stash *stash = arg;
+
+	metric_add(stash->bytes_out, info->n_deleted);
+}
+
+static struct bufferevent *counted(struct conn_stash *stash,
+				   struct bufferevent *bev)
+{
+	if (bev != NULL) {
+		evbuffer_add_cb(bufferevent_get_input(bev), count_in, stash);
+		evbuffer_add_cb(bufferevent_get_output(bev), count_out, stash);
+	}
+	return bev;
+}
+
+static struct bufferevent *wrap(struct conn_stash *stash, void *conn,
+				int connecting)
+{
+	return counted(stash, stash->transport->wrap(stash, conn, connecting));
+}
+
+/* A pair's bufferevent is the connection itself, and gets wrapped
+ * again and again. It mustn't be counted twice.
+ */
+static void unwrap(struct conn_stash *stash, struct bufferevent *bev)
+{
+	evbuffer_remove_cb(bufferevent_get_input(bev), count_in, stash);
+	evbuffer_remove_cb(bufferevent_get_output(bev), count_out, stash);
+	stash->transport->unwrap(bev);
 }
 
 void conn_stash_destroy(struct conn_stash *stash)
 {
 	struct conn_slot *slot, *tmp;
+	struct warm_target *target;
+	struct connect_to *to;
+
+	metrics_uncollect(count_conns, stash);
 
 	for (slot = stash->conns; slot;) {
 		tmp = slot->next;
-		kill_conn(slot->ssl);
-		free(slot);
+		if (slot->warming != NULL) {
+			unwrap(stash, slot->warming);
+		}
+		stash->transport->close(slot->conn);
+		free_slot(slot);
 		slot = tmp;
 	}
 
+	while ((target = stash->warm) != NULL) {
+		stash->warm = target->next;
+		free(target->host);
+		free(target);
+	}
+
+	while ((to = stash->connect_to) != NULL) {
+		stash->connect_to = to->next;
+		free(to->host);
+		free(to->to_host);
+		free(to);
+	}
+
+	event_free(stash->top_up);
+	event_free(stash->reaper);
 	SSL_CTX_free(stash->ssl_ctx);
 	free(stash);
 }
 
 
-static SSL *fresh_conn(struct conn_stash *stash, const char *host, int port)
+int conn_stash_connect_to(struct conn_stash *stash, const char *host, int port,
+			  const char *to_host, int to_port)
+{
+	struct connect_to *to;
+
+	if ((to = malloc(sizeof(*to))) == NULL) {
+		return errno;
+	}
+
+	to->host = strdup(host);
+	to->to_host = strdup(to_host);
+	if (to->host == NULL || to->to_host == NULL) {
+		free(to->host);
+		free(to->to_host);
+		free(to);
+		return ENOMEM;
+	}
+	to->port = port;
+	to->to_port = to_port;
+
+	to->next = stash->connect_to;
+	stash->connect_to = to;
+
+	verbose(NORMAL, "%s(): %s:%d goes to %s:%d\n",
+		__func__, host, port, to_host, to_port);
+	return 0;
+}
+
+int conn_stash_ktls(struct conn_stash *stash)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	SSL_CTX_set_options(stash->ssl_ctx, SSL_OP_ENABLE_KTLS);
+	stash->ktls = 1;
+	return 0;
+#else
+	return ENOTSUP;
+#endif
+}
+
+int conn_stash_h2(struct conn_stash *stash)
+{
+	/* Only TLS has ALPN, and h2 is all about keeping connections */
+	if (stash->transport != &conn_transport_tls || stash->no_keepalive) {
+		return ENOTSUP;
+	}
+
+	stash->h2 = 1;
+	return 0;
+}
+
+void conn_stash_pair_server(struct conn_stash *stash, conn_pair_accept_cb cb,
+			    void *arg)
+{
+	stash->pair_accept = cb;
+	stash->pair_arg = arg;
+}
+
+/*
+ * The connection still belongs to host:port as far as the stash and
+ * SNI are concerned, even if it goes somewhere else.
+ *
+ * Only those handed out to someone who's waiting for them to come up
+ * may offer h2. The others have an HTTP/1.1 request written to them
+ * before anyone knows, or sit idle in the stash, which a server that
+ * speaks h2 doesn't let them do: its SETTINGS would have them look
+ * dead.
+ */
+static void *fresh_conn(struct conn_stash *stash, const char *host, int port,
+			int h2)
+{
+	struct connect_to *to;
+	const char *addr;
+
+	addr = host;
+	for (to = stash->connect_to; to; to = to->next) {
+		if (to->port == port && strcmp(to->host, host) == 0) {
+			addr = to->to_host;
+			port = to->to_port;
+			break;
+		}
+	}
+
+	return stash->transport->open(stash, host, addr, port, h2);
+}
+
+/*
+ * TLS, over OpenSSL's own connect BIO. The connection is the SSL.
+ */
+static void *tls_open(struct conn_stash *stash, const char *host,
+		      const char *addr, int port, int h2)
 {
+	struct in6_addr in6;
+	char service[16];
 	BIO *bio;
 	SSL *ssl;
 
@@ -95,9 +431,11 @@ static SSL *fresh_conn(struct conn_stash *stash, const char *host, int port)
 		return NULL;
 	}
 
+	/* Both are copied */
+	snprintf(service, sizeof(service), "%d", port);
 	BIO_set_nbio(bio, 1);
-	BIO_set_conn_hostname(bio, host);
-	BIO_set_conn_int_port(bio, &port);
+	BIO_set_conn_hostname(bio, addr);
+	BIO_set_conn_port(bio, service);
 
 	ssl = SSL_new(stash->ssl_ctx);
 	if (ssl == NULL) {
@@ -105,12 +443,419 @@ static SSL *fresh_conn(struct conn_stash *stash, const char *host, int port)
 		return NULL;
 	}
 
+	/* No SNI for address literals */
+	if (inet_pton(AF_INET, host, &in6) != 1 &&
+	    inet_pton(AF_INET6, host, &in6) != 1) {
+		SSL_set_tlsext_host_name(ssl, host);
+	}
+	if (h2 && SSL_set_alpn_protos(ssl, alpn_h2, sizeof(alpn_h2) - 1) != 0) {
+		BIO_free(bio);
+		SSL_free(ssl);
+		return NULL;
+	}
 	SSL_set_bio(ssl, bio, bio);
 	SSL_connect(ssl);
+	metric_add(stash->handshakes, 1);
 
 	return ssl;
 }
 
+static struct bufferevent *tls_wrap(struct conn_stash *stash, void *conn,
+				    int connecting)
+{
+	return bufferevent_openssl_socket_new(stash->event_base, -1, conn,
+					      connecting
+					      ? BUFFEREVENT_SSL_CONNECTING
+					      : BUFFEREVENT_SSL_OPEN,
+					      0);
+}
+
+static int tls_owns(void *conn, struct bufferevent *bev)
+{
+	return bufferevent_openssl_get_ssl(bev) == conn;
+}
+
+/*
+ * A connection sitting idle in the stash has nothing to say to us.
+ * If it's readable, the other end has either closed it or sent an
+ * alert on its way out. Either way it's of no use any more.
+ *
+ * Except for TLS 1.3 session tickets, which the server may send any
+ * time after the handshake. SSL_peek() eats those, and only says
+ * there's something to read if it's actual data or a close.
+ */
+static int tls_alive(void *conn)
+{
+	SSL *ssl = conn;
+	char c;
+	int fd;
+	ssize_t n;
+
+	if (SSL_pending(ssl) > 0) {
+		return 0;
+	}
+
+	if ((fd = SSL_get_fd(ssl)) < 0) {
+		return 0;
+	}
+
+	n = recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 1;
+	}
+
+	if (n > 0) {
+		ERR_clear_error();
+		n = SSL_peek(ssl, &c, 1);
+		if (n <= 0 && SSL_get_error(ssl, n) == SSL_ERROR_WANT_READ) {
+			return 1;
+		}
+		ERR_clear_error();
+	}
+
+	verbose(VERBOSE, "%s(): fd %d is %s\n", __func__, fd,
+		n == 0 ? "at EOF" : n > 0 ? "readable" : strerror(errno));
+	return 0;
+}
+
+static void tls_close(void *conn)
+{
+	SSL *ssl = conn;
+
+	(void)BIO_set_close(SSL_get_wbio(ssl), 1);
+	SSL_free(ssl);
+}
+
+static const char *tls_protocol(struct bufferevent *bev)
+{
+	static char proto[32];
+	const unsigned char *data;
+	unsigned int len;
+	SSL *ssl;
+
+	ssl = bufferevent_openssl_get_ssl(bev);
+	if (!SSL_is_init_finished(ssl)) {
+		return NULL;
+	}
+
+	SSL_get0_alpn_selected(ssl, &data, &len);
+	if (len == 0 || len >= sizeof(proto)) {
+		return "http/1.1";
+	}
+
+	memcpy(proto, data, len);
+	proto[len] = '\0';
+	return proto;
+}
+
+/*
+ * With kernel TLS, OpenSSL hands the keys to the kernel once the
+ * handshake is done, if the kernel takes them, and records are
+ * encrypted and decrypted there from then on. The bufferevent stays
+ * an SSL one: records that aren't data, TLS 1.3 session tickets and
+ * alerts, still come up to OpenSSL, and a plain socket would choke on
+ * them.
+ *
+ * If the kernel won't, for want of the tls module or of support for
+ * the cipher, the connection just carries on in userspace.
+ */
+static void tls_connected(struct conn_stash *stash, struct bufferevent *bev)
+{
+	SSL *ssl;
+	int send, recv;
+
+	if (!stash->ktls || (ssl = bufferevent_openssl_get_ssl(bev)) == NULL) {
+		return;
+	}
+
+	/* Same as conn_stash_ktls(), stash->ktls is never set otherwise */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+	recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+	send = recv = 0;
+#endif
+
+	if (send) {
+		metric_add(stash->ktls_send, 1);
+	}
+	if (recv) {
+		metric_add(stash->ktls_recv, 1);
+	}
+
+	if (!send && !recv && !stash->ktls_missed) {
+		stash->ktls_missed = 1;
+		verbose(NORMAL, "%s(): no kernel TLS for %s, it stays in userspace\n",
+			__func__, SSL_get_cipher_name(ssl));
+	} else {
+		verbose(VERBOSE, "%s(): kernel TLS: send %s, receive %s\n",
+			__func__, send ? "yes" : "no", recv ? "yes" : "no");
+	}
+}
+
+const struct conn_transport conn_transport_tls = {
+	.name = "tls",
+	.open = tls_open,
+	.wrap = tls_wrap,
+	.unwrap = bufferevent_free,
+	.owns = tls_owns,
+	.alive = tls_alive,
+	.close = tls_close,
+	.protocol = tls_protocol,
+	.connected = tls_connected,
+};
+
+/*
+ * Plain TCP, for when something in front of us does the TLS. The
+ * socket is made and the name looked up right away, and blocking,
+ * like the connect BIO does. Connecting happens in the bufferevent.
+ */
+struct tcp_conn {
+	evutil_socket_t fd;
+	struct sockaddr_storage addr;
+	ev_socklen_t addrlen;
+};
+
+static void *tcp_open(struct conn_stash *stash, const char *host,
+		      const char *addr, int port, int h2)
+{
+	struct evutil_addrinfo hints, *ai;
+	struct tcp_conn *conn;
+	char service[16];
+	int one = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof(service), "%d", port);
+
+	if (evutil_getaddrinfo(addr, service, &hints, &ai) != 0) {
+		verbose(ERROR, "%s(): can't resolve %s\n", __func__, addr);
+		return NULL;
+	}
+
+	if ((conn = malloc(sizeof(*conn))) == NULL) {
+		evutil_freeaddrinfo(ai);
+		return NULL;
+	}
+	memcpy(&conn->addr, ai->ai_addr, ai->ai_addrlen);
+	conn->addrlen = ai->ai_addrlen;
+
+	conn->fd = socket(ai->ai_family, SOCK_STREAM, 0);
+	evutil_freeaddrinfo(ai);
+	if (conn->fd < 0) {
+		free(conn);
+		return NULL;
+	}
+
+	evutil_make_socket_nonblocking(conn->fd);
+	evutil_make_socket_closeonexec(conn->fd);
+	/* Requests go out in one piece anyway, and Nagle would only
+	 * hold the next one on a kept-alive connection back.
+	 */
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return conn;
+}
+
+static struct bufferevent *tcp_wrap(struct conn_stash *stash, void *arg,
+				    int connecting)
+{
+	struct tcp_conn *conn = arg;
+	struct bufferevent *bev;
+
+	bev = bufferevent_socket_new(stash->event_base, conn->fd, 0);
+	if (bev != NULL && connecting &&
+	    bufferevent_socket_connect(bev, (struct sockaddr *)&conn->addr,
+				       conn->addrlen) != 0) {
+		bufferevent_free(bev);
+		return NULL;
+	}
+
+	return bev;
+}
+
+static int tcp_owns(void *arg, struct bufferevent *bev)
+{
+	struct tcp_conn *conn = arg;
+
+	return bufferevent_getfd(bev) == conn->fd;
+}
+
+static int tcp_alive(void *arg)
+{
+	struct tcp_conn *conn = arg;
+	char c;
+	ssize_t n;
+
+	n = recv(conn->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+	return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void tcp_close(void *arg)
+{
+	struct tcp_conn *conn = arg;
+
+	evutil_closesocket(conn->fd);
+	free(conn);
+}
+
+static const char *plain_protocol(struct bufferevent *bev)
+{
+	return "http/1.1";
+}
+
+const struct conn_transport conn_transport_tcp = {
+	.name = "tcp",
+	.open = tcp_open,
+	.wrap = tcp_wrap,
+	.unwrap = bufferevent_free,
+	.owns = tcp_owns,
+	.alive = tcp_alive,
+	.close = tcp_close,
+	.protocol = plain_protocol,
+};
+
+/*
+ * One end of a bufferevent pair, the other end of which went to
+ * whoever conn_stash_pair_server() says. Nothing leaves the process.
+ * The bufferevent is the connection, so it's handed out as is.
+ */
+static void *pair_open(struct conn_stash *stash, const char *host,
+		       const char *addr, int port, int h2)
+{
+	struct bufferevent *pair[2];
+
+	if (stash->pair_accept == NULL) {
+		verbose(ERROR, "%s(): nobody to connect %s:%d to\n",
+			__func__, host, port);
+		return NULL;
+	}
+
+	if (bufferevent_pair_new(stash->event_base, 0, pair) != 0) {
+		return NULL;
+	}
+
+	stash->pair_accept(pair[1], host, port, stash->pair_arg);
+	return pair[0];
+}
+
+static struct bufferevent *pair_wrap(struct conn_stash *stash, void *conn,
+				     int connecting)
+{
+	struct bufferevent *bev = conn;
+
+	if (connecting) {
+		/* Like any other transport would, once the callbacks
+		 * are in place.
+		 */
+		bufferevent_trigger_event(bev, BEV_EVENT_CONNECTED,
+					  BEV_TRIG_DEFER_CALLBACKS);
+	}
+
+	return bev;
+}
+
+static void pair_unwrap(struct bufferevent *bev)
+{
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	bufferevent_disable(bev, EV_READ|EV_WRITE);
+}
+
+static int pair_owns(void *conn, struct bufferevent *bev)
+{
+	return conn == bev;
+}
+
+static int pair_alive(void *conn)
+{
+	struct bufferevent *bev = conn;
+
+	return bufferevent_pair_get_partner(bev) != NULL &&
+		evbuffer_get_length(bufferevent_get_input(bev)) == 0;
+}
+
+static void pair_close(void *conn)
+{
+	/* The other end sees EOF */
+	bufferevent_free(conn);
+}
+
+const struct conn_transport conn_transport_pair = {
+	.name = "pair",
+	.open = pair_open,
+	.wrap = pair_wrap,
+	.unwrap = pair_unwrap,
+	.owns = pair_owns,
+	.alive = pair_alive,
+	.close = pair_close,
+	.protocol = plain_protocol,
+};
+
+/*
+ * Every connection we hand out gets a slot right away, so we always
+ * know where it goes. Asking the BIO isn't reliable across OpenSSL
+ * versions.
+ */
+static struct conn_slot *new_slot(struct conn_stash *stash, void *conn,
+				  const char *host, int port)
+{
+	struct conn_slot *slot;
+
+	if ((slot = malloc(sizeof(*slot))) == NULL) {
+		return NULL;
+	}
+	memset(slot, 0, sizeof(*slot));
+
+	if ((slot->host = strdup(host)) == NULL) {
+		free(slot);
+		return NULL;
+	}
+	slot->port = port;
+	slot->conn = conn;
+	slot->status = IN_USE;
+	slot->stash = stash;
+
+	slot->next = stash->conns;
+	stash->conns = slot;
+
+	return slot;
+}
+
+static struct conn_slot **find_slot(struct conn_stash *stash, void *conn)
+{
+	struct conn_slot **slotp;
+
+	for (slotp = &stash->conns; *slotp && (*slotp)->conn != conn; slotp = &(*slotp)->next)
+		;
+
+	return slotp;
+}
+
+/* The slot of the connection under bev, NULL if it isn't ours */
+static struct conn_slot **find_slot_bev(struct conn_stash *stash,
+					struct bufferevent *bev)
+{
+	struct conn_slot **slotp;
+
+	for (slotp = &stash->conns; *slotp &&
+		     !stash->transport->owns((*slotp)->conn, bev); slotp = &(*slotp)->next)
+		;
+
+	return slotp;
+}
+
+static void forget_slot(struct conn_stash *stash, void *conn)
+{
+	struct conn_slot **slotp, *slot;
+
+	slotp = find_slot(stash, conn);
+	if ((slot = *slotp) != NULL) {
+		*slotp = slot->next;
+		free_slot(slot);
+	}
+}
+
 static int match_stashed(struct conn_slot *slot, const char *host, int port)
 {
 	return
@@ -119,162 +864,370 @@ static int match_stashed(struct conn_slot *slot, const char *host, int port)
 		strcmp(slot->host, host) == 0;
 }
 
-static SSL *get_stashed_conn(struct conn_stash *stash, const char *host, int port)
+static void *get_stashed_conn(struct conn_stash *stash, const char *host, int port)
+{
+	void *conn;
+	struct conn_slot **slotp, *slot;
+
+	conn = NULL;
+	slotp = &stash->conns;
+	while (!conn && (slot = *slotp) != NULL) {
+		if (!match_stashed(slot, host, port)) {
+			slotp = &slot->next;
+		} else if (!stash->transport->alive(slot->conn)) {
+			*slotp = slot->next;
+			stash->transport->close(slot->conn);
+			free_slot(slot);
+		} else {
+			slot->status = IN_USE;
+			conn = slot->conn;
+		}
+	}
+
+	verbose(FIREHOSE, "%s(): stashed conn: %p\n", __func__, conn);
+	return conn;
+
+}
+
+static struct warm_target *find_target(struct conn_stash *stash,
+				       const char *host, int port)
+{
+	struct warm_target *target;
+
+	for (target = stash->warm; target; target = target->next) {
+		if (target->port == port && strcmp(target->host, host) == 0) {
+			break;
+		}
+	}
+
+	return target;
+}
+
+/* Idle connections, and those on their way to becoming one */
+static int count_idle(struct conn_stash *stash, const char *host, int port)
 {
-	SSL *ssl;
 	struct conn_slot *slot;
+	int n = 0;
 
-	for (ssl = NULL, slot = stash->conns; !ssl && slot; slot = slot->next) {
-		if (match_stashed(slot, host, port)) {
-			slot->status = IN_USE;
-			ssl = slot->ssl;
+	for (slot = stash->conns; slot; slot = slot->next) {
+		if (slot->status != IN_USE &&
+		    slot->port == port &&
+		    strcmp(slot->host, host) == 0) {
+			n++;
 		}
 	}
 
-	verbose(FIREHOSE, "%s(): stashed conn: %p\n", __func__, ssl);
-	return ssl;
+	return n;
+}
 
+static void schedule_top_up(struct conn_stash *stash, int delay)
+{
+	struct timeval tv = { delay, 0 };
+
+	if (stash->warm != NULL && !evtimer_pending(stash->top_up, NULL)) {
+		evtimer_add(stash->top_up, &tv);
+	}
 }
 
-static void fill_slot_info(struct conn_slot *slot, SSL *ssl)
+static void arm_reaper(struct conn_stash *stash)
 {
-	BIO *bio;
+	struct timeval tv;
 
-	bio = SSL_get_wbio(ssl);
+	if (!evutil_timerisset(&stash->idle_timeout) ||
+	    evtimer_pending(stash->reaper, NULL)) {
+		return;
+	}
 
-	slot->host = BIO_get_conn_hostname(bio);
-	BIO_ctrl(bio, BIO_C_GET_CONNECT, 3, &slot->port);
+	/* Check twice per timeout, so nothing overstays by much */
+	tv.tv_sec = stash->idle_timeout.tv_sec / 2;
+	tv.tv_usec = stash->idle_timeout.tv_sec % 2 ? 500000 : 0;
+	evtimer_add(stash->reaper, &tv);
+}
 
-	slot->ssl = ssl;
+/*
+ * Warm targets keep their minimum of idle connections no matter how
+ * long they've been sitting there, as long as they're still alive.
+ */
+static int keep_idle(struct conn_stash *stash, struct conn_slot *slot)
+{
+	struct warm_target *target;
+
+	target = find_target(stash, slot->host, slot->port);
+	if (target == NULL ||
+	    count_idle(stash, slot->host, slot->port) > target->min_idle) {
+		return 0;
+	}
+
+	return stash->transport->alive(slot->conn);
 }
 
-static void put_stashed_conn(struct conn_stash *stash, SSL *ssl)
+static void reap_idle(evutil_socket_t fd, short what, void *arg)
 {
-	struct conn_slot **slotp;
-	for (slotp = &stash->conns; *slotp && (*slotp)->ssl != ssl; slotp = &(*slotp)->next)
-		;
+	struct conn_stash *stash = arg;
+	struct conn_slot **slotp, *slot;
+	struct timeval now, idle;
+	int left, reaped;
+
+	evutil_gettimeofday(&now, NULL);
+
+	left = reaped = 0;
+	slotp = &stash->conns;
+	while ((slot = *slotp) != NULL) {
+		if (slot->status == FREE) {
+			evutil_timersub(&now, &slot->idle_since, &idle);
+			if (evutil_timercmp(&idle, &stash->idle_timeout, >=) &&
+			    !keep_idle(stash, slot)) {
+				verbose(VERBOSE, "%s(): closing idle connection to %s:%d\n",
+					__func__, slot->host, slot->port);
+				*slotp = slot->next;
+				stash->transport->close(slot->conn);
+				free_slot(slot);
+				reaped++;
+				continue;
+			}
+			left++;
+		}
+		slotp = &slot->next;
+	}
 
-	if (*slotp) {
-		(*slotp)->status = FREE;
-	} else {
-		*slotp = malloc(sizeof(**slotp));
-		fill_slot_info(*slotp, ssl);
-		(*slotp)->next = NULL;
-		(*slotp)->status = FREE;
+	if (left > 0) {
+		arm_reaper(stash);
+	}
+
+	if (reaped > 0) {
+		schedule_top_up(stash, 0);
 	}
 }
 
-static void replace_stashed_conn(struct conn_stash *stash, SSL *old, SSL *new)
+static void warm_event(struct bufferevent *bev, short what, void *arg)
 {
-	struct conn_slot **slotp, **prevp;
+	struct conn_slot *slot = arg;
+	struct conn_stash *stash = slot->stash;
+
+	slot->warming = NULL;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		verbose(VERBOSE, "%s(): warm connection to %s:%d ready\n",
+			__func__, slot->host, slot->port);
+		conn_stash_connected(stash, bev);
+		unwrap(stash, bev);
+		slot->status = FREE;
+		evutil_gettimeofday(&slot->idle_since, NULL);
+		arm_reaper(stash);
+		return;
+	}
+
+	verbose(ERROR, "%s(): warming up %s:%d failed\n",
+		__func__, slot->host, slot->port);
+	conn_stash_drop_bev(stash, bev);
+	schedule_top_up(stash, WARM_RETRY_SECS);
+}
+
+static int warm_one(struct conn_stash *stash, struct warm_target *target)
+{
+	struct conn_slot *slot;
+	void *conn;
 
-	slotp = prevp = &stash->conns;
-	while (*slotp && (*slotp)->ssl != old) {
-		prevp = slotp;
-		slotp = &(*slotp)->next;
+	if ((conn = fresh_conn(stash, target->host, target->port, 0)) == NULL) {
+		return ENOTCONN;
 	}
 
-	if (*slotp) {
-		if (new != NULL) {
-			fill_slot_info(*slotp, new);
-		} else {
-			*prevp = (*slotp)->next;
-			free(*slotp);
+	if ((slot = new_slot(stash, conn, target->host, target->port)) == NULL) {
+		stash->transport->close(conn);
+		return ENOMEM;
+	}
+
+	slot->status = WARMING;
+	slot->warming = wrap(stash, conn, 1);
+	if (slot->warming == NULL) {
+		forget_slot(stash, conn);
+		stash->transport->close(conn);
+		return ENOMEM;
+	}
+
+	bufferevent_setcb(slot->warming, NULL, NULL, warm_event, slot);
+	return 0;
+}
+
+static void top_up(evutil_socket_t fd, short what, void *arg)
+{
+	struct conn_stash *stash = arg;
+	struct warm_target *target;
+	int n;
+
+	for (target = stash->warm; target; target = target->next) {
+		n = count_idle(stash, target->host, target->port);
+		for (; n < target->min_idle; n++) {
+			verbose(VERBOSE, "%s(): warming up %s:%d (%d/%d)\n",
+				__func__, target->host, target->port,
+				n + 1, target->min_idle);
+			if (warm_one(stash, target) != 0) {
+				schedule_top_up(stash, WARM_RETRY_SECS);
+				break;
+			}
+		}
+	}
+}
+
+int conn_stash_warm(struct conn_stash *stash, const char *host, int port,
+		    int min_idle)
+{
+	struct warm_target *target;
+
+	if (stash->no_keepalive || min_idle <= 0) {
+		return 0;
+	}
+
+	if ((target = find_target(stash, host, port)) == NULL) {
+		if ((target = malloc(sizeof(*target))) == NULL) {
+			return errno;
+		}
+		if ((target->host = strdup(host)) == NULL) {
+			free(target);
+			return ENOMEM;
 		}
+		target->port = port;
+		target->next = stash->warm;
+		stash->warm = target;
 	}
+	target->min_idle = min_idle;
+
+	/* In the background, once the loop runs */
+	schedule_top_up(stash, 0);
+	return 0;
 }
 
 
 struct bufferevent *conn_stash_get_bev(struct conn_stash *stash,
-				       const char *host, int port)
+				       const char *host, int port,
+				       unsigned int trace)
 {
-	SSL *ssl;
-	enum bufferevent_ssl_state bev_ssl_state;
+	void *conn;
+	int connecting;
+	struct timeval start;
 
-	/* As we don't have keepalive, we'll just return bevs backed
-	 * by fresh SSL connections all the time
-	 */
+	conn = get_stashed_conn(stash, host, port);
 
-	ssl = get_stashed_conn(stash, host, port);
-	if (ssl == NULL) {
-		ssl = fresh_conn(stash, host, port);
-		bev_ssl_state = BUFFEREVENT_SSL_CONNECTING;
+	/* Whichever way it goes, there's now one less idle */
+	if (find_target(stash, host, port) != NULL) {
+		schedule_top_up(stash, 0);
+	}
+
+	if (conn == NULL) {
+		/* Name lookup happens in here, and it blocks */
+		evutil_gettimeofday(&start, NULL);
+		conn = fresh_conn(stash, host, port, stash->h2);
+		trace_span(trace, "resolve", &start, NULL);
+		if (conn != NULL && new_slot(stash, conn, host, port) == NULL) {
+			stash->transport->close(conn);
+			conn = NULL;
+		}
+		connecting = 1;
 	} else {
-		bev_ssl_state = BUFFEREVENT_SSL_OPEN;
+		connecting = 0;
 	}
 
-	if (ssl == NULL) {
+	if (conn == NULL) {
 		return NULL;
 	}
 
-	return bufferevent_openssl_socket_new(stash->event_base, -1, ssl,
-					      bev_ssl_state,
-					      0);
+	return wrap(stash, conn, connecting);
 }
 
 void conn_stash_put_bev(struct conn_stash *stash, struct bufferevent *bev)
 {
-	SSL *ssl;
+	struct conn_slot *slot;
 
-	ssl = bufferevent_openssl_get_ssl(bev);
+	slot = *find_slot_bev(stash, bev);
 
-	if (stash->no_keepalive) {
-		kill_conn(ssl);
-	} else {
-		put_stashed_conn(stash, ssl);
+	if (stash->no_keepalive || slot == NULL) {
+		conn_stash_drop_bev(stash, bev);
+		return;
 	}
-	bufferevent_free(bev);
+
+	slot->status = FREE;
+	evutil_gettimeofday(&slot->idle_since, NULL);
+	arm_reaper(stash);
+
+	unwrap(stash, bev);
 }
 
+void conn_stash_drop_bev(struct conn_stash *stash, struct bufferevent *bev)
+{
+	struct conn_slot **slotp, *slot;
+
+	/* Forget it if it was ever stashed, and close it for good.
+	 * The bufferevent goes first, it still has the socket
+	 * registered with the event base.
+	 */
+	slotp = find_slot_bev(stash, bev);
+	if ((slot = *slotp) == NULL) {
+		verbose(ERROR, "%s(): connection %p is not ours\n",
+			__func__, bev);
+		bufferevent_free(bev);
+		return;
+	}
+	*slotp = slot->next;
+
+	unwrap(stash, bev);
+	stash->transport->close(slot->conn);
+	free_slot(slot);
+}
 
 int conn_stash_reconnect(struct conn_stash *stash, struct bufferevent **bevp)
 {
-	SSL *old_ssl;
-	SSL *ssl;
-	BIO *bio;
-	const char *host;
-	int port;
-	int err;
-
-	ssl = bufferevent_openssl_get_ssl(*bevp);
-	bio = SSL_get_wbio(ssl);
+	struct conn_slot *slot;
+	void *old_conn;
+	void *conn;
 
-	BIO_ctrl(bio, BIO_C_GET_CONNECT, 0, &host);
-	BIO_ctrl(bio, BIO_C_GET_CONNECT, 3, &port);
+	if ((slot = *find_slot_bev(stash, *bevp)) == NULL) {
+		verbose(ERROR, "%s(): connection %p is not ours\n",
+			__func__, *bevp);
+		return ENOTCONN;
+	}
+	old_conn = slot->conn;
 
 	verbose(NORMAL, "%s(): reconnecting to %s:%d\n",
-		__func__, host, port);
+		__func__, slot->host, slot->port);
 
-	old_ssl = ssl;
+	conn = fresh_conn(stash, slot->host, slot->port, 0);
+	if (conn == NULL) {
+		verbose(ERROR, "%s(): could not connect to %s:%d: %d %s\n",
+			__func__, slot->host, slot->port, errno, strerror(errno));
+		return ENOTCONN;
+	}
 
-	ssl = fresh_conn(stash, host, port);
+	verbose(VERBOSE, "%s(): reconnected to %s:%d\n",
+		__func__, slot->host, slot->port);
 
-	replace_stashed_conn(stash, old_ssl, ssl);
+	slot->conn = conn;
 
-	if (ssl != NULL) {
-		verbose(VERBOSE, "%s(): reconnected to %s:%d\n",
-			__func__, host, port);
+	/* get rid of the old bufferevent, and the leftovers */
+	unwrap(stash, *bevp);
+	stash->transport->close(old_conn);
 
-		/* get rid of the old bufferevent */
-		bufferevent_free(*bevp);
-
-		*bevp = bufferevent_openssl_socket_new(stash->event_base, -1, ssl,
-						       BUFFEREVENT_SSL_CONNECTING,
-						       0);
-		err = 0;
-	} else {
-		verbose(ERROR, "%s(): could not connect to %s:%d: %d %s\n",
-			__func__, host, port, errno, strerror(errno));
-		err = ENOTCONN;
+	*bevp = wrap(stash, conn, 1);
+	if (*bevp == NULL) {
+		forget_slot(stash, conn);
+		stash->transport->close(conn);
+		return ENOMEM;
 	}
 
-	/* Get rid of the old SSL leftovers */
-	(void)BIO_set_close(bio, 1);
-	SSL_free(old_ssl);
+	return 0;
+}
 
-	return err;
+
+const char *conn_stash_protocol(struct conn_stash *stash, struct bufferevent *bev)
+{
+	return stash->transport->protocol(bev);
 }
 
+void conn_stash_connected(struct conn_stash *stash, struct bufferevent *bev)
+{
+	if (stash->transport->connected != NULL) {
+		stash->transport->connected(stash, bev);
+	}
+}
 
 int conn_stash_is_keepalive(struct conn_stash *stash)
 {
@@ -5,20 +5,98 @@
 
 struct conn_stash;
 
+/*
+ * What connections are made of. TLS is the default. Plain TCP is for
+ * when something local, a sidecar, does the TLS for us. Pairs don't
+ * leave the process at all, see conn_stash_pair_server().
+ */
+struct conn_transport;
+
+extern const struct conn_transport conn_transport_tls;
+extern const struct conn_transport conn_transport_tcp;
+extern const struct conn_transport conn_transport_pair;
+
+/*
+ * Connections handed back with conn_stash_put_bev() are closed after
+ * sitting idle for idle_timeout seconds. Zero keeps them forever.
+ * transport may be NULL for TLS.
+ */
 int conn_stash_init(struct conn_stash **stashp, struct event_base *event_base,
-		    int no_keepalive);
+		    const struct conn_transport *transport,
+		    int no_keepalive, int idle_timeout);
 
 void conn_stash_destroy(struct conn_stash *stash);
 
 
+/*
+ * Connections asked for host:port really go to to_host:to_port.
+ * For pointing us at a local stand-in for Google.
+ */
+int conn_stash_connect_to(struct conn_stash *stash, const char *host, int port,
+			  const char *to_host, int to_port);
+
+/*
+ * Have the kernel do the TLS records, where it can, once handshakes
+ * are done. Connections it won't take stay in userspace. ENOTSUP if
+ * OpenSSL can't do it at all.
+ */
+int conn_stash_ktls(struct conn_stash *stash);
+
+/*
+ * Offer h2 as well as HTTP/1.1 over ALPN on new connections handed
+ * out by conn_stash_get_bev(). Which one it's to be is known once
+ * they're up, see conn_stash_protocol(). Those that speak h2 are
+ * never to be put back. ENOTSUP if it's not TLS, or connections
+ * aren't kept.
+ */
+int conn_stash_h2(struct conn_stash *stash);
+
+/*
+ * With conn_transport_pair, the far end of every new connection goes
+ * to cb, which serves it on the same event base and frees it when
+ * done. Freeing our end shows up there as EOF, and the other way
+ * round.
+ */
+typedef void (*conn_pair_accept_cb)(struct bufferevent *bev,
+				    const char *host, int port, void *arg);
+
+void conn_stash_pair_server(struct conn_stash *stash, conn_pair_accept_cb cb,
+			    void *arg);
+
+/*
+ * Keep at least min_idle connections to host:port handshaken and
+ * ready in the stash. They're opened in the background, and replaced
+ * as they're used up, found dead or evicted.
+ */
+int conn_stash_warm(struct conn_stash *stash, const char *host, int port,
+		    int min_idle);
+
+/* trace is the trace id to record connection setup spans under */
 struct bufferevent *conn_stash_get_bev(struct conn_stash *stash,
 				       const char *host,
-				       int port);
+				       int port,
+				       unsigned int trace);
 
+/* Only for connections that are good for another request */
 void conn_stash_put_bev(struct conn_stash *stash, struct bufferevent *bev);
 
+/* Like conn_stash_put_bev(), but the connection is closed instead of
+ * kept around for reuse.
+ */
+void conn_stash_drop_bev(struct conn_stash *stash, struct bufferevent *bev);
+
+/*
+ * A fresh connection in place of *bevp, to the same place. If it can't
+ * be had, *bevp is still there, or NULL if it's gone already.
+ */
 int conn_stash_reconnect(struct conn_stash *stash, struct bufferevent **bevp);
 
+/* What ALPN settled on. NULL while it's still connecting. */
+const char *conn_stash_protocol(struct conn_stash *stash, struct bufferevent *bev);
+
+/* To be called when a connection comes up */
+void conn_stash_connected(struct conn_stash *stash, struct bufferevent *bev);
+
 int conn_stash_is_keepalive(struct conn_stash *stash);
 
 #endif
@@ -10,6 +10,9 @@
 #include <expat.h>
 
 #include "verbose.h"
+#include "metrics.h"
+#include "trace.h"
+#include "arena.h"
 
 /* Fields we're interested in. Now, the code that actually figures out
  * we're interested in something can't really stand daylight..
@@ -30,6 +33,9 @@ enum {
 
 struct feed {
 
+	/* Where it came from, NULL for malloc() */
+	struct arena *arena;
+
 	XML_Parser parser;
 	struct evbuffer *sink;
 	int header_sent;
@@ -40,6 +46,10 @@ struct feed {
 	int in_entry;
 	char *fields[F__COUNT];
 	struct evbuffer *cdata_buf;
+
+	unsigned int trace;
+
+	struct metric *entries;
 };
 
 static void XMLCALL cdata(void *user_data, const char *s, int len)
@@ -229,31 +239,28 @@ static void send_navi(struct feed *feed)
 	evbuffer_add_printf(feed->sink, "</div>");
 }
 
-static char *amp_to_amp(char *to, size_t sz, const char *from)
+char *feed_escape_amp(char *to, size_t sz, const char *from)
 {
-	int ind = 0;
-
-	while (from && *from && ind < sz) {
+	size_t ind = 0, need;
+
+	while (from && *from) {
+		need = *from == '&' ? 5 : 1;
+		if (ind + need >= sz) {
+			verbose(ERROR, "%s(): player links grow tall here."
+				" I had to truncate this: '%s'\n",
+				__func__, from);
+			break;
+		}
 		if (*from == '&') {
-			to[ind++] = '&';
-			to[ind++] = 'a';
-			to[ind++] = 'm';
-			to[ind++] = 'p';
-			to[ind++] = ';';
+			memcpy(to + ind, "&amp;", 5);
 		} else {
-			to[ind++] = *from;
+			to[ind] = *from;
 		}
+		ind += need;
 		from++;
 	}
 
-	if (ind == sz) {
-		verbose(ERROR, "%s(): player links grow tall here."
-			" I had to truncate this: '%s'\n",
-			__func__, from);
-		ind = sz-1;
-	}
-
-	to[ind++] = '\0';
+	to[ind] = '\0';
 	return to;
 }
 
@@ -270,7 +277,7 @@ static void flush_element(struct feed *feed)
 	 * But our fancy unit... massive expat-using html-parsing test
 	 * thing is picky.
 	 */
-	amp_to_amp(clean_player, sizeof(clean_player), feed->fields[F_PLAYER]);
+	feed_escape_amp(clean_player, sizeof(clean_player), feed->fields[F_PLAYER]);
 
 	evbuffer_add_printf(feed->sink,
 			    "<div class='entry'>\n"
@@ -314,7 +321,13 @@ static void XMLCALL element_end(void *user_data, const char *element)
 	int cdata_target;
 
 	if (strcmp("entry", element) == 0) {
+		struct timeval start;
+
+		/* Nests inside the "parse" span it's called from */
+		gettimeofday(&start, NULL);
 		flush_element(feed);
+		trace_span(feed->trace, "render", &start, NULL);
+		metric_add(feed->entries, 1);
 		clear_fields(feed);
 		if (feed->cdata_buf != NULL) {
 			evbuffer_free(feed->cdata_buf);
@@ -329,14 +342,18 @@ static void XMLCALL element_end(void *user_data, const char *element)
 }
 
 
-int feed_init(struct feed **feedp, struct evbuffer *sink)
+int feed_init(struct feed **feedp, struct evbuffer *sink, struct arena *arena)
 {
 	struct feed *feed;
 
-	if ((feed = malloc(sizeof(*feed))) == NULL) {
+	feed = arena != NULL
+		? arena_alloc(arena, sizeof(*feed))
+		: malloc(sizeof(*feed));
+	if (feed == NULL) {
 		return ENOMEM;
 	}
 	memset(feed, 0, sizeof(*feed));
+	feed->arena = arena;
 
 	feed->parser = XML_ParserCreate(NULL);
 	XML_SetUserData(feed->parser, feed);
@@ -344,11 +361,18 @@ int feed_init(struct feed **feedp, struct evbuffer *sink)
 	XML_SetCharacterDataHandler(feed->parser, cdata);
 
 	feed->sink = sink;
+	feed->entries = metric_counter("yt_history_feed_entries_total",
+				       "Feed entries parsed", NULL);
 
 	*feedp = feed;
 	return 0;
 
 }
+void feed_trace(struct feed *feed, unsigned int trace)
+{
+	feed->trace = trace;
+}
+
 void feed_destroy(struct feed *feed)
 {
 	if (feed != NULL) {
@@ -360,7 +384,9 @@ void feed_destroy(struct feed *feed)
 		}
 
 		clear_fields(feed);
-		free(feed);
+		if (feed->arena == NULL) {
+			free(feed);
+		}
 	}
 }
 
@@ -405,8 +431,11 @@ static const char *FOOTER = "\n</body></html>\n";
 int feed_consume(struct feed *feed, struct evbuffer *buf)
 {
 	char input[1024];
+	struct timeval start;
 	int removed;
 
+	gettimeofday(&start, NULL);
+
 	if (!feed->header_sent) {
 		evbuffer_add(feed->sink, HEADER, strlen(HEADER));
 		feed->header_sent++;
@@ -417,6 +446,8 @@ int feed_consume(struct feed *feed, struct evbuffer *buf)
 		/* TODO: Handle error. */
 	}
 
+	trace_span(feed->trace, "parse", &start, NULL);
+
 	return 0;
 }
 
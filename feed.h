@@ -8,12 +8,24 @@
 #include <event2/buffer.h>
 
 struct feed;
+struct arena;
 
-int feed_init(struct feed **feedp, struct evbuffer *sink);
+/* With an arena, the feed is carved out of it, and has to be destroyed
+ * before the arena goes. NULL to have it malloc()ed.
+ */
+int feed_init(struct feed **feedp, struct evbuffer *sink, struct arena *arena);
 void feed_destroy(struct feed *feed);
 
+/* Record parsing and rendering spans under this trace id */
+void feed_trace(struct feed *feed, unsigned int trace);
+
 int feed_consume(struct feed *feed, struct evbuffer *buf);
 int feed_final(struct feed *feed);
 
+/* from with its &'s made &amp;, into to. Truncated to fit sz, '\0'
+ * included.
+ */
+char *feed_escape_amp(char *to, size_t sz, const char *from);
+
 #endif
 
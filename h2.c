@@ -0,0 +1,540 @@
+#include "h2.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <event2/event.h>
+#include <nghttp2/nghttp2.h>
+
+#include "verbose.h"
+
+/* How much each stream, and the connection as a whole, may have
+ * coming at us before it's been read. A big history page shouldn't
+ * have to wait for us to say it can go on.
+ */
+#define H2_WINDOW (1 << 20)
+
+/* More than this waiting to go out, and we wait for it to drain */
+#define H2_OUTPUT_MAX (64 * 1024)
+
+struct h2_session {
+	nghttp2_session *ngh;
+	struct bufferevent *bev;
+
+	h2_gone_cb gone;
+	void *arg;
+
+	struct h2_stream *streams;
+	int nstreams;
+
+	/* Inside nghttp2, which mustn't be asked to send from its
+	 * own callbacks. Whatever's submitted meanwhile goes out once
+	 * we're back.
+	 */
+	int busy;
+	int dead;
+};
+
+/* Ours go here, so nothing of a cancelled stream's is ever touched */
+static struct h2_stream *find_stream(struct h2_session *session, int32_t id)
+{
+	struct h2_stream *stream;
+
+	for (stream = session->streams; stream && stream->id != id; stream = stream->next)
+		;
+
+	return stream;
+}
+
+static void unlink_stream(struct h2_stream *stream)
+{
+	struct h2_session *session = stream->session;
+	struct h2_stream **streamp;
+
+	for (streamp = &session->streams; *streamp != stream; streamp = &(*streamp)->next)
+		;
+	*streamp = stream->next;
+	session->nstreams--;
+
+	evbuffer_free(stream->in);
+	stream->in = NULL;
+	stream->next = NULL;
+	stream->session = NULL;
+}
+
+static int on_header(nghttp2_session *ngh, const nghttp2_frame *frame,
+		     const uint8_t *name, size_t namelen,
+		     const uint8_t *value, size_t valuelen,
+		     uint8_t flags, void *user_data)
+{
+	struct h2_session *session = user_data;
+	struct h2_stream *stream;
+
+	if (frame->hd.type != NGHTTP2_HEADERS ||
+	    (stream = find_stream(session, frame->hd.stream_id)) == NULL ||
+	    stream->head_done) {
+		return 0;
+	}
+
+	/* Both come NUL-terminated */
+	if (strcmp((const char *)name, ":status") == 0) {
+		stream->informational = value[0] == '1';
+	}
+	if (!stream->informational) {
+		stream->ops->header((const char *)name, (const char *)value,
+				    stream->arg);
+	}
+
+	return 0;
+}
+
+static int on_frame_recv(nghttp2_session *ngh, const nghttp2_frame *frame,
+			 void *user_data)
+{
+	struct h2_session *session = user_data;
+	struct h2_stream *stream;
+
+	if (frame->hd.type == NGHTTP2_GOAWAY) {
+		verbose(NORMAL, "%s(): server going away, last stream %d, error %u\n",
+			__func__, frame->goaway.last_stream_id,
+			frame->goaway.error_code);
+		return 0;
+	}
+
+	if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) ||
+	    (stream = find_stream(session, frame->hd.stream_id)) == NULL) {
+		return 0;
+	}
+
+	/* The final response has a head of its own */
+	if (frame->hd.type == NGHTTP2_HEADERS) {
+		if (!stream->informational) {
+			stream->head_done = 1;
+		}
+		stream->informational = 0;
+	}
+
+	if (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) {
+		stream->ended = 1;
+	}
+
+	return 0;
+}
+
+static int on_frame_send(nghttp2_session *ngh, const nghttp2_frame *frame,
+			 void *user_data)
+{
+	struct h2_session *session = user_data;
+	struct h2_stream *stream;
+
+	if ((frame->hd.type == NGHTTP2_HEADERS || frame->hd.type == NGHTTP2_DATA) &&
+	    (frame->hd.flags & NGHTTP2_FLAG_END_STREAM) &&
+	    (stream = find_stream(session, frame->hd.stream_id)) != NULL) {
+		stream->ops->sent(stream->arg);
+	}
+
+	return 0;
+}
+
+static int on_data_chunk_recv(nghttp2_session *ngh, uint8_t flags,
+			      int32_t stream_id, const uint8_t *data,
+			      size_t len, void *user_data)
+{
+	struct h2_session *session = user_data;
+	struct h2_stream *stream;
+
+	if ((stream = find_stream(session, stream_id)) == NULL) {
+		return 0;
+	}
+
+	if (evbuffer_add(stream->in, data, len) != 0) {
+		verbose(ERROR, "%s(): out of memory, resetting stream %d\n",
+			__func__, stream_id);
+		nghttp2_submit_rst_stream(ngh, NGHTTP2_FLAG_NONE, stream_id,
+					  NGHTTP2_INTERNAL_ERROR);
+		return 0;
+	}
+
+	stream->ops->data(stream->in, stream->arg);
+	return 0;
+}
+
+static int on_stream_close(nghttp2_session *ngh, int32_t stream_id,
+			   uint32_t error_code, void *user_data)
+{
+	struct h2_session *session = user_data;
+	struct h2_stream *stream;
+	const struct h2_stream_ops *ops;
+	void *arg;
+	size_t len;
+	int err;
+
+	if ((stream = find_stream(session, stream_id)) == NULL) {
+		return 0;
+	}
+
+	switch (error_code) {
+	case NGHTTP2_NO_ERROR:
+		/* A reset that says there's no problem, while the
+		 * response is still coming, is one all the same.
+		 */
+		err = stream->ended ? 0 : ECONNRESET;
+		break;
+	case NGHTTP2_REFUSED_STREAM:
+		err = ECONNREFUSED;
+		break;
+	case NGHTTP2_PROTOCOL_ERROR:
+		err = EPROTO;
+		break;
+	default:
+		err = ECONNRESET;
+		break;
+	}
+
+	verbose(VERBOSE, "%s(): stream %d, error %u\n",
+		__func__, stream_id, error_code);
+
+	/* Force the rest down our consumer's throat, while it's taking */
+	while (err == 0 && (len = evbuffer_get_length(stream->in)) > 0) {
+		stream->ops->data(stream->in, stream->arg);
+		if (evbuffer_get_length(stream->in) == len) {
+			break;
+		}
+	}
+
+	ops = stream->ops;
+	arg = stream->arg;
+	unlink_stream(stream);
+
+	ops->close(err, arg);
+	return 0;
+}
+
+static ssize_t read_body(nghttp2_session *ngh, int32_t stream_id,
+			 uint8_t *buf, size_t length, uint32_t *data_flags,
+			 nghttp2_data_source *source, void *user_data)
+{
+	struct h2_session *session = user_data;
+	struct h2_stream *stream;
+	struct evbuffer_ptr pos;
+	ev_ssize_t n;
+
+	if ((stream = find_stream(session, stream_id)) == NULL ||
+	    evbuffer_ptr_set(stream->body, &pos, stream->body_off,
+			     EVBUFFER_PTR_SET) != 0 ||
+	    (n = evbuffer_copyout_from(stream->body, &pos, buf, length)) < 0) {
+		return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+	}
+
+	stream->body_off += n;
+	if (stream->body_off == evbuffer_get_length(stream->body)) {
+		*data_flags |= NGHTTP2_DATA_FLAG_EOF;
+	}
+
+	return n;
+}
+
+/* Whatever nghttp2 has for the server, into the output buffer */
+static int flush(struct h2_session *session)
+{
+	struct evbuffer *out = bufferevent_get_output(session->bev);
+	const uint8_t *data;
+	ssize_t n;
+	int err;
+
+	err = 0;
+	session->busy = 1;
+	while (evbuffer_get_length(out) < H2_OUTPUT_MAX) {
+		if ((n = nghttp2_session_mem_send(session->ngh, &data)) < 0) {
+			verbose(ERROR, "%s(): %s\n", __func__, nghttp2_strerror(n));
+			err = EPROTO;
+			break;
+		}
+		if (n == 0) {
+			break;
+		}
+		if (evbuffer_add(out, data, n) != 0) {
+			err = ENOMEM;
+			break;
+		}
+	}
+	session->busy = 0;
+
+	return err;
+}
+
+/*
+ * Nobody's getting an answer on it any more. Those still waiting for
+ * one are told, then whoever has the session.
+ */
+static void fail(struct h2_session *session, int err)
+{
+	struct h2_stream *stream;
+	const struct h2_stream_ops *ops;
+	void *arg;
+
+	session->dead = 1;
+
+	while ((stream = session->streams) != NULL) {
+		ops = stream->ops;
+		arg = stream->arg;
+		unlink_stream(stream);
+		ops->close(err, arg);
+	}
+
+	session->gone(session, session->arg);
+}
+
+/* Out with whatever there is to send, unless we're done altogether */
+static void carry_on(struct h2_session *session)
+{
+	int err;
+
+	if ((err = flush(session)) != 0) {
+		fail(session, err);
+		return;
+	}
+
+	if (!nghttp2_session_want_read(session->ngh) &&
+	    !nghttp2_session_want_write(session->ngh)) {
+		verbose(VERBOSE, "%s(): session over\n", __func__);
+		fail(session, ECONNRESET);
+	}
+}
+
+/*
+ * What's been submitted goes out from the write callback, which isn't
+ * run under the caller's feet. Inside the callbacks, it goes out once
+ * nghttp2 is done anyway.
+ */
+static void kick(struct h2_session *session)
+{
+	if (!session->busy) {
+		bufferevent_trigger(session->bev, EV_WRITE,
+				    BEV_TRIG_IGNORE_WATERMARKS |
+				    BEV_TRIG_DEFER_CALLBACKS);
+	}
+}
+
+static void cb_read(struct bufferevent *bev, void *arg)
+{
+	struct h2_session *session = arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	size_t len;
+	ssize_t n;
+
+	session->busy = 1;
+	while ((len = evbuffer_get_contiguous_space(in)) > 0) {
+		n = nghttp2_session_mem_recv(session->ngh,
+					     evbuffer_pullup(in, len), len);
+		if (n < 0) {
+			verbose(ERROR, "%s(): %s\n", __func__, nghttp2_strerror(n));
+			session->busy = 0;
+			fail(session, EPROTO);
+			return;
+		}
+		evbuffer_drain(in, n);
+	}
+	session->busy = 0;
+
+	carry_on(session);
+}
+
+static void cb_write(struct bufferevent *bev, void *arg)
+{
+	carry_on(arg);
+}
+
+static void cb_event(struct bufferevent *bev, short what, void *arg)
+{
+	struct h2_session *session = arg;
+
+	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR)) {
+		verbose(VERBOSE, "%s(): connection %s\n", __func__,
+			what & BEV_EVENT_EOF ? "closed" : "failed");
+		fail(session, ECONNRESET);
+	}
+}
+
+int h2_session_new(struct h2_session **sessionp, struct bufferevent *bev,
+		   h2_gone_cb gone, void *arg)
+{
+	nghttp2_session_callbacks *callbacks;
+	nghttp2_settings_entry settings[] = {
+		{ NGHTTP2_SETTINGS_ENABLE_PUSH, 0 },
+		{ NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, H2_WINDOW },
+	};
+	struct h2_session *session;
+	int err;
+
+	if ((session = malloc(sizeof(*session))) == NULL) {
+		return errno;
+	}
+	memset(session, 0, sizeof(*session));
+	session->bev = bev;
+	session->gone = gone;
+	session->arg = arg;
+
+	if (nghttp2_session_callbacks_new(&callbacks) != 0) {
+		free(session);
+		return ENOMEM;
+	}
+	nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+	nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, on_frame_recv);
+	nghttp2_session_callbacks_set_on_frame_send_callback(callbacks, on_frame_send);
+	nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+								  on_data_chunk_recv);
+	nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+							       on_stream_close);
+
+	err = nghttp2_session_client_new(&session->ngh, callbacks, session);
+	nghttp2_session_callbacks_del(callbacks);
+	if (err != 0) {
+		free(session);
+		return ENOMEM;
+	}
+
+	/* They go out right after the connection preface */
+	if (nghttp2_submit_settings(session->ngh, NGHTTP2_FLAG_NONE, settings,
+				    sizeof(settings) / sizeof(settings[0])) != 0 ||
+	    nghttp2_session_set_local_window_size(session->ngh, NGHTTP2_FLAG_NONE,
+						  0, H2_WINDOW) != 0 ||
+	    (err = flush(session)) != 0) {
+		nghttp2_session_del(session->ngh);
+		free(session);
+		return err != 0 ? err : ENOMEM;
+	}
+
+	bufferevent_setcb(bev, cb_read, cb_write, cb_event, session);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+	/* Its SETTINGS may be in already */
+	if (evbuffer_get_length(bufferevent_get_input(bev)) > 0) {
+		bufferevent_trigger(bev, EV_READ,
+				    BEV_TRIG_IGNORE_WATERMARKS|BEV_TRIG_DEFER_CALLBACKS);
+	}
+
+	*sessionp = session;
+	return 0;
+}
+
+void h2_session_free(struct h2_session *session)
+{
+	while (session->streams != NULL) {
+		unlink_stream(session->streams);
+	}
+
+	nghttp2_session_del(session->ngh);
+	free(session);
+}
+
+int h2_session_usable(struct h2_session *session)
+{
+	return !session->dead &&
+		nghttp2_session_check_request_allowed(session->ngh);
+}
+
+int h2_session_streams(struct h2_session *session)
+{
+	return session->nstreams;
+}
+
+static void set_nv(nghttp2_nv *nv, const char *name, const char *value)
+{
+	nv->name = (uint8_t *)name;
+	nv->namelen = strlen(name);
+	nv->value = (uint8_t *)value;
+	nv->valuelen = strlen(value);
+
+	/* Kept out of the compression tables, where they could be
+	 * guessed at by someone who gets to add headers of their own
+	 */
+	nv->flags = strcmp(name, "authorization") == 0
+		? NGHTTP2_NV_FLAG_NO_INDEX
+		: NGHTTP2_NV_FLAG_NONE;
+}
+
+int h2_submit(struct h2_session *session, struct h2_stream *stream,
+	      const char *method, const char *authority, const char *path,
+	      const struct h2_header *headers, int nheaders,
+	      struct evbuffer *body,
+	      const struct h2_stream_ops *ops, void *arg)
+{
+	nghttp2_data_provider provider, *data;
+	nghttp2_nv *nva;
+	int32_t id;
+	int i, n;
+
+	if (!h2_session_usable(session)) {
+		return EPIPE;
+	}
+
+	memset(stream, 0, sizeof(*stream));
+	if ((stream->in = evbuffer_new()) == NULL) {
+		return ENOMEM;
+	}
+
+	n = nheaders + 4;
+	if ((nva = malloc(n * sizeof(*nva))) == NULL) {
+		evbuffer_free(stream->in);
+		stream->in = NULL;
+		return ENOMEM;
+	}
+	set_nv(&nva[0], ":method", method);
+	set_nv(&nva[1], ":scheme", "https");
+	set_nv(&nva[2], ":authority", authority);
+	set_nv(&nva[3], ":path", path);
+	for (i = 0; i < nheaders; i++) {
+		set_nv(&nva[i + 4], headers[i].name, headers[i].value);
+	}
+
+	data = NULL;
+	if (body != NULL && evbuffer_get_length(body) > 0) {
+		provider.source.ptr = NULL;
+		provider.read_callback = read_body;
+		data = &provider;
+	}
+
+	/* The headers are copied */
+	id = nghttp2_submit_request(session->ngh, NULL, nva, n, data, NULL);
+	free(nva);
+	if (id < 0) {
+		verbose(ERROR, "%s(): %s\n", __func__, nghttp2_strerror(id));
+		evbuffer_free(stream->in);
+		stream->in = NULL;
+		return id == NGHTTP2_ERR_NOMEM ? ENOMEM : EPIPE;
+	}
+
+	stream->id = id;
+	stream->session = session;
+	stream->ops = ops;
+	stream->arg = arg;
+	stream->body = body;
+	stream->next = session->streams;
+	session->streams = stream;
+	session->nstreams++;
+
+	verbose(VERBOSE, "%s(): %s %s%s on stream %d\n",
+		__func__, method, authority, path, id);
+
+	kick(session);
+	return 0;
+}
+
+void h2_stream_cancel(struct h2_stream *stream)
+{
+	struct h2_session *session = stream->session;
+
+	if (session == NULL) {
+		return;
+	}
+
+	unlink_stream(stream);
+
+	if (!session->dead) {
+		nghttp2_submit_rst_stream(session->ngh, NGHTTP2_FLAG_NONE,
+					  stream->id, NGHTTP2_CANCEL);
+		kick(session);
+	}
+}
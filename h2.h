@@ -0,0 +1,108 @@
+#ifndef H2_H__INCLUDED
+#define H2_H__INCLUDED
+
+/*
+ * HTTP/2 over a connection that's up and has agreed on h2 over ALPN.
+ * Requests go out on it side by side, a stream each, as many at once
+ * as the server lets us, and the rest wait their turn inside nghttp2.
+ * The framing is nghttp2's. This is the plumbing between it and the
+ * bufferevent.
+ */
+
+#include <stdint.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+struct h2_session;
+
+/*
+ * The session is done for: the connection was lost, the server went
+ * away or we couldn't make sense of it. Streams that were still open
+ * have been closed by then. Free it, and the bufferevent, from here.
+ */
+typedef void (*h2_gone_cb)(struct h2_session *session, void *arg);
+
+/*
+ * The bufferevent's callbacks are the session's from here on. Whatever
+ * the server has sent already is read off it.
+ */
+int h2_session_new(struct h2_session **sessionp, struct bufferevent *bev,
+		   h2_gone_cb gone, void *arg);
+
+/* Closes what's still open without a word to the streams */
+void h2_session_free(struct h2_session *session);
+
+/* Whether new streams may go out on it, not if it's going away */
+int h2_session_usable(struct h2_session *session);
+
+/* Streams open, or waiting to be */
+int h2_session_streams(struct h2_session *session);
+
+struct h2_header {
+	const char *name;
+	const char *value;
+};
+
+struct h2_stream_ops {
+	/* All of the request is out */
+	void (*sent)(void *arg);
+
+	/* The response head, a field at a time, :status first.
+	 * Informational responses and trailers aren't passed on.
+	 */
+	void (*header)(const char *name, const char *value, void *arg);
+
+	/* Some of the body. What's left in buf is there next time. */
+	void (*data)(struct evbuffer *buf, void *arg);
+
+	/*
+	 * The stream is over. 0 if the response came in whole, and
+	 * whatever was left of it has been passed to data(). ECONNREFUSED
+	 * if the server says it never looked at the request, so it's
+	 * safe to send again, and ECONNRESET or EPROTO if it broke off
+	 * halfway.
+	 */
+	void (*close)(int err, void *arg);
+};
+
+/* Lives in the caller's memory, the fields are h2.c's */
+struct h2_stream {
+	struct h2_stream *next;
+	struct h2_session *session;
+	int32_t id;
+	const struct h2_stream_ops *ops;
+	void *arg;
+	struct evbuffer *in;
+
+	/* Not drained, so that it can be sent again elsewhere */
+	struct evbuffer *body;
+	size_t body_off;
+
+	int informational;
+	int head_done;
+	int ended;
+};
+
+/*
+ * A request on a stream of its own. Header names have to be in lower
+ * case, the pseudo-headers are filled in from method, authority and
+ * path. body may be NULL, and has to stay around, unchanged, until
+ * close() or h2_stream_cancel().
+ *
+ * 0 if it's on its way, and close() will be called. EPIPE if the
+ * session isn't usable.
+ */
+int h2_submit(struct h2_session *session, struct h2_stream *stream,
+	      const char *method, const char *authority, const char *path,
+	      const struct h2_header *headers, int nheaders,
+	      struct evbuffer *body,
+	      const struct h2_stream_ops *ops, void *arg);
+
+/*
+ * Reset it, unless it's over already. No more callbacks are made for
+ * it, and its memory can go right away.
+ */
+void h2_stream_cancel(struct h2_stream *stream);
+
+#endif
@@ -10,25 +10,194 @@
 #include "https.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
+#include <event2/http.h>
 
 #include "verbose.h"
+#include "conf.h"
 
 #include "conn_stash.h"
+#include "h2.h"
+#include "arena.h"
+#include "metrics.h"
+#include "trace.h"
+
+/* Requests, and the callers' contexts around them, are carved out of
+ * arenas built from chunks of this size. One chunk covers a typical
+ * GET with room to spare; the POST body of a token exchange may spill
+ * into a second one.
+ */
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_CHUNKS_IDLE 64
+
+/* Default upstream budgets, in seconds, for routes that don't
+ * configure their own.
+ */
+#define DEADLINE_CONNECT 10
+#define DEADLINE_FIRST_BYTE 20
+#define DEADLINE_TOTAL 60
+
+/* Idempotent requests get this many goes in total. Between them we
+ * back off exponentially, with full jitter, starting from
+ * RETRY_BACKOFF_MS and never waiting longer than RETRY_BACKOFF_MAX_MS.
+ */
+#define RETRY_ATTEMPTS 3
+#define RETRY_BACKOFF_MS 100
+#define RETRY_BACKOFF_MAX_MS 2000
+
+/* Turns each flow of a class gets, and the share of slots the class
+ * may have, in quarters. See https_request_set_priority().
+ */
+static const struct {
+	const char *name;
+	int weight;
+	int quarters;
+} classes[HTTPS_PRIORITIES] = {
+	[HTTPS_INTERACTIVE] = { "interactive", 16, 4 },
+	[HTTPS_BACKGROUND] = { "background", 4, 2 },
+	[HTTPS_BULK] = { "bulk", 1, 1 },
+};
+
+/* A GET that hasn't seen its first byte by the time the host's p95
+ * time to first byte has passed gets a duplicate sent on another
+ * connection. Whichever answers first wins. We want a few samples
+ * before trusting the p95.
+ */
+#define HEDGE_SAMPLES 64
+#define HEDGE_MIN_SAMPLES 20
+
+struct host_stats {
+	struct host_stats *next;
+
+	char *host;
+	int port;
+
+	/* Time to first byte, in milliseconds */
+	int ttfb[HEDGE_SAMPLES];
+	int nsamples;
+	int pos;
+
+	/* The headers every request to this host starts with */
+	char *header_block;
+	size_t header_len;
+
+	/* Its last new connection came up speaking HTTP/1.1, so nobody
+	 * waits for someone else's, see struct h2_conn.
+	 */
+	int http11;
+
+	/* Whole requests, retries and all */
+	struct metric *latency;
+};
+
+/*
+ * With pipelining on, GETs to the same host queue up on one
+ * connection and their responses come back in the order they went
+ * out. The connection's callbacks belong to whoever is at the head
+ * of the queue. When it's done, the next one takes over.
+ */
+struct pipeline {
+	struct pipeline *next;
+
+	char *host;
+	int port;
+
+	struct bufferevent *bev;
+	struct request_ctx *head;
+	struct request_ctx *tail;
+	int depth;
+};
+
+/*
+ * With h2 on, a new connection isn't written to until it's up and
+ * we know what it speaks. Requests to its host wait in line for it
+ * meanwhile. If it's h2, they all go out on it as streams, and so do
+ * those that come along later, for as long as the server takes them.
+ * If it's HTTP/1.1 after all, the first in line has it and the rest
+ * look elsewhere.
+ */
+struct h2_conn {
+	struct h2_conn *next;
+	struct https_engine *https;
+
+	char *host;
+	int port;
+
+	struct bufferevent *bev;
+
+	/* NULL until it's up */
+	struct h2_session *session;
+	struct request_ctx *line;
+
+	/* For when it's had no streams for a while */
+	struct event *idle;
+};
 
 struct https_engine {
 	struct conn_stash *conn_stash;
 	struct event_base *event_base;
+
+	struct slab *chunks;
+
+	struct https_deadline default_deadline;
+
+	struct host_stats *stats;
+	unsigned int seed;
+
+	/* Requests in flight on one connection at most. Below 2,
+	 * no pipelining.
+	 */
+	int pipeline_depth;
+	struct pipeline *pipes;
+
+	/* See https_replay() */
+	char *capture_dir;
+	unsigned int capture_seq;
+
+	/* Slots for requests, see https_request_set_priority().
+	 * waiting is in order of finish tags. vtime is the tag of
+	 * the last one let through.
+	 */
+	int max_slots;
+	int slots;
+	int class_slots[HTTPS_PRIORITIES];
+	struct request_ctx *waiting;
+	int nwaiting[HTTPS_PRIORITIES];
+	double vtime;
+	struct event *dispatch;
+
+	struct metric *slot_wait[HTTPS_PRIORITIES];
+	struct metric *slots_gauge[HTTPS_PRIORITIES];
+	struct metric *waiting_gauge[HTTPS_PRIORITIES];
+
+	/* See https_options.h2 */
+	int h2;
+	int idle_timeout;
+	struct h2_conn *h2_conns;
 };
 
+static void cb_dispatch(evutil_socket_t fd, short what, void *arg);
+static void h2_conn_free(struct h2_conn *conn);
+
 int https_engine_init(struct https_engine **httpsp, struct event_base *event_base,
-		      int no_keepalive)
+		      const struct https_options *opts)
 {
-	int err;
+	const struct https_warm_target *warm;
+	const struct https_connect_to *to;
+	char labels[64];
+	int err, i;
 
 	struct https_engine *https = malloc(sizeof(*https));
 	if (https == NULL) {
@@ -37,13 +206,91 @@ int https_engine_init(struct https_engine **httpsp, struct event_base *event_bas
 
 	memset(https, 0, sizeof(*https));
 
-	err = conn_stash_init(&https->conn_stash, event_base, no_keepalive);
+	err = conn_stash_init(&https->conn_stash, event_base, opts->transport,
+			      opts->no_keepalive, opts->idle_timeout);
 	if (err != 0) {
 		free(https);
 		return errno;
 	}
+	if (opts->pair_accept != NULL) {
+		conn_stash_pair_server(https->conn_stash, opts->pair_accept,
+				       opts->pair_arg);
+	}
+	if (opts->ktls && (err = conn_stash_ktls(https->conn_stash)) != 0) {
+		verbose(ERROR, "%s(): no kernel TLS: %s\n", __func__, strerror(err));
+	}
+	if (opts->h2 && (err = conn_stash_h2(https->conn_stash)) != 0) {
+		verbose(ERROR, "%s(): no HTTP/2: %s\n", __func__, strerror(err));
+	} else {
+		https->h2 = opts->h2;
+	}
+	https->idle_timeout = opts->idle_timeout;
+
+	err = slab_init(&https->chunks, ARENA_CHUNK_SIZE, ARENA_CHUNKS_IDLE);
+	if (err != 0) {
+		conn_stash_destroy(https->conn_stash);
+		free(https);
+		return err;
+	}
 
 	https->event_base = event_base;
+	https->pipeline_depth = opts->pipeline_depth;
+
+	if (opts->capture_dir != NULL &&
+	    (https->capture_dir = strdup(opts->capture_dir)) == NULL) {
+		conn_stash_destroy(https->conn_stash);
+		slab_destroy(https->chunks);
+		free(https);
+		return ENOMEM;
+	}
+
+	https_deadline_init(&https->default_deadline, "default");
+
+	https->max_slots = opts->max_slots;
+	if ((https->dispatch = evtimer_new(event_base, cb_dispatch, https)) == NULL) {
+		conn_stash_destroy(https->conn_stash);
+		slab_destroy(https->chunks);
+		free(https->capture_dir);
+		free(https);
+		return ENOMEM;
+	}
+	for (i = 0; i < HTTPS_PRIORITIES; i++) {
+		snprintf(labels, sizeof(labels), "class=\"%s\"", classes[i].name);
+		https->slot_wait[i] = metric_histogram("yt_history_upstream_slot_wait_seconds",
+						       "Time requests waited for a slot",
+						       labels);
+		https->slots_gauge[i] = metric_gauge("yt_history_upstream_slots",
+						     "Slots taken by requests",
+						     labels);
+		https->waiting_gauge[i] = metric_gauge("yt_history_upstream_waiting",
+						       "Requests waiting for a slot",
+						       labels);
+	}
+
+	for (to = opts->connect_to; to && to->host; to++) {
+		err = conn_stash_connect_to(https->conn_stash, to->host, to->port,
+					    to->to_host, to->to_port);
+		if (err != 0) {
+			conn_stash_destroy(https->conn_stash);
+			slab_destroy(https->chunks);
+			event_free(https->dispatch);
+			free(https->capture_dir);
+			free(https);
+			return err;
+		}
+	}
+
+	for (warm = opts->warm; warm && warm->host; warm++) {
+		err = conn_stash_warm(https->conn_stash, warm->host, warm->port,
+				      warm->min_idle);
+		if (err != 0) {
+			verbose(ERROR, "%s(): can't warm up %s:%d: %s\n",
+				__func__, warm->host, warm->port, strerror(err));
+		}
+	}
+
+	/* Only used for jitter */
+	https->seed = (unsigned long)https;
 
 	*httpsp = https;
 
@@ -52,527 +299,2720 @@ int https_engine_init(struct https_engine **httpsp, struct event_base *event_bas
 
 void https_engine_destroy(struct https_engine *https)
 {
+	struct host_stats *stats;
+	struct pipeline *pipe;
+
+	while (https->h2_conns != NULL) {
+		h2_conn_free(https->h2_conns);
+	}
+
+	while ((stats = https->stats) != NULL) {
+		https->stats = stats->next;
+		free(stats->header_block);
+		free(stats->host);
+		free(stats);
+	}
+
+	while ((pipe = https->pipes) != NULL) {
+		https->pipes = pipe->next;
+		free(pipe->host);
+		free(pipe);
+	}
+
 	conn_stash_destroy(https->conn_stash);
+	slab_destroy(https->chunks);
+	event_free(https->dispatch);
+	free(https->capture_dir);
 	free(https);
 }
 
+static struct host_stats *host_stats(struct https_engine *https,
+				     const char *host, int port)
+{
+	struct host_stats *stats;
+
+	for (stats = https->stats; stats; stats = stats->next) {
+		if (stats->port == port && strcmp(stats->host, host) == 0) {
+			return stats;
+		}
+	}
+
+	if ((stats = malloc(sizeof(*stats))) != NULL) {
+		char labels[128];
+
+		memset(stats, 0, sizeof(*stats));
+		if ((stats->host = strdup(host)) == NULL) {
+			free(stats);
+			return NULL;
+		}
+		if (asprintf(&stats->header_block,
+			     "Host: %s\r\n"
+			     "Connection: %s\r\n",
+			     host,
+			     conn_stash_is_keepalive(https->conn_stash)
+			     ? "Keep-Alive"
+			     : "close") == -1) {
+			free(stats->host);
+			free(stats);
+			return NULL;
+		}
+		stats->header_len = strlen(stats->header_block);
+		snprintf(labels, sizeof(labels), "host=\"%s:%d\"", host, port);
+		stats->latency = metric_histogram("yt_history_upstream_seconds",
+						  "Upstream request latency, by host",
+						  labels);
+		stats->port = port;
+		stats->next = https->stats;
+		https->stats = stats;
+	}
+
+	return stats;
+}
+
+static void record_ttfb(struct https_engine *https, const char *host, int port,
+			const struct timeval *sent)
+{
+	struct host_stats *stats;
+	struct timeval now, elapsed;
+
+	if ((stats = host_stats(https, host, port)) == NULL) {
+		return;
+	}
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, sent, &elapsed);
+
+	stats->ttfb[stats->pos] = elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000;
+	stats->pos = (stats->pos + 1) % HEDGE_SAMPLES;
+	if (stats->nsamples < HEDGE_SAMPLES) {
+		stats->nsamples++;
+	}
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* -1 if we don't know enough yet */
+static int ttfb_p95(struct https_engine *https, const char *host, int port)
+{
+	struct host_stats *stats;
+	int sorted[HEDGE_SAMPLES];
+
+	stats = host_stats(https, host, port);
+	if (stats == NULL || stats->nsamples < HEDGE_MIN_SAMPLES) {
+		return -1;
+	}
+
+	memcpy(sorted, stats->ttfb, stats->nsamples * sizeof(sorted[0]));
+	qsort(sorted, stats->nsamples, sizeof(sorted[0]), cmp_int);
+
+	return sorted[stats->nsamples * 95 / 100];
+}
+
+struct arena *https_arena_new(struct https_engine *https)
+{
+	return arena_new(https->chunks);
+}
+
+static void set_seconds(struct timeval *tv, long seconds)
+{
+	tv->tv_sec = seconds;
+	tv->tv_usec = 0;
+}
+
+int https_deadline_init(struct https_deadline *deadline, const char *route)
+{
+	char name[64];
+	char buf[64];
+	long connect, first_byte, total;
+	int err;
+
+	set_seconds(&deadline->connect, DEADLINE_CONNECT);
+	set_seconds(&deadline->first_byte, DEADLINE_FIRST_BYTE);
+	set_seconds(&deadline->total, DEADLINE_TOTAL);
+
+	/* The file holds "<connect> <first_byte> <total>" in seconds.
+	 * Zero means no limit for that leg.
+	 */
+	snprintf(name, sizeof(name), "%s_deadline", route);
+	if ((err = conf_read(name, buf, sizeof(buf))) != 0) {
+		return err == ENOENT ? 0 : err;
+	}
+
+	if (sscanf(buf, "%ld %ld %ld", &connect, &first_byte, &total) != 3) {
+		verbose(ERROR, "%s(): bad %s: '%s'\n", __func__, name, buf);
+		return EINVAL;
+	}
+
+	set_seconds(&deadline->connect, connect);
+	set_seconds(&deadline->first_byte, first_byte);
+	set_seconds(&deadline->total, total);
+
+	verbose(VERBOSE, "%s(): %s: connect %lds, first byte %lds, total %lds\n",
+		__func__, route, connect, first_byte, total);
+
+	return 0;
+}
+
 struct request_ctx {
 
+	/* Everything below, the request itself included, lives here */
+	struct arena *arena;
+
 	const char *host;
 	int port;
 	const char *method;
 	const char *path;
 
-	const char *access_token;
+	/* Ours to free, see https_request_set_body() */
+	struct evbuffer *body;
 
-	char *request_body;
-	size_t request_body_length;
+	/* Extra headers, until https_request_send() puts the whole
+	 * head together in one piece.
+	 */
+	struct request_header *headers;
+	struct request_header **headers_tail;
+	char *head;
+	size_t head_len;
 
 
 	struct https_cb_ops *cb_ops;
 	void *cb_arg;
 
+	/* Where our caller keeps us, so it can cancel. Cleared
+	 * before done() is called.
+	 */
+	struct request_ctx **handle;
+
 	char *error;
+	int error_status;
+
+	struct bufferevent *bev;
+
+	/* One timer, rearmed to whichever comes first: the end of
+	 * the current leg or the end of the whole budget.
+	 */
+	struct event *deadline_timer;
+	struct https_deadline deadline;
+	struct timeval expires;
+	enum { LEG_CONNECT, LEG_FIRST_BYTE, LEG_BODY } leg;
+	int timed_out;
 
 	enum { READ_NONE, READ_STATUS, READ_HEADERS, READ_BODY, READ_DONE } read_state;
 
 	int status;
 	char *status_line;
 
+	/* -1 until we're told */
 	int content_length;
 	int consumed;
 
+	/* Whether the connection is good for another request once
+	 * we're done with this one.
+	 */
+	int reusable;
+
 	int chunked;
 	ssize_t chunk_size;
 	size_t chunk_left;
 
 	struct conn_stash *conn_stash;
+	struct https_engine *https;
+
+	/* Retries, see retry_later() */
+	int attempt;
+	struct event *retry_timer;
+
+	/* The consumer has seen some of the response, so
+	 * there's no going back.
+	 */
+	int delivered;
+
+	/* Set while reading an error response we're not going
+	 * to show anyone because we'll retry instead.
+	 */
+	int discarding;
+
+	/* Hedging, see cb_hedge(). The primary request points at its
+	 * hedge and the hedge at the primary.
+	 */
+	struct event *hedge_timer;
+	struct request_ctx *twin;
+	int is_hedge;
+	struct timeval sent;
+
+	/* The pipeline we're queued on, and who's queued after us */
+	struct pipeline *pipe;
+	struct request_ctx *pipe_next;
+
+	/* The response so far, in records, and how much of what's in
+	 * the input buffer is in there already. See https_replay().
+	 */
+	struct evbuffer *capture;
+	size_t captured;
+	size_t capture_last;
 
+	/* Where the response comes from when it isn't a connection */
+	struct replay *replay;
+
+	/* The HTTP/2 connection we're on, or in line for, and who's
+	 * after us in line. The headers are built once, like head.
+	 */
+	struct h2_conn *h2;
+	struct request_ctx *h2_next;
+	struct h2_stream stream;
+	struct h2_header *h2_headers;
+	int h2_nheaders;
+
+	/* Whose turn, see https_request_set_priority() */
+	enum https_priority priority;
+	const void *owner;
+	int has_slot;
+	int waiting;
+	double finish;
+	struct request_ctx *wait_next;
+	struct timeval queued;
+
+	/* Spans go here, see trace.h */
+	unsigned int trace;
+	struct timeval started;
+	struct timeval connecting;
+	struct timeval first_byte;
 };
 
-static void cb_write(struct bufferevent *bev, void *arg)
+struct request_header {
+	struct request_header *next;
+	char *name;
+	char *value;
+};
+
+/* A capture being played back, see https_replay() */
+struct replay {
+	unsigned char *data;
+	size_t len;
+	size_t pos;
+
+	int realtime;
+	struct timeval started;
+	struct event *timer;
+
+	/* The far end of the request's bufferevent pair */
+	struct bufferevent *wire;
+};
+
+static void count_slots(struct https_engine *https, enum https_priority priority)
 {
-	verbose(FIREHOSE, "%s(): Write exhausted\n", __func__);
-	bufferevent_disable(bev, EV_WRITE);
-	bufferevent_enable(bev, EV_READ);
+	metric_set(https->slots_gauge[priority], https->class_slots[priority]);
+	metric_set(https->waiting_gauge[priority], https->nwaiting[priority]);
 }
 
-static char *read_line(struct bufferevent *bev, size_t *n)
+/* Its class may have this many slots, and never none */
+static int class_share(struct https_engine *https, enum https_priority priority)
 {
-	return evbuffer_readln(bufferevent_get_input(bev),
-			       n, EVBUFFER_EOL_CRLF_STRICT);
+	int share = https->max_slots * classes[priority].quarters / 4;
+
+	return share > 0 ? share : 1;
 }
 
-static void parse_status(struct request_ctx *req, const char *line, size_t len)
+static int slot_free(struct https_engine *https, enum https_priority priority)
 {
-	int i;
-
-	req->status_line = strdup(line);
-	for (i = 0; line[i] != ' ' && i < len; i++) {
-		;
-	}
-	if (i == len) {
-		verbose(ERROR, "%s(): Invalid status line '%s'\n", __func__, line);
-	} else {
-		req->status = atoi(&line[i+1]);
-		if (req->status != 200) {
-			/*
-			 * A bit of a kludge to handle the NoLinkedYoutubeAccount
-			 * case; If we're logged in to a G+ account, for example,
-			 * that's not linked to a youtube account, the youtube
-			 * history page tells us "401 NoLinkedYouTubeAccount", so
-			 * we'd better just show that instead of a boring blank
-			 * page.
-			 *
-			 * Of course we could handle that specific status and that
-			 * specific message but let's just consider anything != 200
-			 * as an error we propagate to the browser, and see how well
-			 * that works out.
-			 */
-			while (line[++i]) {
-				if (line[i] == ' ') {
-					req->error = strdup(&line[i+1]);
-					break;
-				}
-			}
-		}
-	}
+	return https->slots < https->max_slots &&
+		https->class_slots[priority] < class_share(https, priority);
 }
 
-static int read_chunk_size(struct request_ctx *req, struct bufferevent *bev)
+static void take_slot(struct request_ctx *req)
 {
-	char *line;
-	char *eptr;
-	size_t n;
-	unsigned long val;
-	int err;
+	struct https_engine *https = req->https;
 
+	req->has_slot = 1;
+	https->slots++;
+	https->class_slots[req->priority]++;
+	count_slots(https, req->priority);
+}
 
-	/* A chunk ends with CRLF that's not accounted for by chunk size.
-	 * So we should have an "empty" line followed by next chunk size
-	 */
-	line = NULL;
-	do {
-		free(line);
-		line = read_line(bev, &n);
-	} while (line != NULL && *line == '\0');
+/* Whoever's next gets it, once we're out of the way */
+static void release_slot(struct request_ctx *req)
+{
+	struct https_engine *https = req->https;
 
-	err = 0;
-	if (line != NULL) {
-		errno = 0;
-		val = strtoul(line, &eptr, 16);
-		if (errno != 0) {
-			err = errno;
-			verbose(ERROR, "%s(): bad chunk size '%s': %s\n",
-			       __func__, line, strerror(errno));
-		} else {
-			req->chunk_size = val;
-			req->chunk_left = val;
-			verbose(FIREHOSE,
-				"%s(): chunk size: %zd, from '%s'\n",
-				__func__, val, line);
-			err = 0;
-		}
-		free(line);
+	req->has_slot = 0;
+	https->slots--;
+	https->class_slots[req->priority]--;
+	count_slots(https, req->priority);
+
+	if (https->waiting != NULL) {
+		event_active(https->dispatch, EV_TIMEOUT, 0);
 	}
-	return err;
 }
 
-static const char *pretty_state(char *buf, size_t len, int state)
+/*
+ * In line by finish tag: where the flow's last one ends, or now if it
+ * has nothing waiting, plus a turn's worth for its class.
+ */
+static void enqueue(struct request_ctx *req)
 {
-	switch (state) {
-	case READ_NONE: snprintf(buf, len, "READ_NONE"); break;
-	case READ_STATUS: snprintf(buf, len, "READ_STATUS"); break;
-	case READ_HEADERS: snprintf(buf, len, "READ_HEADERS"); break;
-	case READ_BODY: snprintf(buf, len, "READ_BODY"); break;
-	case READ_DONE: snprintf(buf, len, "READ_DONE"); break;
-	default: snprintf(buf, len, "UNKNWN(%d)", state); break;
+	struct https_engine *https = req->https;
+	struct request_ctx **reqp, *other;
+	double start;
+
+	start = https->vtime;
+	for (other = https->waiting; other; other = other->wait_next) {
+		if (other->owner == req->owner &&
+		    other->priority == req->priority &&
+		    other->finish > start) {
+			start = other->finish;
+		}
 	}
-	return buf;
+	req->finish = start + 1.0 / classes[req->priority].weight;
+
+	for (reqp = &https->waiting;
+	     *reqp != NULL && (*reqp)->finish <= req->finish;
+	     reqp = &(*reqp)->wait_next)
+		;
+	req->wait_next = *reqp;
+	*reqp = req;
+
+	req->waiting = 1;
+	https->nwaiting[req->priority]++;
+	count_slots(https, req->priority);
 }
 
-static void set_read_state(struct request_ctx *req, int state)
+static void unqueue(struct request_ctx *req)
 {
-	char s1[32];
-	char s2[32];
-
-	if (verbose_adjust_level(0) >= VERBOSE) {
-		verbose(VERBOSE, "%s(): %s -> %s\n", __func__,
-			pretty_state(s1, sizeof(s1), req->read_state),
-			pretty_state(s2, sizeof(s2), state));
-	}
+	struct https_engine *https = req->https;
+	struct request_ctx **reqp;
 
-	req->read_state = state;
+	for (reqp = &https->waiting; *reqp != req; reqp = &(*reqp)->wait_next)
+		;
+	*reqp = req->wait_next;
+	req->wait_next = NULL;
 
+	req->waiting = 0;
+	https->nwaiting[req->priority]--;
+	count_slots(https, req->priority);
 }
 
-static void flush_input(struct request_ctx *req, struct evbuffer *buf)
+/* A connection nobody's using goes after the usual idle time */
+static void h2_idle_check(struct h2_conn *conn)
 {
-	int len;
+	struct timeval tv = { conn->https->idle_timeout, 0 };
 
-	while ((len = evbuffer_get_length(buf)) > 0) {
-		verbose(VERBOSE, "%s(): input bytes left: %d\n",
-			__func__, len);
-		req->cb_ops->read(buf, req->cb_arg);
+	if (conn->session != NULL && tv.tv_sec > 0 &&
+	    h2_session_usable(conn->session) &&
+	    h2_session_streams(conn->session) == 0) {
+		evtimer_add(conn->idle, &tv);
 	}
 }
 
-static void request_done(struct request_ctx *req, struct bufferevent *bev)
+/* Out of line for the connection, or off the stream on it */
+static void h2_leave(struct request_ctx *req)
 {
-	/* Force the remaining bytes down our consumer's throat. */
-	flush_input(req, bufferevent_get_input(bev));
+	struct h2_conn *conn = req->h2;
+	struct request_ctx **reqp;
+
+	req->h2 = NULL;
+
+	if (conn->session == NULL) {
+		for (reqp = &conn->line; *reqp != req; reqp = &(*reqp)->h2_next)
+			;
+		*reqp = req->h2_next;
+		req->h2_next = NULL;
+		return;
+	}
 
-	req->cb_ops->done(req->error, req->cb_arg);
-	conn_stash_put_bev(req->conn_stash, bev);
-	free(req->status_line);
-	free(req->request_body);
-	free(req);
+	h2_stream_cancel(&req->stream);
+	h2_idle_check(conn);
 }
 
-static void drain_body(struct request_ctx *req, struct bufferevent *bev)
+/* The request and everything it owns */
+static void free_request(struct request_ctx *req)
 {
-	struct evbuffer *buf;
-	struct evbuffer *saved;
-	int before, after;
-
-	if (req->chunked && req->chunk_size == -1) {
-		/* Transfer-Encoding: chunked but we don't have size yet. */
-		if (read_chunk_size(req, bev) != 0) {
+	if (req->waiting) {
+		unqueue(req);
+	}
+	if (req->h2 != NULL) {
+		h2_leave(req);
+	}
+	if (req->has_slot) {
+		release_slot(req);
+	}
+	if (req->body != NULL) {
+		evbuffer_free(req->body);
+	}
+	if (req->capture != NULL) {
+		evbuffer_free(req->capture);
+	}
+	if (req->replay != NULL) {
+		evtimer_del(req->replay->timer);
+		bufferevent_free(req->replay->wire);
+		free(req->replay->data);
+	}
+	/* Unless done() has it already */
+	free(req->error);
+	arena_free(req->arena);
+}
+
+static const char *leg_name(int leg)
+{
+	switch (leg) {
+	case LEG_CONNECT: return "connect";
+	case LEG_FIRST_BYTE: return "first byte";
+	case LEG_BODY: return "body";
+	default: return "unknown";
+	}
+}
+
+static void arm_deadline(struct request_ctx *req, int leg)
+{
+	const struct timeval *budget;
+	struct timeval now, tv;
+
+	if (req->is_hedge) {
+		/* The primary keeps the time */
+		return;
+	}
+
+	req->leg = leg;
+
+	switch (leg) {
+	case LEG_CONNECT: budget = &req->deadline.connect; break;
+	case LEG_FIRST_BYTE: budget = &req->deadline.first_byte; break;
+	default: budget = NULL; break;
+	}
+
+	if (budget != NULL && evutil_timerisset(budget)) {
+		tv = *budget;
+	} else {
+		evutil_timerclear(&tv);
+	}
+
+	if (evutil_timerisset(&req->expires)) {
+		evutil_gettimeofday(&now, NULL);
+		if (evutil_timercmp(&now, &req->expires, >=)) {
+			/* Fire right away */
+			tv.tv_sec = 0;
+			tv.tv_usec = 1;
+		} else {
+			struct timeval left;
+			evutil_timersub(&req->expires, &now, &left);
+			if (!evutil_timerisset(&tv) || evutil_timercmp(&left, &tv, <)) {
+				tv = left;
+			}
+		}
+	}
+
+	if (evutil_timerisset(&tv)) {
+		evtimer_add(req->deadline_timer, &tv);
+	} else {
+		evtimer_del(req->deadline_timer);
+	}
+}
+
+static void cb_write(struct bufferevent *bev, void *arg)
+{
+	struct request_ctx *req = arg;
+
+	verbose(FIREHOSE, "%s(): Write exhausted\n", __func__);
+	bufferevent_disable(bev, EV_WRITE);
+	bufferevent_enable(bev, EV_READ);
+
+	if (req->leg == LEG_CONNECT) {
+		arm_deadline(req, LEG_FIRST_BYTE);
+	}
+}
+
+static void clear_buffer(struct evbuffer *buf)
+{
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+}
+
+static char *read_line(struct bufferevent *bev, size_t *n)
+{
+	return evbuffer_readln(bufferevent_get_input(bev),
+			       n, EVBUFFER_EOL_CRLF_STRICT);
+}
+
+static int may_retry(struct request_ctx *req, int idempotent_only)
+{
+	if (req->attempt + 1 >= RETRY_ATTEMPTS || req->delivered) {
+		return 0;
+	}
+
+	/* Anything can be sent again if it never got anywhere the
+	 * first time. After that it's only safe for GETs.
+	 */
+	return strcmp(req->method, "GET") == 0 ||
+		(!idempotent_only && req->attempt == 0);
+}
+
+/* reason is what's said about anything but a 200, if anything */
+static void take_status(struct request_ctx *req, int status, const char *reason)
+{
+	req->status = status;
+	if (req->status >= 500 && may_retry(req, 1)) {
+		verbose(NORMAL, "%s(): %s%s said '%s', will retry\n",
+			__func__, req->host, req->path, req->status_line);
+		req->discarding = 1;
+	} else if (req->status != 200 && reason != NULL) {
+		req->error = strdup(reason);
+		req->error_status = HTTP_INTERNAL;
+	}
+}
+
+static void parse_status(struct request_ctx *req, const char *line, size_t len)
+{
+	const char *reason;
+	int i;
+
+	req->status_line = arena_strdup(req->arena, line);
+	for (i = 0; line[i] != ' ' && i < len; i++) {
+		;
+	}
+	if (i == len) {
+		verbose(ERROR, "%s(): Invalid status line '%s'\n", __func__, line);
+	} else {
+		if (strncmp(line, "HTTP/1.0", i) == 0) {
+			/* Unless it tells us otherwise */
+			req->reusable = 0;
+		}
+		/*
+		 * A bit of a kludge to handle the NoLinkedYoutubeAccount
+		 * case; If we're logged in to a G+ account, for example,
+		 * that's not linked to a youtube account, the youtube
+		 * history page tells us "401 NoLinkedYouTubeAccount", so
+		 * we'd better just show that instead of a boring blank
+		 * page.
+		 *
+		 * Of course we could handle that specific status and that
+		 * specific message but let's just consider anything != 200
+		 * as an error we propagate to the browser, and see how well
+		 * that works out.
+		 */
+		reason = strchr(&line[i+1], ' ');
+		take_status(req, atoi(&line[i+1]), reason != NULL ? reason + 1 : NULL);
+	}
+}
+
+static int read_chunk_size(struct request_ctx *req, struct bufferevent *bev)
+{
+	char *line;
+	char *eptr;
+	size_t n;
+	unsigned long val;
+	int err;
+
+
+	/* A chunk ends with CRLF that's not accounted for by chunk size.
+	 * So we should have an "empty" line followed by next chunk size
+	 */
+	line = NULL;
+	do {
+		free(line);
+		line = read_line(bev, &n);
+	} while (line != NULL && *line == '\0');
+
+	err = 0;
+	if (line != NULL) {
+		errno = 0;
+		val = strtoul(line, &eptr, 16);
+		if (errno != 0) {
+			err = errno;
+			verbose(ERROR, "%s(): bad chunk size '%s': %s\n",
+			       __func__, line, strerror(errno));
+		} else {
+			req->chunk_size = val;
+			req->chunk_left = val;
+			verbose(FIREHOSE,
+				"%s(): chunk size: %zd, from '%s'\n",
+				__func__, val, line);
+			err = 0;
+		}
+		free(line);
+	}
+	return err;
+}
+
+static const char *pretty_state(char *buf, size_t len, int state)
+{
+	switch (state) {
+	case READ_NONE: snprintf(buf, len, "READ_NONE"); break;
+	case READ_STATUS: snprintf(buf, len, "READ_STATUS"); break;
+	case READ_HEADERS: snprintf(buf, len, "READ_HEADERS"); break;
+	case READ_BODY: snprintf(buf, len, "READ_BODY"); break;
+	case READ_DONE: snprintf(buf, len, "READ_DONE"); break;
+	default: snprintf(buf, len, "UNKNWN(%d)", state); break;
+	}
+	return buf;
+}
+
+static void set_read_state(struct request_ctx *req, int state)
+{
+	char s1[32];
+	char s2[32];
+
+	verbose(VERBOSE, "%s(): %s -> %s\n", __func__,
+		pretty_state(s1, sizeof(s1), req->read_state),
+		pretty_state(s2, sizeof(s2), state));
+
+	req->read_state = state;
+
+}
+
+static void flush_input(struct request_ctx *req, struct evbuffer *buf)
+{
+	int len;
+
+	while ((len = evbuffer_get_length(buf)) > 0) {
+		verbose(VERBOSE, "%s(): input bytes left: %d\n",
+			__func__, len);
+		req->delivered = 1;
+		req->cb_ops->read(buf, req->cb_arg);
+	}
+}
+
+static void cancel_hedge(struct request_ctx *req)
+{
+	struct request_ctx *hedge = req->twin;
+
+	evtimer_del(req->hedge_timer);
+
+	if (hedge != NULL) {
+		verbose(VERBOSE, "%s(): %s%s\n", __func__, req->host, req->path);
+		conn_stash_drop_bev(hedge->conn_stash, hedge->bev);
+		/* Its memory goes with the primary's arena */
+		req->twin = NULL;
+	}
+}
+
+static void stop_timers(struct request_ctx *req)
+{
+	evtimer_del(req->deadline_timer);
+	evtimer_del(req->retry_timer);
+	cancel_hedge(req);
+}
+
+/*
+ * Only a connection we've read a complete response off, and that
+ * the other end hasn't said it's going to close, goes back into the
+ * stash. Anything else would just fail on whoever gets it next.
+ */
+static int conn_reusable(struct request_ctx *req)
+{
+	return req->reusable && req->read_state == READ_DONE && !req->timed_out;
+}
+
+static void release_conn(struct request_ctx *req, struct bufferevent *bev)
+{
+	if (req->replay != NULL) {
+		/* Not the stash's */
+		bufferevent_free(bev);
+	} else if (conn_reusable(req)) {
+		conn_stash_put_bev(req->conn_stash, bev);
+	} else {
+		verbose(VERBOSE, "%s(): closing connection to %s\n",
+			__func__, req->host);
+		conn_stash_drop_bev(req->conn_stash, bev);
+	}
+}
+
+static void pipe_unlink(struct https_engine *https, struct pipeline *pipe)
+{
+	struct pipeline **pipep;
+
+	for (pipep = &https->pipes; *pipep != pipe; pipep = &(*pipep)->next)
+		;
+	*pipep = pipe->next;
+
+	free(pipe->host);
+	free(pipe);
+}
+
+static void pipe_requeue(struct request_ctx *req);
+
+/*
+ * The connection under a pipeline is going away. Whoever's queued
+ * behind req never got an answer, so they go looking for another.
+ */
+static void pipe_break(struct request_ctx *req)
+{
+	struct pipeline *pipe = req->pipe;
+	struct request_ctx *follower, *next;
+
+	if (pipe == NULL) {
+		return;
+	}
+
+	if (pipe->depth > 1) {
+		verbose(NORMAL, "%s(): lost connection to %s, requeueing %d\n",
+			__func__, pipe->host, pipe->depth - 1);
+	}
+
+	follower = req->pipe_next;
+	req->pipe = NULL;
+	req->pipe_next = NULL;
+	pipe_unlink(req->https, pipe);
+
+	for (; follower; follower = next) {
+		next = follower->pipe_next;
+		pipe_requeue(follower);
+	}
+}
+
+static struct https_cb_ops discard_cb_ops;
+
+static void cb_read(struct bufferevent *bev, void *arg);
+static void cb_event(struct bufferevent *bev, short what, void *arg);
+
+/*
+ * Hand the connection on to the next request in the pipeline, if
+ * there's one and the connection's still good. Back to the stash
+ * otherwise.
+ */
+static void let_go(struct request_ctx *req, struct bufferevent *bev)
+{
+	struct pipeline *pipe = req->pipe;
+	struct request_ctx *next;
+
+	if (pipe == NULL) {
+		release_conn(req, bev);
+		return;
+	}
+
+	if (!conn_reusable(req)) {
+		pipe_break(req);
+		release_conn(req, bev);
+		return;
+	}
+
+	next = req->pipe_next;
+	req->pipe = NULL;
+	req->pipe_next = NULL;
+
+	if (next == NULL) {
+		pipe_unlink(req->https, pipe);
+		release_conn(req, bev);
+		return;
+	}
+
+	pipe->head = next;
+	pipe->depth--;
+	bufferevent_setcb(bev, cb_read, cb_write, cb_event, next);
+
+	if (next->cb_ops == &discard_cb_ops) {
+		/* Nobody's waiting on it, but it still has to answer in
+		 * reasonable time or it holds up the line.
+		 */
+		arm_deadline(next, LEG_FIRST_BYTE);
+	}
+
+	/* Its response may be in the buffer already. Not before we're
+	 * done with this one, though.
+	 */
+	bufferevent_trigger(bev, EV_READ,
+			    BEV_TRIG_IGNORE_WATERMARKS|BEV_TRIG_DEFER_CALLBACKS);
+}
+
+/* Whatever's come in since we last looked goes down as one record */
+static void capture_arrival(struct request_ctx *req, struct evbuffer *buf)
+{
+	struct evbuffer_iovec vec;
+	struct evbuffer_ptr pos;
+	struct timeval now, elapsed;
+	uint32_t rec[2];
+	size_t len;
+
+	if ((len = evbuffer_get_length(buf)) <= req->captured) {
+		return;
+	}
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &req->sent, &elapsed);
+	rec[0] = elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+	rec[1] = len - req->captured;
+
+	req->capture_last = evbuffer_get_length(req->capture);
+	evbuffer_ptr_set(buf, &pos, req->captured, EVBUFFER_PTR_SET);
+	if (evbuffer_add(req->capture, rec, sizeof(rec)) != 0 ||
+	    evbuffer_reserve_space(req->capture, rec[1], &vec, 1) != 1) {
+		verbose(ERROR, "%s(): out of memory, not capturing %s%s\n",
+			__func__, req->host, req->path);
+		evbuffer_free(req->capture);
+		req->capture = NULL;
+		return;
+	}
+	evbuffer_copyout_from(buf, &pos, vec.iov_base, rec[1]);
+	vec.iov_len = rec[1];
+	evbuffer_commit_space(req->capture, &vec, 1);
+
+	req->captured = len;
+}
+
+/* What's still in the buffer has been captured already */
+static void capture_left(struct request_ctx *req, struct bufferevent *bev)
+{
+	req->captured = evbuffer_get_length(bufferevent_get_input(bev));
+}
+
+/*
+ * extra is how much of the last record is past the end of the
+ * response, the start of the next one on a pipeline, say. That isn't
+ * kept.
+ */
+static void capture_save(struct request_ctx *req, size_t extra)
+{
+	struct https_engine *https = req->https;
+	char path[PATH_MAX];
+	unsigned char *data;
+	uint32_t rec[2];
+	size_t len, off;
+	ssize_t n;
+	int fd;
+
+	len = evbuffer_get_length(req->capture);
+	if (len == 0 || (data = evbuffer_pullup(req->capture, -1)) == NULL) {
+		return;
+	}
+
+	memcpy(rec, data + req->capture_last, sizeof(rec));
+	if (extra > 0 && extra <= rec[1]) {
+		rec[1] -= extra;
+		memcpy(data + req->capture_last, rec, sizeof(rec));
+		len -= extra;
+	}
+
+	snprintf(path, sizeof(path), "%s/%d-%u.cap",
+		 https->capture_dir, (int)getpid(), https->capture_seq++);
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) == -1) {
+		verbose(ERROR, "%s(): %s: %s\n", __func__, path, strerror(errno));
+		return;
+	}
+
+	dprintf(fd, "ytcap 1 %s %s %d %s\n",
+		req->method, req->host, req->port, req->path);
+
+	for (off = 0; off < len; off += n) {
+		if ((n = write(fd, data + off, len - off)) == -1) {
+			verbose(ERROR, "%s(): %s: %s\n",
+				__func__, path, strerror(errno));
+			break;
+		}
+	}
+	close(fd);
+
+	verbose(VERBOSE, "%s(): %s%s in %s\n", __func__, req->host, req->path, path);
+}
+
+static void request_done(struct request_ctx *req, struct bufferevent *bev)
+{
+	struct host_stats *stats;
+	size_t extra;
+
+	stop_timers(req);
+
+	if (req->replay == NULL &&
+	    (stats = host_stats(req->https, req->host, req->port)) != NULL) {
+		metric_observe(stats->latency, &req->started, NULL);
+	}
+
+	if (evutil_timerisset(&req->first_byte)) {
+		trace_span(req->trace, "body", &req->first_byte, NULL);
+	}
+	trace_span(req->trace, "upstream", &req->started, NULL);
+
+	/* Force the remaining bytes down our consumer's throat.
+	 * Then let go of the connection, so that whatever done()
+	 * does next can have it. What's left after a complete response
+	 * on a pipeline belongs to the next one in line.
+	 */
+	extra = 0;
+	if (bev != NULL) {
+		if (req->read_state == READ_DONE) {
+			extra = evbuffer_get_length(bufferevent_get_input(bev));
+		}
+		if (req->pipe == NULL || req->read_state != READ_DONE) {
+			flush_input(req, bufferevent_get_input(bev));
+		}
+		let_go(req, bev);
+	}
+
+	if (req->capture != NULL && req->status != 0 && !req->timed_out) {
+		capture_save(req, extra);
+	}
+
+	if (req->handle != NULL) {
+		*req->handle = NULL;
+	}
+
+	/* It's done()'s to free */
+	req->cb_ops->done(req->error_status, req->error, req->cb_arg);
+	req->error = NULL;
+
+	free_request(req);
+}
+
+/* The trailer after the last chunk, up to the empty line that ends it */
+static int read_trailer(struct request_ctx *req, struct bufferevent *bev)
+{
+	char *line;
+	size_t n;
+
+	while ((line = read_line(bev, &n)) != NULL) {
+		if (*line == '\0') {
+			free(line);
+			set_read_state(req, READ_DONE);
+			return 0;
+		}
+		free(line);
+	}
+
+	return EAGAIN;
+}
+
+/* EAGAIN if there's nothing to be done until more comes in */
+static int drain_body(struct request_ctx *req, struct bufferevent *bev)
+{
+	struct evbuffer *buf;
+	struct evbuffer *saved;
+	int before, after;
+
+	if (req->chunked && req->chunk_size == -1) {
+		/* Transfer-Encoding: chunked but we don't have size yet. */
+		if (read_chunk_size(req, bev) != 0) {
 			verbose(ERROR, "%s(): could not read chunk size!\n", __func__);
+			free(req->error);
+			req->error = strdup("Bad chunk size from upstream");
+			req->error_status = HTTP_INTERNAL;
+			req->reusable = 0;
+			set_read_state(req, READ_DONE);
+			return 0;
+		}
+		if (req->chunk_size == -1) {
+			/* Not all of the size line is in yet */
+			return EAGAIN;
+		}
+	}
+
+	if (req->chunked && req->chunk_size == 0) {
+		return read_trailer(req, bev);
+	}
+
+	buf = bufferevent_get_input(bev);
+
+	saved = NULL;
+	before = evbuffer_get_length(buf);
+	if (req->chunked && req->chunk_size > 0 && req->chunk_left < before) {
+		/*
+		 * Save the real buffer away and give the callback
+		 * a temporary one, just the chunk that remains.
+		 */
+		saved = buf;
+		buf = evbuffer_new();
+		evbuffer_remove_buffer(saved, buf, req->chunk_left);
+		before = evbuffer_get_length(buf);
+	}
+
+
+	if (req->discarding) {
+		clear_buffer(buf);
+	} else {
+		req->delivered = 1;
+		req->cb_ops->read(buf, req->cb_arg);
+	}
+	after = evbuffer_get_length(buf);
+	req->consumed += before - after;
+	req->chunk_left -= (before - after);
+	if (req->chunk_size > 0 && req->chunk_left == 0) {
+		/* We've consumed the whole chunk.
+		 * Signal that we need another one.
+		 */
+		req->chunk_size = -1;
+	}
+
+	if (saved != NULL) {
+		/* saved is actually the buffer in bev */
+		evbuffer_prepend_buffer(saved, buf);
+		evbuffer_free(buf);
+	}
+
+	if (!req->chunked && req->content_length >= 0 &&
+	    req->consumed == req->content_length) {
+		set_read_state(req, READ_DONE);
+	}
+
+	return 0;
+}
+
+static void header_keyval(char **key, char **val, char *line)
+{
+	int i;
+
+	*key = line;
+	for (i = 0; line[i] != '\0' && line[i] != ':'; i++) {
+		;
+	}
+
+	if (line[i] == ':') {
+		line[i] = '\0';
+		while (line[++i] == ' ') {
+			;
+		}
+	}
+	*val = &line[i];
+}
+
+
+static void handle_header(struct request_ctx *req, const char *key, const char *val)
+{
+	if (strcasecmp(key, "Content-Length") == 0) {
+		req->content_length = atoi(val);
+	} else if (strcasecmp(key, "Transfer-Encoding") == 0 &&
+		   strcmp(val, "chunked") == 0) {
+		req->chunked = 1;
+		req->chunk_size = -1;
+		req->chunk_left = -1;
+	} else if (strcasecmp(key, "Connection") == 0) {
+		if (strcasecmp(val, "close") == 0) {
+			req->reusable = 0;
+		} else if (strcasecmp(val, "keep-alive") == 0) {
+			req->reusable = conn_stash_is_keepalive(req->conn_stash);
+		}
+	}
+
+	if (req->cb_ops->response_header && !req->discarding) {
+		req->delivered = 1;
+		req->cb_ops->response_header(key, val, req->cb_arg);
+	}
+}
+
+/* The headers are in. Figure out how we'll know the body has ended. */
+static void start_body(struct request_ctx *req)
+{
+	if (req->status == 204 || req->status == 304 || req->status / 100 == 1 ||
+	    (!req->chunked && req->content_length == 0)) {
+		set_read_state(req, READ_DONE);
+	} else {
+		if (!req->chunked && req->content_length < 0) {
+			/* Ends when the connection does */
+			req->reusable = 0;
+		}
+		set_read_state(req, READ_BODY);
+	}
+}
+
+static void retry_later(struct request_ctx *req);
+
+/* The first of the response is in */
+static void answered(struct request_ctx *req)
+{
+	arm_deadline(req, LEG_BODY);
+	/* We're answered, no need for a hedge any more */
+	cancel_hedge(req);
+	/* Time spent queued behind others would skew it */
+	if (req->pipe == NULL && req->replay == NULL) {
+		record_ttfb(req->https, req->host, req->port, &req->sent);
+	}
+	evutil_gettimeofday(&req->first_byte, NULL);
+	trace_span(req->trace, "ttfb", &req->sent, &req->first_byte);
+}
+
+static void cb_read(struct bufferevent *bev, void *arg)
+{
+	struct request_ctx *req = arg;
+	char *line;
+	size_t n;
+
+	if (evbuffer_get_length(bufferevent_get_input(bev)) == 0) {
+		/* Woken up by let_go() with nothing for us yet */
+		return;
+	}
+
+	if (req->capture != NULL) {
+		capture_arrival(req, bufferevent_get_input(bev));
+	}
+
+	if (req->read_state == READ_NONE) {
+		req->read_state = READ_STATUS;
+		answered(req);
+	}
+
+	while (req->read_state == READ_STATUS || req->read_state == READ_HEADERS) {
+
+		line = read_line(bev, &n);
+		if (line == NULL) {
+			capture_left(req, bev);
+			return;
+		}
+
+		if (req->read_state == READ_STATUS) {
+			verbose(VERBOSE, "%s(): status line: '%s'\n", __func__, line);
+			parse_status(req, line, n);
+			set_read_state(req, READ_HEADERS);
+		} else {
+			while (line && req->read_state == READ_HEADERS) {
+				if (*line == '\0') {
+					start_body(req);
+				} else {
+					char *key, *val;
+					verbose(VERBOSE, "%s(): header line '%s'\n", __func__, line);
+					header_keyval(&key, &val, line);
+					handle_header(req, key, val);
+					free(line);
+					line = read_line(bev, &n);
+				}
+			}
+		}
+
+		free(line);
+
+	}
+
+	while (req->read_state == READ_BODY && evbuffer_get_length(bufferevent_get_input(bev)) > 0) {
+		if (drain_body(req, bev) != 0) {
+			break;
+		}
+	}
+	capture_left(req, bev);
+
+	if (req->read_state == READ_DONE) {
+		if (req->discarding) {
+			retry_later(req);
+		} else {
+			request_done(req, bev);
+		}
+	}
+
+}
+
+static __attribute__((format(printf,2,3))) void store_request_error(struct request_ctx *req,
+								    const char *fmt, ...)
+{
+	char buf[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	free(req->error);
+	req->error = strdup(buf);
+	req->error_status = HTTP_INTERNAL;
+
+}
+
+static void arm_hedge(struct request_ctx *req)
+{
+	struct timeval tv;
+	int p95;
+
+	if (req->is_hedge || req->attempt > 0 || req->pipe != NULL ||
+	    strcmp(req->method, "GET") != 0) {
+		return;
+	}
+
+	if ((p95 = ttfb_p95(req->https, req->host, req->port)) < 0) {
+		return;
+	}
+
+	tv.tv_sec = p95 / 1000;
+	tv.tv_usec = (p95 % 1000) * 1000;
+	evtimer_add(req->hedge_timer, &tv);
+}
+
+/*
+ * Everything up to the body, in one piece in the arena. Done once,
+ * however many times the request ends up being sent.
+ */
+static int build_head(struct request_ctx *req)
+{
+	struct host_stats *stats;
+	struct request_header *hdr;
+	char content_length[64];
+	const char *content_type;
+	size_t len;
+	char *p;
+
+	if ((stats = host_stats(req->https, req->host, req->port)) == NULL) {
+		return ENOMEM;
+	}
+
+	content_type = strcmp(req->method, "POST") == 0
+		? "Content-Type: application/x-www-form-urlencoded\r\n"
+		: "";
+
+	*content_length = '\0';
+	if (req->body != NULL) {
+		snprintf(content_length, sizeof(content_length),
+			 "Content-Length: %zd\r\n",
+			 evbuffer_get_length(req->body));
+	}
+
+	len = strlen(req->method) + 1 + strlen(req->path) + strlen(" HTTP/1.1\r\n");
+	len += stats->header_len;
+	for (hdr = req->headers; hdr; hdr = hdr->next) {
+		len += strlen(hdr->name) + 2 + strlen(hdr->value) + 2;
+	}
+	len += strlen(content_type) + strlen(content_length) + 2;
+
+	if ((req->head = arena_alloc(req->arena, len + 1)) == NULL) {
+		return ENOMEM;
+	}
+
+	p = stpcpy(req->head, req->method);
+	p = stpcpy(p, " ");
+	p = stpcpy(p, req->path);
+	p = stpcpy(p, " HTTP/1.1\r\n");
+	p = stpcpy(p, stats->header_block);
+	for (hdr = req->headers; hdr; hdr = hdr->next) {
+		p = stpcpy(p, hdr->name);
+		p = stpcpy(p, ": ");
+		p = stpcpy(p, hdr->value);
+		p = stpcpy(p, "\r\n");
+	}
+	p = stpcpy(p, content_type);
+	p = stpcpy(p, content_length);
+	p = stpcpy(p, "\r\n");
+
+	req->head_len = p - req->head;
+	return 0;
+}
+
+/* Neither the head nor the body get copied on the way out */
+/*
+ * Nonzero if it couldn't be queued for sending. If that was the body,
+ * the head has gone out without it and the connection is no good.
+ */
+static int submit_request(struct bufferevent *bev, struct request_ctx *req)
+{
+	struct evbuffer *out = bufferevent_get_output(bev);
+
+	if (evbuffer_add_reference(out, req->head, req->head_len,
+				   (evbuffer_ref_cleanup_cb)NULL, NULL) != 0) {
+		return ENOMEM;
+	}
+
+	/* Refused if the body is a reference itself */
+	if (req->body != NULL &&
+	    evbuffer_add_buffer_reference(out, req->body) != 0) {
+		return EINVAL;
+	}
+
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+
+	evutil_gettimeofday(&req->sent, NULL);
+	arm_hedge(req);
+
+	return 0;
+}
+
+static void reset_read_state(struct request_ctx *req)
+{
+	req->read_state = READ_NONE;
+	req->chunked = 0;
+	req->chunk_size = 0;
+	req->chunk_left = 0;
+	req->content_length = -1;
+	req->reusable = conn_stash_is_keepalive(req->conn_stash);
+
+	/* Only the attempt that gets through is kept */
+	if (req->capture != NULL) {
+		clear_buffer(req->capture);
+	}
+	req->captured = 0;
+	req->capture_last = 0;
+}
+
+static void restart_request(struct request_ctx *req, struct bufferevent *bev);
+
+static void do_store_request_error(struct request_ctx *req, int sock_err)
+{
+	if (req->status != 0) {
+		store_request_error(req, "%s hates me: %s",
+				    req->host, req->status_line);
+	} else {
+		store_request_error(req, "Socket error. errno %d (%s)",
+				    sock_err, evutil_socket_error_to_string(sock_err));
+	}
+}
+
+/*
+ * A request queued on a pipeline that's given up on, by its caller or
+ * by the clock, stays in line to read its response off the
+ * connection. It just doesn't tell anyone any more.
+ */
+static void abandon(struct request_ctx *req)
+{
+	evtimer_del(req->deadline_timer);
+	evutil_timerclear(&req->expires);
+
+	if (req->handle != NULL) {
+		*req->handle = NULL;
+		req->handle = NULL;
+	}
+
+	req->cb_ops = &discard_cb_ops;
+	req->cb_arg = req;
+}
+
+static void cb_deadline(evutil_socket_t fd, short what, void *arg)
+{
+	struct request_ctx *req = arg;
+
+	verbose(ERROR, "%s(): %s %s%s ran out of time waiting for %s\n",
+		__func__, req->method, req->host, req->path, leg_name(req->leg));
+
+	store_request_error(req, "%s took too long (%s)",
+			    req->host, leg_name(req->leg));
+	req->error_status = HTTP_GATEWAYTIMEOUT;
+
+	if (req->pipe != NULL && req->pipe->head != req) {
+		struct https_cb_ops *cb_ops = req->cb_ops;
+		void *cb_arg = req->cb_arg;
+
+		abandon(req);
+		cb_ops->done(req->error_status, req->error, cb_arg);
+		req->error = NULL;
+		return;
+	}
+
+	req->timed_out = 1;
+
+	request_done(req, req->bev);
+}
+
+static void cb_event(struct bufferevent *bev, short what, void *arg)
+{
+	struct request_ctx *req = arg;
+	int sock_err;
+
+	switch (what & ~(BEV_EVENT_READING|BEV_EVENT_WRITING)) {
+	case BEV_EVENT_CONNECTED:
+		verbose(VERBOSE, "%s(): connected to %s:%d, speaking %s\n",
+			__func__, req->host, req->port,
+			conn_stash_protocol(req->conn_stash, bev));
+		conn_stash_connected(req->conn_stash, bev);
+		trace_span(req->trace, "connection", &req->connecting, NULL);
+		break;
+
+	case BEV_EVENT_ERROR:
+		sock_err = EVUTIL_SOCKET_ERROR();
+		verbose(ERROR,
+			"%s(): last socket error is %d (%s)\n",
+			__func__, sock_err,
+			evutil_socket_error_to_string(sock_err));
+
+		pipe_break(req);
+
+		if (req->read_state == READ_NONE && may_retry(req, 0)) {
+			verbose(NORMAL,
+				"%s(): error reported before nothing read."
+				" Restarting request\n", __func__);
+			restart_request(req, bev);
+			return;
+
+		} else if (req->discarding || may_retry(req, 1)) {
+			/* Reset in the middle of a response nobody has
+			 * seen yet. Just ask again.
+			 */
+			retry_later(req);
+			return;
+
+		} else if (req->status != 200) {
+			/* This needs better heuristics. We just
+			 * handle the case of "error when we have
+			 * read response" differently :(
+			 *
+			 * We should at least be able to determine
+			 * that we've consumed the whole response.
+			 */
+			do_store_request_error(req, sock_err);
+		}
+
+		request_done(req, bev);
+		break;
+	case BEV_EVENT_EOF:
+		pipe_break(req);
+
+		if (req->read_state == READ_NONE && may_retry(req, 0)) {
+			/* Most likely a kept-alive connection the other
+			 * end had given up on.
+			 */
+			verbose(NORMAL, "%s(): EOF before anything read."
+				" Restarting request\n", __func__);
+			restart_request(req, bev);
+			return;
+		} else if (req->discarding) {
+			retry_later(req);
+			return;
+		}
+		request_done(req, bev);
+		break;
+	default:
+		verbose(ERROR, "%s(): Unhandled event: %d\n", __func__, what);
+		break;
+	}
+}
+
+
+static void restart_request(struct request_ctx *req, struct bufferevent *bev)
+{
+	int err;
+
+	if (req->attempt > 0) {
+		/* It's not just a stale connection, then. Take it easy. */
+		retry_later(req);
+		return;
+	}
+
+	req->attempt++;
+	cancel_hedge(req);
+
+	bufferevent_disable(bev, EV_READ|EV_WRITE);
+	evutil_gettimeofday(&req->connecting, NULL);
+	err = conn_stash_reconnect(req->conn_stash, &bev);
+	if (err != 0) {
+		/* The old one's no good either, if it's still there */
+		if (bev != NULL) {
+			conn_stash_drop_bev(req->conn_stash, bev);
+		}
+		req->bev = NULL;
+		store_request_error(req, "%s(): %s", __func__, strerror(err));
+		request_done(req, NULL);
+		return;
+	}
+
+	/* This is rather fragile when someone decides
+	 * to add bits into struct request_ctx. We'll need
+	 * to know what to clear. So it could use a bit of
+	 * restructuring
+	 */
+	clear_buffer(bufferevent_get_output(bev));
+	clear_buffer(bufferevent_get_input(bev));
+	reset_read_state(req);
+	req->bev = bev;
+	bufferevent_setcb(bev, cb_read, cb_write, cb_event, req);
+	arm_deadline(req, LEG_CONNECT);
+	if ((err = submit_request(bev, req)) != 0) {
+		store_request_error(req, "%s(): %s", __func__, strerror(err));
+		request_done(req, bev);
+	}
+}
+
+static void forget_response(struct request_ctx *req)
+{
+	reset_read_state(req);
+	req->status = 0;
+	req->status_line = NULL;
+	req->consumed = 0;
+	req->discarding = 0;
+	evutil_timerclear(&req->first_byte);
+	free(req->error);
+	req->error = NULL;
+}
+
+static void retry_later(struct request_ctx *req)
+{
+	struct timeval tv;
+	long cap, ms;
+
+	cancel_hedge(req);
+
+	/* A fully read error response may leave the connection usable */
+	if (req->bev != NULL) {
+		bufferevent_setcb(req->bev, NULL, NULL, NULL, NULL);
+		let_go(req, req->bev);
+		req->bev = NULL;
+	}
+
+	forget_response(req);
+
+	cap = RETRY_BACKOFF_MS << req->attempt;
+	if (cap > RETRY_BACKOFF_MAX_MS) {
+		cap = RETRY_BACKOFF_MAX_MS;
+	}
+	ms = rand_r(&req->https->seed) % (cap + 1);
+
+	req->attempt++;
+
+	verbose(NORMAL, "%s(): attempt %d of %s%s in %ldms\n",
+		__func__, req->attempt + 1, req->host, req->path, ms);
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	evtimer_add(req->retry_timer, &tv);
+}
+
+static int may_pipeline(struct request_ctx *req)
+{
+	return req->https->pipeline_depth > 1 &&
+		conn_stash_is_keepalive(req->conn_stash) &&
+		strcmp(req->method, "GET") == 0 &&
+		req->body == NULL;
+}
+
+static struct pipeline *find_pipeline(struct https_engine *https,
+				      const char *host, int port)
+{
+	struct pipeline *pipe;
+
+	for (pipe = https->pipes; pipe; pipe = pipe->next) {
+		if (pipe->depth < https->pipeline_depth &&
+		    pipe->port == port && strcmp(pipe->host, host) == 0) {
+			break;
 		}
 	}
 
-	buf = bufferevent_get_input(bev);
+	return pipe;
+}
 
-	saved = NULL;
-	before = evbuffer_get_length(buf);
-	if (req->chunked && req->chunk_size > 0 && req->chunk_left < before) {
-		/*
-		 * Save the real buffer away and give the callback
-		 * a temporary one, just the chunk that remains.
-		 */
-		saved = buf;
-		buf = evbuffer_new();
-		evbuffer_remove_buffer(saved, buf, req->chunk_left);
-		before = evbuffer_get_length(buf);
+/* Without one, the request just goes on its own */
+static void new_pipeline(struct request_ctx *req, struct bufferevent *bev)
+{
+	struct https_engine *https = req->https;
+	struct pipeline *pipe;
+
+	if ((pipe = malloc(sizeof(*pipe))) == NULL) {
+		return;
 	}
+	memset(pipe, 0, sizeof(*pipe));
 
+	if ((pipe->host = strdup(req->host)) == NULL) {
+		free(pipe);
+		return;
+	}
+	pipe->port = req->port;
+	pipe->bev = bev;
+	pipe->head = pipe->tail = req;
+	pipe->depth = 1;
 
-	req->cb_ops->read(buf, req->cb_arg);
-	after = evbuffer_get_length(buf);
-	req->consumed += before - after;
-	req->chunk_left -= (before - after);
-	if (req->chunk_size > 0 && req->chunk_left == 0) {
-		/* We've consumed the whole chunk.
-		 * Signal that we need another one.
-		 */
-		req->chunk_size = -1;
+	pipe->next = https->pipes;
+	https->pipes = pipe;
+
+	req->pipe = pipe;
+}
+
+/*
+ * The head again, for HTTP/2: names in lower case, and nothing that's
+ * the connection's business.
+ */
+static int build_h2_head(struct request_ctx *req)
+{
+	struct request_header *hdr;
+	struct h2_header *headers;
+	char *name, *p;
+	int n;
+
+	n = 2;
+	for (hdr = req->headers; hdr; hdr = hdr->next) {
+		n++;
+	}
+	if ((headers = arena_alloc(req->arena, n * sizeof(*headers))) == NULL) {
+		return ENOMEM;
 	}
 
-	if (saved != NULL) {
-		/* saved is actually the buffer in bev */
-		evbuffer_prepend_buffer(saved, buf);
-		evbuffer_free(buf);
+	n = 0;
+	for (hdr = req->headers; hdr; hdr = hdr->next) {
+		if ((name = arena_strdup(req->arena, hdr->name)) == NULL) {
+			return ENOMEM;
+		}
+		for (p = name; *p; p++) {
+			*p = tolower((unsigned char)*p);
+		}
+		headers[n].name = name;
+		headers[n++].value = hdr->value;
+	}
+
+	if (strcmp(req->method, "POST") == 0) {
+		headers[n].name = "content-type";
+		headers[n++].value = "application/x-www-form-urlencoded";
+	}
+
+	if (req->body != NULL) {
+		if ((p = arena_alloc(req->arena, 32)) == NULL) {
+			return ENOMEM;
+		}
+		snprintf(p, 32, "%zu", evbuffer_get_length(req->body));
+		headers[n].name = "content-length";
+		headers[n++].value = p;
+	}
+
+	req->h2_headers = headers;
+	req->h2_nheaders = n;
+	return 0;
+}
+
+static void stream_sent(void *arg)
+{
+	struct request_ctx *req = arg;
+
+	if (req->leg == LEG_CONNECT) {
+		arm_deadline(req, LEG_FIRST_BYTE);
+	}
+}
+
+static void stream_header(const char *name, const char *value, void *arg)
+{
+	struct request_ctx *req = arg;
+	char line[32];
+
+	if (req->read_state == READ_NONE) {
+		answered(req);
+		set_read_state(req, READ_HEADERS);
+	}
+
+	if (strcmp(name, ":status") == 0) {
+		/* There's no reason phrase, so that's what it says */
+		snprintf(line, sizeof(line), "HTTP/2 %s", value);
+		req->status_line = arena_strdup(req->arena, line);
+		take_status(req, atoi(value), req->status_line);
+	} else {
+		handle_header(req, name, value);
+	}
+}
+
+static void stream_data(struct evbuffer *buf, void *arg)
+{
+	struct request_ctx *req = arg;
+
+	if (req->read_state != READ_BODY) {
+		set_read_state(req, READ_BODY);
+	}
+
+	if (req->discarding) {
+		clear_buffer(buf);
+	} else {
+		req->delivered = 1;
+		req->cb_ops->read(buf, req->cb_arg);
 	}
+}
+
+/* Much like a connection going away in cb_event() */
+static void stream_close(int err, void *arg)
+{
+	struct request_ctx *req = arg;
+	struct h2_conn *conn = req->h2;
+
+	/* The stream's over already */
+	req->h2 = NULL;
+	h2_idle_check(conn);
 
-	if ((req->chunked && req->chunk_size == 0) ||
-	    (req->content_length > 0 && req->consumed == req->content_length)) {
+	if (err == 0) {
 		set_read_state(req, READ_DONE);
+		if (req->discarding) {
+			retry_later(req);
+		} else {
+			request_done(req, NULL);
+		}
+		return;
 	}
 
+	verbose(NORMAL, "%s(): %s%s: %s\n",
+		__func__, req->host, req->path, strerror(err));
 
+	/* Refused is as good as never sent */
+	if (req->discarding ||
+	    may_retry(req, req->read_state != READ_NONE && err != ECONNREFUSED)) {
+		retry_later(req);
+		return;
+	}
+
+	do_store_request_error(req, err);
+	request_done(req, NULL);
 }
 
-static void header_keyval(char **key, char **val, char *line)
+static const struct h2_stream_ops stream_ops = {
+	.sent = stream_sent,
+	.header = stream_header,
+	.data = stream_data,
+	.close = stream_close,
+};
+
+/* On req->h2, which is up */
+static int submit_stream(struct request_ctx *req)
 {
-	int i;
+	struct h2_conn *conn = req->h2;
+	int err;
 
-	*key = line;
-	for (i = 0; line[i] != '\0' && line[i] != ':'; i++) {
+	if (req->h2_headers == NULL && (err = build_h2_head(req)) != 0) {
+		req->h2 = NULL;
+		return err;
+	}
+
+	/* There's no HTTP/1.1 coming off the wire to replay */
+	if (req->capture != NULL) {
+		evbuffer_free(req->capture);
+		req->capture = NULL;
+	}
+
+	err = h2_submit(conn->session, &req->stream,
+			req->method, req->host, req->path,
+			req->h2_headers, req->h2_nheaders, req->body,
+			&stream_ops, req);
+	if (err != 0) {
+		req->h2 = NULL;
+		return err;
+	}
+
+	evtimer_del(conn->idle);
+	evutil_gettimeofday(&req->sent, NULL);
+	return 0;
+}
+
+static void h2_conn_free(struct h2_conn *conn)
+{
+	struct h2_conn **connp;
+
+	for (connp = &conn->https->h2_conns; *connp != conn; connp = &(*connp)->next)
 		;
+	*connp = conn->next;
+
+	if (conn->session != NULL) {
+		h2_session_free(conn->session);
+	}
+	if (conn->bev != NULL) {
+		conn_stash_drop_bev(conn->https->conn_stash, conn->bev);
 	}
+	event_free(conn->idle);
+	free(conn->host);
+	free(conn);
+}
 
-	if (line[i] == ':') {
-		line[i] = '\0';
-		while (line[++i] == ' ') {
+static void h2_gone(struct h2_session *session, void *arg)
+{
+	struct h2_conn *conn = arg;
+
+	verbose(VERBOSE, "%s(): lost connection to %s:%d\n",
+		__func__, conn->host, conn->port);
+	h2_conn_free(conn);
+}
+
+static void cb_h2_idle(evutil_socket_t fd, short what, void *arg)
+{
+	struct h2_conn *conn = arg;
+
+	if (h2_session_streams(conn->session) == 0) {
+		verbose(VERBOSE, "%s(): closing idle connection to %s:%d\n",
+			__func__, conn->host, conn->port);
+		h2_conn_free(conn);
+	}
+}
+
+static void h2_conn_failed(struct h2_conn *conn, int err);
+
+static void h2_up(struct h2_conn *conn)
+{
+	struct host_stats *stats;
+	struct request_ctx *req, *next;
+	int err;
+
+	if ((err = h2_session_new(&conn->session, conn->bev, h2_gone, conn)) != 0) {
+		h2_conn_failed(conn, err);
+		return;
+	}
+
+	if ((stats = host_stats(conn->https, conn->host, conn->port)) != NULL) {
+		stats->http11 = 0;
+	}
+
+	req = conn->line;
+	conn->line = NULL;
+	for (; req; req = next) {
+		next = req->h2_next;
+		req->h2_next = NULL;
+		if ((err = submit_stream(req)) != 0) {
+			store_request_error(req, "%s(): %s", __func__, strerror(err));
+			request_done(req, NULL);
+		}
+	}
+
+	h2_idle_check(conn);
+}
+
+/* As if it had been HTTP/1.1 all along, for the first in line */
+static void h2_fallback(struct h2_conn *conn)
+{
+	struct conn_stash *stash = conn->https->conn_stash;
+	struct bufferevent *bev = conn->bev;
+	struct host_stats *stats;
+	struct request_ctx *req, *next;
+	int err;
+
+	if ((stats = host_stats(conn->https, conn->host, conn->port)) != NULL) {
+		stats->http11 = 1;
+	}
+
+	req = conn->line;
+	conn->line = NULL;
+	conn->bev = NULL;
+	h2_conn_free(conn);
+
+	if (req == NULL) {
+		/* Everyone gave up waiting, but it's good to go */
+		bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+		conn_stash_put_bev(stash, bev);
+		return;
+	}
+
+	next = req->h2_next;
+	req->h2_next = NULL;
+	req->h2 = NULL;
+
+	if (may_pipeline(req)) {
+		new_pipeline(req, bev);
+	}
+	req->bev = bev;
+	bufferevent_setcb(bev, cb_read, cb_write, cb_event, req);
+	if ((err = submit_request(bev, req)) != 0) {
+		pipe_break(req);
+		conn_stash_drop_bev(stash, bev);
+		req->bev = NULL;
+		store_request_error(req, "%s(): %s", __func__, strerror(err));
+		request_done(req, NULL);
+	}
+
+	/* They might just fit on its pipeline */
+	for (req = next; req; req = next) {
+		next = req->h2_next;
+		req->h2_next = NULL;
+		req->h2 = NULL;
+		pipe_requeue(req);
+	}
+}
+
+static void h2_conn_failed(struct h2_conn *conn, int err)
+{
+	struct request_ctx *req, *next;
+
+	verbose(ERROR, "%s(): connecting to %s:%d failed: %s\n",
+		__func__, conn->host, conn->port, strerror(err));
+
+	req = conn->line;
+	conn->line = NULL;
+	h2_conn_free(conn);
+
+	for (; req; req = next) {
+		next = req->h2_next;
+		req->h2_next = NULL;
+		req->h2 = NULL;
+		if (may_retry(req, 0)) {
+			retry_later(req);
+		} else {
+			do_store_request_error(req, err);
+			request_done(req, NULL);
+		}
+	}
+}
+
+static void h2_conn_event(struct bufferevent *bev, short what, void *arg)
+{
+	struct h2_conn *conn = arg;
+	struct conn_stash *stash = conn->https->conn_stash;
+	const char *protocol;
+
+	if (!(what & BEV_EVENT_CONNECTED)) {
+		h2_conn_failed(conn, what & BEV_EVENT_EOF
+			       ? ECONNRESET : EVUTIL_SOCKET_ERROR());
+		return;
+	}
+
+	protocol = conn_stash_protocol(stash, bev);
+	verbose(VERBOSE, "%s(): connected to %s:%d, speaking %s\n",
+		__func__, conn->host, conn->port, protocol);
+	conn_stash_connected(stash, bev);
+	if (conn->line != NULL) {
+		trace_span(conn->line->trace, "connection",
+			   &conn->line->connecting, NULL);
+	}
+
+	if (strcmp(protocol, "h2") == 0) {
+		h2_up(conn);
+	} else {
+		h2_fallback(conn);
+	}
+}
+
+/* A connection to req's host to go on, or to wait for */
+static struct h2_conn *find_h2(struct request_ctx *req)
+{
+	struct host_stats *stats;
+	struct h2_conn *conn;
+
+	stats = host_stats(req->https, req->host, req->port);
+
+	for (conn = req->https->h2_conns; conn; conn = conn->next) {
+		if (conn->port != req->port || strcmp(conn->host, req->host) != 0) {
+			continue;
+		}
+		if (conn->session != NULL
+		    ? h2_session_usable(conn->session)
+		    : stats == NULL || !stats->http11) {
+			break;
+		}
+	}
+
+	return conn;
+}
+
+static int h2_join(struct request_ctx *req, struct h2_conn *conn)
+{
+	struct request_ctx **reqp;
+	int err;
+
+	req->h2 = conn;
+	if (conn->session != NULL) {
+		if ((err = submit_stream(req)) != 0) {
+			return err;
+		}
+	} else {
+		verbose(VERBOSE, "%s(): %s%s waits for a connection\n",
+			__func__, req->host, req->path);
+		for (reqp = &conn->line; *reqp != NULL; reqp = &(*reqp)->h2_next)
 			;
+		*reqp = req;
+	}
+
+	return 0;
+}
+
+/* bev is on its way up, and req is first in line */
+static int h2_connect(struct request_ctx *req, struct bufferevent *bev)
+{
+	struct https_engine *https = req->https;
+	struct h2_conn *conn;
+
+	if ((conn = malloc(sizeof(*conn))) == NULL) {
+		conn_stash_drop_bev(https->conn_stash, bev);
+		return ENOMEM;
+	}
+	memset(conn, 0, sizeof(*conn));
+
+	if ((conn->host = strdup(req->host)) == NULL ||
+	    (conn->idle = evtimer_new(https->event_base, cb_h2_idle, conn)) == NULL) {
+		free(conn->host);
+		free(conn);
+		conn_stash_drop_bev(https->conn_stash, bev);
+		return ENOMEM;
+	}
+	conn->https = https;
+	conn->port = req->port;
+	conn->bev = bev;
+	conn->next = https->h2_conns;
+	https->h2_conns = conn;
+
+	bufferevent_setcb(bev, NULL, NULL, h2_conn_event, conn);
+
+	return h2_join(req, conn);
+}
+
+static int start_request(struct request_ctx *req)
+{
+	struct pipeline *pipe;
+	struct h2_conn *conn;
+	struct bufferevent *bev;
+	int err;
+
+	if (req->https->h2 && (conn = find_h2(req)) != NULL) {
+		return h2_join(req, conn);
+	}
+
+	if (may_pipeline(req) &&
+	    (pipe = find_pipeline(req->https, req->host, req->port)) != NULL) {
+		verbose(VERBOSE, "%s(): %s%s queued behind %d\n",
+			__func__, req->host, req->path, pipe->depth);
+
+		/* GETs only, so it's all or nothing */
+		req->pipe = pipe;
+		if ((err = submit_request(pipe->bev, req)) != 0) {
+			req->pipe = NULL;
+			return err;
 		}
+
+		pipe->tail->pipe_next = req;
+		pipe->tail = req;
+		pipe->depth++;
+		req->bev = pipe->bev;
+
+		/* The connection's up already, or will be for the head */
+		arm_deadline(req, LEG_FIRST_BYTE);
+		return 0;
 	}
-	*val = &line[i];
+
+	/* Only used if it turns out to be a fresh connection */
+	evutil_gettimeofday(&req->connecting, NULL);
+
+	bev = conn_stash_get_bev(req->conn_stash, req->host, req->port,
+				 req->trace);
+	if (bev == NULL) {
+		return ENOTCONN;
+	}
+
+	/* A new one, which may yet turn out to speak h2 */
+	if (req->https->h2 && conn_stash_protocol(req->conn_stash, bev) == NULL) {
+		return h2_connect(req, bev);
+	}
+
+	if (may_pipeline(req)) {
+		new_pipeline(req, bev);
+	}
+
+	req->bev = bev;
+	bufferevent_setcb(bev, cb_read, cb_write, cb_event, req);
+	if ((err = submit_request(bev, req)) != 0) {
+		evtimer_del(req->deadline_timer);
+		pipe_break(req);
+		conn_stash_drop_bev(req->conn_stash, bev);
+		req->bev = NULL;
+		return err;
+	}
+	return 0;
 }
 
+static void cb_retry(evutil_socket_t fd, short what, void *arg)
+{
+	struct request_ctx *req = arg;
 
-static void handle_header(struct request_ctx *req, const char *key, const char *val)
+	/* A new attempt gets all of the connect budget again */
+	arm_deadline(req, LEG_CONNECT);
+	if (start_request(req) != 0) {
+		store_request_error(req, "%s(): failed to set up connection", __func__);
+		request_done(req, NULL);
+	}
+}
+
+/*
+ * Slots have come free. Those first in line get them, unless their
+ * class has had its share, in which case the next one in line might.
+ */
+static void cb_dispatch(evutil_socket_t fd, short what, void *arg)
 {
-	if (strcmp(key, "Content-Length") == 0) {
-		req->content_length = atoi(val);
-	} else if (strcmp(key, "Transfer-Encoding") == 0 &&
-		   strcmp(val, "chunked") == 0) {
-		req->chunked = 1;
-		req->chunk_size = -1;
-		req->chunk_left = -1;
+	struct https_engine *https = arg;
+	struct request_ctx *req;
+
+	for (req = https->waiting; req != NULL && https->slots < https->max_slots; ) {
+		if (!slot_free(https, req->priority)) {
+			req = req->wait_next;
+			continue;
+		}
+
+		unqueue(req);
+		take_slot(req);
+		if (req->finish > https->vtime) {
+			https->vtime = req->finish;
+		}
+
+		metric_observe(https->slot_wait[req->priority], &req->queued, NULL);
+		trace_span(req->trace, "slot", &req->queued, NULL);
+
+		if (start_request(req) != 0) {
+			store_request_error(req, "%s(): failed to set up connection", __func__);
+			request_done(req, NULL);
+		}
+
+		/* Whoever was called back may have changed the line */
+		req = https->waiting;
+	}
+}
+
+/*
+ * Off a pipeline that broke before we got our answer, or out of line
+ * for a connection that turned out not to speak h2. It never got a
+ * response, so it doesn't count as an attempt.
+ */
+static void pipe_requeue(struct request_ctx *req)
+{
+	req->pipe = NULL;
+	req->pipe_next = NULL;
+	req->bev = NULL;
+
+	if (req->cb_ops == &discard_cb_ops) {
+		/* Nobody wants it any more */
+		stop_timers(req);
+		free_request(req);
+		return;
 	}
 
-	if (req->cb_ops->response_header) {
-		req->cb_ops->response_header(key, val, req->cb_arg);
+	forget_response(req);
+
+	/* One that was still connecting carries on with what's left */
+	if (req->leg != LEG_CONNECT) {
+		arm_deadline(req, LEG_CONNECT);
+	}
+	if (start_request(req) != 0) {
+		store_request_error(req, "%s(): failed to set up connection", __func__);
+		request_done(req, NULL);
 	}
 }
 
-static void cb_read(struct bufferevent *bev, void *arg)
+static void hedge_read(struct bufferevent *bev, void *arg)
 {
-	struct request_ctx *req = arg;
-	char *line;
-	size_t n;
+	struct request_ctx *hedge = arg;
+	struct request_ctx *req = hedge->twin;
 
-	if (req->read_state == READ_NONE) {
-		req->read_state = READ_STATUS;
-	}
+	verbose(VERBOSE, "%s(): hedge won for %s%s\n",
+		__func__, req->host, req->path);
 
-	while (req->read_state == READ_STATUS || req->read_state == READ_HEADERS) {
+	/* The primary hasn't read a thing or the hedge would be gone.
+	 * Its connection is mid-request, so there's no reusing it.
+	 */
+	evtimer_del(req->hedge_timer);
+	conn_stash_drop_bev(req->conn_stash, req->bev);
+	req->twin = NULL;
 
-		line = read_line(bev, &n);
-		if (line == NULL) {
+	req->bev = bev;
+	req->sent = hedge->sent;
+	bufferevent_setcb(bev, cb_read, cb_write, cb_event, req);
+
+	cb_read(bev, req);
+}
+
+static void hedge_event(struct bufferevent *bev, short what, void *arg)
+{
+	struct request_ctx *hedge = arg;
+
+	if (what & BEV_EVENT_CONNECTED) {
+		if (strcmp(conn_stash_protocol(hedge->conn_stash, bev), "h2") == 0) {
+			/* It's had HTTP/1.1 written to it already */
+			verbose(VERBOSE, "%s(): hedge speaks h2, primary carries on\n",
+				__func__);
+			cancel_hedge(hedge->twin);
 			return;
 		}
+		conn_stash_connected(hedge->conn_stash, bev);
+	} else if (what & (BEV_EVENT_ERROR|BEV_EVENT_EOF)) {
+		verbose(VERBOSE, "%s(): hedge failed, primary carries on\n", __func__);
+		cancel_hedge(hedge->twin);
+	}
+}
 
-		if (req->read_state == READ_STATUS) {
-			verbose(VERBOSE, "%s(): status line: '%s'\n", __func__, line);
-			parse_status(req, line, n);
-			set_read_state(req, READ_HEADERS);
-		} else {
-			while (line && req->read_state == READ_HEADERS) {
-				if (*line == '\0') {
-					set_read_state(req, READ_BODY);
-				} else {
-					char *key, *val;
-					verbose(VERBOSE, "%s(): header line '%s'\n", __func__, line);
-					header_keyval(&key, &val, line);
-					handle_header(req, key, val);
-					free(line);
-					line = read_line(bev, &n);
-				}
-			}
-		}
+static void cb_hedge(evutil_socket_t fd, short what, void *arg)
+{
+	struct request_ctx *req = arg;
+	struct request_ctx *hedge;
+	struct bufferevent *bev;
 
-		free(line);
+	if (req->twin != NULL || req->read_state != READ_NONE || req->bev == NULL) {
+		return;
+	}
 
+	if ((hedge = arena_alloc(req->arena, sizeof(*hedge))) == NULL) {
+		return;
 	}
 
-	while (req->read_state == READ_BODY && evbuffer_get_length(bufferevent_get_input(bev)) > 0) {
-		drain_body(req, bev);
+	bev = conn_stash_get_bev(req->conn_stash, req->host, req->port,
+				 req->trace);
+	if (bev == NULL) {
+		return;
 	}
 
-	if (req->read_state == READ_DONE) {
-		request_done(req, bev);
+	verbose(VERBOSE, "%s(): %s%s is slow, hedging\n",
+		__func__, req->host, req->path);
+
+	/* Same request, minus everything that is the primary's to
+	 * look after: the caller, the timers and the error.
+	 */
+	*hedge = *req;
+	hedge->is_hedge = 1;
+	hedge->twin = req;
+	hedge->handle = NULL;
+	hedge->error = NULL;
+	hedge->has_slot = 0;
+	hedge->bev = bev;
+	req->twin = hedge;
+
+	bufferevent_setcb(bev, hedge_read, cb_write, hedge_event, hedge);
+	if (submit_request(bev, hedge) != 0) {
+		req->twin = NULL;
+		conn_stash_drop_bev(req->conn_stash, bev);
+	}
+}
+
+struct request_ctx *https_request_new(struct https_engine *https,
+				      const char *host, int port,
+				      const char *method, const char *path)
+{
+	struct request_ctx *request;
+	struct arena *arena;
+	struct event *timers;
+	size_t evsz;
+
+	evsz = event_get_struct_event_size();
+
+	if ((arena = https_arena_new(https)) == NULL ||
+	    (request = arena_alloc(arena, sizeof(*request))) == NULL ||
+	    (timers = arena_alloc(arena, 3 * evsz)) == NULL) {
+		arena_free(arena);
+		return NULL;
 	}
+	memset(request, 0, sizeof(*request));
+	request->deadline_timer = timers;
+	request->retry_timer = (struct event *)((char *)timers + evsz);
+	request->hedge_timer = (struct event *)((char *)timers + 2 * evsz);
+	request->arena = arena;
+	request->https = https;
+	request->method = method;
+	request->host = host;
+	request->port = port;
+	request->path = path;
+	request->headers_tail = &request->headers;
 
+	return request;
 }
 
-static __attribute__((format(printf,2,3))) void store_request_error(struct request_ctx *req,
-								    const char *fmt, ...)
+int https_request_add_header(struct request_ctx *req, const char *name,
+			     const char *fmt, ...)
 {
-	char buf[512];
+	struct request_header *hdr;
 	va_list ap;
+	int len;
 
 	va_start(ap, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, ap);
+	len = vsnprintf(NULL, 0, fmt, ap);
 	va_end(ap);
 
-	req->error = strdup(buf);
+	if ((hdr = arena_alloc(req->arena, sizeof(*hdr))) == NULL ||
+	    (hdr->name = arena_strdup(req->arena, name)) == NULL ||
+	    (hdr->value = arena_alloc(req->arena, len + 1)) == NULL) {
+		return ENOMEM;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(hdr->value, len + 1, fmt, ap);
+	va_end(ap);
+
+	hdr->next = NULL;
+	*req->headers_tail = hdr;
+	req->headers_tail = &hdr->next;
+
+	return 0;
+}
 
+void https_request_set_body(struct request_ctx *req, struct evbuffer *body)
+{
+	if (req->body != NULL) {
+		evbuffer_free(req->body);
+	}
+	req->body = body;
 }
 
-static void submit_request(struct bufferevent *bev, struct request_ctx *req)
+void https_request_set_trace(struct request_ctx *req, unsigned int trace)
 {
-	evbuffer_add_printf(bufferevent_get_output(bev),
-			    "%s %s HTTP/1.1\r\n"
-			    "Host: %s\r\n"
-			    "Connection: %s\r\n",
-			    req->method,
-			    req->path,
-			    req->host,
-			    conn_stash_is_keepalive(req->conn_stash)
-			    ? "Keep-Alive"
-			    : "close");
+	req->trace = trace;
+}
 
+void https_request_set_priority(struct request_ctx *req,
+				enum https_priority priority,
+				const void *owner)
+{
+	int waiting = req->waiting;
 
-	if (req->access_token != NULL) {
-		evbuffer_add_printf(bufferevent_get_output(bev),
-				    "Authorization: Bearer %s\r\n",
-				    req->access_token);
+	if (waiting) {
+		unqueue(req);
+	}
+	if (req->has_slot) {
+		/* It's through, it just counts elsewhere now */
+		req->https->class_slots[req->priority]--;
+		count_slots(req->https, req->priority);
+		req->https->class_slots[priority]++;
+		count_slots(req->https, priority);
 	}
 
-	if (strcmp(req->method, "POST") == 0) {
-		evbuffer_add_printf(bufferevent_get_output(bev),
-				    "Content-Type: application/x-www-form-urlencoded\r\n");
+	req->priority = priority;
+	req->owner = owner;
+
+	if (waiting) {
+		enqueue(req);
+		event_active(req->https->dispatch, EV_TIMEOUT, 0);
 	}
+}
+
+void https_request_free(struct request_ctx *req)
+{
+	free_request(req);
+}
 
-	if (req->request_body != NULL) {
-		evbuffer_add_printf(bufferevent_get_output(bev),
-				    "Content-Length: %zd\r\n",
-				    req->request_body_length);
+void https_request_send(struct request_ctx *request,
+			const struct https_deadline *deadline,
+			struct https_cb_ops *cb_ops,
+			void *cb_arg,
+			struct request_ctx **handle)
+{
+	struct https_engine *https = request->https;
+	struct timeval now;
+
+	evutil_gettimeofday(&request->started, NULL);
+
+	if (build_head(request) != 0) {
+		free_request(request);
+		cb_ops->done(HTTP_INTERNAL, strdup("Out of memory"), cb_arg);
+		return;
 	}
 
-	evbuffer_add_printf(bufferevent_get_output(bev), "\r\n");
+	request->deadline = deadline != NULL ? *deadline : https->default_deadline;
 
-	if (req->request_body != NULL) {
-		evbuffer_add_reference(bufferevent_get_output(bev),
-				       req->request_body,
-				       req->request_body_length,
-				       (evbuffer_ref_cleanup_cb)NULL,
-				       NULL);
+	if (evutil_timerisset(&request->deadline.total)) {
+		evutil_gettimeofday(&now, NULL);
+		evutil_timeradd(&now, &request->deadline.total, &request->expires);
 	}
+	request->cb_ops = cb_ops;
+	request->cb_arg = cb_arg;
+	request->conn_stash = https->conn_stash;
 
-	bufferevent_enable(bev, EV_READ|EV_WRITE);
+	if (https->capture_dir != NULL && strcmp(request->method, "GET") == 0) {
+		/* Fine if it fails, there's just no capture */
+		request->capture = evbuffer_new();
+	}
+	reset_read_state(request);
+
+	/* These sit inside the arena, so there's nothing to free() later */
+	evtimer_assign(request->deadline_timer, https->event_base,
+		       cb_deadline, request);
+	evtimer_assign(request->retry_timer, https->event_base,
+		       cb_retry, request);
+	evtimer_assign(request->hedge_timer, https->event_base,
+		       cb_hedge, request);
+
+	/* From here on, waiting for a slot included. Nothing up to the
+	 * request going out arms it again.
+	 */
+	arm_deadline(request, LEG_CONNECT);
+
+	if (https->max_slots > 0 &&
+	    (https->waiting != NULL || !slot_free(https, request->priority))) {
+		/* Whoever's ahead goes first, see cb_dispatch() */
+		evutil_gettimeofday(&request->queued, NULL);
+		enqueue(request);
+		event_active(https->dispatch, EV_TIMEOUT, 0);
+	} else {
+		if (https->max_slots > 0) {
+			take_slot(request);
+		}
+		if (start_request(request) != 0) {
+			stop_timers(request);
+			free_request(request);
+			cb_ops->done(HTTP_INTERNAL, strdup("Failed to set up connection"), cb_arg);
+			return;
+		}
+	}
 
+	if (handle != NULL) {
+		*handle = request;
+		request->handle = handle;
+	}
 }
 
-static void reset_read_state(struct request_ctx *req)
+void https_request(struct https_engine *https,
+		   const char *host, int port,
+		   const char *method, const char *path,
+		   const char *access_token,
+		   struct evbuffer *body,
+		   const struct https_deadline *deadline,
+		   struct https_cb_ops *cb_ops,
+		   void *cb_arg,
+		   struct request_ctx **handle)
 {
-	req->read_state = READ_NONE;
-	req->chunked = 0;
-	req->chunk_size = 0;
-	req->chunk_left = 0;
-	req->content_length = 0;
-}
+	struct request_ctx *request;
+	struct evbuffer *copy;
+	int err;
 
-static void restart_request(struct request_ctx *req, struct bufferevent *bev);
+	if ((request = https_request_new(https, host, port, method, path)) == NULL) {
+		cb_ops->done(HTTP_INTERNAL, strdup("Out of memory"), cb_arg);
+		return;
+	}
 
-static void do_store_request_error(struct request_ctx *req, int sock_err)
-{
-	if (req->status != 0) {
-		store_request_error(req, "%s hates me: %s",
-				    req->host, req->status_line);
-	} else {
-		store_request_error(req, "Socket error. errno %d (%s)",
-				    sock_err, evutil_socket_error_to_string(sock_err));
+	err = 0;
+	if (access_token != NULL) {
+		err = https_request_add_header(request, "Authorization",
+					       "Bearer %s", access_token);
+	}
+
+	/* The caller keeps theirs. Not a reference to it, those
+	 * can't be referenced again when it's sent.
+	 */
+	if (err == 0 && body != NULL) {
+		if ((copy = evbuffer_new()) == NULL ||
+		    evbuffer_add(copy, evbuffer_pullup(body, -1),
+				 evbuffer_get_length(body)) != 0) {
+			if (copy != NULL) {
+				evbuffer_free(copy);
+			}
+			err = ENOMEM;
+		} else {
+			https_request_set_body(request, copy);
+		}
 	}
+
+	if (err != 0) {
+		free_request(request);
+		cb_ops->done(HTTP_INTERNAL, strdup("Out of memory"), cb_arg);
+		return;
+	}
+
+	https_request_send(request, deadline, cb_ops, cb_arg, handle);
 }
 
-static void cb_event(struct bufferevent *bev, short what, void *arg)
+static void discard_read(struct evbuffer *buf, void *arg)
 {
-	struct request_ctx *req = arg;
-	int sock_err;
+	clear_buffer(buf);
+}
 
-	switch (what & ~(BEV_EVENT_READING|BEV_EVENT_WRITING)) {
-	case BEV_EVENT_CONNECTED:
-		break;
+static void discard_done(int err_status, char *err_msg, void *arg)
+{
+	free(err_msg);
+}
 
-	case BEV_EVENT_ERROR:
-		sock_err = EVUTIL_SOCKET_ERROR();
-		verbose(ERROR,
-			"%s(): last socket error is %d (%s)\n",
-			__func__, sock_err,
-			evutil_socket_error_to_string(sock_err));
+/* What's left of a cancelled request goes here */
+static struct https_cb_ops discard_cb_ops = {
+	.read = discard_read,
+	.done = discard_done,
+};
 
-		if (req->read_state == READ_NONE) {
-			verbose(NORMAL,
-				"%s(): error reported before nothing read."
-				" Restarting request\n", __func__);
-			restart_request(req, bev);
-			return;
+void https_request_cancel(struct request_ctx *req)
+{
+	verbose(VERBOSE, "%s(): %s %s%s\n", __func__,
+		req->method, req->host, req->path);
 
-		} else if (req->status != 200) {
-			/* This needs better heuristics. We just
-			 * handle the case of "error when we have
-			 * read response" differently :(
-			 *
-			 * We should at least be able to determine
-			 * that we've consumed the whole response.
-			 */
-			do_store_request_error(req, sock_err);
+	req->handle = NULL;
+	req->cb_ops = &discard_cb_ops;
+	req->cb_arg = req;
+
+	evtimer_del(req->retry_timer);
+	cancel_hedge(req);
+
+	if (req->pipe != NULL && req->pipe->depth > 1) {
+		/* Others share the connection. It still has to read
+		 * its response off it, when its turn comes.
+		 */
+		if (req->pipe->head != req) {
+			abandon(req);
 		}
+		return;
+	}
 
-		request_done(req, bev);
-		break;
-	case BEV_EVENT_EOF:
-		request_done(req, bev);
-		break;
-	default:
-		verbose(ERROR, "%s(): Unhandled event: %d\n", __func__, what);
-		break;
+	/* If we know where the response ends we can read it to
+	 * the end and keep the connection. Otherwise it's a goner.
+	 */
+	if (req->bev == NULL) {
+		/* Between attempts, or on HTTP/2, where it's just the
+		 * stream that goes
+		 */
+		evtimer_del(req->deadline_timer);
+		free_request(req);
+	} else if (req->read_state == READ_BODY &&
+	    (req->chunked || req->content_length >= 0)) {
+		verbose(VERBOSE, "%s(): draining the rest for reuse\n", __func__);
+		while (req->read_state == READ_BODY &&
+		       evbuffer_get_length(bufferevent_get_input(req->bev)) > 0) {
+			if (drain_body(req, req->bev) != 0) {
+				break;
+			}
+		}
+		capture_left(req, req->bev);
+		if (req->read_state == READ_DONE) {
+			request_done(req, req->bev);
+		}
+	} else {
+		evtimer_del(req->deadline_timer);
+		pipe_break(req);
+		conn_stash_drop_bev(req->conn_stash, req->bev);
+		free_request(req);
 	}
 }
 
-static void clear_buffer(struct evbuffer *buf)
+static void replay_schedule(struct request_ctx *req)
 {
-	evbuffer_drain(buf, evbuffer_get_length(buf));
+	struct replay *replay = req->replay;
+	struct timeval now, due, tv;
+	uint32_t rec[2];
+
+	evutil_timerclear(&tv);
+
+	if (replay->realtime && replay->len - replay->pos >= sizeof(rec)) {
+		memcpy(rec, replay->data + replay->pos, sizeof(rec));
+		tv.tv_sec = rec[0] / 1000000;
+		tv.tv_usec = rec[0] % 1000000;
+		evutil_timeradd(&replay->started, &tv, &due);
+
+		evutil_gettimeofday(&now, NULL);
+		if (evutil_timercmp(&due, &now, >)) {
+			evutil_timersub(&due, &now, &tv);
+		} else {
+			evutil_timerclear(&tv);
+		}
+	}
+
+	evtimer_add(replay->timer, &tv);
 }
 
-static void restart_request(struct request_ctx *req, struct bufferevent *bev)
+/* One record per go, so each gets a cb_read() of its own */
+static void cb_replay(evutil_socket_t fd, short what, void *arg)
 {
-	int err;
+	struct request_ctx *req = arg;
+	struct replay *replay = req->replay;
+	unsigned char *bytes;
+	uint32_t rec[2];
 
-	bufferevent_disable(bev, EV_READ|EV_WRITE);
-	err = conn_stash_reconnect(req->conn_stash, &bev);
-	if (err == 0) {
-		/* This is rather fragile when someone decides
-		 * to add bits into struct request_ctx. We'll need
-		 * to know what to clear. So it could use a bit of
-		 * restructuring
+	if (replay->len - replay->pos < sizeof(rec)) {
+		/* Out of records and the response hasn't ended. Fine
+		 * if it was one that ends with the connection.
 		 */
-		clear_buffer(bufferevent_get_output(bev));
-		clear_buffer(bufferevent_get_input(bev));
-		reset_read_state(req);
-		bufferevent_setcb(bev, cb_read, cb_write, cb_event, req);
-		submit_request(bev, req);
-	} else {
-		store_request_error(req, "%s(): %s", __func__, strerror(err));
-		request_done(req, bev);
+		if (req->read_state != READ_BODY || req->chunked ||
+		    req->content_length >= 0) {
+			store_request_error(req, "Capture ends mid-response");
+		}
+		request_done(req, req->bev);
+		return;
+	}
+
+	memcpy(rec, replay->data + replay->pos, sizeof(rec));
+	if (rec[1] > replay->len - replay->pos - sizeof(rec)) {
+		store_request_error(req, "Capture is cut short");
+		request_done(req, req->bev);
+		return;
 	}
+	bytes = replay->data + replay->pos + sizeof(rec);
+	replay->pos += sizeof(rec) + rec[1];
+
+	/* Before the write, which may well be the end of us */
+	replay_schedule(req);
+
+	bufferevent_write(replay->wire, bytes, rec[1]);
 }
 
-static int setup_request_body(struct request_ctx *req, struct evbuffer *body)
+static int read_file(const char *path, unsigned char **datap, size_t *lenp)
 {
-	size_t len;
+	unsigned char *data;
+	struct stat st;
+	size_t off;
+	ssize_t n;
+	int fd, err;
 
-	if (body != NULL) {
-		len = evbuffer_get_length(body);
-		req->request_body = malloc(len);
-		if (req->request_body == NULL) {
-			return ENOMEM;
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		return errno;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		err = errno;
+		close(fd);
+		return err;
+	}
+
+	if ((data = malloc(st.st_size + 1)) == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	for (off = 0; off < st.st_size; off += n) {
+		if ((n = read(fd, data + off, st.st_size - off)) <= 0) {
+			err = n == 0 ? EINVAL : errno;
+			free(data);
+			close(fd);
+			return err;
 		}
-		evbuffer_copyout(body, req->request_body, len);
-		req->request_body_length = len;
 	}
+	close(fd);
+
+	/* Keeps the header line a string, if nothing else */
+	data[off] = '\0';
+
+	*datap = data;
+	*lenp = off;
 	return 0;
 }
 
-
-void https_request(struct https_engine *https,
-		   const char *host, int port,
-		   const char *method, const char *path,
-		   const char *access_token,
-		   struct evbuffer *body,
-		   struct https_cb_ops *cb_ops,
-		   void *cb_arg)
+int https_replay(struct https_engine *https, const char *path, int realtime,
+		 struct https_cb_ops *cb_ops, void *cb_arg)
 {
-	struct request_ctx *request;
-	struct bufferevent *bev;
+	struct request_ctx *req;
+	struct replay *replay;
+	struct event *timer;
+	struct bufferevent *pair[2];
+	unsigned char *data;
+	char *line, *end, *field[6];
+	size_t len;
+	int i, err;
 
-	if ((request = malloc(sizeof(*request))) == NULL) {
-		cb_ops->done("Out of memory", cb_arg);
-		return;
+	data = NULL;
+	len = 0;
+	if ((err = read_file(path, &data, &len)) != 0) {
+		return err;
 	}
-	memset(request, 0, sizeof(*request));
-	request->method = method;
-	request->host = host;
-	request->port = port;
-	request->path = path;
-	request->access_token = access_token;
-	setup_request_body(request, body);
-	request->cb_ops = cb_ops;
-	request->cb_arg = cb_arg;
-	request->conn_stash = https->conn_stash;
 
-	bev = conn_stash_get_bev(https->conn_stash, host, port);
-	if (bev == NULL) {
-		cb_ops->done("Failed to set up connection", cb_arg);
-		free(request);
-		return;
+	if ((end = memchr(data, '\n', len)) == NULL) {
+		free(data);
+		return EINVAL;
+	}
+	*end = '\0';
+
+	if ((req = https_request_new(https, NULL, 0, NULL, NULL)) == NULL ||
+	    (line = arena_strdup(req->arena, (char *)data)) == NULL ||
+	    (replay = arena_alloc(req->arena, sizeof(*replay))) == NULL ||
+	    (timer = arena_alloc(req->arena, event_get_struct_event_size())) == NULL) {
+		if (req != NULL) {
+			free_request(req);
+		}
+		free(data);
+		return ENOMEM;
+	}
+
+	/* ytcap 1 <method> <host> <port> <path> */
+	for (i = 0; i < 6; i++) {
+		field[i] = strsep(&line, " ");
+	}
+	if (field[5] == NULL || strcmp(field[0], "ytcap") != 0 ||
+	    strcmp(field[1], "1") != 0) {
+		verbose(ERROR, "%s(): %s isn't a capture\n", __func__, path);
+		free_request(req);
+		free(data);
+		return EINVAL;
+	}
+
+	if (bufferevent_pair_new(https->event_base, 0, pair) != 0) {
+		free_request(req);
+		free(data);
+		return ENOMEM;
 	}
 
-	bufferevent_setcb(bev, cb_read, cb_write, cb_event, request);
-	submit_request(bev, request);
+	memset(replay, 0, sizeof(*replay));
+	replay->timer = timer;
+	replay->data = data;
+	replay->len = len;
+	replay->pos = end + 1 - (char *)data;
+	replay->realtime = realtime;
+	replay->wire = pair[1];
+	evtimer_assign(replay->timer, https->event_base, cb_replay, req);
+
+	req->method = field[2];
+	req->host = field[3];
+	req->port = atoi(field[4]);
+	req->path = field[5];
+	req->replay = replay;
+
+	req->cb_ops = cb_ops;
+	req->cb_arg = cb_arg;
+	req->conn_stash = https->conn_stash;
+	reset_read_state(req);
+
+	/* Never armed, but cb_read() and request_done() expect them */
+	evtimer_assign(req->deadline_timer, https->event_base,
+		       cb_deadline, req);
+	evtimer_assign(req->retry_timer, https->event_base,
+		       cb_retry, req);
+	evtimer_assign(req->hedge_timer, https->event_base,
+		       cb_hedge, req);
+
+	req->bev = pair[0];
+	bufferevent_setcb(pair[0], cb_read, NULL, cb_event, req);
+	bufferevent_enable(pair[0], EV_READ);
+	bufferevent_enable(pair[1], EV_WRITE);
+
+	verbose(VERBOSE, "%s(): %s %s%s from %s\n",
+		__func__, req->method, req->host, req->path, path);
+
+	evutil_gettimeofday(&req->started, NULL);
+	req->sent = replay->started = req->started;
+	replay_schedule(req);
 
+	return 0;
 }
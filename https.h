@@ -4,26 +4,230 @@
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 
+#include "conn_stash.h"
+
 struct https_engine;
+struct request_ctx;
+struct arena;
+
+/* Where requests of one kind go */
+struct https_endpoint {
+	const char *host;
+	int port;
+};
+
+/* A host we want connections to ready before anyone asks */
+struct https_warm_target {
+	const char *host;
+	int port;
+	int min_idle;
+};
+
+/* Connect to to_host:to_port whenever asked for host:port */
+struct https_connect_to {
+	const char *host;
+	int port;
+	const char *to_host;
+	int to_port;
+};
+
+struct https_options {
+	/* Pass "Connection: close" and never reuse a connection */
+	int no_keepalive;
+
+	/* Seconds an idle kept-alive connection is kept around for */
+	int idle_timeout;
+
+	/* Terminated by one with a NULL host. May be NULL. */
+	const struct https_warm_target *warm;
+
+	/* Likewise */
+	const struct https_connect_to *connect_to;
+
+	/* GETs to the same host share a connection, this many at a
+	 * time, instead of waiting for their own. 0 or 1 to turn it off.
+	 */
+	int pipeline_depth;
+
+	/* Where to save what GETs get back, see https_replay(). NULL
+	 * to not bother.
+	 */
+	const char *capture_dir;
+
+	/* NULL for TLS. With conn_transport_pair, pair_accept serves
+	 * the other end.
+	 */
+	const struct conn_transport *transport;
+	conn_pair_accept_cb pair_accept;
+	void *pair_arg;
+
+	/* Kernel TLS, see conn_stash_ktls() */
+	int ktls;
+
+	/* Requests at upstream at once, at most, shared out by
+	 * priority, see https_request_set_priority(). 0 for no limit.
+	 */
+	int max_slots;
+
+	/* Offer HTTP/2 over ALPN, and send everything for a host over the
+	 * one connection, a stream a request, where it's taken up. TLS
+	 * only, and not with no_keepalive.
+	 */
+	int h2;
+};
 
 int https_engine_init(struct https_engine **https, struct event_base *event_base,
-		      int no_keepalive);
+		      const struct https_options *opts);
 
 void https_engine_destroy(struct https_engine *https);
 
+/* An arena backed by the engine's chunk slab, for request contexts
+ * that should go away in one piece when the request is done.
+ */
+struct arena *https_arena_new(struct https_engine *https);
+
+/* libevent doesn't have a name for this one */
+#define HTTP_GATEWAYTIMEOUT 504
+
+/*
+ * Upstream time budget for a request. connect covers TCP connect, TLS
+ * handshake and sending the request, first_byte the wait for the
+ * response to start, and total the whole exchange, body included.
+ * A cleared timeval means no limit.
+ *
+ * A request that runs out of time completes with status 504.
+ */
+struct https_deadline {
+	struct timeval connect;
+	struct timeval first_byte;
+	struct timeval total;
+};
+
+/*
+ * Fill in the built-in budget, then override it from
+ * ~/.yt_history/<route>_deadline, if there is one.
+ */
+int https_deadline_init(struct https_deadline *deadline, const char *route);
+
+/*
+ * done() gets a malloc()ed error message it has to free, or NULL if
+ * all went well. err_status is the http status to report to our own
+ * client on error.
+ */
 struct https_cb_ops {
 	void (*read)(struct evbuffer *buf, void *arg);
-	void (*done)(char *err_mg, void *arg);
+	void (*done)(int err_status, char *err_msg, void *arg);
 	void (*response_header)(const char *name, const char *value, void *arg);
 };
 
+/*
+ * Building a request up piece by piece. host, method and path have to
+ * stay around until the request is done. https_request_new() returns
+ * NULL if we're out of memory.
+ */
+struct request_ctx *https_request_new(struct https_engine *https,
+				      const char *host, int port,
+				      const char *method, const char *path);
+
+/* The value is formatted right away, into the request's own memory */
+int https_request_add_header(struct request_ctx *req, const char *name,
+			     const char *fmt, ...)
+	__attribute__((format(printf,3,4)));
+
+/* The request owns body from here on, and sends it as is, without
+ * copying. It can't be a reference to another evbuffer itself.
+ */
+void https_request_set_body(struct request_ctx *req, struct evbuffer *body);
+
+/* Record where the request spends its time under this trace id */
+void https_request_set_trace(struct request_ctx *req, unsigned int trace);
+
+/*
+ * With https_options.max_slots set, requests beyond it wait for a slot.
+ * Interactive ones may have all of them, background ones half and
+ * bulk ones a quarter, so that there's always room for someone who's
+ * waiting on us.
+ *
+ * Whose turn it is goes by weighted fair queueing: each owner's
+ * requests of a class are a flow of their own, and interactive flows
+ * get sixteen turns for a background flow's four and a bulk flow's
+ * one. One user queueing up a lot only gets in their own way. owner
+ * is only compared, NULL for a flow everyone shares.
+ *
+ * Requests are interactive by default. The wait counts towards the
+ * connect deadline. A request that's already waiting moves to its
+ * new place in line.
+ */
+enum https_priority {
+	HTTPS_INTERACTIVE,
+	HTTPS_BACKGROUND,
+	HTTPS_BULK,
+	HTTPS_PRIORITIES,
+};
+
+void https_request_set_priority(struct request_ctx *req,
+				enum https_priority priority,
+				const void *owner);
+
+/* For a request that won't be sent after all */
+void https_request_free(struct request_ctx *req);
+
+/*
+ * Off it goes. Whatever happens, done() gets called, and the request
+ * is gone after that.
+ *
+ * If handle is not NULL, it's set to point at the request for as long
+ * as the request is in flight, and back to NULL just before done() is
+ * called. Pass it to https_request_cancel() to give up on the request.
+ */
+void https_request_send(struct request_ctx *req,
+			const struct https_deadline *deadline,
+			struct https_cb_ops *cb_ops,
+			void *cb_arg,
+			struct request_ctx **handle);
+
+/*
+ * All of the above in one go. body, if any, stays the caller's.
+ */
 void https_request(struct https_engine *https,
 		   const char *host, int port,
 		   const char *method, const char *path,
 		   const char *access_token,
 		   struct evbuffer *body,
+		   const struct https_deadline *deadline,
 		   struct https_cb_ops *cb_ops,
-		   void *cb_arg);
+		   void *cb_arg,
+		   struct request_ctx **handle);
+
+/*
+ * Our own client went away. No more callbacks are made for the
+ * request. The upstream connection is kept if the rest of the
+ * response can be read off it, and closed if not.
+ */
+void https_request_cancel(struct request_ctx *req);
+
+/*
+ * With https_options.capture_dir set, the response to every GET is
+ * saved there, in a file of its own, as it came off the connection:
+ * a line of
+ *
+ *   ytcap 1 <method> <host> <port> <path>
+ *
+ * and then a record for each time something came in, two uint32_ts in
+ * host byte order for microseconds since the request was sent and the
+ * number of bytes, and the bytes. Whatever users have watched is in
+ * there, so the files are only readable by us.
+ *
+ * https_replay() feeds one back through the response parser and on to
+ * cb_ops, as if it came off a connection, in the same pieces. With
+ * realtime set they come in as far apart as they did then, otherwise
+ * as fast as they're taken. There's no network and no TLS involved.
+ *
+ * 0 if it's on its way, and done() will be called. ENOENT, EINVAL if
+ * it isn't a capture, or another errno if it couldn't be read.
+ */
+int https_replay(struct https_engine *https, const char *path, int realtime,
+		 struct https_cb_ops *cb_ops, void *cb_arg);
 
 
 
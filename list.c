@@ -3,26 +3,74 @@
 #include <event2/http.h>
 #include <event2/keyvalq_struct.h>
 
+#include "admit.h"
+#include "auth.h"
 #include "store.h"
 #include "https.h"
 #include "feed.h"
 #include "reply.h"
+#include "arena.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 #include "verbose.h"
 
+/* A prefetched page nobody's come for in this many seconds is dropped */
+#define PREFETCH_TTL 30
+
+/* Prefetches kept around at most, waiting or in flight */
+#define PREFETCH_MAX 64
+
 struct list_request_ctx {
 
+	struct arena *arena;
+
 	char query_buf[512];
 
 	struct feed *feed;
 
 	struct evhttp_request *original_request;
+	struct evhttp_connection *original_conn;
+
+	struct request_ctx *upstream;
+
+	/* For when the access token has to be refreshed first */
+	struct https_engine *https;
+	const struct https_endpoint *api;
+	const struct https_deadline *deadline;
+	struct session *session;
+	struct auth_waiter waiter;
+	struct timeval waited;
+	struct timeval queued;
+
+	/* Our turn at upstream */
+	struct admit *admit;
+	struct admit_ticket ticket;
+
+	/* Where the page is rendered. The response's own buffer, unless
+	 * it's a prefetch.
+	 */
+	struct evbuffer *page;
+
+	/* Page one, fetched right after login before anyone asked.
+	 * original_request is NULL until the browser comes for it. If
+	 * it's fetched before that, it waits with its results.
+	 */
+	int prefetch;
+	struct list_request_ctx *next;
+	int fetched;
+	int err_status;
+	char *err_msg;
 
 	int passthrough;
+
+	unsigned int trace;
+	struct timeval started;
 };
 
 static void read_list(struct evbuffer *buf, void *arg)
@@ -67,31 +115,70 @@ static void setup_pagination(int *start, int *max, struct evkeyvalq *params)
 	}
 }
 
-static void done_free(char *err_msg, void *arg)
+static struct list_request_ctx *prefetches;
+static int nprefetches;
+
+static void free_ctx(struct list_request_ctx *ctx)
+{
+	/* If it's still waiting, or never heard back */
+	admit_leave(ctx->admit, &ctx->ticket, ADMIT_DROPPED);
+
+	session_release(ctx->session);
+	if (ctx->prefetch) {
+		evbuffer_free(ctx->page);
+	}
+	arena_free(ctx->arena);
+}
+
+static void done_free(int err_status, char *err_msg, void *arg)
 {
 	struct list_request_ctx *ctx = arg;
+	struct evbuffer *out;
+
+	/* Upstream running out of time is what being overloaded looks
+	 * like from here. Anything else it answered, and how fast counts.
+	 */
+	admit_leave(ctx->admit, &ctx->ticket,
+		    err_status == HTTP_GATEWAYTIMEOUT ? ADMIT_FAILED : ADMIT_DONE);
+
+	if (ctx->original_request == NULL) {
+		/* Nobody's asked for it yet */
+		ctx->fetched = 1;
+		ctx->err_status = err_status;
+		ctx->err_msg = err_msg;
+		return;
+	}
+
+	if (ctx->original_conn != NULL) {
+		evhttp_connection_set_closecb(ctx->original_conn, NULL, NULL);
+	}
+
+	reply_server_timing(ctx->original_request, ctx->trace, &ctx->started);
 
 	if (err_msg != NULL) {
 		evhttp_send_error(ctx->original_request,
-				  HTTP_INTERNAL, err_msg);
+				  err_status, err_msg);
 	} else {
-		evhttp_send_reply(ctx->original_request,
-				  HTTP_OK, "OK",
-				  evhttp_request_get_output_buffer(ctx->original_request));
+		out = evhttp_request_get_output_buffer(ctx->original_request);
+		if (ctx->page != out) {
+			evbuffer_add_buffer(out, ctx->page);
+		}
+		evhttp_send_reply(ctx->original_request, HTTP_OK, "OK", out);
 	}
 	free(err_msg);
-	free(ctx);
+	free_ctx(ctx);
 
 }
 
-static void done_list(char *err_msg, void *arg)
+static void done_list(int err_status, char *err_msg, void *arg)
 {
 	struct list_request_ctx *ctx = arg;
 
 	feed_final(ctx->feed);
 	feed_destroy(ctx->feed);
+	ctx->feed = NULL;
 
-	done_free(err_msg, ctx);
+	done_free(err_status, err_msg, ctx);
 }
 
 static void build_query(struct list_request_ctx *ctx, struct evhttp_uri *uri)
@@ -101,8 +188,11 @@ static void build_query(struct list_request_ctx *ctx, struct evhttp_uri *uri)
 	const char *alt;
 
 
+	/* No uri for the first page, as is */
 	memset(&params, 0, sizeof(params));
-	evhttp_parse_query_str(evhttp_uri_get_query(uri), &params);
+	if (uri != NULL) {
+		evhttp_parse_query_str(evhttp_uri_get_query(uri), &params);
+	}
 
 	setup_pagination(&start_index, &max_results, &params);
 
@@ -137,8 +227,7 @@ static struct https_cb_ops list_cb_ops = {
 static void read_list_passthrough(struct evbuffer *buf, void *arg)
 {
 	struct list_request_ctx *ctx = arg;
-	evbuffer_add_buffer(evhttp_request_get_output_buffer(ctx->original_request),
-			    buf);
+	evbuffer_add_buffer(ctx->page, buf);
 }
 
 static void response_header_passthrough(const char *key, const char *value, void *arg)
@@ -147,8 +236,8 @@ static void response_header_passthrough(const char *key, const char *value, void
 	int pass;
 
 	pass =
-		strcmp(key, "Content-Type") == 0 ||
-		strcmp(key, "Content-Length") == 0;
+		strcasecmp(key, "Content-Type") == 0 ||
+		strcasecmp(key, "Content-Length") == 0;
 
 	if (pass) {
 		evhttp_add_header(evhttp_request_get_output_headers(ctx->original_request),
@@ -165,63 +254,361 @@ static struct https_cb_ops list_cb_ops_passthrough = {
 
 
 
-static int setup_feed(struct list_request_ctx *ctx, struct evhttp_request *req)
+static void browser_gone(struct evhttp_connection *conn, void *arg)
 {
-	int err;
+	struct list_request_ctx *ctx = arg;
+
+	verbose(VERBOSE, "%s(): %s\n", __func__, ctx->query_buf);
 
-	if ((err = feed_init(&ctx->feed, evhttp_request_get_output_buffer(req))) != 0) {
-		verbose(ERROR, "%s(): feed_init(): %s\n", __func__, strerror(err));
-		evhttp_send_error(req, HTTP_INTERNAL, "feed_init() failed");
+	/* The original request goes down with the connection,
+	 * so we don't get to touch it any more.
+	 */
+	if (ctx->upstream != NULL) {
+		https_request_cancel(ctx->upstream);
 	}
-	return err;
+	auth_waiter_cancel(&ctx->waiter);
+
+	feed_destroy(ctx->feed);
+	free(ctx->err_msg);
+	free_ctx(ctx);
 }
 
 
-void list_handle(struct https_engine *https, struct session *session,
-		 struct evhttp_request *req, struct evhttp_uri *uri)
+/* Without a word to the browser, someone else has answered it */
+static void drop_ctx(struct list_request_ctx *ctx)
 {
-	struct list_request_ctx *ctx;
+	if (ctx->original_conn != NULL) {
+		evhttp_connection_set_closecb(ctx->original_conn, NULL, NULL);
+	}
+	feed_destroy(ctx->feed);
+	free_ctx(ctx);
+}
+
+/* With an access token good for a while yet. ctx is gone if it fails. */
+static int fetch_list(struct list_request_ctx *ctx)
+{
+	struct evhttp_request *req = ctx->original_request;
+	struct request_ctx *upstream;
 	struct https_cb_ops *cb_ops;
 	const char *access_token;
 	int err;
 
-	access_token = session_get_value(session, "access_token");
+	access_token = session_get_value(ctx->session, "access_token");
 	verbose(VERBOSE, "%s(): using access token %s\n", __func__, access_token);
 
-	if (access_token == NULL) {
+	if (!ctx->passthrough) {
+		if ((err = feed_init(&ctx->feed, ctx->page, ctx->arena)) != 0) {
+			verbose(ERROR, "%s(): feed_init(): %s\n", __func__, strerror(err));
+			if (req != NULL) {
+				evhttp_send_error(req, HTTP_INTERNAL, "feed_init() failed");
+			}
+			drop_ctx(ctx);
+			return err;
+		}
+		feed_trace(ctx->feed, ctx->trace);
+		cb_ops = &list_cb_ops;
+	} else {
+		cb_ops = &list_cb_ops_passthrough;
+	}
+
+	upstream = https_request_new(ctx->https, ctx->api->host, ctx->api->port,
+				     "GET", ctx->query_buf);
+	if (upstream == NULL ||
+	    https_request_add_header(upstream, "Authorization",
+				     "Bearer %s", access_token) != 0) {
+		if (upstream != NULL) {
+			https_request_free(upstream);
+		}
+		if (req != NULL) {
+			evhttp_send_error(req, HTTP_INTERNAL, "Out of memory");
+		}
+		drop_ctx(ctx);
+		return ENOMEM;
+	}
+	https_request_set_trace(upstream, ctx->trace);
+	https_request_set_priority(upstream, ctx->prefetch ? HTTPS_BACKGROUND
+				   : HTTPS_INTERACTIVE, ctx->session);
+
+	https_request_send(upstream, ctx->deadline, cb_ops, ctx, &ctx->upstream);
+
+	return 0;
+}
+
+/* Too many ahead of it. Sooner than upstream would have it. */
+static void shed(struct list_request_ctx *ctx)
+{
+	reply_busy(ctx->original_request, admit_retry_after(ctx->admit));
+	drop_ctx(ctx);
+}
+
+static void admitted(int err, void *arg)
+{
+	struct list_request_ctx *ctx = arg;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	trace_span(ctx->trace, "queue", &ctx->queued, &now);
+
+	if (err != 0) {
+		shed(ctx);
+		return;
+	}
+
+	fetch_list(ctx);
+}
+
+/* When upstream has room for it. ctx is gone if it doesn't. */
+static void admit_list(struct list_request_ctx *ctx)
+{
+	switch (admit_enter(ctx->admit, &ctx->ticket, admitted, ctx)) {
+	case 0:
+		fetch_list(ctx);
+		break;
+	case EINPROGRESS:
+		gettimeofday(&ctx->queued, NULL);
+		break;
+	default:
+		shed(ctx);
+		break;
+	}
+}
+
+static void token_refreshed(int err, void *arg)
+{
+	struct list_request_ctx *ctx = arg;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	trace_span(ctx->trace, "refresh", &ctx->waited, &now);
+
+	if (err != 0) {
+		/* Back to square one */
+		reply_redirect(ctx->original_request, "/");
+		drop_ctx(ctx);
+		return;
+	}
+
+	admit_list(ctx);
+}
+
+/* Not come for in time, out of the way */
+static void drop_stale_prefetches(void)
+{
+	struct list_request_ctx **pp, *p;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	for (pp = &prefetches; (p = *pp) != NULL;) {
+		if (now.tv_sec - p->started.tv_sec < PREFETCH_TTL) {
+			pp = &p->next;
+			continue;
+		}
+
+		verbose(VERBOSE, "%s(): nobody came for %s\n", __func__, p->query_buf);
+		*pp = p->next;
+		nprefetches--;
+		metric_add(metric_counter("yt_history_list_prefetches_total",
+					  "First pages fetched ahead, by whether they were used",
+					  "result=\"wasted\""), 1);
+
+		if (p->upstream != NULL) {
+			https_request_cancel(p->upstream);
+		}
+		feed_destroy(p->feed);
+		free(p->err_msg);
+		free_ctx(p);
+	}
+}
+
+/* Off the list, if there's one for this session and query */
+static struct list_request_ctx *claim_prefetch(struct session *session,
+					       const struct list_request_ctx *ctx)
+{
+	struct list_request_ctx **pp, *p;
+
+	drop_stale_prefetches();
+
+	for (pp = &prefetches; (p = *pp) != NULL; pp = &p->next) {
+		if (p->session == session &&
+		    p->passthrough == ctx->passthrough &&
+		    strcmp(p->query_buf, ctx->query_buf) == 0) {
+			*pp = p->next;
+			nprefetches--;
+			metric_add(metric_counter("yt_history_list_prefetches_total",
+						  "First pages fetched ahead, by whether they were used",
+						  "result=\"used\""), 1);
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+/* Right away if it's there, or as soon as it is */
+static void serve_prefetched(struct list_request_ctx *p, struct evhttp_request *req)
+{
+	verbose(VERBOSE, "%s(): %s, %s\n", __func__, p->query_buf,
+		p->fetched ? "fetched already" : "on its way");
+
+	p->original_request = req;
+	gettimeofday(&p->started, NULL);
+
+	if (p->fetched) {
+		done_free(p->err_status, p->err_msg, p);
+		return;
+	}
+
+	/* Someone's waiting on it now */
+	if (p->upstream != NULL) {
+		https_request_set_priority(p->upstream, HTTPS_INTERACTIVE, p->session);
+	}
+
+	if ((p->original_conn = evhttp_request_get_connection(req)) != NULL) {
+		evhttp_connection_set_closecb(p->original_conn, browser_gone, p);
+	}
+}
+
+void list_prefetch(struct https_engine *https, struct admit *admit,
+		   const struct https_endpoint *api,
+		   const struct https_deadline *deadline, struct session *session)
+{
+	struct list_request_ctx *ctx;
+	struct arena *arena;
+
+	drop_stale_prefetches();
+
+	if (nprefetches >= PREFETCH_MAX ||
+	    session_get_value(session, "access_token") == NULL) {
+		return;
+	}
+
+	if (session_hold(session) != 0) {
+		return;
+	}
+
+	if ((arena = https_arena_new(https)) == NULL ||
+	    (ctx = arena_alloc(arena, sizeof(*ctx))) == NULL) {
+		arena_free(arena);
+		session_release(session);
+		return;
+	}
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->arena = arena;
+	ctx->https = https;
+	ctx->api = api;
+	ctx->deadline = deadline;
+	ctx->session = session;
+	ctx->admit = admit;
+	ctx->prefetch = 1;
+	if ((ctx->page = evbuffer_new()) == NULL) {
+		arena_free(arena);
+		session_release(session);
+		return;
+	}
+
+	/* Nobody's waiting for it, so not if anyone has to wait for it */
+	if (admit_enter(admit, &ctx->ticket, NULL, NULL) != 0) {
+		free_ctx(ctx);
+		return;
+	}
+
+	ctx->trace = trace_begin();
+	gettimeofday(&ctx->started, NULL);
+
+	build_query(ctx, NULL);
+
+	verbose(VERBOSE, "%s(): %s\n", __func__, ctx->query_buf);
+
+	if (fetch_list(ctx) == 0) {
+		ctx->next = prefetches;
+		prefetches = ctx;
+		nprefetches++;
+	}
+}
+
+void list_prefetch_cancel_all(void)
+{
+	struct list_request_ctx *p;
+
+	while ((p = prefetches) != NULL) {
+		prefetches = p->next;
+		if (p->upstream != NULL) {
+			https_request_cancel(p->upstream);
+		}
+		feed_destroy(p->feed);
+		free(p->err_msg);
+		free_ctx(p);
+	}
+	nprefetches = 0;
+}
+
+void list_handle(struct https_engine *https, struct auth_engine *auth,
+		 struct admit *admit, const struct https_endpoint *api,
+		 const struct https_deadline *deadline,
+		 struct session *session,
+		 struct evhttp_request *req, struct evhttp_uri *uri)
+{
+	struct list_request_ctx *ctx, *prefetched;
+	struct arena *arena;
+
+	if (session_get_value(session, "access_token") == NULL) {
 		reply_redirect(req, "/");
 		return;
 	}
 
-	if ((ctx = malloc(sizeof(*ctx))) == NULL) {
+	/* It's ours until the request is done, logged out or not */
+	if (session_hold(session) != 0) {
+		reply_redirect(req, "/");
+		return;
+	}
+
+	if ((arena = https_arena_new(https)) == NULL ||
+	    (ctx = arena_alloc(arena, sizeof(*ctx))) == NULL) {
+		arena_free(arena);
+		session_release(session);
 		evhttp_send_error(req, HTTP_INTERNAL, "Out of memory");
 		return;
 	}
 	memset(ctx, 0, sizeof(*ctx));
+	ctx->arena = arena;
+	ctx->https = https;
+	ctx->api = api;
+	ctx->deadline = deadline;
+	ctx->session = session;
+	ctx->admit = admit;
 
 	ctx->original_request = req;
+	ctx->page = evhttp_request_get_output_buffer(req);
+	ctx->trace = trace_begin();
+	gettimeofday(&ctx->started, NULL);
 
 	build_query(ctx, uri);
 
 	verbose(VERBOSE, "%s(): query_buf: '%s'\n", __func__, ctx->query_buf);
 
-	if (!ctx->passthrough) {
-		if ((err = setup_feed(ctx, req)) != 0) {
-			/* It already sent an error */
-			free(ctx);
-			return;
-		}
-		cb_ops = &list_cb_ops;
-	} else {
-		cb_ops = &list_cb_ops_passthrough;
+	if ((prefetched = claim_prefetch(session, ctx)) != NULL) {
+		/* The prefetch holds the session on its own */
+		session_release(session);
+		arena_free(arena);
+		serve_prefetched(prefetched, req);
+		return;
 	}
 
+	if ((ctx->original_conn = evhttp_request_get_connection(req)) != NULL) {
+		evhttp_connection_set_closecb(ctx->original_conn, browser_gone, ctx);
+	}
 
-	https_request(https,
-		      "gdata.youtube.com", 443,
-		      "GET",
-		      ctx->query_buf,
-		      access_token,
-		      (struct evbuffer *)NULL,
-		      cb_ops, ctx);
+	switch (auth_ensure_token(auth, session, &ctx->waiter, token_refreshed, ctx)) {
+	case 0:
+		admit_list(ctx);
+		break;
+	case EINPROGRESS:
+		/* Not for long, the token's refreshed and we're off */
+		ctx->waited = ctx->started;
+		break;
+	default:
+		reply_redirect(req, "/");
+		drop_ctx(ctx);
+		break;
+	}
 }
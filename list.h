@@ -2,12 +2,36 @@
 #define LIST_H__INCLUDED
 
 #include <event2/http.h>
+#include "admit.h"
+#include "auth.h"
 #include "store.h"
 #include "https.h"
 
-void list_handle(struct https_engine *https, struct session *session,
+/* A token that's about to expire is refreshed first, without
+ * bothering the browser. api is where the feeds come from, and has to
+ * stay around, like deadline.
+ *
+ * Then it waits its turn at admit, or gets a 503 with a Retry-After
+ * if the wait's too long.
+ */
+void list_handle(struct https_engine *https, struct auth_engine *auth,
+		 struct admit *admit, const struct https_endpoint *api,
+		 const struct https_deadline *deadline,
+		 struct session *session,
 		 struct evhttp_request *req, struct evhttp_uri *uri);
 
 
+/*
+ * Starts on page one for a session that's just logged in, before the
+ * browser gets around to asking. The next list_handle() for it takes
+ * over, whether the page is there yet or not. Not if it'd have to wait
+ * at admit.
+ */
+void list_prefetch(struct https_engine *https, struct admit *admit,
+		   const struct https_endpoint *api,
+		   const struct https_deadline *deadline, struct session *session);
+
+/* On the way out */
+void list_prefetch_cancel_all(void);
 
 #endif
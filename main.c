@@ -7,13 +7,52 @@
 #include <errno.h>
 
 #include <event2/event.h>
+#include <event2/buffer.h>
 #include <event2/http.h>
 
+#include "admit.h"
 #include "auth.h"
+#include "conf.h"
 #include "store.h"
 #include "list.h"
+#include "metrics.h"
+#include "rcu.h"
+#include "trace.h"
 #include "verbose.h"
 
+/* Seconds we keep idle connections to Google around, by default */
+#define HTTPS_IDLE_TIMEOUT 30
+
+/* Idle connections we keep ready to each upstream, by default */
+#define HTTPS_WARM_CONNS 1
+
+/* Requests at upstream at once, shared out by priority, by default */
+#define HTTPS_MAX_SLOTS 64
+
+/* Sessions we're ready for from the start */
+#define STORE_SESSIONS 1024
+
+/* Sessions unused for this long, in seconds, are thrown away */
+#define STORE_IDLE_TTL (24 * 60 * 60)
+
+/* And the least recently used go when they take more than this */
+#define STORE_MAX_BYTES (256 * 1024 * 1024)
+
+/* Sessions are saved this often, in seconds, if there's a session_key */
+#define STORE_SNAPSHOT_SECS (5 * 60)
+
+/* /list requests at upstream at once, to start with and at most */
+#define ADMIT_INITIAL_LIMIT 16
+#define ADMIT_MIN_LIMIT 2
+#define ADMIT_MAX_LIMIT 256
+
+/* Waiting for their turn at most, and for how many milliseconds */
+#define ADMIT_MAX_QUEUE 128
+#define ADMIT_QUEUE_TIMEOUT 1000
+
+/* How many -C redirections we take */
+#define MAX_CONNECT_TO 4
+
 struct app {
 
 	struct event_base *base;
@@ -24,15 +63,90 @@ struct app {
 	struct https_engine *https;
 	struct auth_engine *auth;
 	struct store *store;
+	struct admit *admit;
 
 	struct event *interrupt_event;
 
+	struct https_deadline list_deadline;
+
+	/* Google, unless told otherwise */
+	struct https_endpoint api;
+	struct https_endpoint accounts;
+
 	int port;
 
-	int no_keepalive;
+	struct store_options store_opts;
+	struct admit_options admit_opts;
+	char snapshot_path[512];
+	struct https_options https_opts;
+	struct https_warm_target warm[3];
+	struct https_connect_to connect_to[MAX_CONNECT_TO + 1];
+	int nconnect_to;
 };
 
 
+/* Load it in chrome://tracing or https://ui.perfetto.dev */
+static void dump_trace(struct evhttp_request *req)
+{
+	struct evbuffer *buf;
+
+	if ((buf = evbuffer_new()) == NULL) {
+		evhttp_send_error(req, HTTP_INTERNAL, "Out of memory");
+		return;
+	}
+
+	trace_dump(buf);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Content-Type", "application/json");
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
+
+static void dump_metrics(struct evhttp_request *req)
+{
+	struct evbuffer *buf;
+
+	if ((buf = evbuffer_new()) == NULL) {
+		evhttp_send_error(req, HTTP_INTERNAL, "Out of memory");
+		return;
+	}
+
+	metrics_dump(buf);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Content-Type", "text/plain; version=0.0.4");
+	evhttp_send_reply(req, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
+
+/* Outlives the request's uri. Anything we don't serve counts as one
+ * route, or a scanner could fill the registry up.
+ */
+static const char *route_name(const char *path)
+{
+	static const char *routes[] = { "/", "/list", "/debug/trace", "/metrics" };
+	int i;
+
+	for (i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+		if (strcmp(path, routes[i]) == 0) {
+			return routes[i];
+		}
+	}
+
+	return "other";
+}
+
+/* Once the reply is out, whoever sent it */
+static void count_request(struct evhttp_request *req, void *route)
+{
+	char labels[64];
+
+	snprintf(labels, sizeof(labels), "route=\"%s\",status=\"%d\"",
+		 (const char *)route, evhttp_request_get_response_code(req));
+	metric_add(metric_counter("yt_history_requests_total",
+				  "Requests served, by route and status",
+				  labels), 1);
+}
+
 static void handle_request(struct evhttp_request *req, void *_app)
 {
 	struct app *app = _app;
@@ -42,6 +156,11 @@ static void handle_request(struct evhttp_request *req, void *_app)
 	const char *path;
 	int err;
 
+	/* Whatever the last request looked at without locks, we're
+	 * done with.
+	 */
+	rcu_quiescent_state();
+
 	uri_str = evhttp_request_get_uri(req);
 
 	verbose(NORMAL, "%s(): %s\n", __func__, uri_str);
@@ -49,6 +168,9 @@ static void handle_request(struct evhttp_request *req, void *_app)
 	uri = evhttp_uri_parse(uri_str);
 	path = evhttp_uri_get_path(uri);
 
+	evhttp_request_set_on_complete_cb(req, count_request,
+					  (void *)route_name(path));
+
 	if (strcmp(path, "/") == 0) {
 		if ((err = session_ensure(app->store, &session, req)) != 0) {
 			verbose(ERROR, "%s(): %s\n", __func__, strerror(err));
@@ -61,8 +183,13 @@ static void handle_request(struct evhttp_request *req, void *_app)
 			verbose(ERROR, "%s(): %s\n", __func__, strerror(err));
 			evhttp_send_error(req, HTTP_INTERNAL, "Failed to ensure session");
 		} else {
-			list_handle(app->https, session, req, uri);
+			list_handle(app->https, app->auth, app->admit, &app->api,
+				    &app->list_deadline, session, req, uri);
 		}
+	} else if (strcmp(path, "/debug/trace") == 0) {
+		dump_trace(req);
+	} else if (strcmp(path, "/metrics") == 0) {
+		dump_metrics(req);
 	} else {
 		evhttp_send_error(req, HTTP_NOTFOUND, NULL);
 	}
@@ -100,6 +227,87 @@ static int lport(struct evhttp_bound_socket *sock)
 	return port;
 }
 
+/* host:port:to_host:to_port, chopped up in place */
+static int parse_connect_to(struct https_connect_to *to, char *arg)
+{
+	char *field[4];
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		field[i] = arg;
+		if ((arg = strchr(arg, ':')) != NULL) {
+			*arg++ = '\0';
+		} else if (i < 3) {
+			return EINVAL;
+		}
+	}
+
+	to->host = field[0];
+	to->port = atoi(field[1]);
+	to->to_host = field[2];
+	to->to_port = atoi(field[3]);
+
+	return to->port > 0 && to->to_port > 0 ? 0 : EINVAL;
+}
+
+/* host or host:port, chopped up in place */
+static int parse_endpoint(struct https_endpoint *endpoint, char *arg)
+{
+	char *port;
+
+	endpoint->host = arg;
+	endpoint->port = 443;
+	if ((port = strrchr(arg, ':')) != NULL) {
+		*port++ = '\0';
+		endpoint->port = atoi(port);
+	}
+
+	return *endpoint->host != '\0' && endpoint->port > 0 ? 0 : EINVAL;
+}
+
+/*
+ * Sessions outlive restarts if there's a key to keep them under, 64
+ * hex digits in $HOME/.yt_history/session_key.
+ */
+static int snapshot_options(struct app *app)
+{
+	char hex[SNAPSHOT_KEY_LEN * 2 + 2];
+	int err, i;
+
+	if ((err = conf_read("session_key", hex, sizeof(hex))) != 0) {
+		return err == ENOENT ? 0 : err;
+	}
+
+	if (strlen(hex) != SNAPSHOT_KEY_LEN * 2) {
+		verbose(ERROR, "%s(): session_key should be %d hex digits\n",
+			__func__, SNAPSHOT_KEY_LEN * 2);
+		return EINVAL;
+	}
+
+	for (i = 0; i < SNAPSHOT_KEY_LEN; i++) {
+		if (sscanf(&hex[i * 2], "%2hhx", &app->store_opts.snapshot_key[i]) != 1) {
+			verbose(ERROR, "%s(): bad session_key\n", __func__);
+			return EINVAL;
+		}
+	}
+	explicit_bzero(hex, sizeof(hex));
+
+	app->store_opts.snapshot_path = conf_path("sessions", app->snapshot_path,
+						  sizeof(app->snapshot_path));
+	app->store_opts.snapshot_interval = STORE_SNAPSHOT_SECS;
+
+	return 0;
+}
+
+/* Page one is on its way while the browser follows the redirect */
+static void logged_in(struct session *session, void *_app)
+{
+	struct app *app = _app;
+
+	list_prefetch(app->https, app->admit, &app->api, &app->list_deadline,
+		      session);
+}
+
 static void interrupted(evutil_socket_t fd, short events, void *base)
 {
 	event_base_loopexit(base, NULL);
@@ -112,23 +320,121 @@ int main(int argc, char **argv)
 
 	memset(&app, 0, sizeof(app));
 
-	while ((opt = getopt(argc, argv, "np:v")) != -1) {
+	app.store_opts.nel = STORE_SESSIONS;
+	app.store_opts.idle_ttl = STORE_IDLE_TTL;
+	app.store_opts.max_bytes = STORE_MAX_BYTES;
+
+	app.https_opts.idle_timeout = HTTPS_IDLE_TIMEOUT;
+	app.https_opts.max_slots = HTTPS_MAX_SLOTS;
+
+	app.admit_opts.initial_limit = ADMIT_INITIAL_LIMIT;
+	app.admit_opts.min_limit = ADMIT_MIN_LIMIT;
+	app.admit_opts.max_limit = ADMIT_MAX_LIMIT;
+	app.admit_opts.max_queue = ADMIT_MAX_QUEUE;
+	app.admit_opts.queue_timeout = ADMIT_QUEUE_TIMEOUT;
+
+	app.api.host = "gdata.youtube.com";
+	app.api.port = 443;
+	app.accounts.host = "accounts.google.com";
+	app.accounts.port = 443;
+
+	app.warm[0].min_idle = HTTPS_WARM_CONNS;
+	app.warm[1].min_idle = HTTPS_WARM_CONNS;
+	app.https_opts.warm = app.warm;
+	app.https_opts.connect_to = app.connect_to;
+
+	while ((opt = getopt(argc, argv, "2A:C:G:Kk:L:nP:p:Q:R:S:Tvw:")) != -1) {
 		switch (opt) {
+		case 'A':
+			if (parse_endpoint(&app.accounts, optarg) != 0) {
+				fprintf(stderr, "Bad -A %s\n", optarg);
+				err = EXIT_FAILURE;
+				goto out_cleanup;
+			}
+			break;
+		case 'G':
+			if (parse_endpoint(&app.api, optarg) != 0) {
+				fprintf(stderr, "Bad -G %s\n", optarg);
+				err = EXIT_FAILURE;
+				goto out_cleanup;
+			}
+			break;
+		case 'C':
+			if (app.nconnect_to == MAX_CONNECT_TO ||
+			    parse_connect_to(&app.connect_to[app.nconnect_to++],
+					     optarg) != 0) {
+				fprintf(stderr, "Bad -C %s\n", optarg);
+				err = EXIT_FAILURE;
+				goto out_cleanup;
+			}
+			break;
+		case '2':
+			app.https_opts.h2 = 1;
+			break;
+		case 'K':
+			app.https_opts.ktls = 1;
+			break;
+		case 'k':
+			app.https_opts.idle_timeout = atoi(optarg);
+			break;
+		case 'L':
+			app.admit_opts.max_limit = atoi(optarg);
+			break;
 		case 'n':
-			app.no_keepalive = 1;
+			app.https_opts.no_keepalive = 1;
+			break;
+		case 'P':
+			app.https_opts.pipeline_depth = atoi(optarg);
 			break;
 		case 'p':
 			app.port = atoi(optarg);
 			break;
+		case 'Q':
+			app.admit_opts.max_queue = atoi(optarg);
+			break;
+		case 'R':
+			app.https_opts.capture_dir = optarg;
+			break;
+		case 'S':
+			app.https_opts.max_slots = atoi(optarg);
+			break;
+		case 'T':
+			app.https_opts.transport = &conn_transport_tcp;
+			break;
 		case 'v':
 			verbose_adjust_level(+1);
 			break;
+		case 'w':
+			app.warm[0].min_idle = app.warm[1].min_idle = atoi(optarg);
+			break;
 		default:
 			err = EXIT_FAILURE;
 			goto out_cleanup;
 		}
 	}
 
+	/* -L 1 means one at a time, always */
+	if (app.admit_opts.min_limit > app.admit_opts.max_limit) {
+		app.admit_opts.min_limit = app.admit_opts.max_limit;
+	}
+
+	/* Everyone's first request goes to one of these */
+	app.warm[0].host = app.api.host;
+	app.warm[0].port = app.api.port;
+	app.warm[1].host = app.accounts.host;
+	app.warm[1].port = app.accounts.port;
+
+	/* From here on, logging doesn't wait for stdout */
+	if ((err = verbose_start_writer()) != 0) {
+		fprintf(stderr, "verbose_start_writer(): %s\n", strerror(err));
+		goto out_cleanup;
+	}
+
+	/* The event loop reads sessions without locks */
+	if ((err = rcu_register_thread()) != 0) {
+		goto out_cleanup;
+	}
+
 	if ((app.base = event_base_new()) == NULL) {
 		err = errno;
 		goto out_cleanup;
@@ -161,26 +467,42 @@ int main(int argc, char **argv)
 		goto out_cleanup;
 	}
 
-	err = store_init(&app.store, 10);
+	if ((err = snapshot_options(&app)) != 0) {
+		fprintf(stderr, "session_key: %s\n", strerror(err));
+		goto out_cleanup;
+	}
+
+	err = store_init(&app.store, app.base, &app.store_opts);
 	if (err != 0) {
-		fprintf(stderr, "session_store_init(): %s\n", strerror(err));
+		fprintf(stderr, "store_init(): %s\n", strerror(err));
 		goto out_cleanup;
 	}
 
-	if (https_engine_init(&app.https, app.base, app.no_keepalive) != 0) {
+	if (https_engine_init(&app.https, app.base, &app.https_opts) != 0) {
 		err = errno;
 		fprintf(stderr, "https_init(): %s\n", strerror(err));
 		goto out_cleanup;
 	}
 
 
+	if ((err = https_deadline_init(&app.list_deadline, "list")) != 0) {
+		fprintf(stderr, "https_deadline_init(): %s\n", strerror(err));
+		goto out_cleanup;
+	}
+
+	if ((err = admit_init(&app.admit, app.base, &app.admit_opts)) != 0) {
+		fprintf(stderr, "admit_init(): %s\n", strerror(err));
+		goto out_cleanup;
+	}
+
 	/* If we had port=0, it's now allocated by bind() */
 	app.port = lport(app.sock);
 
-	if ((err = auth_init(&app.auth, app.https, app.port)) != 0) {
+	if ((err = auth_init(&app.auth, app.base, app.https, &app.accounts, app.port)) != 0) {
 		fprintf(stderr, "auth_init(): %s\n", strerror(err));
 		goto out_cleanup;
 	}
+	auth_on_login(app.auth, logged_in, &app);
 
 	printf("http://localhost:%d/\n", app.port);
 
@@ -192,14 +514,22 @@ int main(int argc, char **argv)
 
  out_cleanup:
 
-	store_destroy(app.store);
-
 	if (app.interrupt_event != NULL) {
 		evsignal_del(app.interrupt_event);
 		event_free(app.interrupt_event);
 		app.interrupt_event = NULL;
 	}
 
+	/* Browsers still waiting are hung up on first. That gives up
+	 * on their requests, which needs auth and https still there.
+	 */
+	if (app.http != NULL) {
+		evhttp_free(app.http);
+		app.http = NULL;
+	}
+
+	/* Their requests still hold sessions, so before the store */
+	list_prefetch_cancel_all();
 	auth_destroy(app.auth);
 
 	if (app.https != NULL) {
@@ -207,16 +537,19 @@ int main(int argc, char **argv)
 		app.https = NULL;
 	}
 
-	if (app.http != NULL) {
-		evhttp_free(app.http);
-		app.http = NULL;
-	}
+	store_destroy(app.store);
+
+	/* After the requests that might still be waiting on it */
+	admit_destroy(app.admit);
 
 	if (app.base != NULL) {
 		event_base_free(app.base);
 		app.base = NULL;
 	}
 
+	rcu_unregister_thread();
+	verbose_stop_writer();
+
 	return err;
 
 }
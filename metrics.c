@@ -0,0 +1,268 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "verbose.h"
+
+/* Label combinations for all metrics together. Routes, statuses and
+ * upstream hosts are few.
+ */
+#define METRICS_MAX 256
+
+#define METRIC_LABELS_MAX 96
+
+#define METRICS_COLLECTORS_MAX 8
+
+enum metric_type {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM,
+};
+
+/* Upper bounds, in microseconds. Anything slower lands in +Inf. */
+static const long buckets_us[] = {
+	5000, 10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+#define NBUCKETS (sizeof(buckets_us) / sizeof(buckets_us[0]))
+
+struct metric {
+	const char *name;
+	const char *help;
+	enum metric_type type;
+	char labels[METRIC_LABELS_MAX];
+
+	/* Counter or gauge value, or the histogram's sum in us */
+	long value;
+
+	/* Not cumulative, they're added up when dumped. The last
+	 * one is +Inf.
+	 */
+	long buckets[NBUCKETS + 1];
+	long count;
+};
+
+struct collector {
+	metrics_collect_fn fn;
+	void *arg;
+};
+
+static struct metric registry[METRICS_MAX];
+static int nmetrics;
+
+/* Where updates go when the registry is full */
+static struct metric sink;
+
+static struct collector collectors[METRICS_COLLECTORS_MAX];
+static int ncollectors;
+
+static struct metric *lookup(const char *name, const char *help,
+			     enum metric_type type, const char *labels)
+{
+	struct metric *metric;
+	int i;
+
+	if (labels == NULL) {
+		labels = "";
+	}
+
+	for (i = 0; i < nmetrics; i++) {
+		metric = &registry[i];
+		if (strcmp(metric->name, name) == 0 &&
+		    strcmp(metric->labels, labels) == 0) {
+			return metric;
+		}
+	}
+
+	if (nmetrics == METRICS_MAX || strlen(labels) >= METRIC_LABELS_MAX) {
+		verbose(ERROR, "%s(): no room for %s{%s}\n",
+			__func__, name, labels);
+		return &sink;
+	}
+
+	metric = &registry[nmetrics++];
+	metric->name = name;
+	metric->help = help;
+	metric->type = type;
+	strcpy(metric->labels, labels);
+
+	return metric;
+}
+
+struct metric *metric_counter(const char *name, const char *help,
+			      const char *labels)
+{
+	return lookup(name, help, METRIC_COUNTER, labels);
+}
+
+struct metric *metric_gauge(const char *name, const char *help,
+			    const char *labels)
+{
+	return lookup(name, help, METRIC_GAUGE, labels);
+}
+
+struct metric *metric_histogram(const char *name, const char *help,
+				const char *labels)
+{
+	return lookup(name, help, METRIC_HISTOGRAM, labels);
+}
+
+void metric_add(struct metric *metric, long n)
+{
+	metric->value += n;
+}
+
+void metric_set(struct metric *metric, long value)
+{
+	metric->value = value;
+}
+
+void metric_observe(struct metric *metric,
+		    const struct timeval *start, const struct timeval *end)
+{
+	struct timeval now, elapsed;
+	long us;
+	int i;
+
+	if (end == NULL) {
+		gettimeofday(&now, NULL);
+		end = &now;
+	}
+
+	timersub(end, start, &elapsed);
+	us = elapsed.tv_sec * 1000000L + elapsed.tv_usec;
+
+	for (i = 0; i < NBUCKETS && us > buckets_us[i]; i++) {
+		;
+	}
+
+	metric->buckets[i]++;
+	metric->count++;
+	metric->value += us;
+}
+
+int metrics_collect(metrics_collect_fn fn, void *arg)
+{
+	if (ncollectors == METRICS_COLLECTORS_MAX) {
+		return ENOMEM;
+	}
+
+	collectors[ncollectors].fn = fn;
+	collectors[ncollectors].arg = arg;
+	ncollectors++;
+
+	return 0;
+}
+
+void metrics_uncollect(metrics_collect_fn fn, void *arg)
+{
+	int i;
+
+	for (i = 0; i < ncollectors; i++) {
+		if (collectors[i].fn == fn && collectors[i].arg == arg) {
+			collectors[i] = collectors[--ncollectors];
+			return;
+		}
+	}
+}
+
+static const char *type_name(enum metric_type type)
+{
+	switch (type) {
+	case METRIC_COUNTER:
+		return "counter";
+	case METRIC_GAUGE:
+		return "gauge";
+	case METRIC_HISTOGRAM:
+		return "histogram";
+	}
+
+	return "untyped";
+}
+
+/* Seconds, from microseconds */
+static void add_seconds(struct evbuffer *out, long us)
+{
+	evbuffer_add_printf(out, "%ld.%06ld", us / 1000000, us % 1000000);
+}
+
+static void dump_histogram(struct evbuffer *out, const struct metric *metric)
+{
+	const char *sep = *metric->labels ? "," : "";
+	long cumulative;
+	int i;
+
+	cumulative = 0;
+	for (i = 0; i < NBUCKETS; i++) {
+		cumulative += metric->buckets[i];
+		evbuffer_add_printf(out, "%s_bucket{%s%sle=\"",
+				    metric->name, metric->labels, sep);
+		add_seconds(out, buckets_us[i]);
+		evbuffer_add_printf(out, "\"} %ld\n", cumulative);
+	}
+	cumulative += metric->buckets[NBUCKETS];
+	evbuffer_add_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %ld\n",
+			    metric->name, metric->labels, sep, cumulative);
+
+	if (*metric->labels) {
+		evbuffer_add_printf(out, "%s_sum{%s} ",
+				    metric->name, metric->labels);
+	} else {
+		evbuffer_add_printf(out, "%s_sum ", metric->name);
+	}
+	add_seconds(out, metric->value);
+
+	if (*metric->labels) {
+		evbuffer_add_printf(out, "\n%s_count{%s} %ld\n",
+				    metric->name, metric->labels, metric->count);
+	} else {
+		evbuffer_add_printf(out, "\n%s_count %ld\n",
+				    metric->name, metric->count);
+	}
+}
+
+static void dump_metric(struct evbuffer *out, const struct metric *metric)
+{
+	if (metric->type == METRIC_HISTOGRAM) {
+		dump_histogram(out, metric);
+	} else if (*metric->labels) {
+		evbuffer_add_printf(out, "%s{%s} %ld\n",
+				    metric->name, metric->labels, metric->value);
+	} else {
+		evbuffer_add_printf(out, "%s %ld\n", metric->name, metric->value);
+	}
+}
+
+void metrics_dump(struct evbuffer *out)
+{
+	int i, j, seen;
+
+	for (i = 0; i < ncollectors; i++) {
+		collectors[i].fn(collectors[i].arg);
+	}
+
+	/* All label combinations of a name have to come together,
+	 * under one HELP and TYPE.
+	 */
+	for (i = 0; i < nmetrics; i++) {
+		for (j = 0, seen = 0; j < i && !seen; j++) {
+			seen = strcmp(registry[j].name, registry[i].name) == 0;
+		}
+		if (seen) {
+			continue;
+		}
+
+		evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s %s\n",
+				    registry[i].name, registry[i].help,
+				    registry[i].name, type_name(registry[i].type));
+		for (j = i; j < nmetrics; j++) {
+			if (strcmp(registry[j].name, registry[i].name) == 0) {
+				dump_metric(out, &registry[j]);
+			}
+		}
+	}
+}
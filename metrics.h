@@ -0,0 +1,51 @@
+#ifndef METRICS_H__INCLUDED
+#define METRICS_H__INCLUDED
+
+/*
+ * Counters, gauges and latency histograms, served to Prometheus from
+ * /metrics. A metric is looked up once by name and labels and the
+ * handle kept around, after which updating it is a plain add.
+ *
+ * name and help have to be string literals or otherwise live forever.
+ * labels is the inside of the braces, preformatted, like
+ * host="accounts.google.com:443". NULL or "" for none.
+ *
+ * Lookups never fail. When the registry is full, the handle given out
+ * is a sink that's never reported.
+ */
+
+#include <sys/time.h>
+
+#include <event2/buffer.h>
+
+struct metric;
+
+struct metric *metric_counter(const char *name, const char *help,
+			      const char *labels);
+struct metric *metric_gauge(const char *name, const char *help,
+			    const char *labels);
+
+/* Buckets from 5ms to 10s, reported in seconds */
+struct metric *metric_histogram(const char *name, const char *help,
+				const char *labels);
+
+void metric_add(struct metric *metric, long n);
+void metric_set(struct metric *metric, long value);
+
+/* Histograms only. NULL end means now. */
+void metric_observe(struct metric *metric,
+		    const struct timeval *start, const struct timeval *end);
+
+/*
+ * Some things are cheaper to count when asked than to keep track of.
+ * fn is called before every scrape, to metric_set() its gauges.
+ */
+typedef void (*metrics_collect_fn)(void *arg);
+
+int metrics_collect(metrics_collect_fn fn, void *arg);
+void metrics_uncollect(metrics_collect_fn fn, void *arg);
+
+/* Everything, in Prometheus text exposition format */
+void metrics_dump(struct evbuffer *out);
+
+#endif
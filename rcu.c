@@ -0,0 +1,199 @@
+#include "rcu.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "verbose.h"
+
+/* A thread tries to free what it's retired once it has this many */
+#define RCU_RECLAIM_BATCH 64
+
+struct retired {
+	struct retired *next;
+	void *ptr;
+	rcu_free_fn fn;
+	unsigned long epoch;
+};
+
+struct rcu_thread {
+	struct rcu_thread *next;
+
+	/* The epoch as of its last quiescent state */
+	atomic_ulong seen;
+
+	struct retired *retired;
+	int nretired;
+};
+
+/* Bumped by every retirement */
+static atomic_ulong epoch = 1;
+
+/* Guards everything below */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu_thread *threads;
+static int nthreads;
+
+/* Retired by threads that weren't registered, or have left. The
+ * count is there to be looked at without the lock.
+ */
+static struct retired *orphans;
+static atomic_int norphans;
+
+static __thread struct rcu_thread *self;
+
+/* ULONG_MAX with nobody around. Call with lock held. */
+static unsigned long oldest_seen(void)
+{
+	struct rcu_thread *thread;
+	unsigned long min, seen;
+
+	min = ULONG_MAX;
+	for (thread = threads; thread; thread = thread->next) {
+		seen = atomic_load_explicit(&thread->seen, memory_order_acquire);
+		if (seen < min) {
+			min = seen;
+		}
+	}
+
+	return min;
+}
+
+/* Frees whatever everyone's done with. Returns how many are left. */
+static int reclaim(struct retired **list, unsigned long seen)
+{
+	struct retired **rp, *r;
+	int left;
+
+	left = 0;
+	for (rp = list; (r = *rp) != NULL;) {
+		if (r->epoch <= seen) {
+			*rp = r->next;
+			r->fn(r->ptr);
+			free(r);
+		} else {
+			rp = &r->next;
+			left++;
+		}
+	}
+
+	return left;
+}
+
+int rcu_register_thread(void)
+{
+	struct rcu_thread *thread;
+
+	if (self != NULL) {
+		return 0;
+	}
+
+	if ((thread = calloc(1, sizeof(*thread))) == NULL) {
+		return ENOMEM;
+	}
+	atomic_init(&thread->seen, atomic_load(&epoch));
+
+	pthread_mutex_lock(&lock);
+	thread->next = threads;
+	threads = thread;
+	nthreads++;
+	pthread_mutex_unlock(&lock);
+
+	self = thread;
+	return 0;
+}
+
+void rcu_unregister_thread(void)
+{
+	struct rcu_thread **tp;
+	struct retired *r;
+
+	if (self == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	for (tp = &threads; *tp != self; tp = &(*tp)->next) {
+		;
+	}
+	*tp = self->next;
+	nthreads--;
+
+	/* Someone else gets to free these */
+	while ((r = self->retired) != NULL) {
+		self->retired = r->next;
+		r->next = orphans;
+		orphans = r;
+	}
+	atomic_store(&norphans, reclaim(&orphans, oldest_seen()));
+
+	pthread_mutex_unlock(&lock);
+
+	free(self);
+	self = NULL;
+}
+
+void rcu_quiescent_state(void)
+{
+	unsigned long seen;
+
+	if (self == NULL) {
+		return;
+	}
+
+	/* Everything we read before this is done with */
+	atomic_thread_fence(memory_order_seq_cst);
+	atomic_store_explicit(&self->seen, atomic_load(&epoch), memory_order_release);
+
+	if (self->retired == NULL && atomic_load(&norphans) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	seen = oldest_seen();
+	atomic_store(&norphans, reclaim(&orphans, seen));
+	pthread_mutex_unlock(&lock);
+
+	self->nretired = reclaim(&self->retired, seen);
+}
+
+void rcu_retire(void *ptr, rcu_free_fn fn)
+{
+	struct retired *r;
+	unsigned long seen;
+
+	if ((r = malloc(sizeof(*r))) == NULL) {
+		verbose(ERROR, "%s(): out of memory, leaking %p\n", __func__, ptr);
+		return;
+	}
+	r->ptr = ptr;
+	r->fn = fn;
+	r->epoch = atomic_fetch_add(&epoch, 1) + 1;
+
+	if (self != NULL) {
+		r->next = self->retired;
+		self->retired = r;
+		if (++self->nretired >= RCU_RECLAIM_BATCH) {
+			pthread_mutex_lock(&lock);
+			seen = oldest_seen();
+			pthread_mutex_unlock(&lock);
+			self->nretired = reclaim(&self->retired, seen);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	if (nthreads == 0) {
+		pthread_mutex_unlock(&lock);
+		fn(ptr);
+		free(r);
+		return;
+	}
+	r->next = orphans;
+	orphans = r;
+	atomic_fetch_add(&norphans, 1);
+	pthread_mutex_unlock(&lock);
+}
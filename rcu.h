@@ -0,0 +1,28 @@
+#ifndef RCU_H__INCLUDED
+#define RCU_H__INCLUDED
+
+/*
+ * Quiescent-state based reclamation, for data that's read without
+ * locks. Writers unlink things and hand them to rcu_retire() instead
+ * of freeing them. They're freed once every registered thread has
+ * passed through rcu_quiescent_state() since, and so can't be looking
+ * at them any more.
+ *
+ * A registered thread must not hold on to pointers it got from such
+ * data across its own rcu_quiescent_state(). An event loop calls it
+ * between callbacks, when it's holding nothing.
+ *
+ * With no threads registered at all, retired things are freed right
+ * away.
+ */
+
+typedef void (*rcu_free_fn)(void *);
+
+int rcu_register_thread(void);
+void rcu_unregister_thread(void);
+
+void rcu_quiescent_state(void);
+
+void rcu_retire(void *ptr, rcu_free_fn fn);
+
+#endif
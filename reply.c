@@ -1,8 +1,12 @@
 #include "reply.h"
 
+#include <stdio.h>
+
 #include <event2/buffer.h>
 #include <event2/http.h>
 
+#include "trace.h"
+
 static void replyv(struct evhttp_request *req, const char *fmt, va_list ap)
 {
 	struct evbuffer *buf;
@@ -35,3 +39,33 @@ void reply_redirect(struct evhttp_request *req, const char *where)
 
 	evbuffer_free(buf);
 }
+
+void reply_busy(struct evhttp_request *req, int retry_after)
+{
+	struct evbuffer *buf;
+	char secs[16];
+
+	buf = evbuffer_new();
+
+	/* Not with evhttp_send_error(), that throws our headers away */
+	snprintf(secs, sizeof(secs), "%d", retry_after);
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Retry-After", secs);
+	evbuffer_add_printf(buf, "Too busy, try again in %d s\n", retry_after);
+	evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service Unavailable", buf);
+
+	evbuffer_free(buf);
+}
+
+void reply_server_timing(struct evhttp_request *req, unsigned int trace,
+			 const struct timeval *start)
+{
+	char buf[512];
+
+	trace_span(trace, "total", start, NULL);
+
+	if (trace_server_timing(trace, buf, sizeof(buf)) > 0) {
+		evhttp_add_header(evhttp_request_get_output_headers(req),
+				  "Server-Timing", buf);
+	}
+}
@@ -1,9 +1,20 @@
 #ifndef REPLY_H__INCLUDED
 #define REPLY_H__INCLUDED
 
+#include <sys/time.h>
+
 #include <event2/http.h>
 
 void reply(struct evhttp_request *req, const char *fmt, ...);
 void reply_redirect(struct evhttp_request *req, const char *where);
 
+/* 503, come back in retry_after seconds */
+void reply_busy(struct evhttp_request *req, int retry_after);
+
+/* Close the "total" span started at start and tell the browser where
+ * the time went, in a Server-Timing header. Call before replying.
+ */
+void reply_server_timing(struct evhttp_request *req, unsigned int trace,
+			 const struct timeval *start);
+
 #endif
@@ -0,0 +1,498 @@
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "verbose.h"
+
+#define SNAPSHOT_MAGIC "YTHSNAP1"
+
+#define ID_LEN 16
+#define NONCE_LEN 12
+#define SALT_LEN 8
+#define TAG_LEN 16
+
+struct header {
+	char magic[8];
+	uint32_t count;
+	uint32_t unused;
+	uint64_t index_off;
+	/* Every record's nonce starts with this, and ends in its number */
+	unsigned char salt[SALT_LEN];
+};
+
+struct index_entry {
+	/* Keyed hash of the id, what the index is sorted by */
+	uint64_t hash;
+	uint64_t off;
+	/* Of the ciphertext, GCM tag included */
+	uint32_t len;
+	uint32_t n;
+};
+
+struct keys {
+	unsigned char seal[32];
+	unsigned char hash[32];
+};
+
+struct snapshot {
+	unsigned char *map;
+	size_t size;
+	const struct header *header;
+	const struct index_entry *index;
+	struct keys keys;
+	atomic_uchar *taken;
+};
+
+struct snapshot_writer {
+	FILE *f;
+	char *path;
+	char *tmp;
+	struct keys keys;
+	unsigned char salt[SALT_LEN];
+
+	struct index_entry *index;
+	uint32_t count;
+	uint32_t capacity;
+	uint64_t off;
+
+	/* Plaintext and ciphertext both, one after the other */
+	unsigned char *buf;
+	size_t buf_size;
+};
+
+/* One key for sealing, another for hashing the ids */
+static int derive_keys(struct keys *keys, const unsigned char *key)
+{
+	unsigned int len;
+
+	if (HMAC(EVP_sha256(), key, SNAPSHOT_KEY_LEN,
+		 (const unsigned char *)"seal", 4, keys->seal, &len) == NULL ||
+	    HMAC(EVP_sha256(), key, SNAPSHOT_KEY_LEN,
+		 (const unsigned char *)"hash", 4, keys->hash, &len) == NULL) {
+		return EIO;
+	}
+
+	return 0;
+}
+
+static uint64_t hash_id(const struct keys *keys, const uint32_t *id)
+{
+	unsigned char md[32];
+	unsigned int len;
+	uint64_t h = 0;
+
+	HMAC(EVP_sha256(), keys->hash, sizeof(keys->hash),
+	     (const unsigned char *)id, ID_LEN, md, &len);
+	memcpy(&h, md, sizeof(h));
+
+	return h;
+}
+
+static void make_nonce(unsigned char *nonce, const unsigned char *salt, uint32_t n)
+{
+	memcpy(nonce, salt, SALT_LEN);
+	memcpy(nonce + SALT_LEN, &n, sizeof(n));
+}
+
+/*
+ * out has room for len + TAG_LEN. The id's hash goes in as associated
+ * data, so a record doesn't open under another index entry.
+ */
+static int seal(const struct keys *keys, const unsigned char *nonce,
+		uint64_t hash, const void *in, int len, unsigned char *out)
+{
+	EVP_CIPHER_CTX *ctx;
+	int n, ok;
+
+	ctx = EVP_CIPHER_CTX_new();
+	ok = ctx != NULL &&
+		EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, keys->seal, nonce) &&
+		EVP_EncryptUpdate(ctx, NULL, &n, (const unsigned char *)&hash, sizeof(hash)) &&
+		EVP_EncryptUpdate(ctx, out, &n, in, len) &&
+		EVP_EncryptFinal_ex(ctx, out + n, &n) &&
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TAG_LEN, out + len);
+	EVP_CIPHER_CTX_free(ctx);
+
+	return ok ? 0 : EIO;
+}
+
+/* len is that of the plaintext, in is len + TAG_LEN */
+static int unseal(const struct keys *keys, const unsigned char *nonce,
+		  uint64_t hash, const unsigned char *in, int len, void *out)
+{
+	EVP_CIPHER_CTX *ctx;
+	int n, ok;
+
+	ctx = EVP_CIPHER_CTX_new();
+	ok = ctx != NULL &&
+		EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, keys->seal, nonce) &&
+		EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN,
+				    (void *)(in + len)) &&
+		EVP_DecryptUpdate(ctx, NULL, &n, (const unsigned char *)&hash, sizeof(hash)) &&
+		EVP_DecryptUpdate(ctx, out, &n, in, len) &&
+		EVP_DecryptFinal_ex(ctx, (unsigned char *)out + n, &n);
+	EVP_CIPHER_CTX_free(ctx);
+
+	return ok ? 0 : EBADMSG;
+}
+
+int snapshot_open(struct snapshot **snapp, const char *path,
+		  const unsigned char *key)
+{
+	struct snapshot *snap;
+	struct stat st;
+	int fd, err;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		return errno;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		err = errno;
+		close(fd);
+		return err;
+	}
+
+	if ((snap = calloc(1, sizeof(*snap))) == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	snap->size = st.st_size;
+	if (snap->size < sizeof(struct header)) {
+		verbose(ERROR, "%s(): %s is too short\n", __func__, path);
+		close(fd);
+		free(snap);
+		return EINVAL;
+	}
+
+	snap->map = mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (snap->map == MAP_FAILED) {
+		err = errno;
+		free(snap);
+		return err;
+	}
+
+	snap->header = (const struct header *)snap->map;
+	snap->index = (const struct index_entry *)(snap->map + snap->header->index_off);
+	if (memcmp(snap->header->magic, SNAPSHOT_MAGIC, sizeof(snap->header->magic)) != 0 ||
+	    snap->header->index_off < sizeof(struct header) ||
+	    snap->header->index_off > snap->size ||
+	    /* Read in place, so as the writer left it */
+	    snap->header->index_off % sizeof(uint64_t) != 0 ||
+	    (snap->size - snap->header->index_off) / sizeof(struct index_entry)
+	    < snap->header->count) {
+		verbose(ERROR, "%s(): %s is not a snapshot\n", __func__, path);
+		snapshot_close(snap);
+		return EINVAL;
+	}
+
+	/* Left to the kernel to zero as it's touched */
+	if ((snap->taken = calloc(snap->header->count + 1, 1)) == NULL ||
+	    derive_keys(&snap->keys, key) != 0) {
+		snapshot_close(snap);
+		return ENOMEM;
+	}
+
+	verbose(VERBOSE, "%s(): %u sessions in %s\n", __func__,
+		snap->header->count, path);
+
+	*snapp = snap;
+	return 0;
+}
+
+void snapshot_close(struct snapshot *snap)
+{
+	if (snap != NULL) {
+		munmap(snap->map, snap->size);
+		free(snap->taken);
+		OPENSSL_cleanse(&snap->keys, sizeof(snap->keys));
+		free(snap);
+	}
+}
+
+/*
+ * The plaintext of e, the id first and then the caller's data. NULL
+ * with errno set if it doesn't fit in the file or doesn't open.
+ */
+static unsigned char *open_entry(struct snapshot *snap,
+				 const struct index_entry *e, size_t *lenp)
+{
+	unsigned char nonce[NONCE_LEN];
+	unsigned char *plain;
+	int err;
+
+	if (e->len < TAG_LEN + ID_LEN ||
+	    e->off < sizeof(struct header) ||
+	    e->off > snap->header->index_off ||
+	    snap->header->index_off - e->off < e->len) {
+		errno = EBADMSG;
+		return NULL;
+	}
+
+	if ((plain = malloc(e->len - TAG_LEN)) == NULL) {
+		return NULL;
+	}
+
+	make_nonce(nonce, snap->header->salt, e->n);
+	if ((err = unseal(&snap->keys, nonce, e->hash, snap->map + e->off,
+			  e->len - TAG_LEN, plain)) != 0) {
+		free(plain);
+		errno = err;
+		return NULL;
+	}
+
+	*lenp = e->len - TAG_LEN;
+	return plain;
+}
+
+int snapshot_take(struct snapshot *snap, const uint32_t *id,
+		  void **datap, size_t *lenp)
+{
+	unsigned char *plain;
+	uint32_t lo, hi, mid;
+	size_t len;
+	uint64_t h;
+
+	h = hash_id(&snap->keys, id);
+
+	lo = 0;
+	hi = snap->header->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (snap->index[mid].hash < h) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/* A 64-bit hash could collide. It's the one with our id in it. */
+	for (; lo < snap->header->count && snap->index[lo].hash == h; lo++) {
+		if (atomic_load_explicit(&snap->taken[lo], memory_order_relaxed) ||
+		    (plain = open_entry(snap, &snap->index[lo], &len)) == NULL) {
+			continue;
+		}
+		if (memcmp(plain, id, ID_LEN) != 0 ||
+		    atomic_exchange(&snap->taken[lo], 1)) {
+			free(plain);
+			continue;
+		}
+
+		/* The caller gets the data without the id in front */
+		memmove(plain, plain + ID_LEN, len - ID_LEN);
+		*datap = plain;
+		*lenp = len - ID_LEN;
+		return 0;
+	}
+
+	return ENOENT;
+}
+
+void snapshot_each(struct snapshot *snap, snapshot_each_fn fn, void *arg)
+{
+	unsigned char *plain;
+	uint32_t id[4];
+	size_t len;
+	uint32_t i;
+
+	for (i = 0; i < snap->header->count; i++) {
+		if (atomic_load_explicit(&snap->taken[i], memory_order_relaxed) ||
+		    (plain = open_entry(snap, &snap->index[i], &len)) == NULL) {
+			continue;
+		}
+		memcpy(id, plain, ID_LEN);
+		fn(id, plain + ID_LEN, len - ID_LEN, arg);
+		free(plain);
+	}
+}
+
+int snapshot_write_begin(struct snapshot_writer **wp, const char *path,
+			 const unsigned char *key)
+{
+	struct snapshot_writer *w;
+	struct header header;
+	int fd, err;
+
+	if ((w = calloc(1, sizeof(*w))) == NULL) {
+		return ENOMEM;
+	}
+
+	if ((w->path = strdup(path)) == NULL ||
+	    asprintf(&w->tmp, "%s.tmp", path) == -1) {
+		w->tmp = NULL;
+		snapshot_write_end(w, 0);
+		return ENOMEM;
+	}
+
+	if (derive_keys(&w->keys, key) != 0 ||
+	    RAND_bytes(w->salt, sizeof(w->salt)) != 1) {
+		snapshot_write_end(w, 0);
+		return EIO;
+	}
+
+	/* Nobody else's business */
+	if ((fd = open(w->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1 ||
+	    (w->f = fdopen(fd, "w")) == NULL) {
+		err = errno;
+		if (fd != -1) {
+			close(fd);
+		}
+		verbose(ERROR, "%s(): %s: %s\n", __func__, w->tmp, strerror(err));
+		snapshot_write_end(w, 0);
+		return err;
+	}
+
+	/* The real one goes in last, when we know where the index is */
+	memset(&header, 0, sizeof(header));
+	if (fwrite(&header, sizeof(header), 1, w->f) != 1) {
+		snapshot_write_end(w, 0);
+		return EIO;
+	}
+	w->off = sizeof(header);
+
+	*wp = w;
+	return 0;
+}
+
+int snapshot_write(struct snapshot_writer *w, const uint32_t *id,
+		   const void *data, size_t len)
+{
+	unsigned char nonce[NONCE_LEN];
+	struct index_entry *e;
+	unsigned char *plain;
+	size_t need;
+	void *p;
+	int err;
+
+	if (len > INT32_MAX - ID_LEN - TAG_LEN) {
+		return EINVAL;
+	}
+
+	if (w->count == w->capacity) {
+		p = realloc(w->index, (w->capacity ? w->capacity * 2 : 64) * sizeof(*w->index));
+		if (p == NULL) {
+			return ENOMEM;
+		}
+		w->index = p;
+		w->capacity = w->capacity ? w->capacity * 2 : 64;
+	}
+
+	/* The plaintext in the first half, ciphertext in the second */
+	need = 2 * (ID_LEN + len) + TAG_LEN;
+	if (need > w->buf_size) {
+		if ((p = realloc(w->buf, need)) == NULL) {
+			return ENOMEM;
+		}
+		w->buf = p;
+		w->buf_size = need;
+	}
+	plain = w->buf;
+	memcpy(plain, id, ID_LEN);
+	memcpy(plain + ID_LEN, data, len);
+
+	e = &w->index[w->count];
+	e->hash = hash_id(&w->keys, id);
+	e->off = w->off;
+	e->len = ID_LEN + len + TAG_LEN;
+	e->n = w->count;
+
+	make_nonce(nonce, w->salt, e->n);
+	if ((err = seal(&w->keys, nonce, e->hash, plain, ID_LEN + len,
+			plain + ID_LEN + len)) != 0) {
+		return err;
+	}
+	OPENSSL_cleanse(plain, ID_LEN + len);
+
+	if (fwrite(plain + ID_LEN + len, e->len, 1, w->f) != 1) {
+		return EIO;
+	}
+
+	w->off += e->len;
+	w->count++;
+
+	return 0;
+}
+
+static int by_hash(const void *a, const void *b)
+{
+	const struct index_entry *ea = a, *eb = b;
+
+	return ea->hash < eb->hash ? -1 : ea->hash > eb->hash;
+}
+
+int snapshot_write_end(struct snapshot_writer *w, int commit)
+{
+	static const char pad[sizeof(uint64_t)];
+	struct header header;
+	size_t npad;
+	int err = 0;
+
+	if (commit) {
+		qsort(w->index, w->count, sizeof(*w->index), by_hash);
+
+		/* The index is read in place, so it's aligned */
+		npad = -w->off % sizeof(uint64_t);
+		if (npad > 0 && fwrite(pad, npad, 1, w->f) != 1) {
+			err = EIO;
+		}
+		w->off += npad;
+
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+		header.count = w->count;
+		header.index_off = w->off;
+		memcpy(header.salt, w->salt, sizeof(header.salt));
+
+		if (err != 0 ||
+		    (w->count > 0 &&
+		     fwrite(w->index, sizeof(*w->index), w->count, w->f) != w->count) ||
+		    fseek(w->f, 0, SEEK_SET) == -1 ||
+		    fwrite(&header, sizeof(header), 1, w->f) != 1 ||
+		    fflush(w->f) != 0 ||
+		    fsync(fileno(w->f)) == -1) {
+			err = err ? err : errno ? errno : EIO;
+		}
+	}
+
+	if (w->f != NULL && fclose(w->f) != 0 && err == 0) {
+		err = errno;
+	}
+
+	if (commit && err == 0 && rename(w->tmp, w->path) == -1) {
+		err = errno;
+	}
+
+	if (w->tmp != NULL && (!commit || err != 0)) {
+		unlink(w->tmp);
+	}
+
+	if (err != 0) {
+		verbose(ERROR, "%s(): %s: %s\n", __func__, w->path, strerror(err));
+	} else if (commit) {
+		verbose(VERBOSE, "%s(): %u sessions in %s\n", __func__,
+			w->count, w->path);
+	}
+
+	OPENSSL_cleanse(&w->keys, sizeof(w->keys));
+	free(w->buf);
+	free(w->index);
+	free(w->tmp);
+	free(w->path);
+	free(w);
+
+	return err;
+}
@@ -0,0 +1,55 @@
+#ifndef SNAPSHOT_H__INCLUDED
+#define SNAPSHOT_H__INCLUDED
+
+/*
+ * Sessions saved to disk, so a restart doesn't log everybody out.
+ *
+ * A snapshot is a file of records, each an opaque blob filed under a
+ * 128-bit session id and sealed with AES-256-GCM. The index at the end
+ * is sorted by a keyed hash of the id, so the ids themselves, which
+ * are as good as the cookies, aren't in the file in the clear.
+ *
+ * Reading one back maps it and checks the header, nothing more. A
+ * record is only decrypted when its session is asked for, so starting
+ * up doesn't take longer the more sessions there are.
+ *
+ * Written and read by the same machine. Nothing's byte-swapped.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAPSHOT_KEY_LEN 32
+
+struct snapshot;
+struct snapshot_writer;
+
+/* ENOENT if there's none yet, EINVAL if it isn't one of ours */
+int snapshot_open(struct snapshot **snapp, const char *path,
+		  const unsigned char *key);
+void snapshot_close(struct snapshot *snap);
+
+/*
+ * The record for id, decrypted into a malloc()ed *datap. Each record
+ * can be taken once. ENOENT if there's no such record, or it's been
+ * taken already. EBADMSG if it doesn't decrypt.
+ */
+int snapshot_take(struct snapshot *snap, const uint32_t *id,
+		  void **datap, size_t *lenp);
+
+/* Every record nobody's taken yet, decrypted, for carrying over */
+typedef void (*snapshot_each_fn)(const uint32_t *id, const void *data,
+				 size_t len, void *arg);
+void snapshot_each(struct snapshot *snap, snapshot_each_fn fn, void *arg);
+
+/*
+ * Written to a temporary file first, which replaces path on commit.
+ * snapshot_write_end() with commit zero throws it away.
+ */
+int snapshot_write_begin(struct snapshot_writer **wp, const char *path,
+			 const unsigned char *key);
+int snapshot_write(struct snapshot_writer *w, const uint32_t *id,
+		   const void *data, size_t len);
+int snapshot_write_end(struct snapshot_writer *w, int commit);
+
+#endif
@@ -2,135 +2,689 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
-#include <search.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
+#include <event2/buffer.h>
+
+#include "metrics.h"
+#include "rcu.h"
+#include "snapshot.h"
 #include "verbose.h"
 
 #define SESSION_COOKIE_NAME "YT_HISTORY_SESSION"
 
-struct node {
-	struct node *next;
-	struct node *prev;
+/* A table is rebuilt when it's fuller than this, in tenths. Removed
+ * sessions leave tombstones, and those count too.
+ */
+#define STORE_MAX_LOAD 7
+
+#define STORE_MIN_SLOTS 16
+
+/* Sessions are spread over this many shards, by hash. Each shard
+ * has its own lock for writers.
+ */
+#define STORE_SHARD_BITS 4
+#define STORE_SHARDS (1 << STORE_SHARD_BITS)
+
+/* Expired sessions are swept at least this often */
+#define STORE_SWEEP_SECS 60
+
+/* Distinct value names, all sessions together */
+#define STORE_MAX_KEYS 256
+
+/* Values a session finds with a linear scan. All we really have is
+ * the access token.
+ */
+#define SESSION_INLINE_KVS 3
 
-	char data[];
+/* The first spill table, once the inline ones run out. Then doubling. */
+#define SESSION_SPILL_MIN 8
+#define SESSION_SPILL_MAX 128
+
+/* 128 random bits, 32 hex digits in the cookie */
+#define SESSION_ID_WORDS 4
+#define SESSION_ID_LEN (SESSION_ID_WORDS * 8)
+
+typedef _Atomic(struct session *) session_slot;
+
+/* Open addressing with linear probing. capacity is a power of two. */
+struct table {
+	size_t capacity;
+	session_slot slots[];
 };
 
-static void tangle_node(struct node **head, struct node *node)
+/* Where a removed session was. Lookups go past it, inserts reuse it. */
+static struct session tombstone;
+#define TOMBSTONE (&tombstone)
+
+struct shard {
+	pthread_mutex_t lock;
+
+	/* Readers only ever look at this */
+	_Atomic(struct table *) table;
+
+	/* The rest is the writers', under lock. Sessions, and
+	 * sessions plus tombstones.
+	 */
+	atomic_size_t live;
+	size_t used;
+
+	/* By when they were last seen used, most recent first. The
+	 * order is only brought up to date by the sweeper and
+	 * eviction.
+	 */
+	struct session *lru_head;
+	struct session *lru_tail;
+
+	size_t bytes;
+
+	atomic_ulong expired;
+	atomic_ulong evicted;
+};
+
+struct store {
+	struct shard shards[STORE_SHARDS];
+
+	unsigned int seed;
+	uint32_t hash_seed;
+
+	/* last_used is counted from here, to fit in 32 bits */
+	time_t epoch;
+
+	int idle_ttl;
+
+	/* Per shard */
+	size_t max_bytes;
+
+	struct event *sweeper;
+
+	/* Where sessions are saved, and the last save, where the ones
+	 * not back yet are taken from.
+	 */
+	char *snapshot_path;
+	unsigned char snapshot_key[SNAPSHOT_KEY_LEN];
+	struct snapshot *snapshot;
+	struct event *saver;
+	atomic_ulong restored;
+
+	/* Key names, once each. A key is known by its index + 1,
+	 * so 0 can mean an empty slot. Only ever appended to.
+	 */
+	pthread_mutex_t keys_lock;
+	_Atomic(char *) keys[STORE_MAX_KEYS];
+	atomic_int nkeys;
+
+	struct metric *nsessions;
+	struct metric *expired;
+	struct metric *evicted;
+	struct metric *nrestored;
+};
+
+/* The value lives at session_values(data) + off */
+struct kv {
+	uint16_t key;
+	uint16_t len;
+	uint32_t off;
+};
+
+/*
+ * A session's values, all in one allocation. Never changed once
+ * published, a new one replaces it. The first SESSION_INLINE_KVS kvs
+ * are scanned, spill_cap more after them are a hash table by key.
+ * The values themselves come last, NUL-terminated.
+ */
+struct session_data {
+	uint16_t spill_cap;
+	uint16_t nkeys;
+	uint32_t values_len;
+	struct kv kv[];
+};
+
+struct session {
+
+	struct store *store;
+
+	/* Neighbours in the LRU list */
+	struct session *newer;
+	struct session *older;
+
+	uint32_t id[SESSION_ID_WORDS];
+	uint32_t hash;
+
+	/* Seconds since store->epoch. Readers bump last_used, the
+	 * LRU list goes by pushed, what last_used was when the session
+	 * was last moved to its head.
+	 */
+	atomic_uint last_used;
+	uint32_t pushed;
+
+	/* One for being in the store, and one for every hold */
+	atomic_uint refs;
+	uint8_t stored;
+
+	_Atomic(struct session_data *) data;
+};
+
+static __thread unsigned int thread_seed;
+
+static uint32_t hash_id(const struct store *store, const uint32_t *id)
+{
+	const unsigned char *p = (const unsigned char *)id;
+	uint32_t h = 2166136261u ^ store->hash_seed;
+	int i;
+
+	/* FNV-1a. The seed keeps made up cookies from piling up
+	 * in one place.
+	 */
+	for (i = 0; i < SESSION_ID_WORDS * sizeof(*id); i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/* Low bits pick the slot, high bits the shard */
+static struct shard *shard_of(struct store *store, uint32_t hash)
+{
+	return &store->shards[hash >> (32 - STORE_SHARD_BITS)];
+}
+
+/* Only for the logs. Good until the thread's next call. */
+static const char *id_str(const struct session *session)
+{
+	static __thread char buf[SESSION_ID_LEN + 1];
+
+	snprintf(buf, sizeof(buf), "%08x%08x%08x%08x",
+		 session->id[0], session->id[1], session->id[2], session->id[3]);
+	return buf;
+}
+
+/* Exactly 32 hex digits, and then the end of the cookie */
+static int parse_id(uint32_t *id, const char *s)
+{
+	char word[9];
+	int i, j;
+
+	for (i = 0; i < SESSION_ID_LEN; i++) {
+		if (!((s[i] >= '0' && s[i] <= '9') || (s[i] >= 'a' && s[i] <= 'f'))) {
+			return EINVAL;
+		}
+	}
+	if (s[i] != '\0' && s[i] != ';') {
+		return EINVAL;
+	}
+
+	word[8] = '\0';
+	for (j = 0; j < SESSION_ID_WORDS; j++) {
+		memcpy(word, s + j * 8, 8);
+		id[j] = strtoul(word, NULL, 16);
+	}
+
+	return 0;
+}
+
+static struct table *new_table(size_t capacity)
+{
+	struct table *table;
+
+	table = calloc(1, sizeof(*table) + capacity * sizeof(table->slots[0]));
+	if (table != NULL) {
+		table->capacity = capacity;
+	}
+	return table;
+}
+
+/*
+ * Where id is, or the first empty slot after it would be. No locks,
+ * and the table may be changing underneath. A session being inserted
+ * meanwhile may or may not be found, one being removed may still be.
+ */
+static size_t probe(struct table *table, const uint32_t *id, uint32_t hash)
+{
+	size_t mask = table->capacity - 1;
+	struct session *s;
+	size_t i;
+
+	for (i = hash & mask;
+	     (s = atomic_load_explicit(&table->slots[i], memory_order_acquire)) != NULL;
+	     i = (i + 1) & mask) {
+		if (s != TOMBSTONE && s->hash == hash &&
+		    memcmp(s->id, id, sizeof(s->id)) == 0) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+static struct session *lookup(struct shard *shard, const uint32_t *id, uint32_t hash)
 {
-	if (*head) {
-		(*head)->prev = node;
+	struct table *table;
+	struct session *s;
+
+	table = atomic_load_explicit(&shard->table, memory_order_acquire);
+	s = atomic_load_explicit(&table->slots[probe(table, id, hash)],
+				 memory_order_acquire);
+
+	return s;
+}
+
+/*
+ * Into a new table, without the tombstones, bigger if need be. Readers
+ * still on the old one are fine, it's not freed before they're done.
+ */
+static int rebuild(struct shard *shard)
+{
+	struct table *old, *table;
+	size_t capacity, live, i, j, mask;
+	struct session *s;
+
+	old = atomic_load_explicit(&shard->table, memory_order_relaxed);
+	live = atomic_load_explicit(&shard->live, memory_order_relaxed);
+
+	/* Half full at most, to leave room for more */
+	for (capacity = STORE_MIN_SLOTS;
+	     (live + 1) * 20 > capacity * STORE_MAX_LOAD;
+	     capacity *= 2) {
+		;
+	}
+
+	if ((table = new_table(capacity)) == NULL) {
+		return ENOMEM;
+	}
+
+	mask = capacity - 1;
+	for (i = 0; i < old->capacity; i++) {
+		s = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+		if (s != NULL && s != TOMBSTONE) {
+			for (j = s->hash & mask;
+			     atomic_load_explicit(&table->slots[j], memory_order_relaxed);
+			     j = (j + 1) & mask) {
+				;
+			}
+			atomic_store_explicit(&table->slots[j], s, memory_order_relaxed);
+		}
 	}
-	node->next = *head;
-	*head = node;
+
+	atomic_store_explicit(&shard->table, table, memory_order_release);
+	shard->used = live;
+	rcu_retire(old, free);
+
+	verbose(VERBOSE, "%s(): %zd slots for %zd sessions\n",
+		__func__, capacity, live);
+
+	return 0;
 }
 
-static void untangle_node(struct node **head, struct node *node)
+/* With the shard locked. The id must not be in there. */
+static int table_insert(struct shard *shard, struct session *session)
 {
-	if (node == *head) {
-		*head = node->next;
+	struct table *table;
+	size_t mask, i;
+	struct session *s;
+	int err;
+
+	if ((shard->used + 1) * 10 >
+	    atomic_load_explicit(&shard->table, memory_order_relaxed)->capacity * STORE_MAX_LOAD &&
+	    (err = rebuild(shard)) != 0) {
+		return err;
 	}
-	if (node->next != NULL) {
-		node->next->prev = node->prev;
+
+	table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+	mask = table->capacity - 1;
+	for (i = session->hash & mask;
+	     (s = atomic_load_explicit(&table->slots[i], memory_order_relaxed)) != NULL &&
+		     s != TOMBSTONE;
+	     i = (i + 1) & mask) {
+		;
 	}
 
-	if (node->prev != NULL) {
-		node->prev->next = node->next;
+	if (s == NULL) {
+		shard->used++;
 	}
+	atomic_fetch_add_explicit(&shard->live, 1, memory_order_relaxed);
+
+	/* Everything about it is in place before anyone can see it */
+	atomic_store_explicit(&table->slots[i], session, memory_order_release);
+
+	return 0;
 }
 
-typedef void (*node_dtor_fn)(void *);
+/* With the shard locked */
+static void table_remove(struct shard *shard, struct session *session)
+{
+	struct table *table;
+	size_t i;
+
+	table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+	i = probe(table, session->id, session->hash);
+	if (atomic_load_explicit(&table->slots[i], memory_order_relaxed) == session) {
+		atomic_store_explicit(&table->slots[i], TOMBSTONE, memory_order_release);
+		atomic_fetch_sub_explicit(&shard->live, 1, memory_order_relaxed);
+	}
+}
 
-static void nodelist_free(struct node *node, node_dtor_fn dtor)
+static void lru_unlink(struct shard *shard, struct session *session)
 {
-	struct node *tmp = node;
+	if (session->newer != NULL) {
+		session->newer->older = session->older;
+	} else {
+		shard->lru_head = session->older;
+	}
 
-	while (node) {
-		tmp = node->next;
-		dtor(node);
-		node = tmp;
+	if (session->older != NULL) {
+		session->older->newer = session->newer;
+	} else {
+		shard->lru_tail = session->newer;
 	}
+
+	session->newer = session->older = NULL;
 }
 
+static void lru_push(struct shard *shard, struct session *session)
+{
+	session->pushed = atomic_load_explicit(&session->last_used,
+					       memory_order_relaxed);
+	session->older = shard->lru_head;
+	session->newer = NULL;
+	if (shard->lru_head != NULL) {
+		shard->lru_head->newer = session;
+	} else {
+		shard->lru_tail = session;
+	}
+	shard->lru_head = session;
+}
+
+static char *session_values(struct session_data *data)
+{
+	return (char *)&data->kv[SESSION_INLINE_KVS + data->spill_cap];
+}
 
-static const char *kvnode_key(struct node *node)
+static size_t data_bytes(const struct session_data *data)
 {
-	return node->data + sizeof(size_t);
+	return data == NULL ? 0
+		: sizeof(*data) +
+		(SESSION_INLINE_KVS + data->spill_cap) * sizeof(struct kv) +
+		data->values_len;
 }
 
-static const char *kvnode_value(struct node *node)
+/* What a session costs us, about. Its share of the table included. */
+static size_t session_bytes(struct session *session)
 {
-	return node->data + *(size_t *)node->data;
+	return sizeof(*session) +
+		sizeof(session_slot) * 10 / STORE_MAX_LOAD +
+		data_bytes(atomic_load_explicit(&session->data, memory_order_relaxed));
 }
 
-static struct node *alloc_node(size_t sz)
+static void destroy_session(void *arg)
 {
-	struct node *node;
+	struct session *session = arg;
 
-	node = malloc(sizeof(*node) + sz);
-	if (node != NULL) {
-		memset(node, 0, sizeof(*node) + sz);
+	free(atomic_load_explicit(&session->data, memory_order_relaxed));
+	free(session);
+}
+
+/* Freed once the last reference goes, and nobody can be looking */
+static void put_session(struct session *session)
+{
+	if (atomic_fetch_sub(&session->refs, 1) == 1) {
+		rcu_retire(session, destroy_session);
 	}
-	return node;
 }
 
-static struct node *alloc_kvnode(const char *key, const char *value)
+/* Out of the store. With the shard locked. */
+static void forget_session(struct shard *shard, struct session *session)
 {
-	struct node *node;
-	int klen, vlen;
+	table_remove(shard, session);
+	lru_unlink(shard, session);
+	shard->bytes -= session_bytes(session);
+	session->stored = 0;
 
-	klen = strlen(key);
-	vlen = strlen(value);
+	put_session(session);
+}
 
-	/* A kvnode stores its data thusly:
-	 *
-	 *   <valueoffset><key>\0<value>\0
-	 *
-	 * So key starts at &data[sizeof(size_t)], and value
-	 * at &data[*(size_t *)&data]
-	 *
-	 * We don't have a natural container for these, so
-	 * we use the expanding ->data member of node directly
-	 *
-	 * For sessions themselves the situation is different.
-	 * All allocations are embedded inside the struct itself,
-	 * so we can embed a struct node in session and have it
-	 * as the first member, punning it all the way to hell.
+static uint32_t now_rel(struct store *store)
+{
+	return time(NULL) - store->epoch;
+}
+
+static int is_expired(struct store *store, struct session *session, uint32_t now)
+{
+	uint32_t last_used;
+
+	/* Another thread may have used it since we looked at the clock,
+	 * and that's as fresh as it gets
 	 */
+	last_used = atomic_load_explicit(&session->last_used, memory_order_relaxed);
 
-	node = alloc_node(sizeof(size_t) + klen + 1 + vlen + 1);
-	if (node != NULL) {
-		memcpy(node->data + sizeof(size_t), key, klen + 1);
-		node->data[sizeof(size_t) + klen] = '\0';
-		memcpy(node->data + sizeof(size_t) + klen + 1, value, vlen + 1);
-		*((size_t *)node->data) = sizeof(size_t) + klen + 1;
+	return store->idle_ttl > 0 &&
+		last_used < now &&
+		now - last_used >= (uint32_t)store->idle_ttl;
+}
+
+/*
+ * The tail of the LRU list, with the ones that have been used since
+ * they were put in line given another chance at the head. NULL when
+ * there's nothing but keep left.
+ */
+static struct session *least_recently_used(struct shard *shard,
+					   struct session *keep)
+{
+	struct session *s;
+	size_t budget;
+
+	budget = atomic_load_explicit(&shard->live, memory_order_relaxed);
+	while ((s = shard->lru_tail) != NULL && s != keep && budget-- > 0) {
+		if (atomic_load_explicit(&s->last_used, memory_order_relaxed) == s->pushed) {
+			return s;
+		}
+		lru_unlink(shard, s);
+		lru_push(shard, s);
 	}
-	return node;
+
+	return s != keep ? s : NULL;
 }
 
-struct store {
-	struct hsearch_data sessions;
-	unsigned int seed;
+/* With the shard locked */
+static void expire(struct store *store, struct shard *shard, uint32_t now)
+{
+	struct session *s;
 
-	struct session *snodes;
-};
+	while ((s = least_recently_used(shard, NULL)) != NULL &&
+	       is_expired(store, s, now)) {
+		verbose(VERBOSE, "%s(): session %s expired\n", __func__, id_str(s));
+		forget_session(shard, s);
+		atomic_fetch_add_explicit(&shard->expired, 1, memory_order_relaxed);
+	}
+}
 
-struct session {
+/* Down to max_bytes, but keep is kept. With the shard locked. */
+static void evict(struct store *store, struct shard *shard, struct session *keep)
+{
+	struct session *s;
 
-	struct node node;
+	while (store->max_bytes > 0 && shard->bytes > store->max_bytes &&
+	       (s = least_recently_used(shard, keep)) != NULL) {
+		verbose(VERBOSE, "%s(): evicting session %s\n", __func__, id_str(s));
+		forget_session(shard, s);
+		atomic_fetch_add_explicit(&shard->evicted, 1, memory_order_relaxed);
+	}
+}
 
-	struct store *store;
+static void sweep(evutil_socket_t fd, short what, void *arg)
+{
+	struct store *store = arg;
+	uint32_t now;
+	int i;
+
+	now = now_rel(store);
+	for (i = 0; i < STORE_SHARDS; i++) {
+		pthread_mutex_lock(&store->shards[i].lock);
+		expire(store, &store->shards[i], now);
+		pthread_mutex_unlock(&store->shards[i].lock);
+	}
+}
+
+static void count_sessions(void *arg)
+{
+	struct store *store = arg;
+	long live, expired, evicted;
+	int i;
+
+	live = expired = evicted = 0;
+	for (i = 0; i < STORE_SHARDS; i++) {
+		live += atomic_load(&store->shards[i].live);
+		expired += atomic_load(&store->shards[i].expired);
+		evicted += atomic_load(&store->shards[i].evicted);
+	}
+
+	metric_set(store->nsessions, live);
+	metric_set(store->expired, expired);
+	metric_set(store->evicted, evicted);
+	metric_set(store->nrestored, atomic_load(&store->restored));
+}
+
+/*
+ * A session in a snapshot: when it was last used, by the wall clock,
+ * and then its values as key, value pairs, each NUL-terminated.
+ * With the shard locked.
+ */
+static int encode_session(struct store *store, struct session *session,
+			  struct evbuffer *out)
+{
+	struct session_data *data;
+	int64_t last_used;
+	struct kv *kv;
+	int i;
+
+	last_used = store->epoch +
+		atomic_load_explicit(&session->last_used, memory_order_relaxed);
+	evbuffer_add(out, &last_used, sizeof(last_used));
+
+	data = atomic_load_explicit(&session->data, memory_order_relaxed);
+	for (i = 0; data != NULL && i < SESSION_INLINE_KVS + data->spill_cap; i++) {
+		kv = &data->kv[i];
+		if (kv->key != 0) {
+			evbuffer_add(out, store->keys[kv->key - 1],
+				     strlen(store->keys[kv->key - 1]) + 1);
+			evbuffer_add(out, session_values(data) + kv->off, kv->len + 1);
+		}
+	}
+
+	return 0;
+}
+
+/* NULL with end reached or on garbage */
+static const char *next_string(const char **p, const char *end)
+{
+	const char *s = *p;
+	const char *nul;
 
-	char id[20];
-	struct hsearch_data keyvals;
+	if (s >= end || (nul = memchr(s, '\0', end - s)) == NULL) {
+		return NULL;
+	}
+	*p = nul + 1;
+	return s;
+}
+
+static int is_expired_at(struct store *store, int64_t last_used, time_t now)
+{
+	return store->idle_ttl > 0 && now - last_used >= store->idle_ttl;
+}
 
-	struct node *kvnodes;
+struct save_ctx {
+	struct store *store;
+	struct snapshot_writer *w;
+	time_t now;
+	int err;
+	int n;
 };
 
-int store_init(struct store **storep, int nel)
+/* From the last snapshot to the next, for those not back yet */
+static void carry_over(const uint32_t *id, const void *data, size_t len, void *arg)
 {
+	struct save_ctx *ctx = arg;
+	int64_t last_used;
+
+	if (ctx->err != 0 || len < sizeof(last_used)) {
+		return;
+	}
+
+	memcpy(&last_used, data, sizeof(last_used));
+	if (!is_expired_at(ctx->store, last_used, ctx->now)) {
+		ctx->err = snapshot_write(ctx->w, id, data, len);
+		ctx->n++;
+	}
+}
+
+static int save_sessions(struct store *store)
+{
+	struct save_ctx ctx = { .store = store, .now = time(NULL) };
+	struct evbuffer *buf;
+	struct session *s;
+	struct shard *shard;
+	uint32_t now;
+	int i;
+
+	if ((buf = evbuffer_new()) == NULL) {
+		return ENOMEM;
+	}
+
+	if ((ctx.err = snapshot_write_begin(&ctx.w, store->snapshot_path,
+					    store->snapshot_key)) != 0) {
+		evbuffer_free(buf);
+		return ctx.err;
+	}
+
+	now = now_rel(store);
+	for (i = 0; i < STORE_SHARDS && ctx.err == 0; i++) {
+		shard = &store->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		for (s = shard->lru_head; s != NULL && ctx.err == 0; s = s->older) {
+			if (is_expired(store, s, now)) {
+				continue;
+			}
+			encode_session(store, s, buf);
+			ctx.err = snapshot_write(ctx.w, s->id,
+						 evbuffer_pullup(buf, -1),
+						 evbuffer_get_length(buf));
+			evbuffer_drain(buf, evbuffer_get_length(buf));
+			ctx.n++;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	if (store->snapshot != NULL && ctx.err == 0) {
+		snapshot_each(store->snapshot, carry_over, &ctx);
+	}
+
+	evbuffer_free(buf);
+
+	if ((ctx.err = snapshot_write_end(ctx.w, ctx.err == 0)) == 0) {
+		verbose(VERBOSE, "%s(): saved %d sessions\n", __func__, ctx.n);
+	}
+
+	return ctx.err;
+}
+
+static void save(evutil_socket_t fd, short what, void *arg)
+{
+	save_sessions(arg);
+}
+
+int store_init(struct store **storep, struct event_base *base,
+	       const struct store_options *opts)
+{
+	struct timeval interval;
 	struct store *store;
+	size_t capacity;
+	int err, i;
 
 	store = malloc(sizeof(*store));
 	if (store == NULL) {
@@ -141,10 +695,84 @@ int store_init(struct store **storep, int nel)
 
 	/* Yeah it's not very random. Nobody cares. */
 	store->seed = (unsigned long)store;
+	store->hash_seed = rand_r(&store->seed);
 
-	if (hcreate_r(nel, &store->sessions) == 0) {
-		free(store);
-		return ENOMEM;
+	store->epoch = time(NULL);
+	store->idle_ttl = opts->idle_ttl;
+	store->max_bytes = opts->max_bytes / STORE_SHARDS;
+
+	for (capacity = STORE_MIN_SLOTS;
+	     capacity * STORE_MAX_LOAD * STORE_SHARDS < opts->nel * 10;
+	     capacity *= 2) {
+		;
+	}
+
+	pthread_mutex_init(&store->keys_lock, NULL);
+	for (i = 0; i < STORE_SHARDS; i++) {
+		pthread_mutex_init(&store->shards[i].lock, NULL);
+		store->shards[i].table = new_table(capacity);
+		if (store->shards[i].table == NULL) {
+			store_destroy(store);
+			return ENOMEM;
+		}
+	}
+
+	if (base != NULL && store->idle_ttl > 0) {
+		store->sweeper = event_new(base, -1, EV_PERSIST, sweep, store);
+		if (store->sweeper == NULL) {
+			store_destroy(store);
+			return ENOMEM;
+		}
+		interval.tv_sec = store->idle_ttl < STORE_SWEEP_SECS
+			? store->idle_ttl
+			: STORE_SWEEP_SECS;
+		interval.tv_usec = 0;
+		event_add(store->sweeper, &interval);
+	}
+
+	store->nsessions = metric_gauge("yt_history_sessions",
+					"Sessions in the store", NULL);
+	store->expired = metric_counter("yt_history_sessions_removed_total",
+					"Sessions thrown away, by why",
+					"reason=\"expired\"");
+	store->evicted = metric_counter("yt_history_sessions_removed_total",
+					"Sessions thrown away, by why",
+					"reason=\"evicted\"");
+	store->nrestored = metric_counter("yt_history_sessions_restored_total",
+					  "Sessions brought back from a snapshot",
+					  NULL);
+	if (metrics_collect(count_sessions, store) != 0) {
+		verbose(ERROR, "%s(): sessions won't be counted\n", __func__);
+	}
+
+	if (opts->snapshot_path != NULL) {
+		if ((store->snapshot_path = strdup(opts->snapshot_path)) == NULL) {
+			store_destroy(store);
+			return ENOMEM;
+		}
+		memcpy(store->snapshot_key, opts->snapshot_key,
+		       sizeof(store->snapshot_key));
+
+		/* Only the header is looked at now, sessions are
+		 * restored as they come back. Starting afresh is fine.
+		 */
+		err = snapshot_open(&store->snapshot, store->snapshot_path,
+				    store->snapshot_key);
+		if (err != 0 && err != ENOENT) {
+			verbose(ERROR, "%s(): not restoring sessions from %s: %s\n",
+				__func__, store->snapshot_path, strerror(err));
+		}
+
+		if (base != NULL && opts->snapshot_interval > 0) {
+			store->saver = event_new(base, -1, EV_PERSIST, save, store);
+			if (store->saver == NULL) {
+				store_destroy(store);
+				return ENOMEM;
+			}
+			interval.tv_sec = opts->snapshot_interval;
+			interval.tv_usec = 0;
+			event_add(store->saver, &interval);
+		}
 	}
 
 	*storep = store;
@@ -153,11 +781,38 @@ int store_init(struct store **storep, int nel)
 }
 
 
+/* Nobody may be using it any more, from any thread */
 void store_destroy(struct store *store)
 {
+	struct shard *shard;
+	int i;
+
 	if (store != NULL) {
-		hdestroy_r(&store->sessions);
-		nodelist_free((struct node *)store->snodes, (node_dtor_fn)session_free);
+		metrics_uncollect(count_sessions, store);
+		if (store->sweeper != NULL) {
+			event_free(store->sweeper);
+		}
+		if (store->saver != NULL) {
+			event_free(store->saver);
+		}
+		if (store->snapshot_path != NULL) {
+			save_sessions(store);
+		}
+		snapshot_close(store->snapshot);
+		free(store->snapshot_path);
+		explicit_bzero(store->snapshot_key, sizeof(store->snapshot_key));
+		for (i = 0; i < STORE_SHARDS; i++) {
+			shard = &store->shards[i];
+			while (shard->lru_head != NULL) {
+				forget_session(shard, shard->lru_head);
+			}
+			free(shard->table);
+			pthread_mutex_destroy(&shard->lock);
+		}
+		for (i = 0; i < store->nkeys; i++) {
+			free(store->keys[i]);
+		}
+		pthread_mutex_destroy(&store->keys_lock);
 		free(store);
 	}
 }
@@ -187,67 +842,176 @@ static const char *session_id_from_request(struct evhttp_request *req)
 	return id;
 }
 
-static struct session *find_existing_session(struct store *store, const char *id)
+/* EEXIST if the id's taken */
+static int insert_session(struct store *store, struct session *session)
 {
-	ENTRY needle;
-	ENTRY *found;
+	struct shard *shard;
+	int err;
 
-	struct session *session = NULL;
+	session->hash = hash_id(store, session->id);
+	shard = shard_of(store, session->hash);
 
-	needle.key = (char *)id;
-	if (hsearch_r(needle, FIND, &found, &store->sessions)) {
-		verbose(VERBOSE, "%s(): Found existing session with id %s\n", __func__, id);
-		session = found->data;
-	} else {
-		verbose(FIREHOSE,
-			"%s(): Existing session with id %s not found."
-			" Throwing it away\n", __func__, id);
+	pthread_mutex_lock(&shard->lock);
+	if (lookup(shard, session->id, session->hash) != NULL) {
+		pthread_mutex_unlock(&shard->lock);
+		return EEXIST;
 	}
 
-	return session;
+	atomic_init(&session->last_used, now_rel(store));
+	atomic_init(&session->refs, 1);
+	session->stored = 1;
+
+	if ((err = table_insert(shard, session)) != 0) {
+		session->stored = 0;
+		pthread_mutex_unlock(&shard->lock);
+		verbose(ERROR, "%s(): Failed to store session: %s\n",
+			__func__, strerror(err));
+		return err;
+	}
+
+	lru_push(shard, session);
+	shard->bytes += session_bytes(session);
+	evict(store, shard, session);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return 0;
 }
 
 static int store_new_session(struct store *store, struct session *session)
 {
-	ENTRY item;
-	ENTRY *found;
+	int err, i;
 
-	snprintf(session->id, sizeof(session->id), "%x%x%x%x",
-		 rand_r(&store->seed), rand_r(&store->seed),
-		 rand_r(&store->seed), rand_r(&store->seed));
+	if (thread_seed == 0) {
+		thread_seed = store->seed ^ (unsigned long)&thread_seed;
+	}
 
-	item.key = session->id;
-	item.data = session;
-	found = NULL;
-	if (!hsearch_r(item, ENTER, &found, &store->sessions)) {
-		verbose(ERROR, "%s(): Failed to store session: %s\n",
-			__func__, strerror(errno));
-		return errno;
+	/* Not very likely to be taken, but if it is, it's someone
+	 * else's.
+	 */
+	do {
+		for (i = 0; i < SESSION_ID_WORDS; i++) {
+			session->id[i] = rand_r(&thread_seed);
+		}
+	} while ((err = insert_session(store, session)) == EEXIST);
+
+	return err;
+}
+
+/* Back from the last snapshot, if it was in there and hasn't expired */
+static struct session *restore_session(struct store *store, const uint32_t *id)
+{
+	struct session *session;
+	const char *p, *end, *key, *value;
+	int64_t last_used;
+	size_t len;
+	void *data;
+
+	if (store->snapshot == NULL ||
+	    snapshot_take(store->snapshot, id, &data, &len) != 0) {
+		return NULL;
 	}
 
-	tangle_node((struct node **)&store->snodes, (struct node *)session);
+	p = data;
+	end = p + len;
+	session = NULL;
+	if (len < sizeof(last_used)) {
+		goto out;
+	}
+	memcpy(&last_used, p, sizeof(last_used));
+	p += sizeof(last_used);
+	if (is_expired_at(store, last_used, time(NULL))) {
+		goto out;
+	}
 
-	if (found->data != item.data) {
+	if ((session = calloc(1, sizeof(*session))) == NULL) {
+		goto out;
+	}
+	session->store = store;
+	memcpy(session->id, id, sizeof(session->id));
 
-		verbose(ERROR,
-			"%s(): Session already existed ((%p,%p),"
-			" trying to insert (%p,%p)\n",
-			__func__,
-			found->key, found->data,
-			item.key, item.data);
+	/* Nobody can see it yet */
+	while ((key = next_string(&p, end)) != NULL &&
+	       (value = next_string(&p, end)) != NULL) {
+		session_set_value(session, key, value);
+	}
 
-		session_free(found->data);
+	if (insert_session(store, session) != 0) {
+		destroy_session(session);
+		session = NULL;
+		goto out;
 	}
 
-	return 0;
+	atomic_fetch_add_explicit(&store->restored, 1, memory_order_relaxed);
+	verbose(VERBOSE, "%s(): session %s restored\n", __func__, id_str(session));
 
+ out:
+	free(data);
+	return session;
 }
 
-static void add_set_cookie(struct evhttp_request *req, const char *id)
+/* No locks, unless it has expired */
+static struct session *find_existing_session(struct store *store, const char *id_hex)
+{
+	uint32_t id[SESSION_ID_WORDS];
+	struct session *session;
+	struct shard *shard;
+	uint32_t hash, now, last_used;
+
+	if (parse_id(id, id_hex) != 0) {
+		verbose(VERBOSE, "%s(): Not one of our ids: %s\n", __func__, id_hex);
+		return NULL;
+	}
+
+	hash = hash_id(store, id);
+	shard = shard_of(store, hash);
+	session = lookup(shard, id, hash);
+	if (session == NULL && (session = restore_session(store, id)) != NULL) {
+		return session;
+	}
+	if (session == NULL) {
+		verbose(FIREHOSE,
+			"%s(): Existing session with id %s not found."
+			" Throwing it away\n", __func__, id_hex);
+		return NULL;
+	}
+
+	/* The sweeper may not have got to it yet */
+	now = now_rel(store);
+	if (is_expired(store, session, now)) {
+		verbose(VERBOSE, "%s(): Session %s has expired\n", __func__, id_hex);
+		pthread_mutex_lock(&shard->lock);
+		if (session->stored) {
+			forget_session(shard, session);
+			atomic_fetch_add_explicit(&shard->expired, 1, memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
+	}
+
+	verbose(VERBOSE, "%s(): Found existing session with id %s\n", __func__, id_hex);
+
+	/* It moves up the LRU list when someone next looks there. Never
+	 * back, whoever got here after us read the clock after us too
+	 */
+	last_used = atomic_load_explicit(&session->last_used, memory_order_relaxed);
+	while (last_used < now &&
+	       !atomic_compare_exchange_weak_explicit(&session->last_used,
+						      &last_used, now,
+						      memory_order_relaxed,
+						      memory_order_relaxed)) {
+		;
+	}
+
+	return session;
+}
+
+static void add_set_cookie(struct evhttp_request *req, struct session *session)
 {
 	char value[128];
 
-	snprintf(value, sizeof(value), "%s=%s", SESSION_COOKIE_NAME, id);
+	snprintf(value, sizeof(value), "%s=%08x%08x%08x%08x", SESSION_COOKIE_NAME,
+		 session->id[0], session->id[1], session->id[2], session->id[3]);
 	evhttp_add_header(evhttp_request_get_output_headers(req),
 			  "Set-Cookie", value);
 	verbose(FIREHOSE, "%s(): added Set-Cookie %s\n", __func__, value);
@@ -269,17 +1033,15 @@ int session_ensure(struct store *store, struct session **sessionp, struct evhttp
 	err = 0;
 	if (session == NULL) {
 		session = malloc(sizeof(*session));
-		memset(session, 0, sizeof(*session));
-		session->store = store;
-		if (!hcreate_r(10, &session->keyvals)) {
-			free(session);
+		if (session == NULL) {
 			return ENOMEM;
 		}
+		memset(session, 0, sizeof(*session));
+		session->store = store;
 		err = store_new_session(store, session);
 		if (err == 0) {
-			add_set_cookie(req, session->id);
+			add_set_cookie(req, session);
 		} else {
-			hdestroy_r(&session->keyvals);
 			free(session);
 		}
 	}
@@ -293,73 +1055,266 @@ int session_ensure(struct store *store, struct session **sessionp, struct evhttp
 
 void session_free(struct session *session)
 {
+	struct shard *shard;
+
 	if (session != NULL) {
-		untangle_node((struct node **)&session->store->snodes,
-			      (struct node *)session);
-		hdestroy_r(&session->keyvals);
-		nodelist_free(session->kvnodes, free);
-		/* Technically you'd want to untangle() ->kvnodes,
-		 * but that'd require making the nodelist_free()
-		 * node destructor callback take the list head as
-		 * parameter, with our current f'd up linked list
-		 * structure. So no.
-		 *
-		 * They've been freed, make them unreachable too.
-		 */
-		session->kvnodes = NULL;
-		free(session);
+		shard = shard_of(session->store, session->hash);
+		pthread_mutex_lock(&shard->lock);
+		if (session->stored) {
+			forget_session(shard, session);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+int session_is_stored(struct session *session)
+{
+	struct shard *shard;
+	int stored;
+
+	shard = shard_of(session->store, session->hash);
+	pthread_mutex_lock(&shard->lock);
+	stored = session->stored;
+	pthread_mutex_unlock(&shard->lock);
+
+	return stored;
+}
+
+int session_hold(struct session *session)
+{
+	unsigned int refs;
+
+	refs = atomic_load(&session->refs);
+	do {
+		if (refs == 0) {
+			/* On its way out already */
+			return ESTALE;
+		}
+	} while (!atomic_compare_exchange_weak(&session->refs, &refs, refs + 1));
+
+	return 0;
+}
+
+void session_release(struct session *session)
+{
+	put_session(session);
+}
+
+/* 0 if nobody ever used it */
+static int find_key(struct store *store, const char *name)
+{
+	int i, n;
+
+	n = atomic_load_explicit(&store->nkeys, memory_order_acquire);
+	for (i = 0; i < n; i++) {
+		if (strcmp(atomic_load_explicit(&store->keys[i], memory_order_relaxed),
+			   name) == 0) {
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
+
+static int intern_key(struct store *store, const char *name)
+{
+	char *copy;
+	int key, n;
+
+	if ((key = find_key(store, name)) != 0) {
+		return key;
+	}
+
+	pthread_mutex_lock(&store->keys_lock);
+
+	/* Someone may have beaten us to it */
+	if ((key = find_key(store, name)) == 0) {
+		n = atomic_load_explicit(&store->nkeys, memory_order_relaxed);
+		if (n < STORE_MAX_KEYS && (copy = strdup(name)) != NULL) {
+			atomic_store_explicit(&store->keys[n], copy, memory_order_relaxed);
+			atomic_store_explicit(&store->nkeys, n + 1, memory_order_release);
+			key = n + 1;
+		}
+	}
+
+	pthread_mutex_unlock(&store->keys_lock);
+
+	return key;
+}
+
+/* The slot for key, or where it would go */
+static struct kv *find_kv(struct session_data *data, int key)
+{
+	struct kv *free_kv = NULL;
+	int i, mask;
+
+	for (i = 0; i < SESSION_INLINE_KVS; i++) {
+		if (data->kv[i].key == key) {
+			return &data->kv[i];
+		} else if (data->kv[i].key == 0 && free_kv == NULL) {
+			free_kv = &data->kv[i];
+		}
+	}
+
+	if (data->spill_cap == 0) {
+		return free_kv;
+	}
+
+	mask = data->spill_cap - 1;
+	for (i = key & mask;
+	     data->kv[SESSION_INLINE_KVS + i].key != 0;
+	     i = (i + 1) & mask) {
+		if (data->kv[SESSION_INLINE_KVS + i].key == key) {
+			return &data->kv[SESSION_INLINE_KVS + i];
+		}
+	}
+
+	return free_kv != NULL ? free_kv : &data->kv[SESSION_INLINE_KVS + i];
+}
+
+/* Enough spill slots for nkeys, 0 if none are needed */
+static int spill_cap_for(int nkeys)
+{
+	int cap;
+
+	if (nkeys <= SESSION_INLINE_KVS) {
+		return 0;
+	}
+
+	for (cap = SESSION_SPILL_MIN;
+	     (nkeys - SESSION_INLINE_KVS) * 10 > cap * STORE_MAX_LOAD;
+	     cap *= 2) {
+		;
 	}
+
+	return cap <= SESSION_SPILL_MAX ? cap : -1;
 }
 
+/* old with key set to value, in a new allocation */
+static struct session_data *copy_data(struct session_data *old, int key,
+				      const char *value, size_t vlen)
+{
+	struct session_data *data;
+	struct kv *kv, *okv;
+	size_t values_len;
+	char *values;
+	int nkeys, cap, i;
+
+	nkeys = 1;
+	values_len = vlen + 1;
+	if (old != NULL) {
+		okv = find_kv(old, key);
+		nkeys = old->nkeys + (okv == NULL || okv->key != key);
+		values_len += old->values_len;
+		if (okv != NULL && okv->key == key) {
+			values_len -= okv->len + 1;
+		}
+	}
+
+	if ((cap = spill_cap_for(nkeys)) < 0) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	data = calloc(1, sizeof(*data) +
+		      (SESSION_INLINE_KVS + cap) * sizeof(struct kv) +
+		      values_len);
+	if (data == NULL) {
+		return NULL;
+	}
+	data->spill_cap = cap;
+	data->nkeys = nkeys;
+
+	values = session_values(data);
+	for (i = 0; old != NULL && i < SESSION_INLINE_KVS + old->spill_cap; i++) {
+		okv = &old->kv[i];
+		if (okv->key != 0 && okv->key != key) {
+			kv = find_kv(data, okv->key);
+			kv->key = okv->key;
+			kv->len = okv->len;
+			kv->off = data->values_len;
+			memcpy(values + kv->off, session_values(old) + okv->off,
+			       okv->len + 1);
+			data->values_len += okv->len + 1;
+		}
+	}
+
+	kv = find_kv(data, key);
+	kv->key = key;
+	kv->len = vlen;
+	kv->off = data->values_len;
+	memcpy(values + kv->off, value, vlen + 1);
+	data->values_len += vlen + 1;
+
+	return data;
+}
 
+/*
+ * Readers may be looking at the old values while we're at it. They're
+ * copied over with the new one into a new allocation, which then
+ * takes the old one's place.
+ */
 int session_set_value(struct session *session, const char *key, const char *value)
 {
-	ENTRY item;
-	ENTRY *found;
-	struct node *node;
+	struct store *store = session->store;
+	struct session_data *old, *data;
+	struct shard *shard;
+	size_t vlen;
+	int id, err;
+
+	vlen = strlen(value);
+	if (vlen > UINT16_MAX) {
+		return EINVAL;
+	}
 
-	node = alloc_kvnode(key, value);
-	if (node == NULL) {
+	if ((id = intern_key(store, key)) == 0) {
 		return ENOMEM;
 	}
 
-	verbose(FIREHOSE, "%s(): kvnode_key(): '%s', kvnode_value(): '%s'\n",
-		__func__, kvnode_key(node), kvnode_value(node));
+	shard = shard_of(store, session->hash);
+	pthread_mutex_lock(&shard->lock);
 
-	item.key = (char *)kvnode_key(node);
-	item.data = node;
+	old = atomic_load_explicit(&session->data, memory_order_relaxed);
+	if ((data = copy_data(old, id, value, vlen)) == NULL) {
+		err = errno;
+		pthread_mutex_unlock(&shard->lock);
+		verbose(ERROR, "%s(): no room for %s: %s\n",
+			__func__, key, strerror(err));
+		return err;
+	}
 
-	if (!hsearch_r(item, ENTER, &found, &session->keyvals)) {
-		verbose(ERROR, "%s(): Failed to store value\n", __func__);
-		free(node);
-		return ENOMEM;
+	atomic_store_explicit(&session->data, data, memory_order_release);
+
+	if (session->stored) {
+		shard->bytes += data_bytes(data) - data_bytes(old);
+		evict(store, shard, session);
 	}
 
-	tangle_node(&session->kvnodes, node);
+	pthread_mutex_unlock(&shard->lock);
 
-	if (found->key != item.key) {
-		untangle_node(&session->kvnodes, found->data);
-		free(found->data);
+	if (old != NULL) {
+		rcu_retire(old, free);
 	}
 
-	verbose(FIREHOSE, "%s() %s stored '%s'\n", __func__, session->id, item.key);
+	verbose(FIREHOSE, "%s() %s stored '%s'\n", __func__, id_str(session), key);
 
 	return 0;
 }
 
+/* No locks */
 const char *session_get_value(struct session *session, const char *key)
 {
-	ENTRY item;
-	ENTRY *found = NULL;
-
-	item.key = (char *)key;
-	if (!hsearch_r(item, FIND, &found, &session->keyvals)) {
-		if (errno != ESRCH) {
-			verbose(ERROR,
-				"%s(): %s hsearch_r() failed: %s\n",
-				__func__, key, strerror(errno));
-		}
+	struct session_data *data;
+	struct kv *kv;
+	int id;
+
+	data = atomic_load_explicit(&session->data, memory_order_acquire);
+	if (data == NULL ||
+	    (id = find_key(session->store, key)) == 0 ||
+	    (kv = find_kv(data, id)) == NULL ||
+	    kv->key != id) {
+		return NULL;
 	}
 
-	return found ? kvnode_value(found->data) : NULL;
+	return session_values(data) + kv->off;
 }
@@ -1,19 +1,77 @@
 #ifndef STORE_H__INCLUDED
 #define STORE_H__INCLUDED
 
+#include <stddef.h>
+
+#include <event2/event.h>
 #include <event2/http.h>
 
+#include "snapshot.h"
+
 struct store;
 struct session;
 
-int store_init(struct store **storep, int nel);
+struct store_options {
+	/* Sessions we expect to have, for sizing the table up front.
+	 * It grows as needed.
+	 */
+	int nel;
+
+	/* Seconds a session may go unused before it's thrown away.
+	 * Zero keeps them until they're evicted.
+	 */
+	int idle_ttl;
+
+	/* Roughly how much memory sessions may take, in bytes. The
+	 * least recently used ones are evicted to stay under. Zero
+	 * for no limit.
+	 */
+	size_t max_bytes;
+
+	/* Sessions are saved here every snapshot_interval seconds and
+	 * when the store is destroyed, encrypted with snapshot_key.
+	 * They're restored from there one by one as their cookies come
+	 * back. NULL for no snapshots.
+	 */
+	const char *snapshot_path;
+	unsigned char snapshot_key[SNAPSHOT_KEY_LEN];
+	int snapshot_interval;
+};
+
+/* Expired sessions are swept on a timer on base. With a NULL base
+ * they're only noticed when looked up.
+ */
+int store_init(struct store **storep, struct event_base *base,
+	       const struct store_options *opts);
 void store_destroy(struct store *store);
 
 
 int session_ensure(struct store *store, struct session **sessionp, struct evhttp_request *req);
+
+/* Removes the session from the store for good */
 void session_free(struct session *session);
 
+/* Not expired, evicted or freed yet. Held ones may well be. */
+int session_is_stored(struct session *session);
+
+/*
+ * Whoever holds on to a session across a trip through the event loop
+ * has to say so. A held session that expires or is evicted meanwhile
+ * is gone from the store, but not freed until it's released.
+ *
+ * Another thread may have thrown the session away since it was found,
+ * in which case it can't be held any more and ESTALE is returned.
+ */
+int session_hold(struct session *session);
+void session_release(struct session *session);
+
 int session_set_value(struct session *session, const char *key, const char *value);
+
+/*
+ * Neither takes the session's lock. Values are never changed in
+ * place, a set replaces them all, so what get returns stays good until
+ * this thread's next rcu_quiescent_state().
+ */
 const char *session_get_value(struct session *session, const char *key);
 
 
@@ -11,10 +11,20 @@ static CU_ErrorCode register_suites()
 {
 	extern CU_SuiteInfo suite_feed;
 	extern CU_SuiteInfo suite_store;
+	extern CU_SuiteInfo suite_arena;
+	extern CU_SuiteInfo suite_trace;
+	extern CU_SuiteInfo suite_metrics;
+	extern CU_SuiteInfo suite_rcu;
+	extern CU_SuiteInfo suite_admit;
 
 	CU_SuiteInfo suites[] = {
 		suite_feed,
 		suite_store,
+		suite_arena,
+		suite_trace,
+		suite_metrics,
+		suite_rcu,
+		suite_admit,
 		CU_SUITE_INFO_NULL,
 	};
 
@@ -0,0 +1,208 @@
+/*
+ * Threads looking up sessions and setting values in them, all at
+ * once, like the server would if it had more than one event loop.
+ *
+ *   ./stress_store [threads] [seconds] [idle_ttl]
+ *
+ * With idle_ttl, sessions expire after that many seconds unused, and
+ * another thread runs the sweeper meanwhile. The workers share a few
+ * sessions between them and keep them all in use, so none may expire.
+ * Seconds are TICK_MSECS milliseconds long here, so there are plenty
+ * of them to race with.
+ */
+
+#include "store.h"
+#include "rcu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/http.h>
+
+#define NSESSIONS 4096
+
+/* Sessions shared with idle_ttl, so that they're used all at once */
+#define NHOT 16
+
+#define TICK_MSECS 100
+
+/* Operations between quiescent states, like requests per loop pass */
+#define OPS_PER_PASS 32
+
+struct worker {
+	pthread_t thread;
+	int n;
+	unsigned long ops;
+	unsigned long bad;
+};
+
+static struct store *store;
+static char cookies[NSESSIONS][64];
+static int nsessions = NSESSIONS;
+static atomic_int stop;
+
+/* The store's clock, instead of the C library's */
+time_t time(time_t *t)
+{
+	struct timespec ts;
+	time_t now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * (1000 / TICK_MSECS) + ts.tv_nsec / (TICK_MSECS * 1000000);
+	if (t != NULL) {
+		*t = now;
+	}
+	return now;
+}
+
+static struct session *lookup(int i)
+{
+	struct evhttp_request *req;
+	struct session *session;
+
+	req = evhttp_request_new(NULL, NULL);
+	if (i >= 0) {
+		evhttp_add_header(evhttp_request_get_input_headers(req),
+				  "Cookie", cookies[i]);
+	}
+	if (session_ensure(store, &session, req) != 0) {
+		session = NULL;
+	}
+	evhttp_request_free(req);
+	return session;
+}
+
+static void *work(void *arg)
+{
+	struct worker *worker = arg;
+	struct session *session;
+	unsigned int seed;
+	const char *value;
+	char prefix[32];
+	char buf[64];
+	int i, j, len;
+
+	rcu_register_thread();
+	seed = worker->n + 1;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for (j = 0; j < OPS_PER_PASS; j++) {
+			i = rand_r(&seed) % nsessions;
+			if ((session = lookup(i)) == NULL) {
+				worker->bad++;
+				continue;
+			}
+
+			len = snprintf(prefix, sizeof(prefix), "session-%d-", i);
+			value = session_get_value(session, "access_token");
+			if (value == NULL || strncmp(value, prefix, len) != 0) {
+				worker->bad++;
+			}
+
+			/* One in eight writes, one in a hundred new */
+			if (rand_r(&seed) % 8 == 0) {
+				snprintf(buf, sizeof(buf), "%s%lu", prefix, worker->ops);
+				session_set_value(session, "access_token", buf);
+			}
+			if (rand_r(&seed) % 100 == 0) {
+				lookup(-1);
+			}
+			worker->ops++;
+		}
+		rcu_quiescent_state();
+	}
+
+	rcu_unregister_thread();
+	return NULL;
+}
+
+/* Takes the shard locks, and holds on to nothing */
+static void *sweep(void *arg)
+{
+	struct event_base *base = arg;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		event_base_loop(base, EVLOOP_ONCE);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct store_options opts = { .nel = NSESSIONS };
+	struct evhttp_request *req;
+	struct session *session;
+	struct worker *workers;
+	struct event_base *base;
+	pthread_t sweeper;
+	unsigned long ops, bad;
+	int nthreads, seconds;
+	char value[32];
+	int i;
+
+	nthreads = argc > 1 ? atoi(argv[1]) : 8;
+	seconds = argc > 2 ? atoi(argv[2]) : 3;
+	opts.idle_ttl = argc > 3 ? atoi(argv[3]) : 0;
+
+	base = NULL;
+	if (opts.idle_ttl > 0) {
+		base = event_base_new();
+		nsessions = NHOT;
+	}
+
+	if (store_init(&store, base, &opts) != 0) {
+		fprintf(stderr, "store_init() failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < nsessions; i++) {
+		req = evhttp_request_new(NULL, NULL);
+		session_ensure(store, &session, req);
+		snprintf(cookies[i], sizeof(cookies[i]), "%s",
+			 evhttp_find_header(evhttp_request_get_output_headers(req),
+					    "Set-Cookie"));
+		evhttp_request_free(req);
+		snprintf(value, sizeof(value), "session-%d-0", i);
+		session_set_value(session, "access_token", value);
+	}
+
+	workers = calloc(nthreads, sizeof(*workers));
+	for (i = 0; i < nthreads; i++) {
+		workers[i].n = i;
+		pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+	}
+	if (base != NULL) {
+		pthread_create(&sweeper, NULL, sweep, base);
+	}
+
+	sleep(seconds);
+	atomic_store(&stop, 1);
+
+	if (base != NULL) {
+		pthread_join(sweeper, NULL);
+	}
+
+	ops = bad = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		bad += workers[i].bad;
+	}
+
+	printf("%d threads: %lu ops in %ds, %.0f ops/s, %lu bad\n",
+	       nthreads, ops, seconds, (double)ops / seconds, bad);
+
+	free(workers);
+	store_destroy(store);
+	if (base != NULL) {
+		event_base_free(base);
+	}
+
+	return bad != 0;
+}
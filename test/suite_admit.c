@@ -0,0 +1,199 @@
+
+
+#include <CUnit/CUnit.h>
+#include "test_util.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <event2/event.h>
+
+#include "admit.h"
+
+static struct admit_options opts = {
+	.initial_limit = 4,
+	.min_limit = 2,
+	.max_limit = 8,
+	.max_queue = 2,
+	.queue_timeout = 10,
+};
+
+struct waiter {
+	struct admit_ticket ticket;
+	int called;
+	int err;
+};
+
+static void turn(int err, void *arg)
+{
+	struct waiter *w = arg;
+
+	w->called++;
+	w->err = err;
+}
+
+static void test_in_right_away_while_there_is_room(void)
+{
+	struct event_base *base;
+	struct admit *admit;
+	struct waiter w[5];
+	int i;
+
+	base = event_base_new();
+	CU_ASSERT_EQUAL_FATAL(admit_init(&admit, base, &opts), 0);
+	memset(w, 0, sizeof(w));
+
+	for (i = 0; i < 4; i++) {
+		CU_ASSERT_EQUAL(admit_enter(admit, &w[i].ticket, turn, &w[i]), 0);
+	}
+	CU_ASSERT_EQUAL(admit_enter(admit, &w[4].ticket, turn, &w[4]), EINPROGRESS);
+
+	/* Its turn comes when someone leaves, but not before */
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	CU_ASSERT_EQUAL(w[4].called, 0);
+
+	admit_leave(admit, &w[0].ticket, ADMIT_DROPPED);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	CU_ASSERT_EQUAL(w[4].called, 1);
+	CU_ASSERT_EQUAL(w[4].err, 0);
+
+	for (i = 1; i < 5; i++) {
+		admit_leave(admit, &w[i].ticket, ADMIT_DROPPED);
+	}
+
+	admit_destroy(admit);
+	event_base_free(base);
+}
+
+static void test_turned_away_when_the_queue_is_full(void)
+{
+	struct event_base *base;
+	struct admit *admit;
+	struct waiter w[7];
+	int i;
+
+	base = event_base_new();
+	CU_ASSERT_EQUAL_FATAL(admit_init(&admit, base, &opts), 0);
+	memset(w, 0, sizeof(w));
+
+	for (i = 0; i < 4; i++) {
+		CU_ASSERT_EQUAL(admit_enter(admit, &w[i].ticket, turn, &w[i]), 0);
+	}
+
+	/* Without a callback, it's now or never */
+	CU_ASSERT_EQUAL(admit_enter(admit, &w[4].ticket, NULL, NULL), EBUSY);
+
+	CU_ASSERT_EQUAL(admit_enter(admit, &w[5].ticket, turn, &w[5]), EINPROGRESS);
+	CU_ASSERT_EQUAL(admit_enter(admit, &w[6].ticket, turn, &w[6]), EINPROGRESS);
+	CU_ASSERT_EQUAL(admit_enter(admit, &w[4].ticket, turn, &w[4]), EBUSY);
+	CU_ASSERT(admit_retry_after(admit) >= 1);
+
+	/* Those left waiting are turned away in the end */
+	event_base_dispatch(base);
+	CU_ASSERT_EQUAL(w[5].called, 1);
+	CU_ASSERT_EQUAL(w[5].err, ETIMEDOUT);
+	CU_ASSERT_EQUAL(w[6].called, 1);
+	CU_ASSERT_EQUAL(w[6].err, ETIMEDOUT);
+
+	for (i = 0; i < 4; i++) {
+		admit_leave(admit, &w[i].ticket, ADMIT_DROPPED);
+	}
+
+	admit_destroy(admit);
+	event_base_free(base);
+}
+
+static void test_leaving_the_queue(void)
+{
+	struct event_base *base;
+	struct admit *admit;
+	struct waiter w[6];
+	int i;
+
+	base = event_base_new();
+	CU_ASSERT_EQUAL_FATAL(admit_init(&admit, base, &opts), 0);
+	memset(w, 0, sizeof(w));
+
+	for (i = 0; i < 4; i++) {
+		CU_ASSERT_EQUAL(admit_enter(admit, &w[i].ticket, turn, &w[i]), 0);
+	}
+	CU_ASSERT_EQUAL(admit_enter(admit, &w[4].ticket, turn, &w[4]), EINPROGRESS);
+	CU_ASSERT_EQUAL(admit_enter(admit, &w[5].ticket, turn, &w[5]), EINPROGRESS);
+
+	/* The last in line gives up, the first gets in */
+	admit_leave(admit, &w[5].ticket, ADMIT_DROPPED);
+	admit_leave(admit, &w[0].ticket, ADMIT_DONE);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	CU_ASSERT_EQUAL(w[4].called, 1);
+	CU_ASSERT_EQUAL(w[4].err, 0);
+	CU_ASSERT_EQUAL(w[5].called, 0);
+
+	for (i = 1; i < 5; i++) {
+		admit_leave(admit, &w[i].ticket, ADMIT_DONE);
+	}
+	/* More than once is fine */
+	admit_leave(admit, &w[4].ticket, ADMIT_DONE);
+
+	admit_destroy(admit);
+	event_base_free(base);
+}
+
+static void test_limit_follows_upstream(void)
+{
+	struct event_base *base;
+	struct admit *admit;
+	struct waiter w[8];
+	int i, round, before;
+
+	base = event_base_new();
+	CU_ASSERT_EQUAL_FATAL(admit_init(&admit, base, &opts), 0);
+	memset(w, 0, sizeof(w));
+
+	/* Quick answers with the limit in use let it grow */
+	for (round = 0; round < 20; round++) {
+		for (i = 0; i < admit_limit(admit); i++) {
+			CU_ASSERT_EQUAL(admit_enter(admit, &w[i].ticket, NULL, NULL), 0);
+		}
+		for (i = 0; i < 8; i++) {
+			admit_leave(admit, &w[i].ticket, ADMIT_DONE);
+		}
+	}
+	CU_ASSERT_EQUAL(admit_limit(admit), 8);
+
+	/* Failures shrink it, once for everyone that was out together */
+	for (i = 0; i < 8; i++) {
+		CU_ASSERT_EQUAL(admit_enter(admit, &w[i].ticket, NULL, NULL), 0);
+	}
+	for (i = 0; i < 8; i++) {
+		admit_leave(admit, &w[i].ticket, ADMIT_FAILED);
+	}
+	CU_ASSERT_EQUAL(admit_limit(admit), 7);
+
+	/* But never below the minimum */
+	for (round = 0; round < 50; round++) {
+		before = admit_limit(admit);
+		usleep(100);
+		CU_ASSERT_EQUAL(admit_enter(admit, &w[0].ticket, NULL, NULL), 0);
+		admit_leave(admit, &w[0].ticket, ADMIT_FAILED);
+		CU_ASSERT(admit_limit(admit) <= before);
+	}
+	CU_ASSERT_EQUAL(admit_limit(admit), 2);
+
+	admit_destroy(admit);
+	event_base_free(base);
+}
+
+
+static CU_TestInfo admit_tests[] = {
+	DECLARE_TESTINFO(test_in_right_away_while_there_is_room),
+	DECLARE_TESTINFO(test_turned_away_when_the_queue_is_full),
+	DECLARE_TESTINFO(test_leaving_the_queue),
+	DECLARE_TESTINFO(test_limit_follows_upstream),
+	CU_TEST_INFO_NULL,
+};
+
+const CU_SuiteInfo suite_admit[] = {
+	{ "admit", 0, 0, admit_tests, },
+	CU_SUITE_INFO_NULL,
+};
@@ -0,0 +1,74 @@
+
+#include <CUnit/CUnit.h>
+#include "test_util.h"
+
+#include "arena.h"
+
+#include <string.h>
+
+static void test_slab_recycles(void)
+{
+	struct slab *slab;
+	void *a, *b;
+
+	CU_ASSERT_EQUAL(slab_init(&slab, 64, 1), 0);
+
+	a = slab_alloc(slab);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(a);
+	slab_free(slab, a);
+
+	/* The one we just gave back is the one we get */
+	b = slab_alloc(slab);
+	CU_ASSERT_PTR_EQUAL(a, b);
+
+	slab_free(slab, b);
+	slab_destroy(slab);
+}
+
+static void test_arena_spans_chunks(void)
+{
+	struct slab *chunks;
+	struct arena *arena;
+	char *small[64];
+	char *big;
+	int i;
+
+	CU_ASSERT_EQUAL(slab_init(&chunks, 256, 8), 0);
+
+	arena = arena_new(chunks);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(arena);
+
+	/* Way more than one chunk's worth */
+	for (i = 0; i < 64; i++) {
+		small[i] = arena_alloc(arena, 24);
+		CU_ASSERT_PTR_NOT_NULL_FATAL(small[i]);
+		memset(small[i], i, 24);
+	}
+
+	for (i = 0; i < 64; i++) {
+		CU_ASSERT_EQUAL(small[i][0], i);
+		CU_ASSERT_EQUAL(small[i][23], i);
+	}
+
+	/* And something that doesn't fit in a chunk at all */
+	big = arena_alloc(arena, 4096);
+	CU_ASSERT_PTR_NOT_NULL_FATAL(big);
+	memset(big, 'x', 4096);
+
+	CU_ASSERT_STRING_EQUAL(arena_strdup(arena, "kittens"), "kittens");
+
+	arena_free(arena);
+	slab_destroy(chunks);
+}
+
+
+static CU_TestInfo arena_tests[] = {
+	DECLARE_TESTINFO(test_slab_recycles),
+	DECLARE_TESTINFO(test_arena_spans_chunks),
+	CU_TEST_INFO_NULL,
+};
+
+const CU_SuiteInfo suite_arena[] = {
+	{ "arena and slab", 0, 0, arena_tests, },
+	CU_SUITE_INFO_NULL,
+};
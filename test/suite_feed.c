@@ -169,7 +169,7 @@ static void test_parse_navigation_links(void)
 
 	sink = evbuffer_new();
 
-	CU_ASSERT_EQUAL(0, feed_init(&feed, sink));
+	CU_ASSERT_EQUAL(0, feed_init(&feed, sink, NULL));
 
 	consume_file(feed, "minimal.atom.xml");
 	feed_final(feed);
@@ -194,11 +194,23 @@ static void test_parse_navigation_links(void)
 	evbuffer_free(sink);
 }
 
+static void test_escape_amp(void)
+{
+	char buf[12];
+
+	CU_ASSERT_STRING_EQUAL(feed_escape_amp(buf, sizeof(buf), "a&b"), "a&amp;b");
+	CU_ASSERT_STRING_EQUAL(feed_escape_amp(buf, sizeof(buf), NULL), "");
+
+	/* An &amp; that doesn't fit isn't cut in half */
+	CU_ASSERT_STRING_EQUAL(feed_escape_amp(buf, sizeof(buf), "abcdefg&h"), "abcdefg");
+	CU_ASSERT_STRING_EQUAL(feed_escape_amp(buf, sizeof(buf), "abcdefghijklm"), "abcdefghijk");
+}
 
 
 
 static CU_TestInfo tests[] = {
 	DECLARE_TESTINFO(test_parse_navigation_links),
+	DECLARE_TESTINFO(test_escape_amp),
 	CU_TEST_INFO_NULL,
 };
 
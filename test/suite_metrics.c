@@ -0,0 +1,121 @@
+
+#include <CUnit/CUnit.h>
+#include "test_util.h"
+
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static char *dump(void)
+{
+	struct evbuffer *buf;
+	char *text;
+	size_t len;
+
+	buf = evbuffer_new();
+	metrics_dump(buf);
+	evbuffer_add(buf, "", 1);
+	len = evbuffer_get_length(buf);
+	text = malloc(len);
+	evbuffer_remove(buf, text, len);
+	evbuffer_free(buf);
+
+	return text;
+}
+
+static void test_same_handle_for_same_labels(void)
+{
+	struct metric *a, *b, *c;
+	char *text;
+
+	a = metric_counter("test_hits_total", "Hits", "route=\"/a\"");
+	b = metric_counter("test_hits_total", "Hits", "route=\"/b\"");
+	c = metric_counter("test_hits_total", "Hits", "route=\"/a\"");
+	CU_ASSERT_PTR_EQUAL(a, c);
+	CU_ASSERT_PTR_NOT_EQUAL(a, b);
+
+	metric_add(a, 2);
+	metric_add(c, 1);
+	metric_add(b, 5);
+
+	text = dump();
+
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "test_hits_total{route=\"/a\"} 3\n"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "test_hits_total{route=\"/b\"} 5\n"));
+
+	/* One HELP for both */
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "# TYPE test_hits_total counter\n"));
+	CU_ASSERT_PTR_NULL(strstr(strstr(text, "# HELP test_hits_total") + 1,
+				  "# HELP test_hits_total"));
+
+	free(text);
+}
+
+static void test_histogram_buckets_are_cumulative(void)
+{
+	struct metric *hist;
+	struct timeval start, end;
+	char *text;
+
+	hist = metric_histogram("test_latency_seconds", "Latency", NULL);
+
+	start.tv_sec = 100;
+	start.tv_usec = 0;
+	end.tv_sec = 100;
+	end.tv_usec = 3000;
+	metric_observe(hist, &start, &end);
+	end.tv_usec = 200000;
+	metric_observe(hist, &start, &end);
+	end.tv_sec = 160;
+	metric_observe(hist, &start, &end);
+
+	text = dump();
+
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "test_latency_seconds_bucket{le=\"0.005000\"} 1\n"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "test_latency_seconds_bucket{le=\"0.250000\"} 2\n"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "test_latency_seconds_bucket{le=\"10.000000\"} 2\n"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "test_latency_seconds_bucket{le=\"+Inf\"} 3\n"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "test_latency_seconds_sum 60.403000\n"));
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "test_latency_seconds_count 3\n"));
+
+	free(text);
+}
+
+static void set_gauge(void *arg)
+{
+	metric_set(arg, 42);
+}
+
+static void test_collectors_run_before_dump(void)
+{
+	struct metric *gauge;
+	char *text;
+
+	gauge = metric_gauge("test_widgets", "Widgets", NULL);
+	CU_ASSERT_EQUAL(metrics_collect(set_gauge, gauge), 0);
+
+	text = dump();
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "# TYPE test_widgets gauge\ntest_widgets 42\n"));
+	free(text);
+
+	metrics_uncollect(set_gauge, gauge);
+	metric_set(gauge, 1);
+
+	text = dump();
+	CU_ASSERT_PTR_NOT_NULL(strstr(text, "test_widgets 1\n"));
+	free(text);
+}
+
+
+static CU_TestInfo metrics_tests[] = {
+	DECLARE_TESTINFO(test_same_handle_for_same_labels),
+	DECLARE_TESTINFO(test_histogram_buckets_are_cumulative),
+	DECLARE_TESTINFO(test_collectors_run_before_dump),
+	CU_TEST_INFO_NULL,
+};
+
+const CU_SuiteInfo suite_metrics[] = {
+	{ "metrics", 0, 0, metrics_tests, },
+	CU_SUITE_INFO_NULL,
+};
@@ -0,0 +1,59 @@
+
+
+#include <CUnit/CUnit.h>
+#include "test_util.h"
+
+#include "rcu.h"
+
+static void count_free(void *arg)
+{
+	(*(int *)arg)++;
+}
+
+static void test_retired_freed_after_quiescent_state(void)
+{
+	int freed = 0;
+
+	CU_ASSERT_EQUAL_FATAL(rcu_register_thread(), 0);
+
+	rcu_retire(&freed, count_free);
+	CU_ASSERT_EQUAL(freed, 0);
+
+	rcu_quiescent_state();
+	CU_ASSERT_EQUAL(freed, 1);
+
+	rcu_unregister_thread();
+}
+
+static void test_freed_right_away_when_nobody_is_reading(void)
+{
+	int freed = 0;
+
+	rcu_retire(&freed, count_free);
+	CU_ASSERT_EQUAL(freed, 1);
+}
+
+static void test_left_for_others_on_unregister(void)
+{
+	int freed = 0;
+
+	CU_ASSERT_EQUAL_FATAL(rcu_register_thread(), 0);
+	rcu_retire(&freed, count_free);
+
+	/* Nobody else is around to look at it */
+	rcu_unregister_thread();
+	CU_ASSERT_EQUAL(freed, 1);
+}
+
+
+static CU_TestInfo rcu_tests[] = {
+	DECLARE_TESTINFO(test_retired_freed_after_quiescent_state),
+	DECLARE_TESTINFO(test_freed_right_away_when_nobody_is_reading),
+	DECLARE_TESTINFO(test_left_for_others_on_unregister),
+	CU_TEST_INFO_NULL,
+};
+
+const CU_SuiteInfo suite_rcu[] = {
+	{ "rcu", 0, 0, rcu_tests, },
+	CU_SUITE_INFO_NULL,
+};
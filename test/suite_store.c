@@ -4,52 +4,259 @@
 
 #include "store.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+/* With cookie set, it's an existing session we're asking for */
+static int do_session_ensure(struct store *store, struct session **session,
+			     const char *cookie)
+{
+	struct evhttp_request *req;
+	int ret;
+
+	req = evhttp_request_new(NULL, NULL);
+	if (cookie != NULL) {
+		evhttp_add_header(evhttp_request_get_input_headers(req),
+				  "Cookie", cookie);
+	}
+	ret = session_ensure(store, session, req);
+	evhttp_request_free(req);
+	return ret;
+}
 
-static int do_session_ensure(struct store *store, struct session **session)
+/* Like do_session_ensure(), but the cookie of a new session is kept */
+static int new_session(struct store *store, struct session **session,
+		       char *cookie, size_t sz)
 {
 	struct evhttp_request *req;
 	int ret;
 
 	req = evhttp_request_new(NULL, NULL);
 	ret = session_ensure(store, session, req);
+	snprintf(cookie, sz, "%s",
+		 evhttp_find_header(evhttp_request_get_output_headers(req),
+				    "Set-Cookie"));
 	evhttp_request_free(req);
 	return ret;
 }
 
-static void test_session_count_overflow(void)
+static void test_store_grows(void)
 {
-	/* By experimentation, hcreate_r() with nelem <= 5 always
-	 * allocates space for 5 entries. This may probably vary
-	 * by system :(
-	 */
-	int nel = 5;
+	struct store_options opts = { .nel = 5 };
+	int n = 5000;
 
-	struct session *sessions[nel + 1];
+	struct session *sessions[n];
+	struct session *found;
 	struct store *store;
+	char cookie[n][64];
 	int i;
 
-	CU_ASSERT_EQUAL(store_init(&store, nel), 0);
+	CU_ASSERT_EQUAL(store_init(&store, NULL, &opts), 0);
 
-	for (i = 0; i < nel; i++) {
-		do_session_ensure(store, &sessions[i]);
-		verbose(VERBOSE, "%s(): ensured %d (%p)\n", __func__, i, sessions[i]);
+	for (i = 0; i < n; i++) {
+		CU_ASSERT_EQUAL_FATAL(new_session(store, &sessions[i],
+						  cookie[i], sizeof(cookie[i])), 0);
 	}
 
-	verbose(ERROR, "You should see an error message below:\n");
-	CU_ASSERT_EQUAL(ENOMEM, do_session_ensure(store, &sessions[i]));
+	for (i = 0; i < n; i++) {
+		CU_ASSERT_EQUAL(do_session_ensure(store, &found, cookie[i]), 0);
+		CU_ASSERT_PTR_EQUAL(found, sessions[i]);
+	}
 
-	for (i = 0; i < nel; i++) {
+	/* Every other one gone, and the rest still found */
+	for (i = 0; i < n; i += 2) {
 		session_free(sessions[i]);
-		verbose(VERBOSE, "%s(): freed %d (%p)\n", __func__, i, sessions[i]);
 	}
+	for (i = 1; i < n; i += 2) {
+		CU_ASSERT_EQUAL(do_session_ensure(store, &found, cookie[i]), 0);
+		CU_ASSERT_PTR_EQUAL(found, sessions[i]);
+	}
+
+	/* A freed one comes back as a new session */
+	CU_ASSERT_EQUAL(do_session_ensure(store, &found, cookie[0]), 0);
+	CU_ASSERT_PTR_NOT_EQUAL(found, sessions[1]);
 
 	store_destroy(store);
 }
 
+static void test_least_recently_used_evicted(void)
+{
+	/* Room for a few sessions, not many */
+	struct store_options opts = { .nel = 5, .max_bytes = 4096 };
+	struct session *first, *second, *found;
+	struct store *store;
+	char cookie[2][64];
+	char value[256];
+	int i;
+
+	CU_ASSERT_EQUAL(store_init(&store, NULL, &opts), 0);
+
+	CU_ASSERT_EQUAL(new_session(store, &first, cookie[0], sizeof(cookie[0])), 0);
+	CU_ASSERT_EQUAL(new_session(store, &second, cookie[1], sizeof(cookie[1])), 0);
+
+	memset(value, 'x', sizeof(value) - 1);
+	value[sizeof(value) - 1] = '\0';
+	session_set_value(first, "access_token", value);
+
+	/* first was used last, second should go first */
+	CU_ASSERT_EQUAL(do_session_ensure(store, &found, cookie[0]), 0);
+	CU_ASSERT_EQUAL(session_hold(found), 0);
+
+	/* Plenty, so that every shard is full */
+	for (i = 0; i < 512; i++) {
+		CU_ASSERT_EQUAL(do_session_ensure(store, &found, NULL), 0);
+	}
+
+	CU_ASSERT_EQUAL(do_session_ensure(store, &found, cookie[1]), 0);
+	CU_ASSERT_PTR_NOT_EQUAL(found, second);
+
+	/* Evicted as well by now, but held on to */
+	CU_ASSERT_STRING_EQUAL(session_get_value(first, "access_token"), value);
+	session_release(first);
+
+	store_destroy(store);
+}
+
+static void test_value_replaced(void)
+{
+	struct store_options opts = { .nel = 5 };
+	struct session *session;
+	struct store *store;
+
+	CU_ASSERT_EQUAL(store_init(&store, NULL, &opts), 0);
+	CU_ASSERT_EQUAL(do_session_ensure(store, &session, NULL), 0);
+
+	CU_ASSERT_EQUAL(session_set_value(session, "access_token", "kittens"), 0);
+	CU_ASSERT_EQUAL(session_set_value(session, "access_token", "puppies"), 0);
+	CU_ASSERT_STRING_EQUAL(session_get_value(session, "access_token"), "puppies");
+	CU_ASSERT_PTR_NULL(session_get_value(session, "refresh_token"));
+
+	store_destroy(store);
+}
+
+static void test_many_values(void)
+{
+	struct store_options opts = { .nel = 5 };
+	struct session *session;
+	struct store *store;
+	char key[32], value[32];
+	int i;
+
+	CU_ASSERT_EQUAL(store_init(&store, NULL, &opts), 0);
+	CU_ASSERT_EQUAL(do_session_ensure(store, &session, NULL), 0);
+
+	/* Way past what fits in the session itself */
+	for (i = 0; i < 40; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		snprintf(value, sizeof(value), "value%d", i);
+		CU_ASSERT_EQUAL(session_set_value(session, key, value), 0);
+	}
+
+	CU_ASSERT_EQUAL(session_set_value(session, "key7", "seven"), 0);
+
+	for (i = 0; i < 40; i++) {
+		snprintf(key, sizeof(key), "key%d", i);
+		snprintf(value, sizeof(value), "value%d", i);
+		CU_ASSERT_STRING_EQUAL(session_get_value(session, key),
+				       i == 7 ? "seven" : value);
+	}
+
+	store_destroy(store);
+}
+
+/* A store saving to a snapshot in a fresh directory */
+static void snapshot_opts(struct store_options *opts, char *dir, char *path,
+			  size_t sz, unsigned char key_byte)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->nel = 5;
+	snprintf(path, sz, "%s/sessions", dir);
+	opts->snapshot_path = path;
+	memset(opts->snapshot_key, key_byte, sizeof(opts->snapshot_key));
+}
+
+static void test_sessions_survive_restart(void)
+{
+	char dir[] = "/tmp/yt_history_test_XXXXXX";
+	struct session *session, *found;
+	struct store_options opts;
+	struct store *store;
+	char cookie[3][64];
+	char path[128];
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(mkdtemp(dir));
+	snapshot_opts(&opts, dir, path, sizeof(path), 0x42);
+
+	CU_ASSERT_EQUAL(store_init(&store, NULL, &opts), 0);
+	CU_ASSERT_EQUAL(new_session(store, &session, cookie[0], sizeof(cookie[0])), 0);
+	CU_ASSERT_EQUAL(session_set_value(session, "access_token", "kittens"), 0);
+	CU_ASSERT_EQUAL(new_session(store, &session, cookie[1], sizeof(cookie[1])), 0);
+	CU_ASSERT_EQUAL(new_session(store, &session, cookie[2], sizeof(cookie[2])), 0);
+	session_free(session);
+	store_destroy(store);
+
+	CU_ASSERT_EQUAL(store_init(&store, NULL, &opts), 0);
+	CU_ASSERT_EQUAL(do_session_ensure(store, &found, cookie[0]), 0);
+	CU_ASSERT_STRING_EQUAL(session_get_value(found, "access_token"), "kittens");
+
+	/* The one not back yet is carried over to the next snapshot */
+	store_destroy(store);
+	CU_ASSERT_EQUAL(store_init(&store, NULL, &opts), 0);
+	CU_ASSERT_EQUAL(do_session_ensure(store, &found, cookie[1]), 0);
+	CU_ASSERT_EQUAL(do_session_ensure(store, &session, cookie[1]), 0);
+	CU_ASSERT_PTR_EQUAL(found, session);
+
+	/* A freed one isn't saved */
+	CU_ASSERT_EQUAL(do_session_ensure(store, &found, cookie[0]), 0);
+	CU_ASSERT_EQUAL(do_session_ensure(store, &session, cookie[2]), 0);
+	CU_ASSERT_PTR_NULL(session_get_value(session, "access_token"));
+	CU_ASSERT_PTR_NOT_EQUAL(session, found);
+	store_destroy(store);
+
+	unlink(path);
+	rmdir(dir);
+}
+
+static void test_snapshot_needs_its_key(void)
+{
+	char dir[] = "/tmp/yt_history_test_XXXXXX";
+	struct session *session;
+	struct store_options opts;
+	struct store *store;
+	char cookie[64];
+	char path[128];
+
+	CU_ASSERT_PTR_NOT_NULL_FATAL(mkdtemp(dir));
+	snapshot_opts(&opts, dir, path, sizeof(path), 0x42);
+
+	CU_ASSERT_EQUAL(store_init(&store, NULL, &opts), 0);
+	CU_ASSERT_EQUAL(new_session(store, &session, cookie, sizeof(cookie)), 0);
+	CU_ASSERT_EQUAL(session_set_value(session, "access_token", "kittens"), 0);
+	store_destroy(store);
+
+	snapshot_opts(&opts, dir, path, sizeof(path), 0x43);
+	CU_ASSERT_EQUAL(store_init(&store, NULL, &opts), 0);
+	CU_ASSERT_EQUAL(do_session_ensure(store, &session, cookie), 0);
+	CU_ASSERT_PTR_NULL(session_get_value(session, "access_token"));
+	store_destroy(store);
+
+	unlink(path);
+	rmdir(dir);
+}
+
 
 static CU_TestInfo session_tests[] = {
-	DECLARE_TESTINFO(test_session_count_overflow),
+	DECLARE_TESTINFO(test_store_grows),
+	DECLARE_TESTINFO(test_least_recently_used_evicted),
+	DECLARE_TESTINFO(test_value_replaced),
+	DECLARE_TESTINFO(test_many_values),
+	DECLARE_TESTINFO(test_sessions_survive_restart),
+	DECLARE_TESTINFO(test_snapshot_needs_its_key),
 	CU_TEST_INFO_NULL,
 };
 
@@ -0,0 +1,74 @@
+
+#include <CUnit/CUnit.h>
+#include "test_util.h"
+
+#include "trace.h"
+
+#include <string.h>
+
+static void test_server_timing_sums_by_name(void)
+{
+	struct timeval start, end;
+	unsigned int trace, other;
+	char buf[256];
+
+	trace = trace_begin();
+	other = trace_begin();
+	CU_ASSERT_NOT_EQUAL(trace, other);
+
+	start.tv_sec = 100;
+	start.tv_usec = 0;
+	end.tv_sec = 100;
+	end.tv_usec = 1500;
+
+	trace_span(trace, "parse", &start, &end);
+	trace_span(other, "ttfb", &start, &end);
+	trace_span(trace, "parse", &start, &end);
+	end.tv_sec = 102;
+	trace_span(trace, "total", &start, &end);
+
+	CU_ASSERT(trace_server_timing(trace, buf, sizeof(buf)) > 0);
+	CU_ASSERT_STRING_EQUAL(buf, "parse;dur=3.000, total;dur=2001.500");
+
+	/* Nothing to say for what was never traced */
+	trace_span(0, "ttfb", &start, &end);
+	CU_ASSERT_EQUAL(trace_server_timing(0, buf, sizeof(buf)), 0);
+}
+
+static void test_dump_is_chrome_trace(void)
+{
+	struct evbuffer *out;
+	struct timeval start;
+	unsigned int trace;
+	char *json;
+	size_t len;
+
+	trace = trace_begin();
+	gettimeofday(&start, NULL);
+	trace_span(trace, "render", &start, NULL);
+
+	out = evbuffer_new();
+	trace_dump(out);
+
+	len = evbuffer_get_length(out);
+	json = (char *)evbuffer_pullup(out, len);
+
+	CU_ASSERT(len > 0);
+	CU_ASSERT(strncmp(json, "{\"traceEvents\":[", 16) == 0);
+	CU_ASSERT_PTR_NOT_NULL(memmem(json, len, "\"name\":\"render\"", 15));
+	CU_ASSERT_PTR_NOT_NULL(memmem(json, len, "\"ph\":\"X\"", 8));
+
+	evbuffer_free(out);
+}
+
+
+static CU_TestInfo trace_tests[] = {
+	DECLARE_TESTINFO(test_server_timing_sums_by_name),
+	DECLARE_TESTINFO(test_dump_is_chrome_trace),
+	CU_TEST_INFO_NULL,
+};
+
+const CU_SuiteInfo suite_trace[] = {
+	{ "tracing", 0, 0, trace_tests, },
+	CU_SUITE_INFO_NULL,
+};
@@ -60,16 +60,20 @@ static int build_token_into(struct access_token *token, struct json_object *obj)
 	if (err != 0) {
 		verbose(ERROR, "%s(): No 'expires_in' member in token json (%s)\n",
 			__func__, strerror(err));
+		return err;
 	}
 
-	return err;
+	/* Refreshed tokens don't come with a new one */
+	copy_value_to_token_string(&token->refresh_token, obj, "refresh_token");
+
+	return 0;
 }
 
 int token_parse_json(struct access_token **tokenp, struct evbuffer *buf)
 {
 	char cbuf[1024];
 	int removed;
-	int ret;
+	int ret = EINVAL;
 
 	struct access_token *token;
 
@@ -121,5 +125,6 @@ int token_parse_json(struct access_token **tokenp, struct evbuffer *buf)
 void token_free(struct access_token *token)
 {
 	free(token->access_token);
+	free(token->refresh_token);
 	free(token);
 }
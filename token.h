@@ -6,6 +6,9 @@
 struct access_token {
 	char *access_token;
 	int expires_in;
+
+	/* Only with the first token of an offline grant. NULL otherwise. */
+	char *refresh_token;
 };
 
 int token_parse_json(struct access_token **tokenp, struct evbuffer *buf);
@@ -0,0 +1,131 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* Room for the last hundred or so /list requests */
+#define TRACE_RING_SIZE 4096
+
+/* Distinct span names per Server-Timing header */
+#define TRACE_MAX_NAMES 16
+
+struct trace_span {
+	unsigned int trace;
+	const char *name;
+	struct timeval start;
+	struct timeval end;
+};
+
+static struct trace_span ring[TRACE_RING_SIZE];
+static unsigned int ring_pos;
+static unsigned int ring_used;
+
+static unsigned int last_trace;
+
+unsigned int trace_begin(void)
+{
+	if (++last_trace == 0) {
+		last_trace++;
+	}
+	return last_trace;
+}
+
+void trace_span(unsigned int trace, const char *name,
+		const struct timeval *start, const struct timeval *end)
+{
+	struct trace_span *span;
+
+	if (trace == 0) {
+		return;
+	}
+
+	span = &ring[ring_pos];
+	span->trace = trace;
+	span->name = name;
+	span->start = *start;
+	if (end != NULL) {
+		span->end = *end;
+	} else {
+		gettimeofday(&span->end, NULL);
+	}
+
+	ring_pos = (ring_pos + 1) % TRACE_RING_SIZE;
+	if (ring_used < TRACE_RING_SIZE) {
+		ring_used++;
+	}
+}
+
+static long span_us(const struct trace_span *span)
+{
+	struct timeval tv;
+
+	timersub(&span->end, &span->start, &tv);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/* Oldest first */
+static struct trace_span *nth_span(unsigned int n)
+{
+	return &ring[(ring_pos + TRACE_RING_SIZE - ring_used + n) % TRACE_RING_SIZE];
+}
+
+int trace_server_timing(unsigned int trace, char *buf, size_t sz)
+{
+	const char *names[TRACE_MAX_NAMES];
+	long total[TRACE_MAX_NAMES];
+	struct trace_span *span;
+	unsigned int i;
+	int n, j, len;
+
+	n = 0;
+	for (i = 0; i < ring_used; i++) {
+		span = nth_span(i);
+		if (span->trace != trace) {
+			continue;
+		}
+		for (j = 0; j < n && strcmp(names[j], span->name) != 0; j++) {
+			;
+		}
+		if (j == n) {
+			if (n == TRACE_MAX_NAMES) {
+				continue;
+			}
+			names[n] = span->name;
+			total[n++] = 0;
+		}
+		total[j] += span_us(span);
+	}
+
+	*buf = '\0';
+	len = 0;
+	for (j = 0; j < n && len < sz; j++) {
+		len += snprintf(buf + len, sz - len, "%s%s;dur=%ld.%03ld",
+				j > 0 ? ", " : "", names[j],
+				total[j] / 1000, total[j] % 1000);
+	}
+
+	return len < sz ? len : sz - 1;
+}
+
+void trace_dump(struct evbuffer *out)
+{
+	struct trace_span *span;
+	unsigned int i;
+
+	evbuffer_add_printf(out, "{\"traceEvents\":[");
+
+	for (i = 0; i < ring_used; i++) {
+		span = nth_span(i);
+		/* One row per trace in the viewer */
+		evbuffer_add_printf(out,
+				    "%s\n{\"name\":\"%s\",\"cat\":\"yt_history\","
+				    "\"ph\":\"X\",\"ts\":%ld%06ld,\"dur\":%ld,"
+				    "\"pid\":1,\"tid\":%u}",
+				    i > 0 ? "," : "",
+				    span->name,
+				    (long)span->start.tv_sec, (long)span->start.tv_usec,
+				    span_us(span), span->trace);
+	}
+
+	evbuffer_add_printf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
@@ -0,0 +1,36 @@
+#ifndef TRACE_H__INCLUDED
+#define TRACE_H__INCLUDED
+
+/*
+ * Where did the time go. Spans are recorded into a fixed-size ring,
+ * tagged with the id of the trace (one per browser request) they
+ * belong to. Old ones are simply overwritten.
+ *
+ * Trace id 0 means "not traced", and recording into it is a no-op.
+ */
+
+#include <sys/time.h>
+
+#include <event2/buffer.h>
+
+/* A fresh trace id. Never 0. */
+unsigned int trace_begin(void);
+
+/*
+ * name has to be a string literal or otherwise live forever. A NULL
+ * end means now.
+ */
+void trace_span(unsigned int trace, const char *name,
+		const struct timeval *start, const struct timeval *end);
+
+/*
+ * Everything recorded for a trace so far, in Server-Timing header
+ * syntax. Spans with the same name are summed up. Returns the length,
+ * 0 if nothing was recorded.
+ */
+int trace_server_timing(unsigned int trace, char *buf, size_t sz);
+
+/* The whole ring as Chrome trace-event JSON */
+void trace_dump(struct evbuffer *out);
+
+#endif
@@ -3,21 +3,166 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
-static enum verbosity_level verbosity_level;
+/* Messages queued for the writer, at most, and how much of each we
+ * keep. Longer ones are cut short.
+ */
+#define RING_SIZE 2048
+#define RECORD_SIZE 512
+
+/* How long the writer naps when there's nothing to write */
+#define WRITER_IDLE_NS (20 * 1000 * 1000)
+
+enum verbosity_level verbosity_level;
+
+struct record {
+	/* Whose turn it is. The producer of message n waits for n, the
+	 * writer for n + 1.
+	 */
+	atomic_uint seq;
+	int len;
+	char text[RECORD_SIZE];
+};
+
+/*
+ * Any thread may log, there's one writer. Producers take turns at
+ * head, the writer alone moves tail.
+ */
+static struct record ring[RING_SIZE];
+static atomic_uint head;
+static unsigned int tail;
+static atomic_ulong dropped;
+
+static pthread_t writer;
+static atomic_int running;
 
 int verbose_adjust_level(int v)
 {
 	return verbosity_level += v;
 }
 
-void verbose(enum verbosity_level level, const char *fmt, ...)
+static void enqueue(const char *fmt, va_list ap)
+{
+	struct record *rec;
+	unsigned int h;
+	int diff;
+
+	h = atomic_load_explicit(&head, memory_order_relaxed);
+	for (;;) {
+		rec = &ring[h % RING_SIZE];
+		diff = atomic_load_explicit(&rec->seq, memory_order_acquire) - h;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&head, &h, h + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			/* The writer hasn't got this far yet */
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			h = atomic_load_explicit(&head, memory_order_relaxed);
+		}
+	}
+
+	rec->len = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	if (rec->len >= (int)sizeof(rec->text)) {
+		rec->len = sizeof(rec->text) - 1;
+	} else if (rec->len < 0) {
+		rec->len = 0;
+	}
+
+	atomic_store_explicit(&rec->seq, h + 1, memory_order_release);
+}
+
+void verbose_log(enum verbosity_level level, const char *fmt, ...)
 {
 	va_list ap;
 
 	va_start(ap, fmt);
-	if (verbosity_level >= level) {
+	if (atomic_load_explicit(&running, memory_order_relaxed)) {
+		enqueue(fmt, ap);
+	} else {
 		vprintf(fmt, ap);
 	}
 	va_end(ap);
 }
+
+/* Everything queued so far, in one go. Returns what was written. */
+static unsigned int drain(void)
+{
+	struct record *rec;
+	unsigned long lost;
+	unsigned int n;
+
+	for (n = 0;; n++, tail++) {
+		rec = &ring[tail % RING_SIZE];
+		if (atomic_load_explicit(&rec->seq, memory_order_acquire) != tail + 1) {
+			break;
+		}
+		fwrite(rec->text, 1, rec->len, stdout);
+		/* Free for the producer one lap later */
+		atomic_store_explicit(&rec->seq, tail + RING_SIZE, memory_order_release);
+	}
+
+	if ((lost = atomic_exchange(&dropped, 0)) > 0) {
+		printf("verbose: %lu messages dropped\n", lost);
+	}
+
+	if (n > 0 || lost > 0) {
+		fflush(stdout);
+	}
+
+	return n;
+}
+
+static void *write_out(void *arg)
+{
+	struct timespec nap = { 0, WRITER_IDLE_NS };
+
+	while (atomic_load(&running)) {
+		if (drain() == 0) {
+			nanosleep(&nap, NULL);
+		}
+	}
+
+	drain();
+	return NULL;
+}
+
+int verbose_start_writer(void)
+{
+	int err, i;
+
+	if (atomic_load(&running)) {
+		return 0;
+	}
+
+	/* Nobody's producing yet, and nobody's consuming */
+	for (i = 0; i < RING_SIZE; i++) {
+		atomic_store(&ring[i].seq, i);
+	}
+	atomic_store(&head, 0);
+	tail = 0;
+	fflush(stdout);
+
+	atomic_store(&running, 1);
+	if ((err = pthread_create(&writer, NULL, write_out, NULL)) != 0) {
+		atomic_store(&running, 0);
+		return err;
+	}
+
+	return 0;
+}
+
+void verbose_stop_writer(void)
+{
+	if (atomic_load(&running)) {
+		atomic_store(&running, 0);
+		pthread_join(writer, NULL);
+	}
+}
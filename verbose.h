@@ -8,8 +8,43 @@ enum verbosity_level {
 	FIREHOSE,
 };
 
+/*
+ * Levels above this are compiled out altogether, arguments and all.
+ * make VERBOSE_MAX_LEVEL=NORMAL for a build that only ever says the
+ * important bits.
+ */
+#ifndef VERBOSE_MAX_LEVEL
+#define VERBOSE_MAX_LEVEL FIREHOSE
+#endif
+
+extern enum verbosity_level verbosity_level;
+
 int verbose_adjust_level(int v);
 
-void __attribute__((format(printf,2,3))) verbose(enum verbosity_level level, const char *fmt, ...);
+static inline int verbose_enabled(enum verbosity_level level)
+{
+	return level <= VERBOSE_MAX_LEVEL && level <= verbosity_level;
+}
+
+void __attribute__((format(printf,2,3))) verbose_log(enum verbosity_level level, const char *fmt, ...);
+
+/* The arguments are only evaluated if the level is enabled */
+#define verbose(level, ...)					\
+	do {							\
+		if (verbose_enabled(level)) {			\
+			verbose_log(level, __VA_ARGS__);	\
+		}						\
+	} while (0)
+
+/*
+ * Until this is called, and after verbose_stop_writer(), messages are
+ * written out right away. In between they're queued up and written by
+ * a thread of their own, so the event loop never waits for stdout.
+ * What doesn't fit in the queue is dropped, and counted.
+ */
+int verbose_start_writer(void);
+
+/* Writes out whatever's still queued */
+void verbose_stop_writer(void);
 
 #endif